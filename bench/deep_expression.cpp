@@ -0,0 +1,78 @@
+#include <chrono>
+#include <cstdio>
+#include <sys/resource.h>
+
+#include "constant.hpp"
+#include "variable.hpp"
+#include "binary_operation.hpp"
+#include "functions.hpp"
+#include "program.hpp"
+
+// Stress test for very deep trees: every traversal should take time linear in the number
+// of nodes and the peak memory should only follow the size of the trees themselves
+
+using Clock = std::chrono::steady_clock;
+
+// Peak resident set size, in MiB
+static double peakMemory() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+}
+
+// Builds ((x + sin(x)) + 1) + x + ... as a left-deep chain of roughly `nodes` nodes
+static mathex::Expression* chain(size_t nodes) {
+    mathex::Expression* e = new mathex::Variable("x");
+    for (size_t i = 0; 4 * i < nodes; i++) {
+        mathex::Expression* term = nullptr;
+        switch (i % 3) {
+        case 0: term = new mathex::Variable("x"); break;
+        case 1: term = new mathex::OperationSin(new mathex::Variable("x")); break;
+        default: term = new mathex::Constant(1.0f); break;
+        }
+        e = new mathex::BinaryOperation(i % 4 == 3 ? mathex::BinaryOperator::SUB : mathex::BinaryOperator::ADD, e, term);
+    }
+    return e;
+}
+
+template <typename F>
+static double nsPerNode(size_t nodes, F f) {
+    auto start = Clock::now();
+    f();
+    std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+    return elapsed.count() / nodes;
+}
+
+int main(int argc, char **argv) {
+    size_t largest = 1000000;
+    if (argc > 1) {
+        largest = std::stoul(argv[1]);
+    }
+
+    printf("%10s %8s %8s %8s %8s %8s %8s %10s\n", "nodes", "eval", "clone", "diff", "compile", "special", "delete", "peak MiB");
+    for (size_t nodes = largest / 8; nodes <= largest; nodes *= 2) {
+        auto e = chain(nodes);
+        mathex::VariableContext ctx{{"x", 0.5f}};
+        mathex::Expression* copy = nullptr;
+        mathex::Expression* derivative = nullptr;
+        mathex::Expression* residual = nullptr;
+        float value = 0.0f;
+
+        double eval = nsPerNode(nodes, [&] { value = e->eval(ctx); });
+        double clone = nsPerNode(nodes, [&] { copy = e->clone(); });
+        double diff = nsPerNode(nodes, [&] { derivative = e->differentiate("x"); });
+        double compile = nsPerNode(nodes, [&] { mathex::Program program(*e); value += program.eval(ctx); });
+        double special = nsPerNode(nodes, [&] { residual = e->specialize({{"x", 0.5f}}); });
+        double destroy = nsPerNode(nodes, [&] {
+            delete e;
+            delete copy;
+            delete derivative;
+            delete residual;
+        });
+
+        printf("%10zu %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %10.1f\n", nodes, eval, clone, diff, compile, special, destroy, peakMemory());
+        (void)value;
+    }
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "expression.hpp"
+
+namespace mathex {
+
+/// @brief Range [lower, upper] of one variable
+struct Interval {
+    std::string variable;
+    float lower;
+    float upper;
+};
+
+/// @brief Piecewise Chebyshev approximation of an expression of one or two variables over a box.
+///
+/// The box is bisected until the Chebyshev interpolant of every piece meets the tolerance: each
+/// piece is sampled at Chebyshev points, its series is truncated to the lowest degree whose
+/// dropped terms stay within the tolerance, and the result is checked against the expression
+/// on a uniform grid denser than the samples. Evaluating then costs a descent in the tree of
+/// pieces and a Clenshaw recurrence of one multiply-add per coefficient. Coefficients are padded with
+/// zeros to the highest degree of any piece, so evalBatch() runs the recurrence over several
+/// points at once.
+class ChebyshevApproximant {
+public:
+    static constexpr size_t MAX_DEGREE = 32;
+
+    /// @param expr Expression whose every free variable is one of the domain variables
+    /// @param domain One or two intervals
+    /// @param tolerance Maximum absolute error
+    /// @param degree Degree of the interpolants sampled on each piece, at most MAX_DEGREE
+    /// @param maxPieces Fails with an exception when the tolerance needs more pieces
+    ChebyshevApproximant(
+        const Expression& expr,
+        const std::vector<Interval>& domain,
+        float tolerance,
+        size_t degree = 16,
+        size_t maxPieces = 4096
+    );
+
+    /// @brief Evaluates at a single point; points outside the domain are clamped to it
+    /// @param values One value per domain variable, in domain order
+    float eval(const float* values) const;
+
+    float eval(float x) const;
+    float eval(float x, float y) const;
+
+    /// @brief Evaluates looking up the domain variables in a variable context
+    float eval(const VariableContext& ctx) const;
+
+    /// @brief Evaluates at `count` points
+    /// @param inputs One array of `count` values per domain variable
+    void evalBatch(const float* const* inputs, float* out, size_t count) const;
+
+    size_t dimensions() const;
+    size_t pieces() const;
+    const std::vector<Interval>& domain() const;
+
+    /// @brief Largest error measured while checking the pieces
+    float error() const;
+
+private:
+    struct Piece {
+        float center[2];
+        float invHalf[2];
+        uint32_t degree[2];
+        uint32_t offset;
+    };
+
+    // Node of the tree of pieces: inner nodes split `axis` at `split` into cells next and
+    // next + 1; leaves have a negative axis and `next` is their piece
+    struct Cell {
+        int32_t axis;
+        float split;
+        uint32_t next;
+    };
+
+    uint32_t locate(const float* point) const;
+    float evalPiece(const Piece& piece, const float* point) const;
+
+    // Evaluates `width` <= Program::LANES consecutive points starting at `offset`
+    void evalLanes(const float* const* inputs, size_t offset, size_t width, float* out) const;
+
+    std::vector<Interval> intervals;
+    std::vector<Cell> cells;
+    std::vector<Piece> pieceList;
+    // Per piece, (maxDegree[0] + 1) rows of maxDegree[1] + 1 coefficients
+    std::vector<float> coefficients;
+    uint32_t maxDegree[2];
+    float maxError;
+};
+
+} // namespace mathex
@@ -31,9 +31,18 @@ public:
 
     virtual ~BinaryOperation();
 
-    virtual float eval(const VariableContext& ctx) const override;
-    virtual Expression* clone() const override;
-    virtual Expression* differentiate(const std::string& varName) const override;
+    virtual size_t childCount() const override;
+    virtual const Expression* child(size_t index) const override;
+    virtual float apply(const float* args, const VariableContext& ctx) const override;
+    virtual Expression* withChildren(Expression* const* children) const override;
+    virtual Expression* derivative(Expression* const* derivatives, SymbolId variable) const override;
+    virtual void emit(Program& program, size_t step) const override;
+    virtual Expression* specializeNode(Expression* const* children, const VariableContext& bound) const override;
+    virtual void releaseChildren(std::vector<Expression*>& out) override;
+
+    BinaryOperator getOperator() const;
+    const Expression* getLeft() const;
+    const Expression* getRight() const;
 
     // BinaryOperation and Constant
     BinaryOperation operator+(const Constant& v) const;
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <string>
+
+#include "expression.hpp"
+#include "nary_operation.hpp"
+
+namespace mathex {
+
+enum class ComparisonOperator {
+    LESS,
+    LESS_EQUAL,
+    GREATER,
+    GREATER_EQUAL,
+    EQUAL,
+    NOT_EQUAL
+};
+
+std::string to_string(ComparisonOperator op);
+
+/// @brief 1 when the comparison of two operands holds, 0 otherwise.
+/// Piecewise constant, so its derivative is 0 everywhere it exists.
+class Comparison : public NaryOperation {
+public:
+    /// @brief Takes ownership of the operands
+    Comparison(ComparisonOperator op, Expression* left, Expression* right);
+
+    virtual float apply(const float* args, const VariableContext& ctx) const override;
+    virtual Expression* withChildren(Expression* const* children) const override;
+    virtual Expression* derivative(Expression* const* derivatives, SymbolId variable) const override;
+    virtual void emit(Program& program, size_t step) const override;
+
+    ComparisonOperator getOperator() const;
+    const Expression* getLeft() const;
+    const Expression* getRight() const;
+
+protected:
+    ComparisonOperator op;
+};
+
+/// @brief `ifTrue` where the condition is nonzero, `ifFalse` elsewhere.
+/// Compiled programs evaluate both branches and blend them, so no lane ever branches;
+/// the derivative selects between the derivatives of the branches with the same condition.
+class Select : public NaryOperation {
+public:
+    /// @brief Takes ownership of the operands
+    Select(Expression* condition, Expression* ifTrue, Expression* ifFalse);
+
+    virtual float apply(const float* args, const VariableContext& ctx) const override;
+    virtual Expression* withChildren(Expression* const* children) const override;
+    virtual Expression* derivative(Expression* const* derivatives, SymbolId variable) const override;
+    virtual void emit(Program& program, size_t step) const override;
+
+    /// @brief Keeps only the chosen branch once the condition is constant
+    virtual Expression* specializeNode(Expression* const* children, const VariableContext& bound) const override;
+
+    const Expression* getCondition() const;
+    const Expression* getIfTrue() const;
+    const Expression* getIfFalse() const;
+};
+
+/// @brief Smaller of two operands; differentiates through the left one on ties
+class Minimum : public NaryOperation {
+public:
+    /// @brief Takes ownership of the operands
+    Minimum(Expression* left, Expression* right);
+
+    virtual float apply(const float* args, const VariableContext& ctx) const override;
+    virtual Expression* withChildren(Expression* const* children) const override;
+    virtual Expression* derivative(Expression* const* derivatives, SymbolId variable) const override;
+    virtual void emit(Program& program, size_t step) const override;
+
+    const Expression* getLeft() const;
+    const Expression* getRight() const;
+};
+
+/// @brief Larger of two operands; differentiates through the left one on ties
+class Maximum : public NaryOperation {
+public:
+    /// @brief Takes ownership of the operands
+    Maximum(Expression* left, Expression* right);
+
+    virtual float apply(const float* args, const VariableContext& ctx) const override;
+    virtual Expression* withChildren(Expression* const* children) const override;
+    virtual Expression* derivative(Expression* const* derivatives, SymbolId variable) const override;
+    virtual void emit(Program& program, size_t step) const override;
+
+    const Expression* getLeft() const;
+    const Expression* getRight() const;
+};
+
+/// @brief min(max(x, lower), upper), taking ownership of the operands.
+/// The returned expression is a heap pointer; delete it after usage.
+Expression* clamp(Expression* x, Expression* lower, Expression* upper);
+
+} // namespace mathex
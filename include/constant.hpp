@@ -15,6 +15,14 @@ public:
     virtual float eval(const VariableContext& ctx) const override;
     virtual Expression* clone() const override;
     virtual Expression* differentiate(const std::string& varName) const override;
+    using Expression::differentiate;
+
+    virtual float apply(const float* args, const VariableContext& ctx) const override;
+    virtual Expression* withChildren(Expression* const* children) const override;
+    virtual Expression* derivative(Expression* const* derivatives, SymbolId variable) const override;
+    virtual void emit(Program& program, size_t step) const override;
+
+    float getValue() const;
 
     // Constant and Constant
     Constant operator+(const Constant& c) const;
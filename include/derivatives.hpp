@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "expression.hpp"
+#include "flat_expression.hpp"
+
+namespace mathex {
+
+/// @brief Builds higher-order and mixed partial derivatives of an expression in one shared node store.
+///
+/// The expression is first stored as a graph where identical subexpressions are a single node.
+/// Each derivative rule then refers to existing nodes instead of cloning them (the derivative
+/// of tan(u) reuses the tan(u) node, the one of u / v reuses u / v, and so on), the derivative
+/// of every node with respect to a variable is computed once and reused by every later order
+/// and partial, and new nodes are simplified as they are created (constants are folded,
+/// x + 0, x * 1, x * 0, -(-x) and x - x are reduced).
+///
+/// @param partials Variables of each requested derivative, in differentiation order;
+/// {"x", "y", "x"} is d³f / dx dy dx and an empty list is f itself
+/// @param variables Inputs of the result; the variables of `expr` in order of first appearance when empty
+/// @return One root per requested derivative, evaluated together by evalAll()
+FlatExpression derivatives(
+    const Expression& expr,
+    const std::vector<std::vector<std::string>>& partials,
+    const std::vector<std::string>& variables = {}
+);
+
+} // namespace mathex
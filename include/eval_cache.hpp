@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "expression.hpp"
+#include "program.hpp"
+
+namespace mathex {
+
+/// @brief How a full cache set picks the entry to replace
+enum class EvictionPolicy {
+    /// @brief Replaces the least recently used entry; every hit records its use
+    LRU,
+
+    /// @brief Replaces the oldest inserted entry; hits never write to the cache
+    FIFO
+};
+
+/// @brief Bounded memo cache in front of the evaluation of one expression.
+///
+/// Results are keyed by the bit patterns of the input values, so repeated points skip the
+/// evaluation entirely. Entries are split over independently locked shards, and each shard is
+/// set-associative: a key can only live in one small set of slots, so a lookup compares a few
+/// keys under a short critical section and eviction only ever looks at that set.
+/// Misses are evaluated with a compiled Program, outside of any lock.
+class EvalCache {
+public:
+    /// @brief Hit and miss counters, summed over every shard
+    struct Statistics {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        uint64_t bypassed = 0;
+
+        /// @brief Fraction of the cached lookups that hit; 0 before any lookup
+        double hitRate() const;
+    };
+
+    /// @param expr Expression to evaluate
+    /// @param variables Inputs of eval(const float*), in order; unknown variables throw
+    /// @param capacity Maximum number of cached results; capacity() gives the number actually
+    /// held, which is smaller when it does not divide into whole sets of every shard
+    /// @param shards Number of independently locked shards, rounded up to a power of two and
+    /// then halved while the capacity cannot give every shard a few full sets
+    EvalCache(
+        const Expression& expr,
+        const std::vector<std::string>& variables,
+        size_t capacity = 1 << 16,
+        size_t shards = 16,
+        EvictionPolicy policy = EvictionPolicy::LRU
+    );
+
+    EvalCache(const EvalCache&) = delete;
+    EvalCache& operator=(const EvalCache&) = delete;
+
+    /// @brief Evaluates at a point, reusing the cached result of an earlier identical point
+    /// @param values One value per variable, in the order given on construction
+    float eval(const float* values);
+
+    /// @brief Evaluates looking up the variables in a variable context
+    float eval(const VariableContext& ctx);
+
+    /// @brief While set, every evaluation skips the cache; for workloads that never repeat
+    void setBypass(bool bypass);
+    bool bypassed() const;
+
+    /// @brief Drops every cached result; the counters are kept
+    void clear();
+
+    /// @brief Number of cached results
+    size_t size() const;
+
+    size_t capacity() const;
+
+    Statistics statistics() const;
+
+    const std::vector<std::string>& variables() const;
+
+private:
+    // Slots compared by one lookup, fewer only for capacities below it
+    static constexpr size_t WAYS = 8;
+
+    // Sets per shard below which the constructor uses fewer shards
+    static constexpr size_t MIN_SETS = 4;
+
+    struct Shard {
+        mutable std::mutex mutex;
+
+        // Slot s holds keys[s * keySize, (s + 1) * keySize), values[s] and stamps[s];
+        // a stamp of 0 marks an empty slot
+        std::vector<uint32_t> keys;
+        std::vector<float> values;
+        std::vector<uint64_t> stamps;
+        uint64_t clock = 0;
+        size_t used = 0;
+
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+    };
+
+    // Hash of a key, spreading every input bit
+    uint64_t hash(const uint32_t* key) const;
+
+    // Evaluates without the cache
+    float compute(const float* values) const;
+
+    Program program;
+    size_t keySize;
+    size_t ways;
+    size_t sets;
+    EvictionPolicy policy;
+    std::vector<Shard> shards;
+    std::atomic<bool> bypass{false};
+    std::atomic<uint64_t> bypassCount{0};
+};
+
+} // namespace mathex
@@ -1,14 +1,24 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <unordered_map>
+#include <vector>
+
+#include "symbol_table.hpp"
 
 namespace mathex {
 
+class Program;
+
 /// @brief Type used to pass values for each variable when evaluating an expression
 using VariableContext = std::unordered_map<std::string, float>;
 
 /// @brief Interface for a math expression
+///
+/// Every traversal of a tree (evaluation, cloning, differentiation, compilation,
+/// specialization and destruction) runs with an explicit stack over childCount() / child(),
+/// calling the per-node steps below, so arbitrarily deep trees never overflow the call stack.
 class Expression {
 public:
     /// @brief Virtual destructor
@@ -16,14 +26,184 @@ public:
 
     /// @brief Evaluates this expression with the given variable context
     /// @param ctx Will be used as variable value lookup
-    virtual float eval(const VariableContext& ctx) const = 0;
+    virtual float eval(const VariableContext& ctx) const;
 
     /// @brief Create a clone heap pointer of this expression
-    virtual Expression* clone() const = 0;
+    virtual Expression* clone() const;
 
     /// @brief Computes and returns the derivative of this expression
     /// @param varName The name of the variable to differentiate with respect to
-    virtual Expression* differentiate(const std::string& varName) const = 0;
+    virtual Expression* differentiate(const std::string& varName) const;
+
+    /// @brief Computes the derivative of a given order of this expression.
+    /// It is built in the shared node store of derivatives(), where intermediate derivatives
+    /// are memoized and simplified, then expanded into a tree. The tree repeats every shared
+    /// node at each of its uses, so it still grows exponentially with the order; use
+    /// derivatives() directly to evaluate high orders from the store, whose size stays small
+    /// @param order Number of differentiations; 0 returns a copy
+    /// @throws std::runtime_error When the tree would have more than MAX_DERIVATIVE_NODES nodes
+    Expression* differentiate(const std::string& varName, unsigned order) const;
+
+    /// @brief Computes a mixed partial derivative, differentiating in the given order:
+    /// {"x", "y", "x"} is d³/dx dy dx. Built and bounded like differentiate(varName, order)
+    Expression* differentiate(const std::vector<std::string>& varNames) const;
+
+    /// @brief Largest tree the higher-order differentiate() overloads build
+    static constexpr size_t MAX_DERIVATIVE_NODES = 1 << 22;
+
+    /// @brief Appends the instructions that evaluate this expression to a program
+    /// @param program Program being compiled; operands are left on its stack
+    virtual void compile(Program& program) const;
+
+    /// @brief Partially evaluates this expression, substituting the bound variables and folding
+    /// every subtree that no longer depends on an unbound variable
+    /// @param bound Values of the variables to substitute
+    /// @return The residual expression over the remaining variables, as a heap pointer
+    virtual Expression* specialize(const VariableContext& bound) const;
+
+    /// @brief Variables this expression depends on, as one bit per variable, computed on construction.
+    /// A variable's bit is its symbol identifier; identifiers past 63 all share the last bit,
+    /// so a set bit means "may depend" and a cleared bit means "does not depend"
+    uint64_t freeVariables() const;
+
+    /// @brief Number of nodes of this expression, computed on construction like freeVariables()
+    size_t nodeCount() const;
+
+    /// @brief Whether this expression may depend on a variable, in constant time
+    bool dependsOn(const std::string& varName) const;
+
+    /// @brief Whether this expression may depend on an interned variable, without any lookup
+    bool dependsOn(SymbolId variable) const;
+
+    /// @brief Number of direct subexpressions
+    virtual size_t childCount() const;
+
+    /// @brief Direct subexpression at `index`, in evaluation order
+    virtual const Expression* child(size_t index) const;
+
+    /// @brief Computes the value of this node from the values of its children
+    /// @param args One value per child
+    virtual float apply(const float* args, const VariableContext& ctx) const = 0;
+
+    /// @brief Creates a copy of this node over new children, taking ownership of them
+    virtual Expression* withChildren(Expression* const* children) const = 0;
+
+    /// @brief Differentiates this node from the derivatives of its children
+    /// @param derivatives One derivative per child; ownership is taken
+    /// @param variable Interned name of the variable to differentiate with respect to
+    virtual Expression* derivative(Expression* const* derivatives, SymbolId variable) const = 0;
+
+    /// @brief Emits this node's instructions while its children are compiled
+    /// @param step Index of the child about to be compiled, or childCount() once all of them are
+    virtual void emit(Program& program, size_t step) const = 0;
+
+    /// @brief Evaluates a node that compiles into a callback (see Program::emitCall) from its
+    /// inputs by position instead of by name
+    /// @param inputs Input k, in the order given to emitCall, is inputs[k * stride]
+    virtual float call(const float* inputs, size_t stride) const;
+
+    /// @brief Specializes this node from its already specialized children, taking ownership of them.
+    /// Folds into a Constant when every child is constant.
+    virtual Expression* specializeNode(Expression* const* children, const VariableContext& bound) const;
+
+    /// @brief Moves the owned children into `out`, leaving this node without children
+    virtual void releaseChildren(std::vector<Expression*>& out);
+
+protected:
+    /// @brief Deletes every node of the given trees one at a time, without recursion
+    static void destroy(std::vector<Expression*>& pending);
+
+    /// @brief Bit of a variable in free-variable sets
+    static uint64_t variableBit(SymbolId variable);
+
+    static constexpr SymbolId MAX_BIT = 63;
+
+    /// @brief Recomputes `dependencies` as the union of the children's sets, and `nodes` as
+    /// this node plus the nodes of its children
+    void gatherDependencies();
+
+    uint64_t dependencies = 0;
+    size_t nodes = 1;
 };
 
-} // namespace mathex
\ No newline at end of file
+/// @brief Visits the nodes of a tree without recursion
+/// @param enter Called as enter(node) before a node is visited; returning false skips its whole subtree
+/// @param step Called as step(node, i) right before the i-th child of `node` is visited
+/// @param leave Called as leave(node) once every child of `node` was visited
+template <typename Enter, typename Step, typename Leave>
+void traverse(const Expression& root, Enter enter, Step step, Leave leave) {
+    struct Frame {
+        const Expression* node;
+        size_t next;
+    };
+
+    if (!enter(root)) {
+        return;
+    }
+
+    std::vector<Frame> frames{{&root, 0}};
+    while (!frames.empty()) {
+        Frame& top = frames.back();
+        const Expression* node = top.node;
+        if (top.next < node->childCount()) {
+            size_t index = top.next++;
+            step(*node, index);
+            const Expression* next = node->child(index);
+            if (enter(*next)) {
+                frames.push_back({next, 0});
+            }
+        } else {
+            frames.pop_back();
+            leave(*node);
+        }
+    }
+}
+
+/// @brief Visits every node of a tree without recursion
+template <typename Step, typename Leave>
+void traverse(const Expression& root, Step step, Leave leave) {
+    traverse(root, [](const Expression&) { return true; }, step, leave);
+}
+
+/// @brief Visits every node of a tree in postorder without recursion
+template <typename Leave>
+void postorder(const Expression& root, Leave leave) {
+    traverse(root, [](const Expression&, size_t) {}, leave);
+}
+
+/// @brief Rebuilds a tree bottom-up without recursion.
+/// `shortcut(node, result)` may produce a node's result directly by returning true, in which
+/// case its subtree is skipped; otherwise `build(node, results)` receives the results of the
+/// node's children and returns its own
+template <typename T, typename Shortcut, typename Build>
+T reduce(const Expression& root, Shortcut shortcut, Build build) {
+    std::vector<T> results;
+    traverse(
+        root,
+        [&results, &shortcut](const Expression& node) {
+            T result;
+            if (shortcut(node, result)) {
+                results.push_back(result);
+                return false;
+            }
+            return true;
+        },
+        [](const Expression&, size_t) {},
+        [&results, &build](const Expression& node) {
+            size_t n = node.childCount();
+            T result = build(node, results.data() + results.size() - n);
+            results.resize(results.size() - n);
+            results.push_back(result);
+        }
+    );
+    return results.back();
+}
+
+/// @brief Rebuilds a tree bottom-up without recursion.
+/// `build(node, results)` receives the results of the node's children and returns its own
+template <typename T, typename Build>
+T reduce(const Expression& root, Build build) {
+    return reduce<T>(root, [](const Expression&, T&) { return false; }, build);
+}
+
+} // namespace mathex
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "expression.hpp"
+#include "program.hpp"
+
+namespace mathex {
+
+/// @brief Plain record for one node of a FlatExpression
+struct FlatNode {
+    /// @brief Operation of the node; shares its values with the program instructions
+    OpCode tag;
+
+    /// @brief Indices of the operand nodes, always smaller than the node's own index.
+    /// VARIABLE nodes store their input slot in operands[0], CALL nodes their callback
+    uint32_t operands[3];
+
+    /// @brief Constant value, or exponent of POWI nodes
+    float value;
+};
+
+/// @brief Expression stored as nodes in postorder in one contiguous vector.
+///
+/// Operands are 32-bit indices instead of heap pointers, so evaluation walks memory
+/// linearly and copying is a single vector copy. Identical subtrees are stored once.
+class FlatExpression {
+public:
+    FlatExpression() = default;
+
+    /// @brief Flattens an expression, assigning input slots in order of first appearance
+    FlatExpression(const Expression& expr);
+
+    /// @brief Flattens an expression over a fixed list of inputs
+    FlatExpression(const Expression& expr, const std::vector<std::string>& variables);
+
+    /// @brief Flattens a compiled program
+    FlatExpression(const Program& program);
+
+    /// @brief Flattens several expressions over a fixed list of inputs into one store,
+    /// sharing the subtrees they have in common
+    FlatExpression(const std::vector<const Expression*>& exprs, const std::vector<std::string>& variables);
+
+    /// @brief Wraps an existing node list
+    /// @param nodes Every operand index must be smaller than the index of its user
+    /// @param roots Nodes computing each expression of the store
+    /// @param callbacks Nodes run by the CALL nodes, over the same inputs
+    FlatExpression(
+        const std::vector<FlatNode>& nodes,
+        const std::vector<uint32_t>& roots,
+        const std::vector<std::string>& variables,
+        const std::vector<Callback>& callbacks = {}
+    );
+
+    /// @brief Rebuilds a pointer-linked expression for one of the roots; delete it after usage
+    Expression* toExpression(size_t root = 0) const;
+
+    /// @brief Number of nodes toExpression() builds for a root. Every use of a shared node
+    /// counts its whole subtree again, so this can be exponentially larger than size();
+    /// saturates at SIZE_MAX
+    size_t treeSize(size_t root = 0) const;
+
+    /// @brief Evaluates the expression at a single point
+    /// @param values One value per input, in the order of variables()
+    /// @param scratch Holds at least size() floats
+    float eval(const float* values, float* scratch) const;
+
+    /// @brief Evaluates the expression looking up every input in a variable context
+    float eval(const VariableContext& ctx) const;
+
+    /// @brief Evaluates every root at a single point in one pass over the nodes
+    /// @param out Receives one value per root, in the order of roots()
+    /// @param scratch Holds at least size() floats
+    void evalAll(const float* values, float* out, float* scratch) const;
+
+    /// @brief Evaluates the expression at `count` points
+    /// @param inputs One array of `count` values per input, in the order of variables()
+    /// @param scratch Holds at least size() * Program::LANES floats
+    void evalBatch(const float* const* inputs, float* out, size_t count, float* scratch) const;
+
+    /// @brief Evaluates every root at `count` points in one pass over the nodes per row of lanes
+    /// @param out One array of `count` values per root, in the order of roots()
+    /// @param scratch Holds at least size() * Program::LANES floats
+    void evalAllBatch(const float* const* inputs, float* const* out, size_t count, float* scratch) const;
+
+    /// @brief Number of nodes
+    size_t size() const;
+
+    /// @brief Index of the node computing each flattened expression; eval() and evalBatch() use the first one
+    const std::vector<uint32_t>& roots() const;
+
+    const std::vector<FlatNode>& nodes() const;
+    const std::vector<std::string>& variables() const;
+
+    /// @brief Nodes run by CALL nodes, indexed by their operands[0]
+    const std::vector<Callback>& callbacks() const;
+
+private:
+    template <size_t Width, typename Load>
+    void run(Load load, float* scratch) const;
+
+    std::vector<FlatNode> list;
+    std::vector<uint32_t> rootList;
+    std::vector<std::string> varNames;
+    std::vector<Callback> calls;
+};
+
+} // namespace mathex
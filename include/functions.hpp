@@ -10,110 +10,159 @@ class OperationNeg : public UnaryOperation {
 public:
     OperationNeg(Expression* operand) : UnaryOperation{operand} {}
 
-    virtual float eval(const VariableContext& ctx) const override;
-    virtual Expression* clone() const override;
-    virtual Expression* differentiate(const std::string& varName) const override;
+    virtual float compute(float u) const override;
+    virtual Expression* chainRule(Expression* du) const override;
+    virtual void emitOperation(Program& program) const override;
+    virtual UnaryOperation* withOperand(Expression* newOperand) const override;
 };
 
 class OperationSin : public UnaryOperation {
 public:
     OperationSin(Expression* operand) : UnaryOperation{operand} {}
 
-    virtual float eval(const VariableContext& ctx) const override;
-    virtual Expression* clone() const override;
-    virtual Expression* differentiate(const std::string& varName) const override;
+    virtual float compute(float u) const override;
+    virtual Expression* chainRule(Expression* du) const override;
+    virtual void emitOperation(Program& program) const override;
+    virtual UnaryOperation* withOperand(Expression* newOperand) const override;
 };
 
 class OperationCos : public UnaryOperation {
 public:
     OperationCos(Expression* operand) : UnaryOperation{operand} {}
 
-    virtual float eval(const VariableContext& ctx) const override;
-    virtual Expression* clone() const override;
-    virtual Expression* differentiate(const std::string& varName) const override;
+    virtual float compute(float u) const override;
+    virtual Expression* chainRule(Expression* du) const override;
+    virtual void emitOperation(Program& program) const override;
+    virtual UnaryOperation* withOperand(Expression* newOperand) const override;
 };
 
 class OperationTan : public UnaryOperation {
 public:
     OperationTan(Expression* operand) : UnaryOperation{operand} {}
 
-    virtual float eval(const VariableContext& ctx) const override;
-    virtual Expression* clone() const override;
-    virtual Expression* differentiate(const std::string& varName) const override;
+    virtual float compute(float u) const override;
+    virtual Expression* chainRule(Expression* du) const override;
+    virtual void emitOperation(Program& program) const override;
+    virtual UnaryOperation* withOperand(Expression* newOperand) const override;
 };
 
 class OperationCsc : public UnaryOperation {
 public:
     OperationCsc(Expression* operand) : UnaryOperation{operand} {}
 
-    virtual float eval(const VariableContext& ctx) const override;
-    virtual Expression* clone() const override;
-    virtual Expression* differentiate(const std::string& varName) const override;
+    virtual float compute(float u) const override;
+    virtual Expression* chainRule(Expression* du) const override;
+    virtual void emitOperation(Program& program) const override;
+    virtual UnaryOperation* withOperand(Expression* newOperand) const override;
 };
 
 class OperationSec : public UnaryOperation {
 public:
     OperationSec(Expression* operand) : UnaryOperation{operand} {}
 
-    virtual float eval(const VariableContext& ctx) const override;
-    virtual Expression* clone() const override;
-    virtual Expression* differentiate(const std::string& varName) const override;
+    virtual float compute(float u) const override;
+    virtual Expression* chainRule(Expression* du) const override;
+    virtual void emitOperation(Program& program) const override;
+    virtual UnaryOperation* withOperand(Expression* newOperand) const override;
 };
 
 class OperationCot : public UnaryOperation {
 public:
     OperationCot(Expression* operand) : UnaryOperation{operand} {}
 
-    virtual float eval(const VariableContext& ctx) const override;
-    virtual Expression* clone() const override;
-    virtual Expression* differentiate(const std::string& varName) const override;
+    virtual float compute(float u) const override;
+    virtual Expression* chainRule(Expression* du) const override;
+    virtual void emitOperation(Program& program) const override;
+    virtual UnaryOperation* withOperand(Expression* newOperand) const override;
 };
 
 class OperationLn : public UnaryOperation {
 public:
     OperationLn(Expression* operand) : UnaryOperation{operand} {}
 
-    virtual float eval(const VariableContext& ctx) const override;
-    virtual Expression* clone() const override;
-    virtual Expression* differentiate(const std::string& varName) const override;
+    virtual float compute(float u) const override;
+    virtual Expression* chainRule(Expression* du) const override;
+    virtual void emitOperation(Program& program) const override;
+    virtual UnaryOperation* withOperand(Expression* newOperand) const override;
 };
 
 class OperationLog10 : public UnaryOperation {
 public:
     OperationLog10(Expression* operand) : UnaryOperation{operand} {}
 
-    virtual float eval(const VariableContext& ctx) const override;
-    virtual Expression* clone() const override;
-    virtual Expression* differentiate(const std::string& varName) const override;
+    virtual float compute(float u) const override;
+    virtual Expression* chainRule(Expression* du) const override;
+    virtual void emitOperation(Program& program) const override;
+    virtual UnaryOperation* withOperand(Expression* newOperand) const override;
 };
 
 class OperationExp : public UnaryOperation {
 public:
     OperationExp(Expression* operand) : UnaryOperation{operand} {}
 
-    virtual float eval(const VariableContext& ctx) const override;
-    virtual Expression* clone() const override;
-    virtual Expression* differentiate(const std::string& varName) const override;
+    virtual float compute(float u) const override;
+    virtual Expression* chainRule(Expression* du) const override;
+    virtual void emitOperation(Program& program) const override;
+    virtual UnaryOperation* withOperand(Expression* newOperand) const override;
 };
 
 class OperationSqrt : public UnaryOperation {
 public:
     OperationSqrt(Expression* operand) : UnaryOperation{operand} {}
 
-    virtual float eval(const VariableContext& ctx) const override;
-    virtual Expression* clone() const override;
-    virtual Expression* differentiate(const std::string& varName) const override;
+    virtual float compute(float u) const override;
+    virtual Expression* chainRule(Expression* du) const override;
+    virtual void emitOperation(Program& program) const override;
+    virtual UnaryOperation* withOperand(Expression* newOperand) const override;
 };
 
 class OperationAbs : public UnaryOperation {
 public:
     OperationAbs(Expression* operand) : UnaryOperation{operand} {}
 
-    virtual float eval(const VariableContext& ctx) const override;
-    virtual Expression* clone() const override;
-    virtual Expression* differentiate(const std::string& varName) const override;
+    virtual float compute(float u) const override;
+    virtual Expression* chainRule(Expression* du) const override;
+    virtual void emitOperation(Program& program) const override;
+    virtual UnaryOperation* withOperand(Expression* newOperand) const override;
 };
 
+/// @brief Power with a constant exponent.
+///
+/// The evaluation strategy is picked once from the exponent: integer exponents up to
+/// MAX_POWI_EXPONENT use a multiplication chain, ±0.5 use a square root, -1 a reciprocal, and only the remaining
+/// exponents go through std::pow.
+class OperationPow : public UnaryOperation {
+public:
+    enum class Kind {
+        INTEGER,
+        RECIPROCAL,
+        SQRT,
+        RSQRT,
+        GENERAL
+    };
+
+    OperationPow(Expression* operand, float exponent);
+
+    virtual float compute(float u) const override;
+    virtual Expression* chainRule(Expression* du) const override;
+    virtual void emitOperation(Program& program) const override;
+    virtual UnaryOperation* withOperand(Expression* newOperand) const override;
+
+    float getExponent() const;
+    Kind getKind() const;
+
+protected:
+    float exponent;
+    Kind kind;
+};
+
+/// @brief Largest |n| for which x^n is computed by powi() instead of std::pow; every place
+/// that turns a power into a POWI instruction or node checks this bound
+constexpr int MAX_POWI_EXPONENT = 32;
+
+/// @brief Computes x^n with O(log n) multiplications, accumulated in double so the result is
+/// rounded once, like std::pow
+float powi(float x, int n);
 
 inline OperationSin sin(const Expression& expr) {
     return OperationSin(expr.clone());
@@ -167,16 +216,20 @@ inline BinaryOperation pow(const Expression& base, const Expression& exp) {
     );
 }
 
-inline BinaryOperation pow(const Expression& base, float exp) {
-    return pow(base, Constant(exp));
+inline OperationPow pow(const Expression& base, float exp) {
+    return OperationPow(base.clone(), exp);
+}
+
+inline OperationPow pow(const Expression& base, const Constant& exp) {
+    return OperationPow(base.clone(), exp.getValue());
 }
 
 inline BinaryOperation pow(float base, const Expression& exp) {
     return pow(Constant(base), exp);
 }
 
-inline BinaryOperation pow(float base, float exp) {
-    return pow(Constant(base), Constant(exp));
+inline OperationPow pow(float base, float exp) {
+    return OperationPow(new Constant(base), exp);
 }
 
 } // namespace mathex
\ No newline at end of file
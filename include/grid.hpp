@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "expression.hpp"
+#include "flat_expression.hpp"
+
+namespace mathex {
+
+/// @brief Evaluates an expression over every point of a 2D or 3D grid of axis samples.
+///
+/// Each node of the flattened expression is classified by the axes it depends on. Nodes that
+/// depend on no axis are computed once per evaluation, nodes that depend on a single axis once
+/// per sample of that axis (sin(x) is computed n_x times instead of n_x * n_y), and only the
+/// nodes mixing several axes are computed per point, over tiles of consecutive points sized
+/// to stay in cache. Tiles are shared between threads.
+class GridEvaluator {
+public:
+    /// @brief Number of points in a tile
+    static constexpr size_t TILE = 512;
+
+    /// @param axes Two or three variables; the first one varies fastest in the output
+    GridEvaluator(const Expression& expr, const std::vector<std::string>& axes);
+
+    /// @brief Evaluates the expression at every point of the grid
+    /// @param samples One array of counts[a] samples per axis
+    /// @param parameters Values of the other variables, in the order of parameters()
+    /// @param out Receives counts[0] * counts[1] (* counts[2]) values; point (i, j, k) is at
+    /// index i + counts[0] * (j + counts[1] * k)
+    /// @param threads Number of threads; 0 uses every hardware thread
+    void eval(const float* const* samples, const size_t* counts, const float* parameters, float* out, unsigned threads = 1) const;
+
+    /// @brief Evaluates the expression looking up the other variables in a variable context
+    void eval(const std::vector<std::vector<float>>& samples, const VariableContext& ctx, float* out, unsigned threads = 1) const;
+
+    const std::vector<std::string>& axes() const;
+
+    /// @brief Variables other than the axes, inputs of eval()
+    const std::vector<std::string>& parameters() const;
+
+    /// @brief Number of nodes computed once per evaluation, once per axis sample, and once per point
+    size_t fixedNodes() const;
+    size_t axisNodes() const;
+    size_t mixedNodes() const;
+
+private:
+    FlatExpression flat;
+    std::vector<std::string> axisNames;
+    std::vector<std::string> paramNames;
+
+    // Per node: the axis it depends on, FIXED or MIXED
+    std::vector<int32_t> kinds;
+
+    // Per node: whether a mixed node (or the result) reads it, so tiles need it expanded
+    std::vector<bool> expanded;
+};
+
+} // namespace mathex
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "expression.hpp"
+
+namespace mathex {
+
+/// @brief Integration range of one variable
+struct IntegrationBounds {
+    std::string variable;
+    float lower;
+    float upper;
+};
+
+/// @brief Settings for integrate()
+struct IntegrationOptions {
+    /// @brief Refinement stops once the error estimate is below max(tolerance, relativeTolerance * |value|)
+    double tolerance = 1e-6;
+    double relativeTolerance = 1e-6;
+
+    /// @brief Maximum number of panels evaluated, including the initial one
+    size_t maxPanels = 2000;
+
+    /// @brief Worker threads refining panels concurrently; 0 uses every hardware thread
+    unsigned threads = 0;
+};
+
+/// @brief Outcome of integrate()
+struct IntegrationResult {
+    double value = 0.0;
+    double error = 0.0;
+
+    /// @brief Number of points the expression was evaluated at
+    size_t evaluations = 0;
+
+    /// @brief Number of panels evaluated
+    size_t panels = 0;
+
+    /// @brief Whether the requested tolerance was reached within maxPanels
+    bool converged = false;
+};
+
+/// @brief Integrates an expression over an interval with adaptive Gauss-Kronrod (7-15) quadrature
+/// @param ctx Values of every other variable of `expr`
+IntegrationResult integrate(
+    const Expression& expr,
+    const std::string& varName,
+    float lower,
+    float upper,
+    const IntegrationOptions& options = {},
+    const VariableContext& ctx = {}
+);
+
+/// @brief Integrates an expression over a 1D, 2D or 3D box with tensor-product Gauss-Kronrod panels.
+///
+/// All nodes of a panel are evaluated as one batch. The panels with the largest error
+/// estimates are split along their worst dimension. With several threads, each round splits
+/// enough of them to total a few thousand points, in a whole number per thread, leaving out
+/// panels already below an even share of the tolerance; rounds share one pool of threads.
+/// @param ctx Values of every other variable of `expr`
+IntegrationResult integrate(
+    const Expression& expr,
+    const std::vector<IntegrationBounds>& bounds,
+    const IntegrationOptions& options = {},
+    const VariableContext& ctx = {}
+);
+
+} // namespace mathex
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "expression.hpp"
+#include "flat_expression.hpp"
+
+namespace mathex {
+
+/// @brief Sparse matrix of derivative expressions in compressed sparse row form.
+///
+/// Only the structurally nonzero entries are built, using the variables each expression
+/// depends on. All of them are compiled into one FlatExpression, so the subexpressions they
+/// have in common are stored and evaluated once, and the whole matrix is evaluated in one pass.
+class SparseDerivatives {
+public:
+    SparseDerivatives(const SparseDerivatives& o);
+    SparseDerivatives& operator=(const SparseDerivatives& o);
+
+    virtual ~SparseDerivatives();
+
+    size_t rows() const;
+    size_t cols() const;
+    size_t nonZeros() const;
+
+    /// @brief Entries of row i are [rowOffsets()[i], rowOffsets()[i + 1]); rows() + 1 values
+    const std::vector<uint32_t>& rowOffsets() const;
+
+    /// @brief Column of each entry, increasing within a row
+    const std::vector<uint32_t>& columns() const;
+
+    /// @brief Variable of each column; also the inputs of eval()
+    const std::vector<std::string>& variables() const;
+
+    /// @brief Derivative expression at a position, or nullptr when it is structurally zero
+    const Expression* at(size_t row, size_t col) const;
+
+    /// @brief Number of floats of scratch space needed by eval()
+    size_t scratchSize() const;
+
+    /// @brief Evaluates every entry at a single point
+    /// @param values One value per variable, in column order
+    /// @param out Receives nonZeros() values, in the order of columns()
+    /// @param scratch Holds at least scratchSize() floats
+    void eval(const float* values, float* out, float* scratch) const;
+
+    /// @brief Evaluates every entry looking up the variables in a variable context
+    void eval(const VariableContext& ctx, float* out) const;
+
+protected:
+    SparseDerivatives(const std::vector<std::string>& variables);
+
+    // Appends an entry to the current row, unless it simplified to zero; takes ownership
+    void add(uint32_t col, Expression* entry);
+
+    // Appends an entry that is already stored, for symmetric matrices
+    void share(uint32_t col, uint32_t slot);
+
+    // Closes the current row
+    void endRow();
+
+    // Compiles every entry once the pattern is complete
+    void compile();
+
+    std::vector<std::string> varNames;
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> colIndices;
+
+    // Distinct entry expressions, and the one used by each nonzero
+    std::vector<Expression*> entries;
+    std::vector<uint32_t> slots;
+
+    FlatExpression flat;
+};
+
+/// @brief Jacobian matrix J[i][j] = d outputs[i] / d variables[j]
+class Jacobian : public SparseDerivatives {
+public:
+    /// @param outputs Expressions whose every free variable is listed in `variables`
+    /// @param variables Variable of each column
+    Jacobian(const std::vector<const Expression*>& outputs, const std::vector<std::string>& variables);
+};
+
+/// @brief Hessian matrix H[j][k] = d² f / d variables[j] d variables[k].
+/// Both halves are stored, but each symmetric pair shares one expression.
+class Hessian : public SparseDerivatives {
+public:
+    /// @param f Expression whose every free variable is listed in `variables`
+    /// @param variables Variable of each row and column
+    Hessian(const Expression& f, const std::vector<std::string>& variables);
+};
+
+} // namespace mathex
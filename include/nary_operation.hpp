@@ -0,0 +1,78 @@
+#pragma once
+
+#include <vector>
+
+#include "expression.hpp"
+
+namespace mathex {
+
+/// @brief Operation over any number of operands, stored contiguously
+class NaryOperation : public Expression {
+public:
+    /// @brief Takes ownership of the operands
+    NaryOperation(const std::vector<Expression*>& operands);
+    NaryOperation(const NaryOperation& o);
+    NaryOperation& operator=(const NaryOperation& o);
+
+    virtual ~NaryOperation();
+
+    virtual size_t childCount() const override;
+    virtual const Expression* child(size_t index) const override;
+    virtual void releaseChildren(std::vector<Expression*>& out) override;
+
+protected:
+    std::vector<Expression*> operands;
+};
+
+/// @brief Weighted sum offset + w0 * t0 + w1 * t1 + ..., evaluated as one contiguous reduction
+class Sum : public NaryOperation {
+public:
+    /// @brief Creates a sum with unit weights, taking ownership of the terms
+    Sum(const std::vector<Expression*>& terms, float offset = 0.0f);
+
+    /// @brief Creates a weighted sum, taking ownership of the terms
+    /// @param weights One weight per term
+    Sum(const std::vector<Expression*>& terms, const std::vector<float>& weights, float offset = 0.0f);
+
+    virtual float apply(const float* args, const VariableContext& ctx) const override;
+    virtual Expression* withChildren(Expression* const* children) const override;
+    virtual Expression* derivative(Expression* const* derivatives, SymbolId variable) const override;
+    virtual void emit(Program& program, size_t step) const override;
+    virtual Expression* specializeNode(Expression* const* children, const VariableContext& bound) const override;
+
+    float getOffset() const;
+    const std::vector<float>& getWeights() const;
+
+    friend Expression* flatten(const Expression& expr);
+
+protected:
+    std::vector<float> weights;
+    float offset;
+};
+
+/// @brief Product scale * f0 * f1 * ..., evaluated as one contiguous reduction
+class Product : public NaryOperation {
+public:
+    /// @brief Takes ownership of the factors
+    Product(const std::vector<Expression*>& factors, float scale = 1.0f);
+
+    virtual float apply(const float* args, const VariableContext& ctx) const override;
+    virtual Expression* withChildren(Expression* const* children) const override;
+    virtual Expression* derivative(Expression* const* derivatives, SymbolId variable) const override;
+    virtual void emit(Program& program, size_t step) const override;
+    virtual Expression* specializeNode(Expression* const* children, const VariableContext& bound) const override;
+
+    float getScale() const;
+
+    friend Expression* flatten(const Expression& expr);
+
+protected:
+    float scale;
+};
+
+/// @brief Replaces every chain of additions, subtractions and negations by a Sum and every
+/// chain of multiplications by a Product, folding their constant operands.
+/// The returned expression is a heap pointer; delete it after usage.
+Expression* flatten(const Expression& expr);
+
+} // namespace mathex
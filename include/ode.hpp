@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "expression.hpp"
+#include "flat_expression.hpp"
+
+namespace mathex {
+
+/// @brief Stepping scheme of OdeSystem::solve()
+enum class OdeMethod {
+    /// @brief Classic fourth-order Runge-Kutta with a fixed step
+    RK4,
+
+    /// @brief Dormand-Prince 5(4) with adaptive steps
+    DORMAND_PRINCE,
+
+    /// @brief Linearly implicit two-stage Rosenbrock method (ROS2) with adaptive steps, for
+    /// stiff systems; solves one linear system with the Jacobian per stage
+    ROSENBROCK
+};
+
+/// @brief Settings for OdeSystem::solve()
+struct OdeOptions {
+    OdeMethod method = OdeMethod::DORMAND_PRINCE;
+
+    /// @brief Adaptive steps keep the local error of each state below tolerance + relativeTolerance * |y|
+    double tolerance = 1e-5;
+    double relativeTolerance = 1e-5;
+
+    /// @brief Step of RK4, initial step of the adaptive methods; 0 uses 1/100 of the interval
+    double step = 0.0;
+
+    /// @brief Maximum number of steps per trajectory, rejected ones included
+    size_t maxSteps = 100000;
+
+    /// @brief Worker threads, each integrating blocks of trajectories; 0 uses every hardware thread
+    unsigned threads = 0;
+};
+
+/// @brief Outcome of OdeSystem::solve(), summed over every trajectory
+struct OdeResult {
+    size_t steps = 0;
+    size_t rejected = 0;
+
+    /// @brief Number of points the right-hand side was evaluated at
+    size_t evaluations = 0;
+
+    /// @brief Number of trajectories that did not reach the end of the interval within maxSteps
+    size_t failed = 0;
+
+    /// @brief Whether every trajectory reached the end of the interval
+    bool converged = false;
+};
+
+/// @brief System of ordinary differential equations dy_i/dt = f_i(t, y), compiled once and
+/// integrated for many initial conditions at a time.
+///
+/// Trajectories are stepped together in blocks of Program::LANES, one lane each, with the
+/// right-hand side of the whole block evaluated in one pass over the shared nodes. Each lane
+/// keeps its own time and step size, so adaptive methods accept and reject steps per lane.
+/// The implicit method evaluates the right-hand side, its time derivative and its Jacobian
+/// (from differentiate()) in the same pass.
+class OdeSystem {
+public:
+    /// @param rhs Right-hand side of each state equation
+    /// @param states Variable of each state, in the order of `rhs`
+    /// @param time Variable of the time, which the right-hand sides may use
+    OdeSystem(
+        const std::vector<const Expression*>& rhs,
+        const std::vector<std::string>& states,
+        const std::string& time = "t"
+    );
+
+    /// @brief Number of state variables
+    size_t dimension() const;
+
+    const std::vector<std::string>& states() const;
+
+    /// @brief Variables other than the time and the states, inputs of solve()
+    const std::vector<std::string>& parameters() const;
+
+    /// @brief Integrates `count` trajectories from t0 to t1, which may be smaller than t0
+    /// @param y One array of `count` values per state, holding the initial conditions and
+    /// receiving the states at t1; a failed trajectory keeps the state it reached
+    /// @param parameters Values of the other variables, in the order of parameters()
+    OdeResult solve(float* const* y, size_t count, float t0, float t1, const float* parameters, const OdeOptions& options = {}) const;
+
+    /// @brief Integrates the trajectories looking up the other variables in a variable context
+    /// @param y One vector of initial conditions per state, all of the same size
+    OdeResult solve(std::vector<std::vector<float>>& y, float t0, float t1, const VariableContext& ctx, const OdeOptions& options = {}) const;
+
+private:
+    std::vector<std::string> stateNames;
+    std::vector<std::string> paramNames;
+
+    // Inputs are the time, the states, then the parameters; roots are f
+    FlatExpression system;
+
+    // Roots are f, df/dt, then df_i/dy_j row by row
+    FlatExpression linearization;
+};
+
+} // namespace mathex
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "expression.hpp"
+#include "flat_expression.hpp"
+
+namespace mathex {
+
+/// @brief Search direction used by Optimizer
+enum class OptimizationMethod {
+    /// @brief Limited-memory BFGS, restricted to the variables away from their bounds
+    LBFGS,
+
+    /// @brief Projected gradient descent with Barzilai-Borwein step lengths
+    PROJECTED_GRADIENT
+};
+
+/// @brief Settings for Optimizer
+struct OptimizationOptions {
+    OptimizationMethod method = OptimizationMethod::LBFGS;
+
+    /// @brief Number of correction pairs kept by L-BFGS
+    size_t history = 8;
+
+    /// @brief Converged once every component of the projected gradient is below this
+    double gradientTolerance = 1e-4;
+
+    /// @brief Converged once an iteration lowers f by less than this fraction of |f|
+    double valueTolerance = 1e-7;
+
+    size_t maxIterations = 1000;
+
+    /// @brief Maximum number of evaluations of f and its gradient, line searches included
+    size_t maxEvaluations = 10000;
+};
+
+/// @brief Progress made by one iteration of Optimizer::minimize
+struct OptimizationIteration {
+    /// @brief Objective at the end of the iteration
+    double value = 0.0;
+
+    /// @brief Largest component of the projected gradient at the end of the iteration
+    double gradientNorm = 0.0;
+
+    /// @brief Step length accepted by the line search
+    double step = 0.0;
+
+    /// @brief Evaluations of f and its gradient made by the iteration
+    size_t evaluations = 0;
+
+    /// @brief Wall time of the iteration
+    double seconds = 0.0;
+};
+
+/// @brief Outcome of Optimizer::minimize
+struct OptimizationResult {
+    double value = 0.0;
+    double gradientNorm = 0.0;
+    size_t iterations = 0;
+    size_t evaluations = 0;
+    double seconds = 0.0;
+
+    /// @brief Whether a tolerance was reached, rather than a limit or a failed line search
+    bool converged = false;
+
+    /// @brief One entry per iteration
+    std::vector<OptimizationIteration> trace;
+};
+
+/// @brief Minimizes an expression over several variables, optionally within box constraints.
+///
+/// The objective and every component of its gradient are built in one shared node store, so
+/// each evaluation is a single pass that computes f and the gradient together. An optimizer
+/// owns its scratch buffers, so evaluations do not allocate but an instance must not be
+/// shared between threads.
+class Optimizer {
+public:
+    /// @param f Objective
+    /// @param variables Unknowns of the problem
+    /// @param parameters Other variables of `f`, given to minimize()
+    /// @param options Method, tolerances and limits
+    Optimizer(
+        const Expression& f,
+        const std::vector<std::string>& variables,
+        const std::vector<std::string>& parameters = {},
+        const OptimizationOptions& options = {}
+    );
+
+    /// @brief Restricts every variable to [lower[i], upper[i]]; infinite bounds are allowed
+    void setBounds(const std::vector<float>& lower, const std::vector<float>& upper);
+
+    /// @brief Evaluates f and its gradient at a point in one pass
+    /// @param point One value per variable
+    /// @param gradient Receives one value per variable
+    /// @param parameters One value per parameter, in constructor order
+    float evaluate(const float* point, float* gradient, const float* parameters = nullptr);
+
+    /// @brief Minimizes f starting from a point, which is first projected into the bounds
+    /// @param point Starting point on input, best point found on output
+    /// @param parameters One value per parameter, in constructor order
+    OptimizationResult minimize(float* point, const float* parameters = nullptr);
+
+    const std::vector<std::string>& variables() const;
+
+private:
+    // Evaluates f at a point, its gradient into `gradient`, and counts the evaluation
+    double evaluate(const double* point, double* gradient);
+
+    // Largest component of P(x - g) - x
+    double projectedGradientNorm(const double* point, const double* gradient) const;
+
+    // Search direction into d; returns false when it is not a descent direction
+    bool direction(size_t pairs);
+
+    OptimizationOptions options;
+    FlatExpression objective;
+    std::vector<std::string> varNames;
+    size_t n;
+
+    std::vector<double> lower;
+    std::vector<double> upper;
+
+    // Scratch: evaluation inputs and outputs, current and trial points, direction, and the
+    // L-BFGS correction pairs stored as rings of n values
+    std::vector<float> inputs;
+    std::vector<float> outputs;
+    std::vector<float> scratch;
+    std::vector<double> x;
+    std::vector<double> g;
+    std::vector<double> trial;
+    std::vector<double> trialGradient;
+    std::vector<double> d;
+    std::vector<double> s;
+    std::vector<double> y;
+    std::vector<double> rho;
+    std::vector<double> alpha;
+    size_t newest = 0;
+    size_t evaluations = 0;
+};
+
+} // namespace mathex
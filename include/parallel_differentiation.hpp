@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "expression.hpp"
+
+namespace mathex {
+
+/// @brief Settings for parallelDifferentiate()
+struct ParallelDifferentiationOptions {
+    /// @brief Worker threads, the calling thread included; 0 uses every hardware thread
+    unsigned threads = 0;
+
+    /// @brief Subtrees of at most this many nodes are differentiated sequentially by one task
+    size_t cutoff = 4096;
+};
+
+/// @brief Differentiates a large expression with a pool of work-stealing threads.
+///
+/// Subtrees larger than the cutoff are split into one task per large child plus tasks that
+/// each differentiate a run of small siblings sequentially. Every thread pushes and pops the
+/// tasks it spawns at the back of its own queue and steals from the front of the others'
+/// queues when it runs out. A node is combined, through its own derivative(), by whichever
+/// thread finishes the last of its children, so no thread ever waits on another.
+///
+/// Every node is differentiated by the same rule as differentiate(), from structurally
+/// identical derivatives of its children, so the result is the same tree for any number of
+/// threads and any cutoff. The returned expression is a heap pointer; delete it after usage.
+/// @param varName The name of the variable to differentiate with respect to
+Expression* parallelDifferentiate(
+    const Expression& expr,
+    const std::string& varName,
+    const ParallelDifferentiationOptions& options = {}
+);
+
+} // namespace mathex
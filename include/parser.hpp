@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+
+#include "expression.hpp"
+
+namespace mathex {
+
+/// @brief Parses a formula such as "ln(x^2 + 1) * -y / 2" into an expression.
+///
+/// Understands numbers, variable names, parentheses, the binary operators + - * / ^
+/// (^ is right-associative and binds tighter than unary minus), the comparisons
+/// < <= > >= == != (binding loosest, giving 1 or 0), the functions sin, cos, tan, csc, sec,
+/// cot, ln, log10, exp, sqrt and abs, and the functions of several comma-separated
+/// arguments min(a, b), max(a, b), clamp(x, lower, upper) and select(condition, a, b).
+/// Parsing is iterative, so long or deeply nested formulas never overflow the call stack.
+/// The returned expression is a heap pointer; delete it after usage.
+Expression* parse(const std::string& formula);
+
+} // namespace mathex
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "expression.hpp"
+#include "program.hpp"
+
+namespace mathex {
+
+/// @brief Ways an expression can be evaluated at many points
+enum class Strategy {
+    /// @brief Expression::eval at every point; nothing to compile
+    TREE_WALK,
+
+    /// @brief A compiled Program evaluated one point at a time
+    BYTECODE,
+
+    /// @brief A compiled Program evaluated LANES points at a time
+    BATCH,
+
+    /// @brief Batches split in chunks across threads
+    THREADED
+};
+
+std::string to_string(Strategy strategy);
+
+/// @brief Shape of an expression as seen by the cost model: how many times each operation runs
+/// per point. Every node is counted under the opcodes it compiles to, so each BinaryOperator
+/// and each Operation* class has its own weight.
+struct ExpressionProfile {
+    size_t counts[static_cast<size_t>(OpCode::CALL) + 1] = {};
+
+    /// @brief Operations run per point inside the range and vector reduction nodes, which are
+    /// counted once under CALL. Every strategy runs them alike, in batches over the indices or
+    /// elements of the node, so they are priced at lane costs
+    size_t inner[static_cast<size_t>(OpCode::CALL) + 1] = {};
+
+    size_t nodes = 0;
+    size_t variables = 0;
+
+    /// @brief Counts the nodes of an expression with one traversal, without compiling it
+    static ExpressionProfile of(const Expression& expr);
+};
+
+/// @brief Estimated evaluation costs, in nanoseconds.
+///
+/// The default weights are rough figures; calibrated() measures them on this machine with a
+/// short microbenchmark the first time it is called.
+class CostModel {
+public:
+    /// @brief Model with built-in default weights
+    CostModel();
+
+    /// @brief Model measured on this machine, once per process
+    static const CostModel& calibrated();
+
+    /// @brief Runs the microbenchmark; takes a few milliseconds
+    static CostModel calibrate();
+
+    /// @brief Cost per point of one operation in a program evaluated one point at a time
+    double scalar(OpCode op) const;
+
+    /// @brief Cost per point of one operation in a batch evaluation
+    double lane(OpCode op) const;
+
+    /// @brief Overrides the weights of an operation
+    void setWeights(OpCode op, double scalar, double lane);
+
+    /// @brief Estimated time to evaluate `points` points with a strategy
+    /// @param threads Threads used by THREADED
+    double estimate(Strategy strategy, const ExpressionProfile& profile, size_t points, unsigned threads) const;
+
+    /// @brief Estimated batch cost of one point
+    double pointCost(const ExpressionProfile& profile) const;
+
+    /// @brief Estimated cost of one point inside range and vector reduction nodes, the same for every strategy
+    double innerCost(const ExpressionProfile& profile) const;
+
+    /// @brief Overhead of one single-point program evaluation, besides its operations
+    double pointOverhead;
+
+    /// @brief Overhead of visiting one node in a tree walk, besides its operation
+    double nodeVisit;
+
+    /// @brief Lookup of a variable in a VariableContext
+    double variableLookup;
+
+    /// @brief Compilation of one node into a program
+    double compileNode;
+
+    /// @brief Starting and joining one thread
+    double threadStart;
+
+private:
+    static constexpr size_t OPS = static_cast<size_t>(OpCode::CALL) + 1;
+    double scalarCosts[OPS];
+    double laneCosts[OPS];
+};
+
+/// @brief Strategy picked for one evaluation, and why
+struct Plan {
+    Strategy strategy = Strategy::TREE_WALK;
+
+    /// @brief Points given to each task; every point at once unless THREADED
+    size_t chunk = 0;
+
+    unsigned threads = 1;
+    size_t points = 0;
+
+    /// @brief Estimated time of every strategy, in nanoseconds, indexed by Strategy
+    double estimates[4] = {};
+
+    /// @brief One-line report of the decision and its estimates
+    std::string describe() const;
+};
+
+/// @brief Picks and runs the cheapest evaluation strategy for each call
+class Planner {
+public:
+    /// @param threads Upper bound for THREADED; 0 uses every hardware thread
+    Planner(const CostModel& model = CostModel::calibrated(), unsigned threads = 0);
+
+    /// @brief Chooses a strategy for evaluating an expression at `points` points
+    Plan plan(const Expression& expr, size_t points) const;
+    Plan plan(const ExpressionProfile& profile, size_t points) const;
+
+    /// @brief Evaluates an expression at `count` points with the strategy plan() picks
+    /// @param variables Input of each array of `inputs`
+    /// @param inputs One array of `count` values per variable
+    /// @param out Receives `count` results
+    /// @return The plan that was followed
+    Plan evaluate(
+        const Expression& expr,
+        const std::vector<std::string>& variables,
+        const float* const* inputs,
+        float* out,
+        size_t count
+    ) const;
+
+    const CostModel& costModel() const;
+
+private:
+    CostModel model;
+    unsigned maxThreads;
+};
+
+} // namespace mathex
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <vector>
+
+#include "expression.hpp"
+
+namespace mathex {
+
+/// @brief Polynomial in one variable, evaluated with Horner's scheme and fused multiply-adds.
+///
+/// Each coefficient is either a constant or an expression that does not depend on the
+/// variable (usually a nested Polynomial), so multivariate polynomials are stored as
+/// Horner schemes of Horner schemes.
+class Polynomial : public Expression {
+public:
+    /// @brief Creates coefficients[0] + coefficients[1] * x + coefficients[2] * x² + ...
+    Polynomial(const std::string& varName, const std::vector<float>& coefficients);
+
+    /// @brief Creates a polynomial with expression coefficients, taking ownership of them
+    /// @param coefficients Must not depend on varName; Constant coefficients are stored as values
+    Polynomial(const std::string& varName, const std::vector<Expression*>& coefficients);
+
+    /// @brief Same as the constructors above, over an interned variable
+    Polynomial(SymbolId variable, const std::vector<float>& coefficients);
+    Polynomial(SymbolId variable, const std::vector<Expression*>& coefficients);
+
+    Polynomial(const Polynomial& o);
+    Polynomial& operator=(const Polynomial& o);
+
+    virtual ~Polynomial();
+
+    virtual size_t childCount() const override;
+    virtual const Expression* child(size_t index) const override;
+    virtual float apply(const float* args, const VariableContext& ctx) const override;
+    virtual Expression* withChildren(Expression* const* children) const override;
+    virtual Expression* derivative(Expression* const* derivatives, SymbolId variable) const override;
+    virtual void emit(Program& program, size_t step) const override;
+    virtual Expression* specializeNode(Expression* const* children, const VariableContext& bound) const override;
+    virtual void releaseChildren(std::vector<Expression*>& out) override;
+
+    const std::string& getName() const;
+    SymbolId getId() const;
+    size_t degree() const;
+
+    /// @brief Creates a copy of this polynomial multiplied by a constant
+    Polynomial* scaled(float k) const;
+
+protected:
+    // Rebuilds `slots` and the free variables after `terms` changed
+    void index();
+
+    SymbolId id;
+
+    // Coefficient k is terms[k] when set, values[k] otherwise
+    std::vector<float> values;
+    std::vector<Expression*> terms;
+
+    // Power k of each expression coefficient, from the highest; child i is terms[slots[i]]
+    std::vector<size_t> slots;
+};
+
+/// @brief Replaces every polynomial subtree of an expression by a Polynomial node.
+///
+/// Sums, differences, products, negations, divisions by constants and constant integer
+/// powers are expanded and their coefficients collected. Products and powers of sums are
+/// only multiplied out up to degree 2, since expanded coefficients cancel each other near
+/// the roots of the factors; (x - 1)^12 stays an integer power of the Polynomial x - 1.
+/// The returned expression is a heap pointer; delete it after usage.
+Expression* rewritePolynomials(const Expression& expr);
+
+} // namespace mathex
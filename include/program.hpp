@@ -0,0 +1,208 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "expression.hpp"
+
+namespace mathex {
+
+/// @brief Operations understood by a compiled program
+enum class OpCode : uint8_t {
+    CONSTANT,
+    VARIABLE,
+    ADD,
+    SUB,
+    MUL,
+    DIV,
+    POW,
+    POWI,
+    FMA,
+    NEG,
+    SIN,
+    COS,
+    TAN,
+    CSC,
+    SEC,
+    COT,
+    LN,
+    LOG10,
+    EXP,
+    SQRT,
+    RSQRT,
+    RECIPROCAL,
+    ABS,
+    MIN,
+    MAX,
+    LESS,
+    LESS_EQUAL,
+    GREATER,
+    GREATER_EQUAL,
+    EQUAL,
+    NOT_EQUAL,
+    SELECT,
+    SUM,
+    PRODUCT,
+    CALL
+};
+
+std::string to_string(OpCode op);
+
+/// @brief Single instruction of a compiled program
+struct Instruction {
+    OpCode op;
+
+    /// @brief Input slot read by VARIABLE instructions, operand count of SUM and PRODUCT
+    /// instructions, callback run by CALL instructions
+    uint32_t index;
+
+    /// @brief Value pushed by CONSTANT instructions, exponent of POWI instructions
+    float value;
+};
+
+/// @brief Node a program evaluates by calling back into the expression, for nodes that have
+/// no instructions of their own (range and vector reductions). The node is a leaf that reads
+/// its scalar inputs by position through Expression::call, so only those inputs are loaded
+/// for the call and no variable context is built
+struct Callback {
+    /// @brief Leaf node evaluated at each point; shared between copies of a program
+    std::shared_ptr<const Expression> node;
+
+    /// @brief Variables the node reads, in the order it reads them
+    std::vector<std::string> names;
+
+    /// @brief Input slot of each of those variables
+    std::vector<uint32_t> slots;
+
+    /// @brief Evaluates the node at `count` points
+    /// @param inputs Values of input k for every point start at inputs + k * stride
+    /// @param out Receives `count` results; may alias the values of the first input
+    void eval(const float* inputs, size_t stride, float* out, size_t count) const;
+};
+
+struct ScratchLevel;
+
+/// @brief Scratch space shared by the evaluations that run on one thread at the same depth.
+///
+/// Callbacks and the vector expressions they reduce need buffers of their own while the
+/// program that called them still uses its own, so every live instance holds the next level
+/// of a per-thread stack. A level keeps its buffers between uses and only allocates when
+/// they grow, so repeated evaluations do not allocate.
+class ThreadScratch {
+public:
+    /// @brief Takes the next level of this thread
+    ThreadScratch();
+    ThreadScratch(const ThreadScratch&) = delete;
+    ThreadScratch& operator=(const ThreadScratch&) = delete;
+
+    /// @brief Gives the level back
+    ~ThreadScratch();
+
+    /// @brief Buffer of at least `n` floats; every call returns the same buffer, grown when needed
+    float* floats(size_t n);
+
+    /// @brief Buffer of at least `n` pointers, like floats()
+    const float** pointers(size_t n);
+
+    /// @brief Context of this level; names set by earlier users stay in it
+    VariableContext& context();
+
+private:
+    ScratchLevel* level;
+};
+
+/// @brief An expression compiled once into a flat stack program over an ordered list of inputs.
+///
+/// Evaluation never touches the expression tree nor a VariableContext, except for the leaves
+/// compiled into callbacks, and the batch evaluator runs every instruction over LANES points
+/// at a time so the inner loops vectorize.
+class Program {
+public:
+    /// @brief Number of points evaluated together by the batch evaluator
+    static constexpr size_t LANES = 8;
+
+    /// @brief Creates an empty program
+    Program() = default;
+
+    /// @brief Compiles an expression, assigning input slots in order of first appearance
+    Program(const Expression& expr);
+
+    /// @brief Compiles an expression over a fixed list of inputs
+    /// @param variables Input slot of each variable; unknown variables throw on compilation
+    Program(const Expression& expr, const std::vector<std::string>& variables);
+
+    /// @brief Pushes a constant value
+    void emitConstant(float c);
+
+    /// @brief Pushes the value of a variable
+    void emitVariable(const std::string& name);
+
+    /// @brief Appends an operation consuming its operands from the top of the stack
+    void emit(OpCode op);
+
+    /// @brief Raises the top of the stack to a constant integer power
+    void emitPowi(int n);
+
+    /// @brief Pushes the value of a leaf node evaluated through a callback at every point
+    /// @param inputs Variables the node reads from its context, loaded like emitVariable()
+    void emitCall(const Expression& node, const std::vector<std::string>& inputs);
+
+    /// @brief Replaces the `count` top entries of the stack by their sum
+    void emitSum(size_t count);
+
+    /// @brief Replaces the `count` top entries of the stack by their product
+    void emitProduct(size_t count);
+
+    /// @brief Evaluates the program at a single point
+    /// @param values One value per input, in the order of variables()
+    /// @param stack Scratch space holding at least stackSize() * LANES floats
+    float eval(const float* values, float* stack) const;
+
+    /// @brief Evaluates the program at a single point, allocating its own scratch space
+    float eval(const float* values) const;
+
+    /// @brief Evaluates the program looking up every input in a variable context
+    float eval(const VariableContext& ctx) const;
+
+    /// @brief Evaluates the program at `count` points
+    /// @param inputs One array of `count` values per input, in the order of variables()
+    /// @param out Receives `count` results
+    /// @param stack Scratch space holding at least stackSize() * LANES floats
+    void evalBatch(const float* const* inputs, float* out, size_t count, float* stack) const;
+
+    /// @brief Evaluates the program at `count` points, allocating its own scratch space
+    void evalBatch(const float* const* inputs, float* out, size_t count) const;
+
+    /// @brief Maximum stack depth reached by the program, in rows of LANES floats
+    size_t stackSize() const;
+
+    /// @brief Inputs of the program, in slot order
+    const std::vector<std::string>& variables() const;
+
+    /// @brief Compiled instructions in execution order
+    const std::vector<Instruction>& instructions() const;
+
+    /// @brief Nodes run by CALL instructions, in the order they were emitted
+    const std::vector<Callback>& callbacks() const;
+
+private:
+    void push(const Instruction& ins, int delta);
+
+    // Input slot of a variable, added unless the inputs are fixed
+    uint32_t slot(const std::string& name);
+
+    template <size_t Width, typename Load>
+    void run(Load load, float* out, float* stack) const;
+
+    std::vector<Instruction> code;
+    std::vector<Callback> calls;
+    std::vector<std::string> varNames;
+    bool fixedInputs = false;
+    size_t depth = 0;
+    size_t maxDepth = 0;
+};
+
+} // namespace mathex
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <vector>
+
+#include "expression.hpp"
+#include "program.hpp"
+
+namespace mathex {
+
+/// @brief Reduction of a body expression over an integer range of a bound index variable.
+///
+/// The body is stored once and compiled once; evaluation runs it over Program::LANES indices
+/// at a time instead of expanding one copy per index. For the tree drivers the node is a leaf:
+/// the index is bound inside it, so it never depends on the index variable, and compiling it
+/// into a Program emits a single callback instruction that runs this loop.
+class RangeOperation : public Expression {
+public:
+    /// @brief Takes ownership of the body
+    /// @param index Name of the index variable, bound to lower, lower + 1, ..., upper
+    RangeOperation(const std::string& index, int lower, int upper, Expression* body);
+    RangeOperation(const RangeOperation& o);
+    RangeOperation& operator=(const RangeOperation& o);
+
+    virtual ~RangeOperation();
+
+    virtual float apply(const float* args, const VariableContext& ctx) const override;
+    virtual float call(const float* inputs, size_t stride) const override;
+    virtual void emit(Program& program, size_t step) const override;
+    virtual Expression* specializeNode(Expression* const* children, const VariableContext& bound) const override;
+    virtual void releaseChildren(std::vector<Expression*>& out) override;
+
+    const std::string& getIndex() const;
+    int getLower() const;
+    int getUpper() const;
+    const Expression* getBody() const;
+
+    /// @brief Number of indices in the range; 0 when upper < lower
+    size_t count() const;
+
+    /// @brief Explicit Sum or Product of the body with each index substituted, one copy of the
+    /// body per index; for consumers that need the terms themselves, such as Taylor series
+    virtual Expression* expand() const;
+
+protected:
+    // Creates a node of the same kind over another body, taking ownership of it
+    virtual RangeOperation* withBody(Expression* body) const = 0;
+
+    // Operation combining the terms of expand()
+    virtual OpCode combiner() const = 0;
+
+    // Value of the reduction over no index
+    virtual float identity() const = 0;
+
+    // Programs run at every index, all over the inputs of `program`; the compiled body alone
+    // unless overridden
+    virtual size_t outputs() const;
+    virtual const Program& output(size_t k) const;
+
+    // Number of accumulators; one per lane unless overridden
+    virtual size_t stateSize() const;
+
+    // Accumulators of the reduction: set to the identity, then updated with the values of the
+    // outputs at up to BLOCK consecutive indices at a time, output k in row k of `values`
+    // (rows of BLOCK floats), then combined
+    virtual void start(float* acc) const = 0;
+    virtual void accumulate(float* acc, const float* values, size_t n) const = 0;
+    virtual float finish(const float* acc) const = 0;
+
+    // Runs the body over the range, reading input v of the compiled body as value(v)
+    template <typename Lookup>
+    float evaluate(Lookup value) const;
+
+    void initialize();
+
+    SymbolId indexId;
+    int lower;
+    int upper;
+    Expression* body;
+
+    // Compiled body, and the input slot of the index in it (or none when the body does not use it)
+    Program program;
+    size_t indexSlot;
+};
+
+/// @brief Σ body for index = lower..upper
+class RangeSum : public RangeOperation {
+public:
+    using RangeOperation::RangeOperation;
+
+    virtual Expression* withChildren(Expression* const* children) const override;
+    virtual Expression* derivative(Expression* const* derivatives, SymbolId variable) const override;
+
+protected:
+    virtual RangeOperation* withBody(Expression* body) const override;
+    virtual OpCode combiner() const override;
+    virtual float identity() const override;
+    virtual void start(float* acc) const override;
+    virtual void accumulate(float* acc, const float* values, size_t n) const override;
+    virtual float finish(const float* acc) const override;
+};
+
+/// @brief Π body for index = lower..upper
+class RangeProduct : public RangeOperation {
+public:
+    using RangeOperation::RangeOperation;
+
+    virtual Expression* withChildren(Expression* const* children) const override;
+
+    /// @brief Derivative as a RangeProductDerivative, defined where factors are zero
+    virtual Expression* derivative(Expression* const* derivatives, SymbolId variable) const override;
+
+protected:
+    virtual RangeOperation* withBody(Expression* body) const override;
+    virtual OpCode combiner() const override;
+    virtual float identity() const override;
+    virtual void start(float* acc) const override;
+    virtual void accumulate(float* acc, const float* values, size_t n) const override;
+    virtual float finish(const float* acc) const override;
+};
+
+/// @brief Partial derivative of Π body for index = lower..upper, of any order in any variables.
+///
+/// The loop multiplies truncated Taylor series of the factors in those variables, with the
+/// Leibniz rule, instead of dividing by the factors: the result is exact where some factor is
+/// zero, which is where products are usually evaluated. The node holds one compiled partial
+/// derivative of the body per term of the series, Π (order + 1) over its variables, and
+/// differentiating it again only adds terms.
+class RangeProductDerivative : public RangeOperation {
+public:
+    /// @brief Largest number of series terms, past which derivative() throws
+    static constexpr size_t MAX_TERMS = 1 << 10;
+
+    /// @brief Takes ownership of the body
+    /// @param variables Variable differentiated each time, with repetitions for higher orders
+    RangeProductDerivative(const std::string& index, int lower, int upper, Expression* body, const std::vector<std::string>& variables);
+    RangeProductDerivative(const RangeProductDerivative& o);
+    RangeProductDerivative& operator=(const RangeProductDerivative& o) = delete;
+
+    virtual ~RangeProductDerivative();
+
+    virtual Expression* withChildren(Expression* const* children) const override;
+    virtual Expression* derivative(Expression* const* derivatives, SymbolId variable) const override;
+    virtual Expression* specializeNode(Expression* const* children, const VariableContext& bound) const override;
+    virtual void releaseChildren(std::vector<Expression*>& out) override;
+
+    /// @brief Derivative of the explicit product
+    virtual Expression* expand() const override;
+
+    /// @brief Partial derivatives of the body, one per term of the series; the body is the first
+    const std::vector<Expression*>& getPartials() const;
+
+protected:
+    // Takes ownership of the partials, laid out as in `partials` for these orders
+    RangeProductDerivative(const std::string& index, int lower, int upper, const std::vector<Expression*>& partials, const std::vector<SymbolId>& variables, const std::vector<unsigned>& orders);
+
+    virtual RangeOperation* withBody(Expression* body) const override;
+    virtual OpCode combiner() const override;
+    virtual float identity() const override;
+    virtual size_t outputs() const override;
+    virtual const Program& output(size_t k) const override;
+    virtual size_t stateSize() const override;
+    virtual void start(float* acc) const override;
+    virtual void accumulate(float* acc, const float* values, size_t n) const override;
+    virtual float finish(const float* acc) const override;
+
+    // Compiles the partials and lists the products of the Leibniz rule
+    void prepare();
+
+    // Distinct variables and the order of differentiation in each
+    std::vector<SymbolId> variables;
+    std::vector<unsigned> orders;
+
+    // Partial derivative with multi-index (a_0, a_1, ...) at a_0 + (o_0 + 1) (a_1 + (o_1 + 1) (...)),
+    // scaled in the loop by 1 / Π a_i! into a series coefficient
+    std::vector<Expression*> partials;
+    std::vector<Program> programs;
+    std::vector<float> scales;
+
+    // Term t of a product of series is the sum of a[terms[j]] b[others[j]] for j in [first[t], first[t + 1])
+    std::vector<uint32_t> first;
+    std::vector<uint32_t> terms;
+    std::vector<uint32_t> others;
+};
+
+} // namespace mathex
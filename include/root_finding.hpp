@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "expression.hpp"
+#include "program.hpp"
+
+namespace mathex {
+
+/// @brief Update rule used by RootSolver
+enum class RootMethod {
+    NEWTON,
+    HALLEY
+};
+
+/// @brief Settings for RootSolver
+struct RootOptions {
+    /// @brief Update rule; HALLEY also compiles the second derivative
+    RootMethod method = RootMethod::NEWTON;
+
+    /// @brief A lane converges when |f(x) - c| or its relative step falls below this
+    float tolerance = 1e-6f;
+
+    /// @brief Maximum number of iterations per lane
+    int maxIterations = 50;
+
+    /// @brief Whether [lower, upper] is used as a bisection fallback
+    bool bracketed = false;
+    float lower = 0.0f;
+    float upper = 0.0f;
+};
+
+/// @brief Counters collected by RootSolver::solve
+struct RootStatistics {
+    size_t converged = 0;
+    size_t failed = 0;
+
+    /// @brief Iterations summed over every lane
+    size_t iterations = 0;
+
+    /// @brief Iterations where the update left the bracket and bisection was used instead
+    size_t bisections = 0;
+
+    /// @brief Iterations of the slowest lane
+    int maxIterations = 0;
+};
+
+/// @brief Solves f(x; p) = c for many targets and parameter sets at once.
+///
+/// f, f' and (for Halley) f'' are compiled once; solve() then iterates over batches of
+/// Program::LANES starting points, keeping a convergence mask per lane. A solver owns its
+/// scratch buffers, so solve() does not allocate but an instance must not be shared
+/// between threads.
+class RootSolver {
+public:
+    /// @param f Function whose roots are searched
+    /// @param varName Unknown of the equation
+    /// @param parameters Other variables of `f`, given per point to solve()
+    /// @param options Method, tolerance and optional bracket
+    RootSolver(
+        const Expression& f,
+        const std::string& varName,
+        const std::vector<std::string>& parameters = {},
+        const RootOptions& options = {}
+    );
+
+    /// @brief Solves f(x; p) = c at `count` points
+    /// @param targets Right-hand side per point, or nullptr to solve f(x; p) = 0
+    /// @param roots Initial guesses on input, roots on output (NaN where a lane failed)
+    /// @param count Number of points
+    /// @param parameters One array of `count` values per parameter, in constructor order
+    RootStatistics solve(
+        const float* targets,
+        float* roots,
+        size_t count,
+        const float* const* parameters = nullptr
+    );
+
+private:
+    void evalLanes(const Program& program, float* out);
+
+    RootOptions options;
+    Program f;
+    Program df;
+    Program ddf;
+
+    // Scratch: one row of LANES floats per input, plus the evaluation stack
+    std::vector<float> inputRows;
+    std::vector<const float*> inputs;
+    std::vector<float> stack;
+};
+
+} // namespace mathex
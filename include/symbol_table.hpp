@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+namespace mathex {
+
+/// @brief Small integer standing for an interned variable name
+using SymbolId = uint32_t;
+
+/// @brief Thread-safe table of interned variable names.
+///
+/// Every name is stored once and gets the next free identifier. Interning and lookups by name
+/// take a lock; looking a name up by identifier never does, so it is cheap on evaluation paths.
+class SymbolTable {
+public:
+    /// @brief Table shared by every expression of the process
+    static SymbolTable& global();
+
+    SymbolTable();
+    SymbolTable(const SymbolTable&) = delete;
+    SymbolTable& operator=(const SymbolTable&) = delete;
+
+    ~SymbolTable();
+
+    /// @brief Identifier of a name, interning it on first use
+    SymbolId intern(const std::string& name);
+
+    /// @brief Looks up a name without interning it
+    /// @return Whether the name was interned before
+    bool find(const std::string& name, SymbolId& id) const;
+
+    /// @brief Name of an interned identifier; the reference stays valid for the table's lifetime
+    const std::string& name(SymbolId id) const;
+
+    /// @brief Number of interned names
+    size_t size() const;
+
+    /// @brief Maximum number of names a table can hold
+    static constexpr size_t CAPACITY = size_t{1} << 22;
+
+private:
+    // Names are stored in fixed-size chunks that never move, so readers need no lock
+    static constexpr size_t CHUNK_BITS = 10;
+    static constexpr size_t CHUNK_SIZE = size_t{1} << CHUNK_BITS;
+    static constexpr size_t MAX_CHUNKS = CAPACITY / CHUNK_SIZE;
+
+    mutable std::shared_mutex mutex;
+    std::unordered_map<std::string, SymbolId> ids;
+    std::atomic<std::string*> chunks[MAX_CHUNKS];
+    std::atomic<uint32_t> count;
+};
+
+} // namespace mathex
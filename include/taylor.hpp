@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "expression.hpp"
+#include "flat_expression.hpp"
+
+namespace mathex {
+
+/// @brief Truncated Taylor series of an expression along one of its variables.
+///
+/// Every node of the flattened expression propagates the coefficients of its power series
+/// instead of a single value: sums add them termwise, products use Cauchy products, quotients
+/// series division, and exp, ln, sqrt, sin, cos and constant powers their recurrences, so all
+/// coefficients up to order k cost O(k²) operations per node. Series are kept in doubles, since
+/// high-order coefficients lose precision quickly in single precision.
+class TaylorExpansion {
+public:
+    /// @param variable Variable along which the expression is expanded
+    /// @param variables Inputs of coefficients(); the variables of `expr` in order of first appearance when empty
+    /// @throws std::runtime_error When a vector reduction depends on the expansion variable; its
+    /// series is not propagated, only its value. Ranges over it are expanded into their terms
+    TaylorExpansion(const Expression& expr, const std::string& variable, const std::vector<std::string>& variables = {});
+
+    /// @brief Number of doubles of scratch space needed by coefficients()
+    size_t scratchSize(size_t order) const;
+
+    /// @brief Computes c[j] = f^(j)(x) / j! for j = 0..order at a single point
+    /// @param values One value per input, in the order of variables(); the expansion variable holds x
+    /// @param out Receives order + 1 coefficients
+    /// @param scratch Holds at least scratchSize(order) doubles
+    void coefficients(const float* values, size_t order, double* out, double* scratch) const;
+
+    /// @brief Taylor coefficients looking up every input in a variable context
+    std::vector<double> coefficients(const VariableContext& ctx, size_t order) const;
+
+    /// @brief Derivatives f, f', ..., f^(order) looking up every input in a variable context
+    std::vector<double> derivatives(const VariableContext& ctx, size_t order) const;
+
+    const std::string& variable() const;
+    const std::vector<std::string>& variables() const;
+
+private:
+    FlatExpression flat;
+    std::string varName;
+
+    // Input slot of the expansion variable, or UINT32_MAX when the expression does not use it
+    uint32_t slot;
+};
+
+} // namespace mathex
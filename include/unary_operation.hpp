@@ -18,10 +18,29 @@ public:
 
     virtual ~UnaryOperation();
 
+    virtual size_t childCount() const override;
+    virtual const Expression* child(size_t index) const override;
+    virtual float apply(const float* args, const VariableContext& ctx) const override;
+    virtual Expression* withChildren(Expression* const* children) const override;
+    virtual Expression* derivative(Expression* const* derivatives, SymbolId variable) const override;
+    virtual void emit(Program& program, size_t step) const override;
+    virtual void releaseChildren(std::vector<Expression*>& out) override;
+
     // These will be implemented by concrete operation classes.
-    virtual float eval(const VariableContext& ctx) const override = 0;
-    virtual Expression* clone() const override = 0;
-    virtual Expression* differentiate(const std::string& varName) const override = 0;
+
+    /// @brief Applies the operation to the value of the operand
+    virtual float compute(float u) const = 0;
+
+    /// @brief Derivative of the operation given the derivative of the operand, taking ownership of it
+    virtual Expression* chainRule(Expression* du) const = 0;
+
+    /// @brief Emits the operation once the operand is on the program stack
+    virtual void emitOperation(Program& program) const = 0;
+
+    /// @brief Creates the same operation applied to another operand, taking ownership of it
+    virtual UnaryOperation* withOperand(Expression* newOperand) const = 0;
+
+    const Expression* getOperand() const;
 
     // UnaryOperation and Constant
     BinaryOperation operator+(const Constant& c) const;
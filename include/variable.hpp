@@ -11,11 +11,25 @@ class OperationNeg;
 
 class Variable : public Expression {
 public:
+    /// @brief Creates a variable, interning its name in the global symbol table
     Variable(const std::string& name);
 
+    /// @brief Creates a variable from an already interned name
+    Variable(SymbolId id);
+
     virtual float eval(const VariableContext& ctx) const override;
     virtual Expression* clone() const override;
     virtual Expression* differentiate(const std::string& varName) const override;
+    using Expression::differentiate;
+
+    virtual float apply(const float* args, const VariableContext& ctx) const override;
+    virtual Expression* withChildren(Expression* const* children) const override;
+    virtual Expression* derivative(Expression* const* derivatives, SymbolId variable) const override;
+    virtual void emit(Program& program, size_t step) const override;
+    virtual Expression* specializeNode(Expression* const* children, const VariableContext& bound) const override;
+
+    const std::string& getName() const;
+    SymbolId getId() const;
 
     // Variable and Constant
     BinaryOperation operator+(const Constant& c) const;
@@ -49,7 +63,7 @@ public:
     BinaryOperation operator/(float f) const;
 
 protected:
-    std::string name;
+    SymbolId id;
 };
 
 // float and Variable
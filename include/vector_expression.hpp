@@ -0,0 +1,256 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "expression.hpp"
+#include "binary_operation.hpp"
+
+namespace mathex {
+
+/// @brief Interface for an expression whose value is an array of floats.
+///
+/// Every vector expression is element-wise, so the derivative of element i with respect to a
+/// vector variable only involves element i of that variable: Jacobians are diagonal, and
+/// derivatives are vector expressions of the same size holding that diagonal.
+class VectorExpression {
+public:
+    virtual ~VectorExpression() = default;
+
+    /// @brief Number of elements
+    size_t size() const;
+
+    /// @brief Computes every element
+    /// @param out Receives size() floats
+    virtual void eval(const VariableContext& ctx, float* out) const = 0;
+
+    /// @brief Elements stored contiguously without computation, or nullptr when they must be evaluated
+    virtual const float* view() const;
+
+    /// @brief Create a clone heap pointer of this expression
+    virtual VectorExpression* clone() const = 0;
+
+    /// @brief Element-wise derivative with respect to a scalar variable, or the diagonal of
+    /// the Jacobian with respect to a vector variable
+    virtual VectorExpression* derivative(SymbolId variable) const = 0;
+
+    /// @brief Whether a vector variable appears in this expression, outside of broadcast scalars
+    virtual bool containsVector(SymbolId variable) const = 0;
+
+    /// @brief Whether every element is the given constant, so rules can skip it
+    virtual bool isConstant(float value) const;
+
+    /// @brief Appends the scalar variables that broadcast scalars read from the context,
+    /// skipping names already in `out`
+    virtual void scalarInputs(std::vector<std::string>& out) const;
+
+    /// @brief Variables this expression may depend on, scalar and vector alike; see Expression::freeVariables()
+    uint64_t freeVariables() const;
+
+    bool dependsOn(SymbolId variable) const;
+
+protected:
+    VectorExpression(size_t size);
+
+    size_t length;
+    uint64_t dependencies = 0;
+};
+
+/// @brief Vector variable bound to a caller-owned contiguous array
+class VectorVariable : public VectorExpression {
+public:
+    /// @param data Array of `size` floats, read at every evaluation; may be bound later
+    VectorVariable(const std::string& name, size_t size, const float* data = nullptr);
+
+    virtual void eval(const VariableContext& ctx, float* out) const override;
+    virtual const float* view() const override;
+    virtual VectorExpression* clone() const override;
+    virtual VectorExpression* derivative(SymbolId variable) const override;
+    virtual bool containsVector(SymbolId variable) const override;
+
+    /// @brief Binds the variable to another array of size() floats
+    void bind(const float* data);
+
+    const std::string& getName() const;
+    SymbolId getId() const;
+
+protected:
+    SymbolId id;
+    const float* data;
+};
+
+/// @brief Scalar expression repeated over every element
+class VectorBroadcast : public VectorExpression {
+public:
+    /// @brief Takes ownership of the scalar
+    VectorBroadcast(Expression* scalar, size_t size);
+    VectorBroadcast(const VectorBroadcast& o);
+    VectorBroadcast& operator=(const VectorBroadcast& o) = delete;
+
+    virtual ~VectorBroadcast();
+
+    virtual void eval(const VariableContext& ctx, float* out) const override;
+    virtual VectorExpression* clone() const override;
+
+    /// @brief Broadcast of the scalar's derivative; throws when the scalar depends on a
+    /// vector variable, since every element would then depend on every element of it
+    virtual VectorExpression* derivative(SymbolId variable) const override;
+    virtual bool containsVector(SymbolId variable) const override;
+    virtual bool isConstant(float value) const override;
+    virtual void scalarInputs(std::vector<std::string>& out) const override;
+
+    const Expression* getScalar() const;
+
+protected:
+    Expression* scalar;
+};
+
+/// @brief Element-wise +, -, * or / of two vectors of the same size; POW is rejected
+class VectorBinary : public VectorExpression {
+public:
+    /// @brief Takes ownership of the operands
+    VectorBinary(BinaryOperator op, VectorExpression* left, VectorExpression* right);
+    VectorBinary(const VectorBinary& o);
+    VectorBinary& operator=(const VectorBinary& o) = delete;
+
+    virtual ~VectorBinary();
+
+    virtual void eval(const VariableContext& ctx, float* out) const override;
+    virtual VectorExpression* clone() const override;
+    virtual VectorExpression* derivative(SymbolId variable) const override;
+    virtual bool containsVector(SymbolId variable) const override;
+    virtual void scalarInputs(std::vector<std::string>& out) const override;
+
+    BinaryOperator getOperator() const;
+    const VectorExpression* getLeft() const;
+    const VectorExpression* getRight() const;
+
+protected:
+    BinaryOperator op;
+    VectorExpression* left;
+    VectorExpression* right;
+};
+
+/// @brief 1 at the first position of the maximum of a vector, 0 elsewhere; gradient of max()
+class VectorMaxMask : public VectorExpression {
+public:
+    /// @brief Takes ownership of the operand
+    VectorMaxMask(VectorExpression* operand);
+    VectorMaxMask(const VectorMaxMask& o);
+    VectorMaxMask& operator=(const VectorMaxMask& o) = delete;
+
+    virtual ~VectorMaxMask();
+
+    virtual void eval(const VariableContext& ctx, float* out) const override;
+    virtual VectorExpression* clone() const override;
+
+    /// @brief Zero: the mask is piecewise constant
+    virtual VectorExpression* derivative(SymbolId variable) const override;
+    virtual bool containsVector(SymbolId variable) const override;
+    virtual void scalarInputs(std::vector<std::string>& out) const override;
+
+protected:
+    VectorExpression* operand;
+};
+
+/// @brief Scalar reduction of vector expressions, evaluated as one loop with independent
+/// accumulators per lane. Reductions are leaves for the tree drivers, and compile into a
+/// Program as a callback over the scalar inputs of their broadcasts; the compiled copy reads
+/// the arrays its vector variables were bound to at compilation.
+class Reduction : public Expression {
+public:
+    Reduction(const Reduction& o);
+    Reduction& operator=(const Reduction& o) = delete;
+
+    virtual ~Reduction();
+
+    virtual float apply(const float* args, const VariableContext& ctx) const override;
+    virtual float call(const float* inputs, size_t stride) const override;
+    virtual void emit(Program& program, size_t step) const override;
+
+    /// @brief Gradient with respect to a vector variable, as a vector of its size
+    virtual VectorExpression* gradient(SymbolId variable) const = 0;
+
+    const std::vector<VectorExpression*>& getOperands() const;
+
+protected:
+    /// @brief Takes ownership of the operands, which must all have the same size
+    Reduction(const std::vector<VectorExpression*>& operands);
+
+    // Reduces the elements of the operands, each one an array of size `n`
+    virtual float reduce(const float* const* elements, size_t n) const = 0;
+
+    // Throws when differentiating with respect to a vector variable, whose derivative is a gradient
+    void checkScalar(SymbolId variable) const;
+
+    std::vector<VectorExpression*> operands;
+
+    // Scalar variables read by the broadcasts, in the order of the callback's inputs
+    std::vector<std::string> names;
+};
+
+/// @brief Σ a[i] b[i]
+class Dot : public Reduction {
+public:
+    /// @brief Takes ownership of the operands
+    Dot(VectorExpression* a, VectorExpression* b);
+
+    virtual Expression* withChildren(Expression* const* children) const override;
+    virtual Expression* derivative(Expression* const* derivatives, SymbolId variable) const override;
+    virtual VectorExpression* gradient(SymbolId variable) const override;
+
+protected:
+    virtual float reduce(const float* const* elements, size_t n) const override;
+};
+
+/// @brief Euclidean norm sqrt(Σ a[i]²)
+class Norm2 : public Reduction {
+public:
+    /// @brief Takes ownership of the operand
+    Norm2(VectorExpression* a);
+
+    virtual Expression* withChildren(Expression* const* children) const override;
+    virtual Expression* derivative(Expression* const* derivatives, SymbolId variable) const override;
+    virtual VectorExpression* gradient(SymbolId variable) const override;
+
+protected:
+    virtual float reduce(const float* const* elements, size_t n) const override;
+};
+
+/// @brief Σ a[i]
+class VectorSum : public Reduction {
+public:
+    /// @brief Takes ownership of the operand
+    VectorSum(VectorExpression* a);
+
+    virtual Expression* withChildren(Expression* const* children) const override;
+    virtual Expression* derivative(Expression* const* derivatives, SymbolId variable) const override;
+    virtual VectorExpression* gradient(SymbolId variable) const override;
+
+protected:
+    virtual float reduce(const float* const* elements, size_t n) const override;
+};
+
+/// @brief max a[i]; -infinity for an empty vector. Differentiates through the first maximum
+class VectorMax : public Reduction {
+public:
+    /// @brief Takes ownership of the operand
+    VectorMax(VectorExpression* a);
+
+    virtual Expression* withChildren(Expression* const* children) const override;
+    virtual Expression* derivative(Expression* const* derivatives, SymbolId variable) const override;
+    virtual VectorExpression* gradient(SymbolId variable) const override;
+
+protected:
+    virtual float reduce(const float* const* elements, size_t n) const override;
+};
+
+/// @brief Gradient of a scalar expression with respect to a vector variable, by the chain
+/// rule through every reduction it contains: Σ_r (∂f/∂r) ∇r.
+/// The returned expression is a heap pointer; delete it after usage.
+/// @param size Size of the vector variable
+VectorExpression* gradient(const Expression& f, const std::string& variable, size_t size);
+
+} // namespace mathex
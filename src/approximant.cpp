@@ -0,0 +1,396 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+
+#include "approximant.hpp"
+#include "program.hpp"
+
+namespace mathex {
+
+// Sum of c[k] T_k(t) for k = 0..n by Clenshaw's recurrence; each step is one multiply-add,
+// contracted to an FMA on targets that have it
+static inline float clenshaw(const float* c, uint32_t n, float t) {
+    float t2 = 2.0f * t;
+    float b1 = 0.0f;
+    float b2 = 0.0f;
+    for (uint32_t k = n; k > 0; k--) {
+        float b0 = t2 * b1 + (c[k] - b2);
+        b2 = b1;
+        b1 = b0;
+    }
+    return t * b1 + (c[0] - b2);
+}
+
+// Value of a series with degrees nx in x and ny in y, stored as rows of `stride` coefficients
+static inline float clenshaw(const float* c, uint32_t nx, uint32_t ny, uint32_t stride, float tx, float ty) {
+    if (ny == 0 && stride == 1) {
+        return clenshaw(c, nx, tx);
+    }
+
+    float rows[ChebyshevApproximant::MAX_DEGREE + 1];
+    for (uint32_t k = 0; k <= nx; k++) {
+        rows[k] = clenshaw(c + k * stride, ny, ty);
+    }
+    return clenshaw(rows, nx, tx);
+}
+
+// Clenshaw's recurrence over a row of points at once; c(k, l) is the k-th coefficient of point l
+template <typename Coefficient>
+static inline void clenshaw(uint32_t n, const float* t, float* out, Coefficient c) {
+    constexpr size_t L = Program::LANES;
+    float b1[L] = {};
+    float b2[L] = {};
+    for (uint32_t k = n; k > 0; k--) {
+        for (size_t l = 0; l < L; l++) {
+            float b0 = 2.0f * t[l] * b1[l] + (c(k, l) - b2[l]);
+            b2[l] = b1[l];
+            b1[l] = b0;
+        }
+    }
+    for (size_t l = 0; l < L; l++) {
+        out[l] = t[l] * b1[l] + (c(0, l) - b2[l]);
+    }
+}
+
+// Highest degree kept so the dropped tail, given per degree, sums to at most `budget`
+static uint32_t truncate(const std::vector<double>& tail, size_t count, double budget) {
+    uint32_t n = static_cast<uint32_t>(count - 1);
+    double dropped = 0.0;
+    while (n > 0 && dropped + tail[n] <= budget) {
+        dropped += tail[n];
+        n--;
+    }
+    return n;
+}
+
+ChebyshevApproximant::ChebyshevApproximant(
+    const Expression& expr,
+    const std::vector<Interval>& domain,
+    float tolerance,
+    size_t degree,
+    size_t maxPieces
+)
+  : intervals{domain},
+    maxError{0.0f} {
+    if (domain.empty() || domain.size() > 2) {
+        throw std::runtime_error{"[ChebyshevApproximant::ChebyshevApproximant] Domain must have one or two variables"};
+    }
+    for (const auto& interval : domain) {
+        if (!(interval.lower < interval.upper)) {
+            throw std::runtime_error{"[ChebyshevApproximant::ChebyshevApproximant] Empty interval"};
+        }
+    }
+    if (degree < 2 || degree > MAX_DEGREE) {
+        throw std::runtime_error{"[ChebyshevApproximant::ChebyshevApproximant] Degree out of range"};
+    }
+    if (!(tolerance > 0.0f)) {
+        throw std::runtime_error{"[ChebyshevApproximant::ChebyshevApproximant] Tolerance must be positive"};
+    }
+
+    std::vector<std::string> names;
+    for (const auto& interval : domain) {
+        names.push_back(interval.variable);
+    }
+    Program program{expr, names};
+
+    size_t dims = domain.size();
+    size_t n = degree + 1;
+    size_t ny = dims == 2 ? n : 1;
+    size_t checks = (dims == 2 ? 2 : 4) * degree + 1;
+    size_t checksY = dims == 2 ? checks : 1;
+
+    // Chebyshev points and T_k at each of them
+    std::vector<double> nodes(n);
+    std::vector<double> basis(n * n);
+    for (size_t i = 0; i < n; i++) {
+        nodes[i] = std::cos(M_PI * (i + 0.5) / n);
+        for (size_t k = 0; k < n; k++) {
+            basis[k * n + i] = std::cos(M_PI * k * (i + 0.5) / n);
+        }
+    }
+
+    size_t points = std::max(n * ny, checks * checksY);
+    std::vector<float> xs(points);
+    std::vector<float> ys(points, 0.0f);
+    std::vector<float> fs(points);
+    std::vector<float> stack(program.stackSize() * Program::LANES);
+    const float* inputs[2] = {xs.data(), ys.data()};
+
+    std::vector<double> partial(n * ny);
+    std::vector<double> c(n * ny);
+    std::vector<double> rowTail(n);
+    std::vector<double> colTail(n);
+
+    struct Pending {
+        uint32_t cell;
+        float lo[2];
+        float hi[2];
+    };
+    std::vector<Pending> work;
+    work.push_back({0, {domain[0].lower, dims == 2 ? domain[1].lower : -1.0f}, {domain[0].upper, dims == 2 ? domain[1].upper : 1.0f}});
+    cells.push_back({-1, 0.0f, 0});
+
+    while (!work.empty()) {
+        auto p = work.back();
+        work.pop_back();
+
+        float center[2];
+        float half[2];
+        for (size_t d = 0; d < 2; d++) {
+            center[d] = 0.5f * (p.lo[d] + p.hi[d]);
+            half[d] = 0.5f * (p.hi[d] - p.lo[d]);
+        }
+
+        // Sample at the Chebyshev points of the piece
+        for (size_t i = 0; i < n; i++) {
+            for (size_t j = 0; j < ny; j++) {
+                xs[i * ny + j] = static_cast<float>(center[0] + half[0] * nodes[i]);
+                ys[i * ny + j] = dims == 2 ? static_cast<float>(center[1] + half[1] * nodes[j]) : 0.0f;
+            }
+        }
+        program.evalBatch(inputs, fs.data(), n * ny, stack.data());
+        bool finite = std::all_of(fs.begin(), fs.begin() + n * ny, [](float f) { return std::isfinite(f); });
+
+        // Discrete cosine transform along x, then along y
+        for (size_t k = 0; k < n; k++) {
+            for (size_t j = 0; j < ny; j++) {
+                double s = 0.0;
+                for (size_t i = 0; i < n; i++) {
+                    s += fs[i * ny + j] * basis[k * n + i];
+                }
+                partial[k * ny + j] = (k == 0 ? 1.0 : 2.0) * s / n;
+            }
+        }
+        for (size_t k = 0; k < n; k++) {
+            for (size_t l = 0; l < ny; l++) {
+                if (dims == 1) {
+                    c[k] = partial[k];
+                    continue;
+                }
+                double s = 0.0;
+                for (size_t j = 0; j < n; j++) {
+                    s += partial[k * ny + j] * basis[l * n + j];
+                }
+                c[k * ny + l] = (l == 0 ? 1.0 : 2.0) * s / n;
+            }
+        }
+
+        // Each axis may drop terms worth an eighth of the tolerance
+        std::fill(rowTail.begin(), rowTail.end(), 0.0);
+        std::fill(colTail.begin(), colTail.end(), 0.0);
+        for (size_t k = 0; k < n; k++) {
+            for (size_t l = 0; l < ny; l++) {
+                rowTail[k] += std::abs(c[k * ny + l]);
+                colTail[l] += std::abs(c[k * ny + l]);
+            }
+        }
+        uint32_t nx = truncate(rowTail, n, tolerance / 8.0);
+        uint32_t nyKept = dims == 2 ? truncate(colTail, n, tolerance / 8.0) : 0;
+        bool converged = finite && nx < degree && (dims == 1 || nyKept < degree);
+
+        if (converged) {
+            Piece piece;
+            piece.center[0] = center[0];
+            piece.center[1] = dims == 2 ? center[1] : 0.0f;
+            piece.invHalf[0] = 1.0f / half[0];
+            piece.invHalf[1] = dims == 2 ? 1.0f / half[1] : 0.0f;
+            piece.degree[0] = nx;
+            piece.degree[1] = nyKept;
+            piece.offset = static_cast<uint32_t>(coefficients.size());
+            for (size_t k = 0; k <= nx; k++) {
+                for (size_t l = 0; l <= nyKept; l++) {
+                    coefficients.push_back(static_cast<float>(c[k * ny + l]));
+                }
+            }
+
+            // Check against the expression on a uniform grid including the boundary
+            for (size_t i = 0; i < checks; i++) {
+                for (size_t j = 0; j < checksY; j++) {
+                    xs[i * checksY + j] = p.lo[0] + (p.hi[0] - p.lo[0]) * i / (checks - 1);
+                    ys[i * checksY + j] = dims == 2 ? p.lo[1] + (p.hi[1] - p.lo[1]) * j / (checks - 1) : 0.0f;
+                }
+            }
+            program.evalBatch(inputs, fs.data(), checks * checksY, stack.data());
+
+            float error = 0.0f;
+            for (size_t i = 0; i < checks * checksY; i++) {
+                float tx = std::clamp((xs[i] - piece.center[0]) * piece.invHalf[0], -1.0f, 1.0f);
+                float ty = std::clamp((ys[i] - piece.center[1]) * piece.invHalf[1], -1.0f, 1.0f);
+                float value = clenshaw(coefficients.data() + piece.offset, nx, nyKept, nyKept + 1, tx, ty);
+                float diff = std::abs(value - fs[i]);
+                error = std::isfinite(diff) ? std::max(error, diff) : INFINITY;
+            }
+
+            if (error <= tolerance) {
+                cells[p.cell] = {-1, 0.0f, static_cast<uint32_t>(pieceList.size())};
+                pieceList.push_back(piece);
+                maxError = std::max(maxError, error);
+                continue;
+            }
+            coefficients.resize(piece.offset);
+        }
+
+        // Split along the axis whose series converges slowest, or the relatively widest one
+        int32_t axis = 0;
+        if (dims == 2) {
+            double tailX = rowTail[n - 1] + rowTail[n - 2];
+            double tailY = colTail[n - 1] + colTail[n - 2];
+            if (finite && std::max(tailX, tailY) > tolerance / 8.0) {
+                axis = tailY > tailX ? 1 : 0;
+            } else {
+                float widthX = (p.hi[0] - p.lo[0]) / (domain[0].upper - domain[0].lower);
+                float widthY = (p.hi[1] - p.lo[1]) / (domain[1].upper - domain[1].lower);
+                axis = widthY > widthX ? 1 : 0;
+            }
+        }
+
+        float split = center[axis];
+        if (pieceList.size() + work.size() + 2 > maxPieces || !(p.lo[axis] < split && split < p.hi[axis])) {
+            throw std::runtime_error{"[ChebyshevApproximant::ChebyshevApproximant] Tolerance not reached within the piece limit"};
+        }
+
+        auto child = static_cast<uint32_t>(cells.size());
+        cells[p.cell] = {axis, split, child};
+        cells.push_back({-1, 0.0f, 0});
+        cells.push_back({-1, 0.0f, 0});
+
+        Pending left = p;
+        Pending right = p;
+        left.cell = child;
+        left.hi[axis] = split;
+        right.cell = child + 1;
+        right.lo[axis] = split;
+        work.push_back(right);
+        work.push_back(left);
+    }
+
+    // Pad every piece to the same degrees so evalBatch() runs one recurrence for all of its points
+    maxDegree[0] = 0;
+    maxDegree[1] = 0;
+    for (const auto& piece : pieceList) {
+        maxDegree[0] = std::max(maxDegree[0], piece.degree[0]);
+        maxDegree[1] = std::max(maxDegree[1], piece.degree[1]);
+    }
+
+    uint32_t stride = maxDegree[1] + 1;
+    size_t size = (maxDegree[0] + 1) * stride;
+    std::vector<float> padded(pieceList.size() * size, 0.0f);
+    for (size_t i = 0; i < pieceList.size(); i++) {
+        auto& piece = pieceList[i];
+        const float* c = coefficients.data() + piece.offset;
+        for (uint32_t k = 0; k <= piece.degree[0]; k++) {
+            for (uint32_t l = 0; l <= piece.degree[1]; l++) {
+                padded[i * size + k * stride + l] = c[k * (piece.degree[1] + 1) + l];
+            }
+        }
+        piece.offset = static_cast<uint32_t>(i * size);
+    }
+    coefficients = std::move(padded);
+}
+
+uint32_t ChebyshevApproximant::locate(const float* point) const {
+    uint32_t cell = 0;
+    while (cells[cell].axis >= 0) {
+        const auto& node = cells[cell];
+        cell = node.next + (point[node.axis] >= node.split ? 1 : 0);
+    }
+    return cells[cell].next;
+}
+
+float ChebyshevApproximant::evalPiece(const Piece& piece, const float* point) const {
+    float tx = std::clamp((point[0] - piece.center[0]) * piece.invHalf[0], -1.0f, 1.0f);
+    float ty = std::clamp((point[1] - piece.center[1]) * piece.invHalf[1], -1.0f, 1.0f);
+    return clenshaw(coefficients.data() + piece.offset, piece.degree[0], piece.degree[1], maxDegree[1] + 1, tx, ty);
+}
+
+float ChebyshevApproximant::eval(const float* values) const {
+    float point[2] = {values[0], intervals.size() == 2 ? values[1] : 0.0f};
+    return evalPiece(pieceList[locate(point)], point);
+}
+
+void ChebyshevApproximant::evalLanes(const float* const* inputs, size_t offset, size_t width, float* out) const {
+    constexpr size_t L = Program::LANES;
+    float tx[L];
+    float ty[L];
+    const float* c[L];
+
+    // Lanes past `width` repeat the first point
+    for (size_t l = 0; l < L; l++) {
+        size_t i = offset + (l < width ? l : 0);
+        float point[2] = {inputs[0][i], intervals.size() == 2 ? inputs[1][i] : 0.0f};
+        const auto& piece = pieceList[locate(point)];
+        tx[l] = std::clamp((point[0] - piece.center[0]) * piece.invHalf[0], -1.0f, 1.0f);
+        ty[l] = std::clamp((point[1] - piece.center[1]) * piece.invHalf[1], -1.0f, 1.0f);
+        c[l] = coefficients.data() + piece.offset;
+    }
+
+    float result[L];
+    if (intervals.size() == 1 && std::all_of(c, c + L, [&](const float* p) { return p == c[0]; })) {
+        // Points of a batch are usually in the same piece, which needs no gather
+        const float* shared = c[0];
+        clenshaw(maxDegree[0], tx, result, [shared](uint32_t k, size_t) { return shared[k]; });
+        std::copy(result, result + width, out);
+        return;
+    }
+
+    uint32_t stride = maxDegree[1] + 1;
+    float rows[MAX_DEGREE + 1][L];
+    for (uint32_t k = 0; k <= maxDegree[0]; k++) {
+        if (intervals.size() == 1) {
+            for (size_t l = 0; l < L; l++) {
+                rows[k][l] = c[l][k];
+            }
+        } else {
+            clenshaw(maxDegree[1], ty, rows[k], [&](uint32_t j, size_t l) { return c[l][k * stride + j]; });
+        }
+    }
+
+    clenshaw(maxDegree[0], tx, result, [&](uint32_t k, size_t l) { return rows[k][l]; });
+    std::copy(result, result + width, out);
+}
+
+float ChebyshevApproximant::eval(float x) const {
+    float values[2] = {x, 0.0f};
+    return eval(values);
+}
+
+float ChebyshevApproximant::eval(float x, float y) const {
+    float values[2] = {x, y};
+    return eval(values);
+}
+
+float ChebyshevApproximant::eval(const VariableContext& ctx) const {
+    float values[2] = {0.0f, 0.0f};
+    for (size_t d = 0; d < intervals.size(); d++) {
+        auto it = ctx.find(intervals[d].variable);
+        if (it == ctx.end()) {
+            throw std::runtime_error{"[ChebyshevApproximant::eval] Variable name not found in context"};
+        }
+        values[d] = it->second;
+    }
+    return eval(values);
+}
+
+void ChebyshevApproximant::evalBatch(const float* const* inputs, float* out, size_t count) const {
+    for (size_t offset = 0; offset < count; offset += Program::LANES) {
+        evalLanes(inputs, offset, std::min(Program::LANES, count - offset), out + offset);
+    }
+}
+
+size_t ChebyshevApproximant::dimensions() const {
+    return intervals.size();
+}
+
+size_t ChebyshevApproximant::pieces() const {
+    return pieceList.size();
+}
+
+const std::vector<Interval>& ChebyshevApproximant::domain() const {
+    return intervals;
+}
+
+float ChebyshevApproximant::error() const {
+    return maxError;
+}
+
+} // namespace mathex
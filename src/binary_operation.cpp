@@ -6,6 +6,7 @@
 #include "constant.hpp"
 #include "unary_operation.hpp"
 #include "functions.hpp"
+#include "program.hpp"
 
 namespace mathex {
 
@@ -37,12 +38,15 @@ BinaryOperation::BinaryOperation(
     Expression* right
 ) : op{operand},
     left{left},
-    right{right} {}
+    right{right} {
+    gatherDependencies();
+}
 
 BinaryOperation::BinaryOperation(const BinaryOperation& o)
   : op{o.op},
     left{o.left ? o.left->clone() : nullptr},
     right{o.right ? o.right->clone() : nullptr} {
+    gatherDependencies();
 }
 
 BinaryOperation& BinaryOperation::operator=(const BinaryOperation& o) {
@@ -58,17 +62,30 @@ BinaryOperation& BinaryOperation::operator=(const BinaryOperation& o) {
     op = o.op;
     left = o.left ? o.left->clone() : nullptr;
     right = o.right ? o.right->clone() : nullptr;
+    gatherDependencies();
     return *this;
 }
 
 BinaryOperation::~BinaryOperation() {
-    delete left;
-    delete right;
+    // Children are deleted one node at a time so that deep trees do not overflow the stack
+    std::vector<Expression*> pending;
+    releaseChildren(pending);
+    destroy(pending);
 }
 
-float BinaryOperation::eval(const VariableContext& ctx) const {
-    auto l = left->eval(ctx);
-    auto r = right->eval(ctx);
+size_t BinaryOperation::childCount() const {
+    return 2;
+}
+
+const Expression* BinaryOperation::child(size_t index) const {
+    return index == 0 ? left : right;
+}
+
+float BinaryOperation::apply(const float* args, const VariableContext& ctx) const {
+    (void)ctx;
+
+    auto l = args[0];
+    auto r = args[1];
 
     switch (op) {
     case BinaryOperator::ADD:
@@ -87,77 +104,150 @@ float BinaryOperation::eval(const VariableContext& ctx) const {
     throw std::runtime_error{"[BinaryOperator::eval] Unknown operation"};
 }
 
-Expression* BinaryOperation::clone() const {
-    return new BinaryOperation(*this);
+Expression* BinaryOperation::withChildren(Expression* const* children) const {
+    return new BinaryOperation(op, children[0], children[1]);
+}
+
+// Whether a derivative is known to be zero, i.e. its expression did not depend on the variable
+static bool isZero(const Expression* e) {
+    auto c = dynamic_cast<const Constant*>(e);
+    return c != nullptr && c->getValue() == 0.0f;
 }
 
-Expression* BinaryOperation::differentiate(const std::string& varName) const {
-    auto du = left->differentiate(varName);
-    auto dv = right->differentiate(varName);
+Expression* BinaryOperation::derivative(Expression* const* derivatives, SymbolId variable) const {
+    (void)variable;
+
+    auto du = derivatives[0];
+    auto dv = derivatives[1];
 
-    auto u = left->clone();
-    auto v = right->clone();
+    // Terms of the rules below with a zero factor are left out
+    bool constantLeft = isZero(du);
+    bool constantRight = isZero(dv);
+    if (constantLeft && constantRight) {
+        delete du;
+        delete dv;
+        return new Constant(0.0f);
+    }
 
     switch (op) {
     case BinaryOperator::ADD: {
         // Sum rule: (u + v)' = u' + v'
-        delete u;
-        delete v;
+        if (constantLeft) {
+            delete du;
+            return dv;
+        }
+        if (constantRight) {
+            delete dv;
+            return du;
+        }
         return new BinaryOperation(BinaryOperator::ADD, du, dv);
     }
 
     case BinaryOperator::SUB: {
         // Difference rule: (u - v)' = u' - v'
-        delete u;
-        delete v;
+        if (constantLeft) {
+            delete du;
+            return new OperationNeg(dv);
+        }
+        if (constantRight) {
+            delete dv;
+            return du;
+        }
         return new BinaryOperation(BinaryOperator::SUB, du, dv);
     }
 
     case BinaryOperator::MUL: {
         // Product rule: (u * v)' = u'v + uv'
+        if (constantLeft) {
+            delete du;
+            return new BinaryOperation(BinaryOperator::MUL, left->clone(), dv);   // uv'
+        }
+        if (constantRight) {
+            delete dv;
+            return new BinaryOperation(BinaryOperator::MUL, du, right->clone());  // u'v
+        }
         return new BinaryOperation(
             BinaryOperator::ADD,
-            new BinaryOperation(BinaryOperator::MUL, du, v), // u'v
-            new BinaryOperation(BinaryOperator::MUL, u, dv)  // uv'
+            new BinaryOperation(BinaryOperator::MUL, du, right->clone()), // u'v
+            new BinaryOperation(BinaryOperator::MUL, left->clone(), dv)   // uv'
         );
     }
 
     case BinaryOperator::DIV: {
         // Quotient rule: (u / v)' = (u'v - uv') / v^2
+        if (constantRight) {
+            // (u / v)' = u' / v
+            delete dv;
+            return new BinaryOperation(BinaryOperator::DIV, du, right->clone());
+        }
+
+        Expression* numerator = nullptr;
+        if (constantLeft) {
+            // -uv'
+            delete du;
+            numerator = new OperationNeg(new BinaryOperation(BinaryOperator::MUL, left->clone(), dv));
+        } else {
+            numerator = new BinaryOperation(                                      // u'v - uv'
+                BinaryOperator::SUB,
+                new BinaryOperation(BinaryOperator::MUL, du, right->clone()),     // u'v
+                new BinaryOperation(BinaryOperator::MUL, left->clone(), dv)       // uv'
+            );
+        }
         return new BinaryOperation(
             BinaryOperator::DIV,
-            new BinaryOperation(                                             // u'v - uv'
-                BinaryOperator::SUB,
-                new BinaryOperation(BinaryOperator::MUL, du, v->clone()),    // u'v
-                new BinaryOperation(BinaryOperator::MUL, u, dv)              // uv'
-            ),
-            new BinaryOperation(BinaryOperator::POW, v, new Constant(2.0f))  // v^2
+            numerator,
+            new OperationPow(right->clone(), 2.0f)                                // v^2
         );
     }
 
     case BinaryOperator::POW: {
         // Check if the exponent 'v' is a constant
-        if (dynamic_cast<Constant*>(right) != nullptr) {
+        auto n = dynamic_cast<Constant*>(right);
+        if (n != nullptr) {
             // Simple Power Rule: (u^n)' = n * u^(n-1) * u'
             delete dv;
             return new BinaryOperation(
                 BinaryOperator::MUL,
                 du,
-                new BinaryOperation(              // v * u^(v - 1)
+                new BinaryOperation(                                    // n * u^(n - 1)
                     BinaryOperator::MUL,
-                    v->clone(),
-                    new BinaryOperation(          // u^(v - 1)
-                       BinaryOperator::POW,
-                        u,
-                        new BinaryOperation(      // v - 1
-                            BinaryOperator::SUB,
-                            v,
-                            new Constant(1.0f)
-                        )
+                    new Constant(n->getValue()),
+                    new OperationPow(left->clone(), n->getValue() - 1.0f) // u^(n - 1)
+                )
+            );
+        }
+
+        if (constantRight) {
+            // Exponent independent of the variable: (u^v)' = v * u^(v-1) * u'
+            delete dv;
+            return new BinaryOperation(
+                BinaryOperator::MUL,
+                du,
+                new BinaryOperation(                                    // v * u^(v - 1)
+                    BinaryOperator::MUL,
+                    right->clone(),
+                    new BinaryOperation(                                // u^(v - 1)
+                        BinaryOperator::POW,
+                        left->clone(),
+                        new BinaryOperation(BinaryOperator::SUB, right->clone(), new Constant(1.0f))
                     )
                 )
             );
         }
+
+        if (constantLeft) {
+            // Base independent of the variable: (u^v)' = u^v * ln(u) * v'
+            delete du;
+            return new BinaryOperation(
+                BinaryOperator::MUL,
+                new BinaryOperation(BinaryOperator::POW, left->clone(), right->clone()), // u^v
+                new BinaryOperation(BinaryOperator::MUL, new OperationLn(left->clone()), dv)
+            );
+        }
+
+        auto u = left->clone();
+        auto v = right->clone();
+
         // General Power rule: (u^v)' = (u^v)(v'ln(u) + vu'/u)
         return new BinaryOperation(
             BinaryOperator::MUL,
@@ -180,9 +270,73 @@ Expression* BinaryOperation::differentiate(const std::string& varName) const {
     }
 
     // Should not be reached
+    delete du;
+    delete dv;
     return new Constant(0.0f);
 }
 
+void BinaryOperation::emit(Program& program, size_t step) const {
+    // Emitted once both operands are on the stack
+    if (step < 2) {
+        return;
+    }
+
+    switch (op) {
+    case BinaryOperator::ADD:
+        program.emit(OpCode::ADD);
+        return;
+    case BinaryOperator::SUB:
+        program.emit(OpCode::SUB);
+        return;
+    case BinaryOperator::MUL:
+        program.emit(OpCode::MUL);
+        return;
+    case BinaryOperator::DIV:
+        program.emit(OpCode::DIV);
+        return;
+    case BinaryOperator::POW:
+        program.emit(OpCode::POW);
+        return;
+    }
+
+    // Should never reach this
+    throw std::runtime_error{"[BinaryOperation::compile] Unknown operation"};
+}
+
+Expression* BinaryOperation::specializeNode(Expression* const* children, const VariableContext& bound) const {
+    // An exponent that became constant picks the strength-reduced power
+    auto exponent = dynamic_cast<Constant*>(children[1]);
+    if (op == BinaryOperator::POW && exponent != nullptr && dynamic_cast<Constant*>(children[0]) == nullptr) {
+        auto result = new OperationPow(children[0], exponent->getValue());
+        delete exponent;
+        return result;
+    }
+    return Expression::specializeNode(children, bound);
+}
+
+void BinaryOperation::releaseChildren(std::vector<Expression*>& out) {
+    if (left) {
+        out.push_back(left);
+        left = nullptr;
+    }
+    if (right) {
+        out.push_back(right);
+        right = nullptr;
+    }
+}
+
+BinaryOperator BinaryOperation::getOperator() const {
+    return op;
+}
+
+const Expression* BinaryOperation::getLeft() const {
+    return left;
+}
+
+const Expression* BinaryOperation::getRight() const {
+    return right;
+}
+
 // --------------------------
 // --------------------------
 // BinaryOperation and Constant
@@ -0,0 +1,268 @@
+#include <stdexcept>
+#include <algorithm>
+
+#include "conditional.hpp"
+#include "constant.hpp"
+#include "program.hpp"
+
+namespace mathex {
+
+static bool isZero(const Expression* e) {
+    auto c = dynamic_cast<const Constant*>(e);
+    return c != nullptr && c->getValue() == 0.0f;
+}
+
+// Derivative of a piecewise operation choosing its left operand where `op` holds, the right one elsewhere
+static Expression* piecewise(ComparisonOperator op, const std::vector<Expression*>& operands, Expression* const* derivatives) {
+    // Both pieces are constant in the variable
+    if (isZero(derivatives[0]) && isZero(derivatives[1])) {
+        delete derivatives[1];
+        return derivatives[0];
+    }
+
+    auto condition = new Comparison(op, operands[0]->clone(), operands[1]->clone());
+    return new Select(condition, derivatives[0], derivatives[1]);
+}
+
+std::string to_string(ComparisonOperator op) {
+    switch (op) {
+    case ComparisonOperator::LESS:
+        return "LESS";
+    case ComparisonOperator::LESS_EQUAL:
+        return "LESS_EQUAL";
+    case ComparisonOperator::GREATER:
+        return "GREATER";
+    case ComparisonOperator::GREATER_EQUAL:
+        return "GREATER_EQUAL";
+    case ComparisonOperator::EQUAL:
+        return "EQUAL";
+    case ComparisonOperator::NOT_EQUAL:
+        return "NOT_EQUAL";
+    }
+
+    return "UNKNOWN";
+}
+
+// --------------------------
+// --------------------------
+// Comparison
+
+Comparison::Comparison(ComparisonOperator op, Expression* left, Expression* right)
+  : NaryOperation{{left, right}},
+    op{op} {}
+
+float Comparison::apply(const float* args, const VariableContext& ctx) const {
+    (void)ctx;
+
+    float a = args[0];
+    float b = args[1];
+    switch (op) {
+    case ComparisonOperator::LESS:
+        return a < b ? 1.0f : 0.0f;
+    case ComparisonOperator::LESS_EQUAL:
+        return a <= b ? 1.0f : 0.0f;
+    case ComparisonOperator::GREATER:
+        return a > b ? 1.0f : 0.0f;
+    case ComparisonOperator::GREATER_EQUAL:
+        return a >= b ? 1.0f : 0.0f;
+    case ComparisonOperator::EQUAL:
+        return a == b ? 1.0f : 0.0f;
+    case ComparisonOperator::NOT_EQUAL:
+        return a != b ? 1.0f : 0.0f;
+    }
+
+    throw std::runtime_error{"[Comparison::apply] Invalid operator: " + to_string(op)};
+}
+
+Expression* Comparison::withChildren(Expression* const* children) const {
+    return new Comparison(op, children[0], children[1]);
+}
+
+Expression* Comparison::derivative(Expression* const* derivatives, SymbolId variable) const {
+    (void)variable;
+
+    // Piecewise constant; the jump itself has no derivative
+    delete derivatives[0];
+    delete derivatives[1];
+    return new Constant(0.0f);
+}
+
+void Comparison::emit(Program& program, size_t step) const {
+    if (step < operands.size()) {
+        return;
+    }
+
+    switch (op) {
+    case ComparisonOperator::LESS:
+        program.emit(OpCode::LESS);
+        break;
+    case ComparisonOperator::LESS_EQUAL:
+        program.emit(OpCode::LESS_EQUAL);
+        break;
+    case ComparisonOperator::GREATER:
+        program.emit(OpCode::GREATER);
+        break;
+    case ComparisonOperator::GREATER_EQUAL:
+        program.emit(OpCode::GREATER_EQUAL);
+        break;
+    case ComparisonOperator::EQUAL:
+        program.emit(OpCode::EQUAL);
+        break;
+    case ComparisonOperator::NOT_EQUAL:
+        program.emit(OpCode::NOT_EQUAL);
+        break;
+    }
+}
+
+ComparisonOperator Comparison::getOperator() const {
+    return op;
+}
+
+const Expression* Comparison::getLeft() const {
+    return operands[0];
+}
+
+const Expression* Comparison::getRight() const {
+    return operands[1];
+}
+
+// --------------------------
+// --------------------------
+// Select
+
+Select::Select(Expression* condition, Expression* ifTrue, Expression* ifFalse)
+  : NaryOperation{{condition, ifTrue, ifFalse}} {}
+
+float Select::apply(const float* args, const VariableContext& ctx) const {
+    (void)ctx;
+    return args[0] != 0.0f ? args[1] : args[2];
+}
+
+Expression* Select::withChildren(Expression* const* children) const {
+    return new Select(children[0], children[1], children[2]);
+}
+
+Expression* Select::derivative(Expression* const* derivatives, SymbolId variable) const {
+    (void)variable;
+
+    // The condition only chooses the piece, so its own derivative is not needed
+    delete derivatives[0];
+    if (isZero(derivatives[1]) && isZero(derivatives[2])) {
+        delete derivatives[2];
+        return derivatives[1];
+    }
+
+    return new Select(operands[0]->clone(), derivatives[1], derivatives[2]);
+}
+
+void Select::emit(Program& program, size_t step) const {
+    if (step < operands.size()) {
+        return;
+    }
+    program.emit(OpCode::SELECT);
+}
+
+Expression* Select::specializeNode(Expression* const* children, const VariableContext& bound) const {
+    auto c = dynamic_cast<Constant*>(children[0]);
+    if (c == nullptr) {
+        return Expression::specializeNode(children, bound);
+    }
+
+    // The branch not taken is dropped without being evaluated
+    bool taken = c->getValue() != 0.0f;
+    delete c;
+    delete children[taken ? 2 : 1];
+    return children[taken ? 1 : 2];
+}
+
+const Expression* Select::getCondition() const {
+    return operands[0];
+}
+
+const Expression* Select::getIfTrue() const {
+    return operands[1];
+}
+
+const Expression* Select::getIfFalse() const {
+    return operands[2];
+}
+
+// --------------------------
+// --------------------------
+// Minimum
+
+Minimum::Minimum(Expression* left, Expression* right) : NaryOperation{{left, right}} {}
+
+float Minimum::apply(const float* args, const VariableContext& ctx) const {
+    (void)ctx;
+    return std::min(args[0], args[1]);
+}
+
+Expression* Minimum::withChildren(Expression* const* children) const {
+    return new Minimum(children[0], children[1]);
+}
+
+Expression* Minimum::derivative(Expression* const* derivatives, SymbolId variable) const {
+    (void)variable;
+    return piecewise(ComparisonOperator::LESS_EQUAL, operands, derivatives);
+}
+
+void Minimum::emit(Program& program, size_t step) const {
+    if (step < operands.size()) {
+        return;
+    }
+    program.emit(OpCode::MIN);
+}
+
+const Expression* Minimum::getLeft() const {
+    return operands[0];
+}
+
+const Expression* Minimum::getRight() const {
+    return operands[1];
+}
+
+// --------------------------
+// --------------------------
+// Maximum
+
+Maximum::Maximum(Expression* left, Expression* right) : NaryOperation{{left, right}} {}
+
+float Maximum::apply(const float* args, const VariableContext& ctx) const {
+    (void)ctx;
+    return std::max(args[0], args[1]);
+}
+
+Expression* Maximum::withChildren(Expression* const* children) const {
+    return new Maximum(children[0], children[1]);
+}
+
+Expression* Maximum::derivative(Expression* const* derivatives, SymbolId variable) const {
+    (void)variable;
+    return piecewise(ComparisonOperator::GREATER_EQUAL, operands, derivatives);
+}
+
+void Maximum::emit(Program& program, size_t step) const {
+    if (step < operands.size()) {
+        return;
+    }
+    program.emit(OpCode::MAX);
+}
+
+const Expression* Maximum::getLeft() const {
+    return operands[0];
+}
+
+const Expression* Maximum::getRight() const {
+    return operands[1];
+}
+
+// --------------------------
+// --------------------------
+// Clamping
+
+Expression* clamp(Expression* x, Expression* lower, Expression* upper) {
+    return new Minimum(new Maximum(x, lower), upper);
+}
+
+} // namespace mathex
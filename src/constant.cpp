@@ -2,6 +2,7 @@
 #include "variable.hpp"
 #include "binary_operation.hpp"
 #include "unary_operation.hpp"
+#include "program.hpp"
 
 namespace mathex {
 
@@ -23,6 +24,32 @@ Expression* Constant::differentiate(const std::string& varName) const {
     return new Constant(0.0f);
 }
 
+float Constant::apply(const float* args, const VariableContext& ctx) const {
+    (void)args;
+    (void)ctx;
+    return c;
+}
+
+Expression* Constant::withChildren(Expression* const* children) const {
+    (void)children;
+    return new Constant(*this);
+}
+
+Expression* Constant::derivative(Expression* const* derivatives, SymbolId variable) const {
+    (void)derivatives;
+    (void)variable;
+    return new Constant(0.0f);
+}
+
+void Constant::emit(Program& program, size_t step) const {
+    (void)step;
+    program.emitConstant(c);
+}
+
+float Constant::getValue() const {
+    return c;
+}
+
 // --------------------------
 // --------------------------
 // Constant and Constant
@@ -0,0 +1,621 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <tuple>
+
+#include "derivatives.hpp"
+#include "functions.hpp"
+
+namespace mathex {
+
+namespace {
+
+constexpr uint32_t NONE = UINT32_MAX;
+
+size_t arity(OpCode op) {
+    switch (op) {
+    case OpCode::CONSTANT:
+    case OpCode::VARIABLE:
+    case OpCode::CALL:
+        return 0;
+    case OpCode::ADD:
+    case OpCode::SUB:
+    case OpCode::MUL:
+    case OpCode::DIV:
+    case OpCode::POW:
+    case OpCode::MIN:
+    case OpCode::MAX:
+    case OpCode::LESS:
+    case OpCode::LESS_EQUAL:
+    case OpCode::GREATER:
+    case OpCode::GREATER_EQUAL:
+    case OpCode::EQUAL:
+    case OpCode::NOT_EQUAL:
+        return 2;
+    case OpCode::FMA:
+    case OpCode::SELECT:
+        return 3;
+    default:
+        return 1;
+    }
+}
+
+// Value of a unary node over a constant, as evaluated by a program
+float foldUnary(OpCode op, float u, float value) {
+    switch (op) {
+    case OpCode::POWI:
+        return powi(u, static_cast<int>(value));
+    case OpCode::NEG:
+        return -u;
+    case OpCode::SIN:
+        return std::sin(u);
+    case OpCode::COS:
+        return std::cos(u);
+    case OpCode::TAN:
+        return std::tan(u);
+    case OpCode::CSC:
+        return 1.0f / std::sin(u);
+    case OpCode::SEC:
+        return 1.0f / std::cos(u);
+    case OpCode::COT:
+        return 1.0f / std::tan(u);
+    case OpCode::LN:
+        return std::log(u);
+    case OpCode::LOG10:
+        return std::log10(u);
+    case OpCode::EXP:
+        return std::exp(u);
+    case OpCode::SQRT:
+        return std::sqrt(u);
+    case OpCode::RSQRT:
+        return 1.0f / std::sqrt(u);
+    case OpCode::RECIPROCAL:
+        return 1.0f / u;
+    case OpCode::ABS:
+        return std::abs(u);
+    default:
+        return u;
+    }
+}
+
+// Value of a min, max or comparison node over two constants, as evaluated by a program
+float foldPiecewise(OpCode op, float l, float r) {
+    switch (op) {
+    case OpCode::MIN:
+        return std::min(l, r);
+    case OpCode::MAX:
+        return std::max(l, r);
+    case OpCode::LESS:
+        return l < r ? 1.0f : 0.0f;
+    case OpCode::LESS_EQUAL:
+        return l <= r ? 1.0f : 0.0f;
+    case OpCode::GREATER:
+        return l > r ? 1.0f : 0.0f;
+    case OpCode::GREATER_EQUAL:
+        return l >= r ? 1.0f : 0.0f;
+    case OpCode::EQUAL:
+        return l == r ? 1.0f : 0.0f;
+    case OpCode::NOT_EQUAL:
+        return l != r ? 1.0f : 0.0f;
+    default:
+        return l;
+    }
+}
+
+// Node store where every node is unique and simplified on creation, with the derivatives of
+// each node memoized per variable
+class Differentiator {
+public:
+    Differentiator(const FlatExpression& flat) : names{flat.variables()} {
+        // Re-interning the nodes applies the simplifications to the original expression too
+        const auto& nodes = flat.nodes();
+        std::vector<uint32_t> index(nodes.size());
+        for (size_t i = 0; i < nodes.size(); i++) {
+            FlatNode node = nodes[i];
+            for (size_t k = 0; k < arity(node.tag); k++) {
+                node.operands[k] = index[node.operands[k]];
+            }
+            if (node.tag == OpCode::CALL) {
+                node.operands[0] = call(flat.callbacks()[node.operands[0]]);
+            }
+            index[i] = make(node);
+        }
+        root = index[flat.roots()[0]];
+    }
+
+    uint32_t original() const {
+        return root;
+    }
+
+    // Derivative of node `f` with respect to input slot `v`
+    uint32_t differentiate(uint32_t f, size_t v) {
+        if (memo.size() <= v) {
+            memo.resize(v + 1);
+        }
+
+        // Nodes reachable from f that depend on v, and have no memoized derivative yet
+        std::vector<bool> pending(f + 1, false);
+        pending[f] = true;
+        for (size_t i = f + 1; i > 0; i--) {
+            size_t n = i - 1;
+            if (!pending[n]) {
+                continue;
+            }
+            if (!dependsOn(n, v) || memoized(n, v) != NONE) {
+                pending[n] = false;
+                continue;
+            }
+            FlatNode node = list[n];
+            for (size_t k = 0; k < arity(node.tag); k++) {
+                pending[node.operands[k]] = true;
+            }
+        }
+
+        // Operands precede their users, so increasing order has every operand derivative ready
+        for (size_t n = 0; n <= f; n++) {
+            if (pending[n]) {
+                uint32_t d = rule(static_cast<uint32_t>(n), v);
+                memo[v].resize(std::max(memo[v].size(), n + 1), NONE);
+                memo[v][n] = d;
+            }
+        }
+
+        return derivativeOf(f, v);
+    }
+
+    const std::vector<FlatNode>& nodes() const {
+        return list;
+    }
+
+    const std::vector<Callback>& callbacks() const {
+        return calls;
+    }
+
+private:
+    using Key = std::tuple<OpCode, uint32_t, uint32_t, uint32_t, uint32_t>;
+
+    bool dependsOn(size_t n, size_t v) const {
+        return (masks[n] & bit(v)) != 0;
+    }
+
+    static uint64_t bit(size_t v) {
+        return uint64_t{1} << std::min<size_t>(v, 63);
+    }
+
+    uint32_t memoized(size_t n, size_t v) const {
+        return n < memo[v].size() ? memo[v][n] : NONE;
+    }
+
+    uint32_t derivativeOf(uint32_t n, size_t v) {
+        if (!dependsOn(n, v)) {
+            return constant(0.0f);
+        }
+        return memo[v][n];
+    }
+
+    // Whether node n is a constant, storing its value
+    bool constantValue(uint32_t n, float& value) const {
+        if (list[n].tag != OpCode::CONSTANT) {
+            return false;
+        }
+        value = list[n].value;
+        return true;
+    }
+
+    bool isConstant(uint32_t n, float expected) const {
+        return list[n].tag == OpCode::CONSTANT && list[n].value == expected;
+    }
+
+    // Stores a node unless an identical one exists
+    uint32_t intern(const FlatNode& node) {
+        uint32_t bits;
+        std::memcpy(&bits, &node.value, sizeof(bits));
+        Key key{node.tag, node.operands[0], node.operands[1], node.operands[2], bits};
+
+        auto it = existing.find(key);
+        if (it != existing.end()) {
+            return it->second;
+        }
+
+        uint64_t mask = 0;
+        if (node.tag == OpCode::VARIABLE) {
+            mask = bit(node.operands[0]);
+        } else if (node.tag == OpCode::CALL) {
+            for (auto slot : calls[node.operands[0]].slots) {
+                mask |= bit(slot);
+            }
+        } else {
+            for (size_t k = 0; k < arity(node.tag); k++) {
+                mask |= masks[node.operands[k]];
+            }
+        }
+
+        auto index = static_cast<uint32_t>(list.size());
+        list.push_back(node);
+        masks.push_back(mask);
+        existing.emplace(key, index);
+        return index;
+    }
+
+    uint32_t constant(float c) {
+        return intern({OpCode::CONSTANT, {0, 0, 0}, c});
+    }
+
+    // Index of a new callback
+    uint32_t call(const Callback& callback) {
+        calls.push_back(callback);
+        return static_cast<uint32_t>(calls.size() - 1);
+    }
+
+    // Stores the nodes of an expression over the same inputs, returning the one computing it
+    uint32_t import(const Expression& expr) {
+        Program program(expr, names);
+        std::vector<uint32_t> stack;
+        for (const auto& ins : program.instructions()) {
+            if (ins.op == OpCode::SUM || ins.op == OpCode::PRODUCT) {
+                OpCode op = ins.op == OpCode::SUM ? OpCode::ADD : OpCode::MUL;
+                size_t first = stack.size() - ins.index;
+                uint32_t acc = stack[first];
+                for (size_t i = first + 1; i < stack.size(); i++) {
+                    acc = binary(op, acc, stack[i]);
+                }
+                stack.resize(first);
+                stack.push_back(acc);
+                continue;
+            }
+
+            FlatNode node{ins.op, {0, 0, 0}, 0.0f};
+            size_t n = arity(ins.op);
+            for (size_t i = 0; i < n; i++) {
+                node.operands[n - 1 - i] = stack.back();
+                stack.pop_back();
+            }
+            if (ins.op == OpCode::VARIABLE) {
+                node.operands[0] = ins.index;
+            } else if (ins.op == OpCode::CALL) {
+                node.operands[0] = call(program.callbacks()[ins.index]);
+            } else {
+                node.value = ins.value;
+            }
+            stack.push_back(make(node));
+        }
+        return stack.back();
+    }
+
+    uint32_t unary(OpCode op, uint32_t a, float value = 0.0f) {
+        return make({op, {a, 0, 0}, value});
+    }
+
+    uint32_t binary(OpCode op, uint32_t a, uint32_t b) {
+        return make({op, {a, b, 0}, 0.0f});
+    }
+
+    uint32_t select(uint32_t condition, uint32_t ifTrue, uint32_t ifFalse) {
+        return make({OpCode::SELECT, {condition, ifTrue, ifFalse}, 0.0f});
+    }
+
+    // Simplifies a node before storing it
+    uint32_t make(FlatNode node) {
+        uint32_t a = node.operands[0];
+        uint32_t b = node.operands[1];
+        uint32_t c = node.operands[2];
+        float x;
+        float y;
+
+        switch (node.tag) {
+        case OpCode::CONSTANT:
+        case OpCode::VARIABLE:
+        case OpCode::CALL:
+            return intern(node);
+        case OpCode::ADD:
+            if (constantValue(a, x) && constantValue(b, y)) {
+                return constant(x + y);
+            }
+            if (isConstant(a, 0.0f)) {
+                return b;
+            }
+            if (isConstant(b, 0.0f)) {
+                return a;
+            }
+            // Commutative operands in a fixed order, so a + b and b + a are one node
+            node.operands[0] = std::min(a, b);
+            node.operands[1] = std::max(a, b);
+            return intern(node);
+        case OpCode::SUB:
+            if (constantValue(a, x) && constantValue(b, y)) {
+                return constant(x - y);
+            }
+            if (a == b) {
+                return constant(0.0f);
+            }
+            if (isConstant(b, 0.0f)) {
+                return a;
+            }
+            if (isConstant(a, 0.0f)) {
+                return unary(OpCode::NEG, b);
+            }
+            return intern(node);
+        case OpCode::MUL:
+            if (constantValue(a, x) && constantValue(b, y)) {
+                return constant(x * y);
+            }
+            if (isConstant(a, 0.0f) || isConstant(b, 0.0f)) {
+                return constant(0.0f);
+            }
+            if (isConstant(a, 1.0f)) {
+                return b;
+            }
+            if (isConstant(b, 1.0f)) {
+                return a;
+            }
+            if (isConstant(a, -1.0f)) {
+                return unary(OpCode::NEG, b);
+            }
+            if (isConstant(b, -1.0f)) {
+                return unary(OpCode::NEG, a);
+            }
+            if (a == b) {
+                return unary(OpCode::POWI, a, 2.0f);
+            }
+            node.operands[0] = std::min(a, b);
+            node.operands[1] = std::max(a, b);
+            return intern(node);
+        case OpCode::DIV:
+            if (constantValue(a, x) && constantValue(b, y)) {
+                return constant(x / y);
+            }
+            if (isConstant(a, 0.0f)) {
+                return constant(0.0f);
+            }
+            if (isConstant(b, 1.0f)) {
+                return a;
+            }
+            if (a == b) {
+                return constant(1.0f);
+            }
+            return intern(node);
+        case OpCode::POW:
+            if (constantValue(a, x) && constantValue(b, y)) {
+                return constant(std::pow(x, y));
+            }
+            if (constantValue(b, y)) {
+                if (y == std::floor(y) && std::abs(y) <= MAX_POWI_EXPONENT) {
+                    return unary(OpCode::POWI, a, y);
+                }
+            }
+            return intern(node);
+        case OpCode::FMA:
+            if (isConstant(a, 0.0f) || isConstant(b, 0.0f)) {
+                return c;
+            }
+            if (isConstant(c, 0.0f)) {
+                return binary(OpCode::MUL, a, b);
+            }
+            if (constantValue(a, x) && constantValue(b, y) && list[c].tag == OpCode::CONSTANT) {
+                return constant(std::fma(x, y, list[c].value));
+            }
+            return intern(node);
+        case OpCode::POWI:
+            if (node.value == 0.0f) {
+                return constant(1.0f);
+            }
+            if (node.value == 1.0f) {
+                return a;
+            }
+            if (list[a].tag == OpCode::POWI && std::abs(list[a].value * node.value) <= MAX_POWI_EXPONENT) {
+                // (u^m)^n = u^(mn) for integers
+                return unary(OpCode::POWI, list[a].operands[0], list[a].value * node.value);
+            }
+            break;
+        case OpCode::NEG:
+            if (list[a].tag == OpCode::NEG) {
+                return list[a].operands[0];
+            }
+            break;
+        case OpCode::MIN:
+        case OpCode::MAX:
+            if (constantValue(a, x) && constantValue(b, y)) {
+                return constant(foldPiecewise(node.tag, x, y));
+            }
+            if (a == b) {
+                return a;
+            }
+            return intern(node);
+        case OpCode::LESS:
+        case OpCode::LESS_EQUAL:
+        case OpCode::GREATER:
+        case OpCode::GREATER_EQUAL:
+        case OpCode::EQUAL:
+        case OpCode::NOT_EQUAL:
+            if (constantValue(a, x) && constantValue(b, y)) {
+                return constant(foldPiecewise(node.tag, x, y));
+            }
+            return intern(node);
+        case OpCode::SELECT:
+            // A constant condition picks its branch; equal branches make the condition irrelevant
+            if (constantValue(a, x)) {
+                return x != 0.0f ? b : c;
+            }
+            if (b == c) {
+                return b;
+            }
+            return intern(node);
+        default:
+            break;
+        }
+
+        if (constantValue(a, x)) {
+            return constant(foldUnary(node.tag, x, node.value));
+        }
+        return intern(node);
+    }
+
+    // d/dv of node n, from the memoized derivatives of its operands
+    uint32_t rule(uint32_t n, size_t v) {
+        FlatNode node = list[n];
+        uint32_t a = node.operands[0];
+        uint32_t b = node.operands[1];
+        uint32_t c = node.operands[2];
+
+        switch (node.tag) {
+        case OpCode::CONSTANT:
+            return constant(0.0f);
+        case OpCode::VARIABLE:
+            return constant(node.operands[0] == v ? 1.0f : 0.0f);
+        case OpCode::CALL: {
+            // Range and vector reductions differentiate into new nodes of their own kind, so
+            // every order stays one callback instead of an expanded loop
+            if (v >= names.size()) {
+                return constant(0.0f);
+            }
+            auto d = calls[node.operands[0]].node->differentiate(names[v]);
+            uint32_t result = import(*d);
+            delete d;
+            return result;
+        }
+        default:
+            break;
+        }
+
+        uint32_t da = derivativeOf(a, v);
+
+        switch (node.tag) {
+        case OpCode::ADD:
+            return binary(OpCode::ADD, da, derivativeOf(b, v));
+        case OpCode::SUB:
+            return binary(OpCode::SUB, da, derivativeOf(b, v));
+        case OpCode::MUL:
+            // (ab)' = a'b + ab'
+            return binary(OpCode::ADD, binary(OpCode::MUL, da, b), binary(OpCode::MUL, a, derivativeOf(b, v)));
+        case OpCode::DIV:
+            // (a/b)' = (a' - (a/b) b') / b
+            return binary(OpCode::DIV, binary(OpCode::SUB, da, binary(OpCode::MUL, n, derivativeOf(b, v))), b);
+        case OpCode::POW: {
+            uint32_t db = derivativeOf(b, v);
+            if (isConstant(db, 0.0f)) {
+                // (a^b)' = b a^(b-1) a' when b does not depend on v
+                uint32_t power = binary(OpCode::POW, a, binary(OpCode::SUB, b, constant(1.0f)));
+                return binary(OpCode::MUL, binary(OpCode::MUL, b, power), da);
+            }
+
+            // (a^b)' = a^b (b' ln a + b a' / a)
+            uint32_t inner = binary(
+                OpCode::ADD,
+                binary(OpCode::MUL, db, unary(OpCode::LN, a)),
+                binary(OpCode::DIV, binary(OpCode::MUL, b, da), a)
+            );
+            return binary(OpCode::MUL, n, inner);
+        }
+        case OpCode::FMA:
+            // (ab + c)' = a'b + ab' + c'
+            return binary(
+                OpCode::ADD,
+                binary(OpCode::ADD, binary(OpCode::MUL, da, b), binary(OpCode::MUL, a, derivativeOf(b, v))),
+                derivativeOf(c, v)
+            );
+        case OpCode::POWI: {
+            // (u^k)' = k u^(k-1) u'
+            float k = node.value;
+            return binary(OpCode::MUL, binary(OpCode::MUL, constant(k), unary(OpCode::POWI, a, k - 1.0f)), da);
+        }
+        case OpCode::NEG:
+            return unary(OpCode::NEG, da);
+        case OpCode::SIN:
+            return binary(OpCode::MUL, unary(OpCode::COS, a), da);
+        case OpCode::COS:
+            return unary(OpCode::NEG, binary(OpCode::MUL, unary(OpCode::SIN, a), da));
+        case OpCode::TAN:
+            // tan' = 1 + tan²
+            return binary(OpCode::MUL, binary(OpCode::ADD, constant(1.0f), unary(OpCode::POWI, n, 2.0f)), da);
+        case OpCode::CSC:
+            // csc' = -csc cot
+            return unary(OpCode::NEG, binary(OpCode::MUL, binary(OpCode::MUL, n, unary(OpCode::COT, a)), da));
+        case OpCode::SEC:
+            // sec' = sec tan
+            return binary(OpCode::MUL, binary(OpCode::MUL, n, unary(OpCode::TAN, a)), da);
+        case OpCode::COT:
+            // cot' = -(1 + cot²)
+            return unary(OpCode::NEG, binary(OpCode::MUL, binary(OpCode::ADD, constant(1.0f), unary(OpCode::POWI, n, 2.0f)), da));
+        case OpCode::LN:
+            return binary(OpCode::DIV, da, a);
+        case OpCode::LOG10:
+            return binary(OpCode::DIV, da, binary(OpCode::MUL, a, constant(std::log(10.0f))));
+        case OpCode::EXP:
+            return binary(OpCode::MUL, n, da);
+        case OpCode::SQRT:
+            // (√u)' = u' / (2√u)
+            return binary(OpCode::DIV, da, binary(OpCode::MUL, constant(2.0f), n));
+        case OpCode::RSQRT:
+            // (u^-1/2)' = -u' u^-1/2 / (2u)
+            return unary(OpCode::NEG, binary(OpCode::DIV, binary(OpCode::MUL, n, da), binary(OpCode::MUL, constant(2.0f), a)));
+        case OpCode::RECIPROCAL:
+            // (1/u)' = -u' (1/u)²
+            return unary(OpCode::NEG, binary(OpCode::MUL, unary(OpCode::POWI, n, 2.0f), da));
+        case OpCode::ABS:
+            // |u|' = u' u / |u|
+            return binary(OpCode::MUL, da, binary(OpCode::DIV, a, n));
+        case OpCode::MIN:
+            // Derivative of the operand that is chosen, the left one on ties
+            return select(binary(OpCode::LESS_EQUAL, a, b), da, derivativeOf(b, v));
+        case OpCode::MAX:
+            return select(binary(OpCode::GREATER_EQUAL, a, b), da, derivativeOf(b, v));
+        case OpCode::LESS:
+        case OpCode::LESS_EQUAL:
+        case OpCode::GREATER:
+        case OpCode::GREATER_EQUAL:
+        case OpCode::EQUAL:
+        case OpCode::NOT_EQUAL:
+            // Piecewise constant
+            return constant(0.0f);
+        case OpCode::SELECT:
+            return select(a, derivativeOf(b, v), derivativeOf(c, v));
+        default:
+            break;
+        }
+
+        throw std::runtime_error{"[derivatives] Unsupported operation " + to_string(node.tag)};
+    }
+
+    uint32_t root = 0;
+    std::vector<std::string> names;
+    std::vector<Callback> calls;
+    std::vector<FlatNode> list;
+    std::vector<uint64_t> masks;
+    std::map<Key, uint32_t> existing;
+
+    // memo[v][n] is the node of d(n)/dv, or NONE while not computed
+    std::vector<std::vector<uint32_t>> memo;
+};
+
+} // namespace
+
+FlatExpression derivatives(
+    const Expression& expr,
+    const std::vector<std::vector<std::string>>& partials,
+    const std::vector<std::string>& variables
+) {
+    FlatExpression flat = variables.empty() ? FlatExpression(expr) : FlatExpression(expr, variables);
+    const auto& names = flat.variables();
+    Differentiator differentiator{flat};
+
+    std::vector<uint32_t> roots;
+    for (const auto& partial : partials) {
+        uint32_t node = differentiator.original();
+        for (const auto& name : partial) {
+            auto it = std::find(names.begin(), names.end(), name);
+            if (it == names.end()) {
+                // Nothing depends on a variable that is not an input
+                node = differentiator.differentiate(node, names.size());
+            } else {
+                node = differentiator.differentiate(node, static_cast<size_t>(it - names.begin()));
+            }
+        }
+        roots.push_back(node);
+    }
+
+    return FlatExpression(differentiator.nodes(), roots, names, differentiator.callbacks());
+}
+
+} // namespace mathex
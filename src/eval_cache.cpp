@@ -0,0 +1,180 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+
+#include "eval_cache.hpp"
+
+namespace mathex {
+
+double EvalCache::Statistics::hitRate() const {
+    uint64_t lookups = hits + misses;
+    return lookups == 0 ? 0.0 : static_cast<double>(hits) / static_cast<double>(lookups);
+}
+
+EvalCache::EvalCache(
+    const Expression& expr,
+    const std::vector<std::string>& variables,
+    size_t capacity,
+    size_t shards,
+    EvictionPolicy policy
+)
+  : program{expr, variables},
+    keySize{variables.size()},
+    policy{policy} {
+    if (capacity == 0) {
+        throw std::runtime_error{"[EvalCache::EvalCache] Capacity must be positive"};
+    }
+
+    size_t count = 1;
+    while (count < shards) {
+        count *= 2;
+    }
+
+    // Every shard holds the same number of whole sets, and together no more than the capacity.
+    // Small capacities use fewer shards, so that rounding down to whole sets stays a small loss
+    ways = std::min(WAYS, capacity);
+    while (count > 1 && count * ways * MIN_SETS > capacity) {
+        count /= 2;
+    }
+    sets = capacity / (count * ways);
+
+    this->shards = std::vector<Shard>(count);
+    for (auto& shard : this->shards) {
+        shard.keys.resize(sets * ways * keySize);
+        shard.values.resize(sets * ways);
+        shard.stamps.resize(sets * ways, 0);
+    }
+}
+
+uint64_t EvalCache::hash(const uint32_t* key) const {
+    uint64_t h = 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < keySize; i++) {
+        h = (h ^ key[i]) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+float EvalCache::compute(const float* values) const {
+    thread_local std::vector<float> stack;
+    stack.resize(program.stackSize() * Program::LANES);
+    return program.eval(values, stack.data());
+}
+
+float EvalCache::eval(const float* values) {
+    if (bypass.load(std::memory_order_relaxed)) {
+        bypassCount.fetch_add(1, std::memory_order_relaxed);
+        return compute(values);
+    }
+
+    thread_local std::vector<uint32_t> key;
+    key.resize(keySize);
+    if (keySize > 0) {
+        memcpy(key.data(), values, keySize * sizeof(float));
+    }
+
+    // High bits pick the shard, low bits the set inside it
+    uint64_t h = hash(key.data());
+    Shard& shard = shards[(h >> 40) & (shards.size() - 1)];
+    size_t first = (h % sets) * ways;
+
+    {
+        std::lock_guard<std::mutex> lock{shard.mutex};
+        for (size_t s = first; s < first + ways; s++) {
+            if (shard.stamps[s] != 0 && std::equal(key.begin(), key.end(), shard.keys.begin() + s * keySize)) {
+                shard.hits++;
+                if (policy == EvictionPolicy::LRU) {
+                    shard.stamps[s] = ++shard.clock;
+                }
+                return shard.values[s];
+            }
+        }
+        shard.misses++;
+    }
+
+    float value = compute(values);
+
+    std::lock_guard<std::mutex> lock{shard.mutex};
+
+    // An empty slot if there is one, otherwise the oldest stamp of the set; another thread
+    // may have inserted the same key meanwhile, in which case it is only refreshed
+    size_t victim = first;
+    for (size_t s = first; s < first + ways; s++) {
+        if (shard.stamps[s] != 0 && std::equal(key.begin(), key.end(), shard.keys.begin() + s * keySize)) {
+            return value;
+        }
+        if (shard.stamps[s] < shard.stamps[victim]) {
+            victim = s;
+        }
+    }
+
+    if (shard.stamps[victim] == 0) {
+        shard.used++;
+    } else {
+        shard.evictions++;
+    }
+    std::copy(key.begin(), key.end(), shard.keys.begin() + victim * keySize);
+    shard.values[victim] = value;
+    shard.stamps[victim] = ++shard.clock;
+    return value;
+}
+
+float EvalCache::eval(const VariableContext& ctx) {
+    thread_local std::vector<float> values;
+    values.clear();
+    for (const auto& name : program.variables()) {
+        auto it = ctx.find(name);
+        if (it == ctx.end()) {
+            throw std::runtime_error{"[EvalCache::eval] Variable name not found in context"};
+        }
+        values.push_back(it->second);
+    }
+    return eval(values.data());
+}
+
+void EvalCache::setBypass(bool bypass) {
+    this->bypass.store(bypass, std::memory_order_relaxed);
+}
+
+bool EvalCache::bypassed() const {
+    return bypass.load(std::memory_order_relaxed);
+}
+
+void EvalCache::clear() {
+    for (auto& shard : shards) {
+        std::lock_guard<std::mutex> lock{shard.mutex};
+        std::fill(shard.stamps.begin(), shard.stamps.end(), 0);
+        shard.used = 0;
+    }
+}
+
+size_t EvalCache::size() const {
+    size_t total = 0;
+    for (const auto& shard : shards) {
+        std::lock_guard<std::mutex> lock{shard.mutex};
+        total += shard.used;
+    }
+    return total;
+}
+
+size_t EvalCache::capacity() const {
+    return shards.size() * sets * ways;
+}
+
+EvalCache::Statistics EvalCache::statistics() const {
+    Statistics stats;
+    for (const auto& shard : shards) {
+        std::lock_guard<std::mutex> lock{shard.mutex};
+        stats.hits += shard.hits;
+        stats.misses += shard.misses;
+        stats.evictions += shard.evictions;
+    }
+    stats.bypassed = bypassCount.load(std::memory_order_relaxed);
+    return stats;
+}
+
+const std::vector<std::string>& EvalCache::variables() const {
+    return program.variables();
+}
+
+} // namespace mathex
@@ -0,0 +1,203 @@
+#include <stdexcept>
+#include <algorithm>
+
+#include "expression.hpp"
+#include "constant.hpp"
+#include "program.hpp"
+#include "derivatives.hpp"
+
+namespace mathex {
+
+float Expression::eval(const VariableContext& ctx) const {
+    struct Frame {
+        const Expression* node;
+        size_t next;
+    };
+
+    // Reused between calls on the same thread; a nested evaluation stacks on top of the
+    // caller's entries and the guard trims them back, even when a lookup throws
+    thread_local std::vector<Frame> frames;
+    thread_local std::vector<float> values;
+
+    struct Guard {
+        size_t frameBase = frames.size();
+        size_t valueBase = values.size();
+        ~Guard() {
+            frames.resize(frameBase);
+            values.resize(valueBase);
+        }
+    } guard;
+
+    frames.push_back({this, 0});
+    while (frames.size() > guard.frameBase) {
+        Frame& top = frames.back();
+        const Expression* node = top.node;
+        if (top.next < node->childCount()) {
+            frames.push_back({node->child(top.next++), 0});
+            continue;
+        }
+
+        frames.pop_back();
+        size_t n = node->childCount();
+        float value = node->apply(values.data() + values.size() - n, ctx);
+        values.resize(values.size() - n);
+        values.push_back(value);
+    }
+
+    return values.back();
+}
+
+Expression* Expression::clone() const {
+    return reduce<Expression*>(*this, [](const Expression& node, Expression** children) {
+        return node.withChildren(children);
+    });
+}
+
+Expression* Expression::differentiate(const std::string& varName) const {
+    // A name that was never interned cannot appear in the tree, so every subtree is skipped
+    SymbolId variable = 0;
+    uint64_t bit = SymbolTable::global().find(varName, variable) ? variableBit(variable) : 0;
+
+    // Subtrees that do not depend on the variable are never visited
+    return reduce<Expression*>(
+        *this,
+        [bit](const Expression& node, Expression*& derivative) {
+            if ((node.dependencies & bit) != 0) {
+                return false;
+            }
+            derivative = new Constant(0.0f);
+            return true;
+        },
+        [variable](const Expression& node, Expression** derivatives) {
+            return node.derivative(derivatives, variable);
+        }
+    );
+}
+
+Expression* Expression::differentiate(const std::string& varName, unsigned order) const {
+    return differentiate(std::vector<std::string>(order, varName));
+}
+
+Expression* Expression::differentiate(const std::vector<std::string>& varNames) const {
+    if (varNames.empty()) {
+        return clone();
+    }
+
+    // Expanding the store repeats its shared nodes; refuse before allocating a runaway tree
+    auto store = derivatives(*this, {varNames});
+    if (store.treeSize() > MAX_DERIVATIVE_NODES) {
+        throw std::runtime_error{"[Expression::differentiate] Derivative tree too large; evaluate it with derivatives() instead"};
+    }
+    return store.toExpression();
+}
+
+void Expression::compile(Program& program) const {
+    traverse(
+        *this,
+        [&program](const Expression& node, size_t step) { node.emit(program, step); },
+        [&program](const Expression& node) { node.emit(program, node.childCount()); }
+    );
+}
+
+Expression* Expression::specialize(const VariableContext& bound) const {
+    return reduce<Expression*>(
+        *this,
+        [](const Expression& node, Expression*& folded) {
+            // Subtrees without any variable are folded at once instead of node by node
+            if (node.dependencies != 0 || node.childCount() == 0) {
+                return false;
+            }
+            folded = new Constant(node.eval({}));
+            return true;
+        },
+        [&bound](const Expression& node, Expression** children) {
+            return node.specializeNode(children, bound);
+        }
+    );
+}
+
+uint64_t Expression::freeVariables() const {
+    return dependencies;
+}
+
+size_t Expression::nodeCount() const {
+    return nodes;
+}
+
+bool Expression::dependsOn(const std::string& varName) const {
+    SymbolId variable;
+    return SymbolTable::global().find(varName, variable) && dependsOn(variable);
+}
+
+bool Expression::dependsOn(SymbolId variable) const {
+    return (dependencies & variableBit(variable)) != 0;
+}
+
+size_t Expression::childCount() const {
+    return 0;
+}
+
+const Expression* Expression::child(size_t index) const {
+    (void)index;
+    throw std::runtime_error{"[Expression::child] Index out of range"};
+}
+
+float Expression::call(const float* inputs, size_t stride) const {
+    (void)inputs;
+    (void)stride;
+    throw std::runtime_error{"[Expression::call] Node does not compile into a callback"};
+}
+
+Expression* Expression::specializeNode(Expression* const* children, const VariableContext& bound) const {
+    (void)bound;
+
+    size_t n = childCount();
+    bool constant = n > 0;
+    for (size_t i = 0; i < n; i++) {
+        constant = constant && dynamic_cast<Constant*>(children[i]) != nullptr;
+    }
+
+    auto result = withChildren(children);
+
+    // Fold when no child depends on an unbound variable anymore
+    if (constant) {
+        float value = result->eval({});
+        delete result;
+        return new Constant(value);
+    }
+
+    return result;
+}
+
+void Expression::releaseChildren(std::vector<Expression*>& out) {
+    (void)out;
+}
+
+uint64_t Expression::variableBit(SymbolId variable) {
+    return uint64_t{1} << std::min(variable, MAX_BIT);
+}
+
+void Expression::gatherDependencies() {
+    dependencies = 0;
+    nodes = 1;
+    for (size_t i = 0; i < childCount(); i++) {
+        auto c = child(i);
+        if (c != nullptr) {
+            dependencies |= c->dependencies;
+            nodes += c->nodes;
+        }
+    }
+}
+
+void Expression::destroy(std::vector<Expression*>& pending) {
+    while (!pending.empty()) {
+        auto node = pending.back();
+        pending.pop_back();
+
+        // Detach the children first so that deleting the node is shallow
+        node->releaseChildren(pending);
+        delete node;
+    }
+}
+
+} // namespace mathex
@@ -0,0 +1,600 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <tuple>
+
+#include "flat_expression.hpp"
+#include "constant.hpp"
+#include "variable.hpp"
+#include "binary_operation.hpp"
+#include "functions.hpp"
+#include "conditional.hpp"
+
+namespace mathex {
+
+// Number of operands consumed by each operation
+static size_t arity(OpCode op) {
+    switch (op) {
+    case OpCode::CONSTANT:
+    case OpCode::VARIABLE:
+    case OpCode::CALL:
+        return 0;
+    case OpCode::ADD:
+    case OpCode::SUB:
+    case OpCode::MUL:
+    case OpCode::DIV:
+    case OpCode::POW:
+    case OpCode::MIN:
+    case OpCode::MAX:
+    case OpCode::LESS:
+    case OpCode::LESS_EQUAL:
+    case OpCode::GREATER:
+    case OpCode::GREATER_EQUAL:
+    case OpCode::EQUAL:
+    case OpCode::NOT_EQUAL:
+        return 2;
+    case OpCode::FMA:
+    case OpCode::SELECT:
+        return 3;
+    default:
+        return 1;
+    }
+}
+
+FlatExpression::FlatExpression(const Expression& expr)
+  : FlatExpression(Program(expr)) {}
+
+FlatExpression::FlatExpression(const Expression& expr, const std::vector<std::string>& variables)
+  : FlatExpression(Program(expr, variables)) {}
+
+namespace {
+
+// Appends programs to a node list, storing identical nodes (same tag, operands and payload bits) once
+class Builder {
+public:
+    Builder(std::vector<FlatNode>& list, std::vector<Callback>& calls) : list{list}, calls{calls} {}
+
+    // Returns the index of the node computing the program's result
+    uint32_t append(const Program& program) {
+        std::vector<uint32_t> stack;
+
+        for (const auto& ins : program.instructions()) {
+            // Reductions are stored as left-to-right chains of binary nodes
+            if (ins.op == OpCode::SUM || ins.op == OpCode::PRODUCT) {
+                OpCode op = ins.op == OpCode::SUM ? OpCode::ADD : OpCode::MUL;
+                size_t first = stack.size() - ins.index;
+                uint32_t acc = stack[first];
+                for (size_t i = first + 1; i < stack.size(); i++) {
+                    acc = intern({op, {acc, stack[i], 0}, 0.0f});
+                }
+                stack.resize(first);
+                stack.push_back(acc);
+                continue;
+            }
+
+            FlatNode node{ins.op, {0, 0, 0}, 0.0f};
+            size_t n = arity(ins.op);
+            for (size_t i = 0; i < n; i++) {
+                node.operands[n - 1 - i] = stack.back();
+                stack.pop_back();
+            }
+            if (ins.op == OpCode::VARIABLE) {
+                node.operands[0] = ins.index;
+            } else if (ins.op == OpCode::CALL) {
+                node.operands[0] = static_cast<uint32_t>(calls.size());
+                calls.push_back(program.callbacks()[ins.index]);
+            } else {
+                node.value = ins.value;
+            }
+
+            stack.push_back(intern(node));
+        }
+
+        return stack.back();
+    }
+
+private:
+    using Key = std::tuple<OpCode, uint32_t, uint32_t, uint32_t, uint32_t>;
+
+    uint32_t intern(const FlatNode& node) {
+        uint32_t bits;
+        std::memcpy(&bits, &node.value, sizeof(bits));
+        Key key{node.tag, node.operands[0], node.operands[1], node.operands[2], bits};
+
+        auto it = existing.find(key);
+        if (it == existing.end()) {
+            it = existing.emplace(key, static_cast<uint32_t>(list.size())).first;
+            list.push_back(node);
+        }
+        return it->second;
+    }
+
+    std::vector<FlatNode>& list;
+    std::vector<Callback>& calls;
+    std::map<Key, uint32_t> existing;
+};
+
+} // namespace
+
+FlatExpression::FlatExpression(const Program& program)
+  : varNames{program.variables()} {
+    Builder builder{list, calls};
+    rootList.push_back(builder.append(program));
+}
+
+FlatExpression::FlatExpression(const std::vector<const Expression*>& exprs, const std::vector<std::string>& variables)
+  : varNames{variables} {
+    Builder builder{list, calls};
+    for (auto expr : exprs) {
+        rootList.push_back(builder.append(Program(*expr, variables)));
+    }
+}
+
+FlatExpression::FlatExpression(
+    const std::vector<FlatNode>& nodes,
+    const std::vector<uint32_t>& roots,
+    const std::vector<std::string>& variables,
+    const std::vector<Callback>& callbacks
+)
+  : list{nodes},
+    rootList{roots},
+    varNames{variables},
+    calls{callbacks} {
+    for (const auto& call : calls) {
+        for (auto slot : call.slots) {
+            if (slot >= varNames.size()) {
+                throw std::runtime_error{"[FlatExpression::FlatExpression] Variable slot out of range"};
+            }
+        }
+    }
+    for (size_t i = 0; i < list.size(); i++) {
+        const auto& node = list[i];
+        if (node.tag == OpCode::SUM || node.tag == OpCode::PRODUCT) {
+            throw std::runtime_error{"[FlatExpression::FlatExpression] Reductions must be stored as binary nodes"};
+        }
+        if (node.tag == OpCode::VARIABLE && node.operands[0] >= varNames.size()) {
+            throw std::runtime_error{"[FlatExpression::FlatExpression] Variable slot out of range"};
+        }
+        if (node.tag == OpCode::CALL && node.operands[0] >= calls.size()) {
+            throw std::runtime_error{"[FlatExpression::FlatExpression] Callback index out of range"};
+        }
+        for (size_t k = 0; k < arity(node.tag); k++) {
+            if (node.operands[k] >= i) {
+                throw std::runtime_error{"[FlatExpression::FlatExpression] Operand does not precede its user"};
+            }
+        }
+    }
+    for (auto root : rootList) {
+        if (root >= list.size()) {
+            throw std::runtime_error{"[FlatExpression::FlatExpression] Root index out of range"};
+        }
+    }
+}
+
+Expression* FlatExpression::toExpression(size_t root) const {
+    if (root >= rootList.size()) {
+        throw std::runtime_error{"[FlatExpression::toExpression] Root index out of range"};
+    }
+
+    // Only the nodes reachable from the root are rebuilt; operands always come before their users
+    uint32_t last = rootList[root];
+    std::vector<bool> reachable(last + 1, false);
+    reachable[last] = true;
+    for (size_t i = last + 1; i > 0; i--) {
+        const auto& node = list[i - 1];
+        if (reachable[i - 1]) {
+            for (size_t k = 0; k < arity(node.tag); k++) {
+                reachable[node.operands[k]] = true;
+            }
+        }
+    }
+
+    // A node used more than once is cloned for all but its last use
+    std::vector<size_t> uses(last + 1, 0);
+    for (size_t i = 0; i <= last; i++) {
+        const auto& node = list[i];
+        if (reachable[i]) {
+            for (size_t k = 0; k < arity(node.tag); k++) {
+                uses[node.operands[k]]++;
+            }
+        }
+    }
+
+    std::vector<Expression*> built(last + 1, nullptr);
+    auto take = [&](uint32_t index) {
+        return --uses[index] == 0 ? built[index] : built[index]->clone();
+    };
+
+    for (size_t i = 0; i <= last; i++) {
+        if (!reachable[i]) {
+            continue;
+        }
+        const auto& node = list[i];
+        Expression* e = nullptr;
+
+        switch (node.tag) {
+        case OpCode::CONSTANT:
+            e = new Constant(node.value);
+            break;
+        case OpCode::VARIABLE:
+            e = new Variable(varNames[node.operands[0]]);
+            break;
+        case OpCode::ADD:
+        case OpCode::SUB:
+        case OpCode::MUL:
+        case OpCode::DIV:
+        case OpCode::POW: {
+            auto l = take(node.operands[0]);
+            auto r = take(node.operands[1]);
+            BinaryOperator op = node.tag == OpCode::ADD ? BinaryOperator::ADD
+                              : node.tag == OpCode::SUB ? BinaryOperator::SUB
+                              : node.tag == OpCode::MUL ? BinaryOperator::MUL
+                              : node.tag == OpCode::DIV ? BinaryOperator::DIV
+                              : BinaryOperator::POW;
+            e = new BinaryOperation(op, l, r);
+            break;
+        }
+        case OpCode::FMA: {
+            auto a = take(node.operands[0]);
+            auto b = take(node.operands[1]);
+            auto c = take(node.operands[2]);
+            e = new BinaryOperation(BinaryOperator::ADD, new BinaryOperation(BinaryOperator::MUL, a, b), c);
+            break;
+        }
+        case OpCode::POWI:
+            e = new OperationPow(take(node.operands[0]), node.value);
+            break;
+        case OpCode::RSQRT:
+            e = new OperationPow(take(node.operands[0]), -0.5f);
+            break;
+        case OpCode::RECIPROCAL:
+            e = new OperationPow(take(node.operands[0]), -1.0f);
+            break;
+        case OpCode::NEG:
+            e = new OperationNeg(take(node.operands[0]));
+            break;
+        case OpCode::SIN:
+            e = new OperationSin(take(node.operands[0]));
+            break;
+        case OpCode::COS:
+            e = new OperationCos(take(node.operands[0]));
+            break;
+        case OpCode::TAN:
+            e = new OperationTan(take(node.operands[0]));
+            break;
+        case OpCode::CSC:
+            e = new OperationCsc(take(node.operands[0]));
+            break;
+        case OpCode::SEC:
+            e = new OperationSec(take(node.operands[0]));
+            break;
+        case OpCode::COT:
+            e = new OperationCot(take(node.operands[0]));
+            break;
+        case OpCode::LN:
+            e = new OperationLn(take(node.operands[0]));
+            break;
+        case OpCode::LOG10:
+            e = new OperationLog10(take(node.operands[0]));
+            break;
+        case OpCode::EXP:
+            e = new OperationExp(take(node.operands[0]));
+            break;
+        case OpCode::SQRT:
+            e = new OperationSqrt(take(node.operands[0]));
+            break;
+        case OpCode::ABS:
+            e = new OperationAbs(take(node.operands[0]));
+            break;
+        case OpCode::MIN: {
+            auto l = take(node.operands[0]);
+            auto r = take(node.operands[1]);
+            e = new Minimum(l, r);
+            break;
+        }
+        case OpCode::MAX: {
+            auto l = take(node.operands[0]);
+            auto r = take(node.operands[1]);
+            e = new Maximum(l, r);
+            break;
+        }
+        case OpCode::LESS:
+        case OpCode::LESS_EQUAL:
+        case OpCode::GREATER:
+        case OpCode::GREATER_EQUAL:
+        case OpCode::EQUAL:
+        case OpCode::NOT_EQUAL: {
+            auto l = take(node.operands[0]);
+            auto r = take(node.operands[1]);
+            ComparisonOperator op = node.tag == OpCode::LESS ? ComparisonOperator::LESS
+                                  : node.tag == OpCode::LESS_EQUAL ? ComparisonOperator::LESS_EQUAL
+                                  : node.tag == OpCode::GREATER ? ComparisonOperator::GREATER
+                                  : node.tag == OpCode::GREATER_EQUAL ? ComparisonOperator::GREATER_EQUAL
+                                  : node.tag == OpCode::EQUAL ? ComparisonOperator::EQUAL
+                                  : ComparisonOperator::NOT_EQUAL;
+            e = new Comparison(op, l, r);
+            break;
+        }
+        case OpCode::SELECT: {
+            auto a = take(node.operands[0]);
+            auto b = take(node.operands[1]);
+            auto c = take(node.operands[2]);
+            e = new Select(a, b, c);
+            break;
+        }
+        case OpCode::SUM:
+        case OpCode::PRODUCT:
+            // Lowered to binary nodes on construction
+            break;
+        case OpCode::CALL:
+            e = calls[node.operands[0]].node->clone();
+            break;
+        }
+
+        built[i] = e;
+    }
+
+    return built[last];
+}
+
+size_t FlatExpression::treeSize(size_t root) const {
+    if (root >= rootList.size()) {
+        throw std::runtime_error{"[FlatExpression::treeSize] Root index out of range"};
+    }
+
+    // Operands come before their users, so one pass sums the subtree sizes
+    uint32_t last = rootList[root];
+    std::vector<size_t> sizes(last + 1);
+    for (size_t i = 0; i <= last; i++) {
+        const auto& node = list[i];
+        size_t total = node.tag == OpCode::FMA ? 2
+                     : node.tag == OpCode::CALL ? calls[node.operands[0]].node->nodeCount()
+                     : 1;
+        for (size_t k = 0; k < arity(node.tag); k++) {
+            size_t operand = sizes[node.operands[k]];
+            total = operand > SIZE_MAX - total ? SIZE_MAX : total + operand;
+        }
+        sizes[i] = total;
+    }
+    return sizes[last];
+}
+
+template <size_t Width, typename Load>
+void FlatExpression::run(Load load, float* scratch) const {
+    // Row i of the scratch holds the value of node i in every lane
+    for (size_t i = 0; i < list.size(); i++) {
+        const auto& node = list[i];
+        float* r = scratch + i * Width;
+        const float* a = scratch + node.operands[0] * Width;
+        const float* b = scratch + node.operands[1] * Width;
+        const float* c = scratch + node.operands[2] * Width;
+
+        switch (node.tag) {
+        case OpCode::CONSTANT:
+            std::fill(r, r + Width, node.value);
+            break;
+        case OpCode::VARIABLE:
+            load(node.operands[0], r);
+            break;
+        case OpCode::ADD:
+            for (size_t l = 0; l < Width; l++) r[l] = a[l] + b[l];
+            break;
+        case OpCode::SUB:
+            for (size_t l = 0; l < Width; l++) r[l] = a[l] - b[l];
+            break;
+        case OpCode::MUL:
+            for (size_t l = 0; l < Width; l++) r[l] = a[l] * b[l];
+            break;
+        case OpCode::DIV:
+            for (size_t l = 0; l < Width; l++) r[l] = a[l] / b[l];
+            break;
+        case OpCode::POW:
+            for (size_t l = 0; l < Width; l++) r[l] = std::pow(a[l], b[l]);
+            break;
+        case OpCode::POWI:
+            for (size_t l = 0; l < Width; l++) r[l] = powi(a[l], static_cast<int>(node.value));
+            break;
+        case OpCode::FMA:
+            for (size_t l = 0; l < Width; l++) r[l] = std::fma(a[l], b[l], c[l]);
+            break;
+        case OpCode::NEG:
+            for (size_t l = 0; l < Width; l++) r[l] = -a[l];
+            break;
+        case OpCode::SIN:
+            for (size_t l = 0; l < Width; l++) r[l] = std::sin(a[l]);
+            break;
+        case OpCode::COS:
+            for (size_t l = 0; l < Width; l++) r[l] = std::cos(a[l]);
+            break;
+        case OpCode::TAN:
+            for (size_t l = 0; l < Width; l++) r[l] = std::tan(a[l]);
+            break;
+        case OpCode::CSC:
+            for (size_t l = 0; l < Width; l++) r[l] = 1.0f / std::sin(a[l]);
+            break;
+        case OpCode::SEC:
+            for (size_t l = 0; l < Width; l++) r[l] = 1.0f / std::cos(a[l]);
+            break;
+        case OpCode::COT:
+            for (size_t l = 0; l < Width; l++) r[l] = 1.0f / std::tan(a[l]);
+            break;
+        case OpCode::LN:
+            for (size_t l = 0; l < Width; l++) r[l] = std::log(a[l]);
+            break;
+        case OpCode::LOG10:
+            for (size_t l = 0; l < Width; l++) r[l] = std::log10(a[l]);
+            break;
+        case OpCode::EXP:
+            for (size_t l = 0; l < Width; l++) r[l] = std::exp(a[l]);
+            break;
+        case OpCode::SQRT:
+            for (size_t l = 0; l < Width; l++) r[l] = std::sqrt(a[l]);
+            break;
+        case OpCode::RSQRT:
+            for (size_t l = 0; l < Width; l++) r[l] = 1.0f / std::sqrt(a[l]);
+            break;
+        case OpCode::RECIPROCAL:
+            for (size_t l = 0; l < Width; l++) r[l] = 1.0f / a[l];
+            break;
+        case OpCode::ABS:
+            for (size_t l = 0; l < Width; l++) r[l] = std::abs(a[l]);
+            break;
+        case OpCode::MIN:
+            for (size_t l = 0; l < Width; l++) r[l] = std::min(a[l], b[l]);
+            break;
+        case OpCode::MAX:
+            for (size_t l = 0; l < Width; l++) r[l] = std::max(a[l], b[l]);
+            break;
+        case OpCode::LESS:
+            for (size_t l = 0; l < Width; l++) r[l] = a[l] < b[l] ? 1.0f : 0.0f;
+            break;
+        case OpCode::LESS_EQUAL:
+            for (size_t l = 0; l < Width; l++) r[l] = a[l] <= b[l] ? 1.0f : 0.0f;
+            break;
+        case OpCode::GREATER:
+            for (size_t l = 0; l < Width; l++) r[l] = a[l] > b[l] ? 1.0f : 0.0f;
+            break;
+        case OpCode::GREATER_EQUAL:
+            for (size_t l = 0; l < Width; l++) r[l] = a[l] >= b[l] ? 1.0f : 0.0f;
+            break;
+        case OpCode::EQUAL:
+            for (size_t l = 0; l < Width; l++) r[l] = a[l] == b[l] ? 1.0f : 0.0f;
+            break;
+        case OpCode::NOT_EQUAL:
+            for (size_t l = 0; l < Width; l++) r[l] = a[l] != b[l] ? 1.0f : 0.0f;
+            break;
+        case OpCode::SELECT:
+            for (size_t l = 0; l < Width; l++) r[l] = a[l] != 0.0f ? b[l] : c[l];
+            break;
+        case OpCode::SUM:
+        case OpCode::PRODUCT:
+            // Lowered to binary nodes on construction
+            break;
+        case OpCode::CALL: {
+            // Inputs are gathered in rows of the thread's scratch, reused from call to call
+            const auto& call = calls[node.operands[0]];
+            ThreadScratch rows;
+            float* inputs = rows.floats(call.slots.size() * Width);
+            for (size_t k = 0; k < call.slots.size(); k++) {
+                load(call.slots[k], inputs + k * Width);
+            }
+            call.eval(inputs, Width, r, Width);
+            break;
+        }
+        }
+    }
+}
+
+float FlatExpression::eval(const float* values, float* scratch) const {
+    run<1>([values](uint32_t index, float* dst) { dst[0] = values[index]; }, scratch);
+    return scratch[rootList[0]];
+}
+
+void FlatExpression::evalAll(const float* values, float* out, float* scratch) const {
+    run<1>([values](uint32_t index, float* dst) { dst[0] = values[index]; }, scratch);
+    for (size_t i = 0; i < rootList.size(); i++) {
+        out[i] = scratch[rootList[i]];
+    }
+}
+
+float FlatExpression::eval(const VariableContext& ctx) const {
+    std::vector<float> values;
+    values.reserve(varNames.size());
+    for (const auto& name : varNames) {
+        auto it = ctx.find(name);
+        if (it == ctx.end()) {
+            throw std::runtime_error{"[FlatExpression::eval] Variable name not found in context"};
+        }
+        values.push_back(it->second);
+    }
+
+    std::vector<float> scratch(list.size());
+    return eval(values.data(), scratch.data());
+}
+
+void FlatExpression::evalBatch(const float* const* inputs, float* out, size_t count, float* scratch) const {
+    constexpr size_t LANES = Program::LANES;
+    const float* root = scratch + rootList[0] * LANES;
+
+    size_t offset = 0;
+    for (; offset + LANES <= count; offset += LANES) {
+        run<LANES>(
+            [inputs, offset](uint32_t index, float* dst) {
+                std::copy(inputs[index] + offset, inputs[index] + offset + LANES, dst);
+            },
+            scratch
+        );
+        std::copy(root, root + LANES, out + offset);
+    }
+
+    // Remaining points are padded with zeros up to a full row
+    size_t width = count - offset;
+    if (width > 0) {
+        run<LANES>(
+            [inputs, offset, width](uint32_t index, float* dst) {
+                std::copy(inputs[index] + offset, inputs[index] + offset + width, dst);
+                std::fill(dst + width, dst + LANES, 0.0f);
+            },
+            scratch
+        );
+        std::copy(root, root + width, out + offset);
+    }
+}
+
+void FlatExpression::evalAllBatch(const float* const* inputs, float* const* out, size_t count, float* scratch) const {
+    constexpr size_t LANES = Program::LANES;
+
+    size_t offset = 0;
+    for (; offset + LANES <= count; offset += LANES) {
+        run<LANES>(
+            [inputs, offset](uint32_t index, float* dst) {
+                std::copy(inputs[index] + offset, inputs[index] + offset + LANES, dst);
+            },
+            scratch
+        );
+        for (size_t i = 0; i < rootList.size(); i++) {
+            const float* root = scratch + rootList[i] * LANES;
+            std::copy(root, root + LANES, out[i] + offset);
+        }
+    }
+
+    // Remaining points are padded with zeros up to a full row
+    size_t width = count - offset;
+    if (width > 0) {
+        run<LANES>(
+            [inputs, offset, width](uint32_t index, float* dst) {
+                std::copy(inputs[index] + offset, inputs[index] + offset + width, dst);
+                std::fill(dst + width, dst + LANES, 0.0f);
+            },
+            scratch
+        );
+        for (size_t i = 0; i < rootList.size(); i++) {
+            const float* root = scratch + rootList[i] * LANES;
+            std::copy(root, root + width, out[i] + offset);
+        }
+    }
+}
+
+size_t FlatExpression::size() const {
+    return list.size();
+}
+
+const std::vector<uint32_t>& FlatExpression::roots() const {
+    return rootList;
+}
+
+const std::vector<FlatNode>& FlatExpression::nodes() const {
+    return list;
+}
+
+const std::vector<std::string>& FlatExpression::variables() const {
+    return varNames;
+}
+
+const std::vector<Callback>& FlatExpression::callbacks() const {
+    return calls;
+}
+
+} // namespace mathex
@@ -1,90 +1,95 @@
+#include <stdexcept>
 #include <cmath>
 
 #include "functions.hpp"
+#include "program.hpp"
 
 namespace mathex {
 
-float OperationNeg::eval(const VariableContext& ctx) const {
-    return -operand->eval(ctx);
+float OperationNeg::compute(float u) const {
+    return -u;
 }
 
-Expression* OperationNeg::clone() const {
-    return new OperationNeg(operand->clone());
-}
-
-Expression* OperationNeg::differentiate(const std::string& varName) const {
+Expression* OperationNeg::chainRule(Expression* du) const {
     // (-u)' = -u'
-    auto du = operand->differentiate(varName);
     return new OperationNeg(du);
 }
 
-float OperationSin::eval(const VariableContext& ctx) const {
-    return std::sin(operand->eval(ctx));
+void OperationNeg::emitOperation(Program& program) const {
+    program.emit(OpCode::NEG);
+}
+
+UnaryOperation* OperationNeg::withOperand(Expression* newOperand) const {
+    return new OperationNeg(newOperand);
 }
 
-Expression* OperationSin::clone() const {
-    return new OperationSin(operand->clone());
+float OperationSin::compute(float u) const {
+    return std::sin(u);
 }
 
-Expression* OperationSin::differentiate(const std::string& varName) const {
+Expression* OperationSin::chainRule(Expression* du) const {
     // (sin(u))' = u'cos(u)
     auto u = operand->clone();
-    auto du = operand->differentiate(varName);
     return new BinaryOperation(BinaryOperator::MUL, du, new OperationCos(u));
 }
 
-float OperationCos::eval(const VariableContext& ctx) const {
-    return std::cos(operand->eval(ctx));
+void OperationSin::emitOperation(Program& program) const {
+    program.emit(OpCode::SIN);
+}
+
+UnaryOperation* OperationSin::withOperand(Expression* newOperand) const {
+    return new OperationSin(newOperand);
 }
 
-Expression* OperationCos::clone() const {
-    return new OperationCos(operand->clone());
+float OperationCos::compute(float u) const {
+    return std::cos(u);
 }
 
-Expression* OperationCos::differentiate(const std::string& varName) const {
+Expression* OperationCos::chainRule(Expression* du) const {
     // (cos(u))' = -u'sin(u)
     auto u = operand->clone();
-    auto du = operand->differentiate(varName);
     return new OperationNeg(
         new BinaryOperation(BinaryOperator::MUL, du, new OperationSin(u))
     );
 }
 
-float OperationTan::eval(const VariableContext& ctx) const {
-    return std::tan(operand->eval(ctx));
+void OperationCos::emitOperation(Program& program) const {
+    program.emit(OpCode::COS);
 }
 
-Expression* OperationTan::clone() const {
-    return new OperationTan(operand->clone());
+UnaryOperation* OperationCos::withOperand(Expression* newOperand) const {
+    return new OperationCos(newOperand);
 }
 
-Expression* OperationTan::differentiate(const std::string& varName) const {
+float OperationTan::compute(float u) const {
+    return std::tan(u);
+}
+
+Expression* OperationTan::chainRule(Expression* du) const {
     // (tan(u))' = u'(sec(u))^2
     auto u = operand->clone();
-    auto du = operand->differentiate(varName);
     return new BinaryOperation(
         BinaryOperator::MUL,
         du,
-        new BinaryOperation(     // (sec(u))^2
-            BinaryOperator::POW,
-            new OperationSec(u), // sec(u)
-            new Constant(2.0f)
-        )
+        new OperationPow(new OperationSec(u), 2.0f) // (sec(u))^2
     );
 }
 
-float OperationCsc::eval(const VariableContext& ctx) const {
-    return 1.0f / std::sin(operand->eval(ctx));
+void OperationTan::emitOperation(Program& program) const {
+    program.emit(OpCode::TAN);
+}
+
+UnaryOperation* OperationTan::withOperand(Expression* newOperand) const {
+    return new OperationTan(newOperand);
 }
 
-Expression* OperationCsc::clone() const {
-    return new OperationCsc(operand->clone());
+float OperationCsc::compute(float u) const {
+    return 1.0f / std::sin(u);
 }
 
-Expression* OperationCsc::differentiate(const std::string& varName) const {
+Expression* OperationCsc::chainRule(Expression* du) const {
     // (csc(u))' = -u'csc(u)cot(u)
     auto u = operand->clone();
-    auto du = operand->differentiate(varName);
     return new OperationNeg(
         new BinaryOperation(                  // u'csc(u)cot(u)
             BinaryOperator::MUL,
@@ -98,18 +103,21 @@ Expression* OperationCsc::differentiate(const std::string& varName) const {
     );
 }
 
-float OperationSec::eval(const VariableContext& ctx) const {
-    return 1.0f / std::cos(operand->eval(ctx));
+void OperationCsc::emitOperation(Program& program) const {
+    program.emit(OpCode::CSC);
 }
 
-Expression* OperationSec::clone() const {
-    return new OperationSec(operand->clone());
+UnaryOperation* OperationCsc::withOperand(Expression* newOperand) const {
+    return new OperationCsc(newOperand);
 }
 
-Expression* OperationSec::differentiate(const std::string& varName) const {
+float OperationSec::compute(float u) const {
+    return 1.0f / std::cos(u);
+}
+
+Expression* OperationSec::chainRule(Expression* du) const {
     // (sec(u))' = u'tan(u)sec(u)
     auto u = operand->clone();
-    auto du = operand->differentiate(varName);
     return new BinaryOperation(
         BinaryOperator::MUL,
         du,
@@ -121,58 +129,63 @@ Expression* OperationSec::differentiate(const std::string& varName) const {
     );
 }
 
-float OperationCot::eval(const VariableContext& ctx) const {
-    return 1.0f / std::tan(operand->eval(ctx));
+void OperationSec::emitOperation(Program& program) const {
+    program.emit(OpCode::SEC);
+}
+
+UnaryOperation* OperationSec::withOperand(Expression* newOperand) const {
+    return new OperationSec(newOperand);
 }
 
-Expression* OperationCot::clone() const {
-    return new OperationCot(operand->clone());
+float OperationCot::compute(float u) const {
+    return 1.0f / std::tan(u);
 }
 
-Expression* OperationCot::differentiate(const std::string& varName) const {
+Expression* OperationCot::chainRule(Expression* du) const {
     // (cot(u))' = -u'(csc(u))^2
     auto u = operand->clone();
-    auto du = operand->differentiate(varName);
     return new OperationNeg(
-        new BinaryOperation(         // u'(csc(u))^2
+        new BinaryOperation(                              // u'(csc(u))^2
             BinaryOperator::MUL,
             du,
-            new BinaryOperation(     // (csc(u))^2
-                BinaryOperator::POW,
-                new OperationCsc(u), // csc(u)
-                new Constant(2.0f)
-            )
+            new OperationPow(new OperationCsc(u), 2.0f)   // (csc(u))^2
         )
     );
 }
 
-float OperationLn::eval(const VariableContext& ctx) const {
-    return std::log(operand->eval(ctx));
+void OperationCot::emitOperation(Program& program) const {
+    program.emit(OpCode::COT);
 }
 
-Expression* OperationLn::clone() const {
-    return new OperationLn(operand->clone());
+UnaryOperation* OperationCot::withOperand(Expression* newOperand) const {
+    return new OperationCot(newOperand);
 }
 
-Expression* OperationLn::differentiate(const std::string& varName) const {
+float OperationLn::compute(float u) const {
+    return std::log(u);
+}
+
+Expression* OperationLn::chainRule(Expression* du) const {
     // (ln(u))' = u'/u
     auto u = operand->clone();
-    auto du = operand->differentiate(varName);
     return new BinaryOperation(BinaryOperator::DIV, du, u);
 }
 
-float OperationLog10::eval(const VariableContext& ctx) const {
-    return std::log10(operand->eval(ctx));
+void OperationLn::emitOperation(Program& program) const {
+    program.emit(OpCode::LN);
+}
+
+UnaryOperation* OperationLn::withOperand(Expression* newOperand) const {
+    return new OperationLn(newOperand);
 }
 
-Expression* OperationLog10::clone() const {
-    return new OperationLog10(operand->clone());
+float OperationLog10::compute(float u) const {
+    return std::log10(u);
 }
 
-Expression* OperationLog10::differentiate(const std::string& varName) const {
+Expression* OperationLog10::chainRule(Expression* du) const {
     // (log10(u))' = u' / (ln(10) * u)
     auto u = operand->clone();
-    auto du = operand->differentiate(varName);
     return new BinaryOperation(
         BinaryOperator::DIV,
         du,
@@ -184,33 +197,38 @@ Expression* OperationLog10::differentiate(const std::string& varName) const {
     );
 }
 
-float OperationExp::eval(const VariableContext& ctx) const {
-    return std::exp(operand->eval(ctx));
+void OperationLog10::emitOperation(Program& program) const {
+    program.emit(OpCode::LOG10);
+}
+
+UnaryOperation* OperationLog10::withOperand(Expression* newOperand) const {
+    return new OperationLog10(newOperand);
 }
 
-Expression* OperationExp::clone() const {
-    return new OperationExp(operand->clone());
+float OperationExp::compute(float u) const {
+    return std::exp(u);
 }
 
-Expression* OperationExp::differentiate(const std::string& varName) const {
+Expression* OperationExp::chainRule(Expression* du) const {
     // (e^u)' = u'e^u
-    auto u = operand->clone();
-    auto du = operand->differentiate(varName);
-    return new BinaryOperation(BinaryOperator::MUL, du, u);
+    return new BinaryOperation(BinaryOperator::MUL, du, new OperationExp(operand->clone()));
+}
+
+void OperationExp::emitOperation(Program& program) const {
+    program.emit(OpCode::EXP);
 }
 
-float OperationSqrt::eval(const VariableContext& ctx) const {
-    return std::sqrt(operand->eval(ctx));
+UnaryOperation* OperationExp::withOperand(Expression* newOperand) const {
+    return new OperationExp(newOperand);
 }
 
-Expression* OperationSqrt::clone() const {
-    return new OperationSqrt(operand->clone());
+float OperationSqrt::compute(float u) const {
+    return std::sqrt(u);
 }
 
-Expression* OperationSqrt::differentiate(const std::string& varName) const {
+Expression* OperationSqrt::chainRule(Expression* du) const {
     // (sqrt(u))' = u' / 2sqrt(u)
     auto u = operand->clone();
-    auto du = operand->differentiate(varName);
     return new BinaryOperation(
         BinaryOperator::DIV,
         du,
@@ -222,18 +240,21 @@ Expression* OperationSqrt::differentiate(const std::string& varName) const {
     );
 }
 
-float OperationAbs::eval(const VariableContext& ctx) const {
-    return std::abs(operand->eval(ctx));
+void OperationSqrt::emitOperation(Program& program) const {
+    program.emit(OpCode::SQRT);
 }
 
-Expression* OperationAbs::clone() const {
-    return new OperationAbs(operand->clone());
+UnaryOperation* OperationSqrt::withOperand(Expression* newOperand) const {
+    return new OperationSqrt(newOperand);
 }
 
-Expression* OperationAbs::differentiate(const std::string& varName) const {
+float OperationAbs::compute(float u) const {
+    return std::abs(u);
+}
+
+Expression* OperationAbs::chainRule(Expression* du) const {
     // (|x|)' = u' * |u| / u
     auto u = operand->clone();
-    auto du = operand->differentiate(varName);
     return new BinaryOperation(
         BinaryOperator::MUL,
         du,
@@ -245,4 +266,111 @@ Expression* OperationAbs::differentiate(const std::string& varName) const {
     );
 }
 
+void OperationAbs::emitOperation(Program& program) const {
+    program.emit(OpCode::ABS);
+}
+
+UnaryOperation* OperationAbs::withOperand(Expression* newOperand) const {
+    return new OperationAbs(newOperand);
+}
+
+float powi(float x, int n) {
+    // Binary addition chain: square the base, multiply it in for every set bit. Each float
+    // step would round, and the error grows with n; doubles keep it below one float ulp
+    unsigned e = n < 0 ? -static_cast<unsigned>(n) : static_cast<unsigned>(n);
+    double base = x;
+    double r = 1.0;
+    while (e != 0) {
+        if (e & 1u) {
+            r *= base;
+        }
+        e >>= 1;
+        if (e != 0) {
+            base *= base;
+        }
+    }
+    return static_cast<float>(n < 0 ? 1.0 / r : r);
+}
+
+OperationPow::OperationPow(Expression* operand, float exponent)
+  : UnaryOperation{operand},
+    exponent{exponent} {
+    if (exponent == -1.0f) {
+        kind = Kind::RECIPROCAL;
+    } else if (exponent == std::floor(exponent) && std::abs(exponent) <= MAX_POWI_EXPONENT) {
+        kind = Kind::INTEGER;
+    } else if (exponent == 0.5f) {
+        kind = Kind::SQRT;
+    } else if (exponent == -0.5f) {
+        kind = Kind::RSQRT;
+    } else {
+        kind = Kind::GENERAL;
+    }
+}
+
+float OperationPow::compute(float u) const {
+    switch (kind) {
+    case Kind::INTEGER:
+        return powi(u, static_cast<int>(exponent));
+    case Kind::RECIPROCAL:
+        return 1.0f / u;
+    case Kind::SQRT:
+        return std::sqrt(u);
+    case Kind::RSQRT:
+        return 1.0f / std::sqrt(u);
+    case Kind::GENERAL:
+        return std::pow(u, exponent);
+    }
+
+    // Should never reach this
+    throw std::runtime_error{"[OperationPow::compute] Unknown kind"};
+}
+
+Expression* OperationPow::chainRule(Expression* du) const {
+    // (u^n)' = u' * n * u^(n-1)
+    auto u = operand->clone();
+    return new BinaryOperation(
+        BinaryOperator::MUL,
+        du,
+        new BinaryOperation(                       // n * u^(n-1)
+            BinaryOperator::MUL,
+            new Constant(exponent),                // n
+            new OperationPow(u, exponent - 1.0f)   // u^(n-1)
+        )
+    );
+}
+
+void OperationPow::emitOperation(Program& program) const {
+    switch (kind) {
+    case Kind::INTEGER:
+        program.emitPowi(static_cast<int>(exponent));
+        return;
+    case Kind::RECIPROCAL:
+        program.emit(OpCode::RECIPROCAL);
+        return;
+    case Kind::SQRT:
+        program.emit(OpCode::SQRT);
+        return;
+    case Kind::RSQRT:
+        program.emit(OpCode::RSQRT);
+        return;
+    case Kind::GENERAL:
+        program.emitConstant(exponent);
+        program.emit(OpCode::POW);
+        return;
+    }
+}
+
+UnaryOperation* OperationPow::withOperand(Expression* newOperand) const {
+    return new OperationPow(newOperand, exponent);
+}
+
+float OperationPow::getExponent() const {
+    return exponent;
+}
+
+OperationPow::Kind OperationPow::getKind() const {
+    return kind;
+}
+
 } // namespace mathex
\ No newline at end of file
@@ -0,0 +1,447 @@
+#include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+
+#include "grid.hpp"
+#include "functions.hpp"
+
+namespace mathex {
+
+// Node kinds besides the index of the only axis a node depends on
+static constexpr int32_t FIXED = -1;
+static constexpr int32_t MIXED = -2;
+
+static size_t arity(OpCode op) {
+    switch (op) {
+    case OpCode::CONSTANT:
+    case OpCode::VARIABLE:
+    case OpCode::CALL:
+        return 0;
+    case OpCode::ADD:
+    case OpCode::SUB:
+    case OpCode::MUL:
+    case OpCode::DIV:
+    case OpCode::POW:
+    case OpCode::MIN:
+    case OpCode::MAX:
+    case OpCode::LESS:
+    case OpCode::LESS_EQUAL:
+    case OpCode::GREATER:
+    case OpCode::GREATER_EQUAL:
+    case OpCode::EQUAL:
+    case OpCode::NOT_EQUAL:
+        return 2;
+    case OpCode::FMA:
+    case OpCode::SELECT:
+        return 3;
+    default:
+        return 1;
+    }
+}
+
+// Computes n values of a node from n values of each of its operands
+static void compute(const FlatNode& node, const float* a, const float* b, const float* c, float* r, size_t n) {
+    switch (node.tag) {
+    case OpCode::CONSTANT:
+        std::fill(r, r + n, node.value);
+        break;
+    case OpCode::VARIABLE:
+        throw std::runtime_error{"[GridEvaluator::eval] Variables are loaded, not computed"};
+    case OpCode::ADD:
+        for (size_t i = 0; i < n; i++) r[i] = a[i] + b[i];
+        break;
+    case OpCode::SUB:
+        for (size_t i = 0; i < n; i++) r[i] = a[i] - b[i];
+        break;
+    case OpCode::MUL:
+        for (size_t i = 0; i < n; i++) r[i] = a[i] * b[i];
+        break;
+    case OpCode::DIV:
+        for (size_t i = 0; i < n; i++) r[i] = a[i] / b[i];
+        break;
+    case OpCode::POW:
+        for (size_t i = 0; i < n; i++) r[i] = std::pow(a[i], b[i]);
+        break;
+    case OpCode::POWI:
+        for (size_t i = 0; i < n; i++) r[i] = powi(a[i], static_cast<int>(node.value));
+        break;
+    case OpCode::FMA:
+        for (size_t i = 0; i < n; i++) r[i] = std::fma(a[i], b[i], c[i]);
+        break;
+    case OpCode::NEG:
+        for (size_t i = 0; i < n; i++) r[i] = -a[i];
+        break;
+    case OpCode::SIN:
+        for (size_t i = 0; i < n; i++) r[i] = std::sin(a[i]);
+        break;
+    case OpCode::COS:
+        for (size_t i = 0; i < n; i++) r[i] = std::cos(a[i]);
+        break;
+    case OpCode::TAN:
+        for (size_t i = 0; i < n; i++) r[i] = std::tan(a[i]);
+        break;
+    case OpCode::CSC:
+        for (size_t i = 0; i < n; i++) r[i] = 1.0f / std::sin(a[i]);
+        break;
+    case OpCode::SEC:
+        for (size_t i = 0; i < n; i++) r[i] = 1.0f / std::cos(a[i]);
+        break;
+    case OpCode::COT:
+        for (size_t i = 0; i < n; i++) r[i] = 1.0f / std::tan(a[i]);
+        break;
+    case OpCode::LN:
+        for (size_t i = 0; i < n; i++) r[i] = std::log(a[i]);
+        break;
+    case OpCode::LOG10:
+        for (size_t i = 0; i < n; i++) r[i] = std::log10(a[i]);
+        break;
+    case OpCode::EXP:
+        for (size_t i = 0; i < n; i++) r[i] = std::exp(a[i]);
+        break;
+    case OpCode::SQRT:
+        for (size_t i = 0; i < n; i++) r[i] = std::sqrt(a[i]);
+        break;
+    case OpCode::RSQRT:
+        for (size_t i = 0; i < n; i++) r[i] = 1.0f / std::sqrt(a[i]);
+        break;
+    case OpCode::RECIPROCAL:
+        for (size_t i = 0; i < n; i++) r[i] = 1.0f / a[i];
+        break;
+    case OpCode::ABS:
+        for (size_t i = 0; i < n; i++) r[i] = std::abs(a[i]);
+        break;
+    case OpCode::MIN:
+        for (size_t i = 0; i < n; i++) r[i] = std::min(a[i], b[i]);
+        break;
+    case OpCode::MAX:
+        for (size_t i = 0; i < n; i++) r[i] = std::max(a[i], b[i]);
+        break;
+    case OpCode::LESS:
+        for (size_t i = 0; i < n; i++) r[i] = a[i] < b[i] ? 1.0f : 0.0f;
+        break;
+    case OpCode::LESS_EQUAL:
+        for (size_t i = 0; i < n; i++) r[i] = a[i] <= b[i] ? 1.0f : 0.0f;
+        break;
+    case OpCode::GREATER:
+        for (size_t i = 0; i < n; i++) r[i] = a[i] > b[i] ? 1.0f : 0.0f;
+        break;
+    case OpCode::GREATER_EQUAL:
+        for (size_t i = 0; i < n; i++) r[i] = a[i] >= b[i] ? 1.0f : 0.0f;
+        break;
+    case OpCode::EQUAL:
+        for (size_t i = 0; i < n; i++) r[i] = a[i] == b[i] ? 1.0f : 0.0f;
+        break;
+    case OpCode::NOT_EQUAL:
+        for (size_t i = 0; i < n; i++) r[i] = a[i] != b[i] ? 1.0f : 0.0f;
+        break;
+    case OpCode::SELECT:
+        for (size_t i = 0; i < n; i++) r[i] = a[i] != 0.0f ? b[i] : c[i];
+        break;
+    case OpCode::SUM:
+    case OpCode::PRODUCT:
+        throw std::runtime_error{"[GridEvaluator::eval] Reductions must be stored as binary nodes"};
+    case OpCode::CALL:
+        throw std::runtime_error{"[GridEvaluator::eval] Callbacks are called on their inputs, not computed"};
+    }
+}
+
+GridEvaluator::GridEvaluator(const Expression& expr, const std::vector<std::string>& axes) : axisNames{axes} {
+    if (axes.size() != 2 && axes.size() != 3) {
+        throw std::runtime_error{"[GridEvaluator::GridEvaluator] Expected two or three axes"};
+    }
+
+    // Axes take the first input slots, the other variables follow in order of first appearance
+    std::vector<std::string> variables = axes;
+    FlatExpression probe{expr};
+    for (const auto& name : probe.variables()) {
+        if (std::find(axes.begin(), axes.end(), name) == axes.end()) {
+            paramNames.push_back(name);
+            variables.push_back(name);
+        }
+    }
+    flat = FlatExpression(expr, variables);
+
+    const auto& nodes = flat.nodes();
+    std::vector<uint32_t> masks(nodes.size(), 0);
+    kinds.resize(nodes.size());
+    expanded.resize(nodes.size(), false);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const auto& node = nodes[i];
+        if (node.tag == OpCode::VARIABLE) {
+            masks[i] = node.operands[0] < axes.size() ? 1u << node.operands[0] : 0;
+        } else if (node.tag == OpCode::CALL) {
+            for (auto slot : flat.callbacks()[node.operands[0]].slots) {
+                masks[i] |= slot < axes.size() ? 1u << slot : 0;
+            }
+        } else {
+            for (size_t k = 0; k < arity(node.tag); k++) {
+                masks[i] |= masks[node.operands[k]];
+            }
+        }
+
+        uint32_t mask = masks[i];
+        if (mask == 0) {
+            kinds[i] = FIXED;
+        } else if ((mask & (mask - 1)) == 0) {
+            kinds[i] = mask == 1 ? 0 : mask == 2 ? 1 : 2;
+        } else {
+            kinds[i] = MIXED;
+            for (size_t k = 0; k < arity(node.tag); k++) {
+                if (kinds[node.operands[k]] != MIXED) {
+                    expanded[node.operands[k]] = true;
+                }
+            }
+        }
+    }
+
+    uint32_t root = flat.roots()[0];
+    if (kinds[root] != MIXED) {
+        expanded[root] = true;
+    }
+}
+
+void GridEvaluator::eval(
+    const float* const* samples,
+    const size_t* counts,
+    const float* parameters,
+    float* out,
+    unsigned threads
+) const {
+    const auto& nodes = flat.nodes();
+    size_t dims = axisNames.size();
+    size_t total = 1;
+    for (size_t a = 0; a < dims; a++) {
+        total *= counts[a];
+    }
+    if (total == 0) {
+        return;
+    }
+
+    // Runs a CALL node at n points, after fill(slot, column) wrote the n values of each input
+    auto call = [this](const FlatNode& node, size_t n, auto fill, float* r) {
+        const auto& callback = flat.callbacks()[node.operands[0]];
+        ThreadScratch rows;
+        float* inputs = rows.floats(callback.slots.size() * n);
+        for (size_t k = 0; k < callback.slots.size(); k++) {
+            fill(callback.slots[k], inputs + k * n);
+        }
+        callback.eval(inputs, n, r, n);
+    };
+
+    // Nodes without axes once, then single-axis nodes once per sample of their axis
+    std::vector<float> fixed(nodes.size(), 0.0f);
+    std::vector<size_t> offsets(nodes.size(), 0);
+    size_t rowSize = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (kinds[i] >= 0) {
+            offsets[i] = rowSize;
+            rowSize += counts[kinds[i]];
+        }
+    }
+    std::vector<float> rows(rowSize);
+    std::vector<float> broadcast[3];
+
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const auto& node = nodes[i];
+        if (kinds[i] == FIXED) {
+            if (node.tag == OpCode::VARIABLE) {
+                fixed[i] = parameters[node.operands[0] - dims];
+            } else if (node.tag == OpCode::CALL) {
+                call(node, 1, [&](uint32_t slot, float* column) { column[0] = parameters[slot - dims]; }, &fixed[i]);
+            } else {
+                compute(node, &fixed[node.operands[0]], &fixed[node.operands[1]], &fixed[node.operands[2]], &fixed[i], 1);
+            }
+            continue;
+        }
+        if (kinds[i] == MIXED) {
+            continue;
+        }
+
+        size_t n = counts[kinds[i]];
+        float* r = rows.data() + offsets[i];
+        if (node.tag == OpCode::VARIABLE) {
+            std::copy(samples[kinds[i]], samples[kinds[i]] + n, r);
+            continue;
+        }
+        if (node.tag == OpCode::CALL) {
+            // Inputs are the axis samples and parameters repeated along it
+            call(node, n, [&](uint32_t slot, float* column) {
+                if (slot < dims) {
+                    std::copy(samples[slot], samples[slot] + n, column);
+                } else {
+                    std::fill(column, column + n, parameters[slot - dims]);
+                }
+            }, r);
+            continue;
+        }
+
+        // Operands depend on the same axis or on none, which are repeated along it
+        const float* operands[3] = {nullptr, nullptr, nullptr};
+        for (size_t k = 0; k < arity(node.tag); k++) {
+            uint32_t o = node.operands[k];
+            if (kinds[o] == FIXED) {
+                broadcast[k].assign(n, fixed[o]);
+                operands[k] = broadcast[k].data();
+            } else {
+                operands[k] = rows.data() + offsets[o];
+            }
+        }
+        compute(node, operands[0], operands[1], operands[2], r, n);
+    }
+
+    // Nodes stored per point in tiles: mixed ones and the ones they read
+    std::vector<uint32_t> tiled;
+    std::vector<size_t> slots(nodes.size(), 0);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (kinds[i] == MIXED || expanded[i]) {
+            slots[i] = tiled.size();
+            tiled.push_back(static_cast<uint32_t>(i));
+        }
+    }
+    uint32_t root = flat.roots()[0];
+
+    size_t tiles = (total + TILE - 1) / TILE;
+    std::atomic<size_t> next{0};
+    auto work = [&]() {
+        std::vector<float> tile(tiled.size() * TILE);
+        std::vector<uint32_t> coordinates(dims * TILE);
+
+        // Rows of nodes without axes never change
+        for (auto i : tiled) {
+            if (kinds[i] == FIXED) {
+                std::fill(tile.begin() + slots[i] * TILE, tile.begin() + (slots[i] + 1) * TILE, fixed[i]);
+            }
+        }
+
+        while (true) {
+            size_t t = next.fetch_add(1);
+            if (t >= tiles) {
+                return;
+            }
+            size_t first = t * TILE;
+            size_t n = std::min(TILE, total - first);
+
+            // Grid coordinates of every point of the tile
+            size_t coordinate[3] = {first % counts[0], (first / counts[0]) % counts[1], 0};
+            if (dims == 3) {
+                coordinate[2] = first / (counts[0] * counts[1]);
+            }
+            for (size_t p = 0; p < n; p++) {
+                for (size_t a = 0; a < dims; a++) {
+                    coordinates[a * TILE + p] = static_cast<uint32_t>(coordinate[a]);
+                }
+                for (size_t a = 0; a < dims && ++coordinate[a] == counts[a]; a++) {
+                    coordinate[a] = 0;
+                }
+            }
+
+            for (auto i : tiled) {
+                float* r = tile.data() + slots[i] * TILE;
+                if (kinds[i] == FIXED) {
+                    continue;
+                }
+                if (kinds[i] >= 0) {
+                    // Single-axis values are gathered from their row
+                    const float* row = rows.data() + offsets[i];
+                    const uint32_t* c = coordinates.data() + kinds[i] * TILE;
+                    for (size_t p = 0; p < n; p++) {
+                        r[p] = row[c[p]];
+                    }
+                    continue;
+                }
+
+                const auto& node = nodes[i];
+                if (node.tag == OpCode::CALL) {
+                    // Inputs are gathered from the samples at the coordinates of each point
+                    call(node, n, [&](uint32_t slot, float* column) {
+                        if (slot < dims) {
+                            const uint32_t* c = coordinates.data() + slot * TILE;
+                            for (size_t p = 0; p < n; p++) {
+                                column[p] = samples[slot][c[p]];
+                            }
+                        } else {
+                            std::fill(column, column + n, parameters[slot - dims]);
+                        }
+                    }, r);
+                    continue;
+                }
+
+                const float* operands[3] = {nullptr, nullptr, nullptr};
+                for (size_t k = 0; k < arity(node.tag); k++) {
+                    operands[k] = tile.data() + slots[node.operands[k]] * TILE;
+                }
+                compute(node, operands[0], operands[1], operands[2], r, n);
+            }
+
+            const float* result = tile.data() + slots[root] * TILE;
+            std::copy(result, result + n, out + first);
+        }
+    };
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = static_cast<unsigned>(std::min<size_t>(threads, tiles));
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; t++) {
+        pool.emplace_back(work);
+    }
+    work();
+    for (auto& thread : pool) {
+        thread.join();
+    }
+}
+
+void GridEvaluator::eval(
+    const std::vector<std::vector<float>>& samples,
+    const VariableContext& ctx,
+    float* out,
+    unsigned threads
+) const {
+    if (samples.size() != axisNames.size()) {
+        throw std::runtime_error{"[GridEvaluator::eval] Expected one sample vector per axis"};
+    }
+
+    std::vector<const float*> data;
+    std::vector<size_t> counts;
+    for (const auto& s : samples) {
+        data.push_back(s.data());
+        counts.push_back(s.size());
+    }
+
+    std::vector<float> values;
+    for (const auto& name : paramNames) {
+        auto it = ctx.find(name);
+        if (it == ctx.end()) {
+            throw std::runtime_error{"[GridEvaluator::eval] Variable name not found in context"};
+        }
+        values.push_back(it->second);
+    }
+
+    eval(data.data(), counts.data(), values.data(), out, threads);
+}
+
+const std::vector<std::string>& GridEvaluator::axes() const {
+    return axisNames;
+}
+
+const std::vector<std::string>& GridEvaluator::parameters() const {
+    return paramNames;
+}
+
+size_t GridEvaluator::fixedNodes() const {
+    return std::count(kinds.begin(), kinds.end(), FIXED);
+}
+
+size_t GridEvaluator::axisNodes() const {
+    return std::count_if(kinds.begin(), kinds.end(), [](int32_t kind) { return kind >= 0; });
+}
+
+size_t GridEvaluator::mixedNodes() const {
+    return std::count(kinds.begin(), kinds.end(), MIXED);
+}
+
+} // namespace mathex
@@ -0,0 +1,435 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "integration.hpp"
+#include "program.hpp"
+
+namespace mathex {
+
+namespace {
+
+constexpr size_t NODES = 15;
+constexpr size_t MAX_DIMENSIONS = 3;
+
+// Points per refinement round below which threads cost more than they save; with several
+// threads, rounds split enough panels to reach it
+constexpr size_t PARALLEL_CUTOFF = 4096;
+
+// Gauss-Kronrod 7-15 rule on [-1, 1]; Gauss weights are zero on Kronrod-only nodes
+struct Rule {
+    double x[NODES];
+    double wk[NODES];
+    double wg[NODES];
+};
+
+Rule makeRule() {
+    // Non-negative half of the nodes, from QUADPACK's qk15
+    const double xgk[8] = {
+        0.991455371120812639206854697526329,
+        0.949107912342758524526189684047851,
+        0.864864423359769072789712788640926,
+        0.741531185599394439863864773280788,
+        0.586087235467691130294144845693013,
+        0.405845151377397166906606412076961,
+        0.207784955007898467600689403773245,
+        0.000000000000000000000000000000000
+    };
+    const double wgk[8] = {
+        0.022935322010529224963732008058970,
+        0.063092092629978553290700663189204,
+        0.104790010322250183839876322541518,
+        0.140653259715525918745189590510238,
+        0.169004726639267902826583426598550,
+        0.190350578064785409913256402421014,
+        0.204432940075298892414161999234649,
+        0.209482141084727828012999174891714
+    };
+    const double wg[4] = {
+        0.129484966168869693270611432679082,
+        0.279705391489276667901467771423780,
+        0.381830050505118944950369775488975,
+        0.417959183673469387755102040816327
+    };
+
+    Rule rule;
+    for (size_t k = 0; k < 8; k++) {
+        double g = k % 2 == 1 ? wg[k / 2] : 0.0;
+        rule.x[k] = -xgk[k];
+        rule.wk[k] = wgk[k];
+        rule.wg[k] = g;
+        rule.x[NODES - 1 - k] = xgk[k];
+        rule.wk[NODES - 1 - k] = wgk[k];
+        rule.wg[NODES - 1 - k] = g;
+    }
+    return rule;
+}
+
+const Rule rule = makeRule();
+
+struct Panel {
+    float lower[MAX_DIMENSIONS];
+    float upper[MAX_DIMENSIONS];
+    double value;
+    double error;
+    size_t splitDim;
+};
+
+// Max-heap on the error estimate
+bool operator<(const Panel& a, const Panel& b) {
+    return a.error < b.error;
+}
+
+// Buffers owned by one thread
+struct Workspace {
+    std::vector<float> columns;
+    std::vector<const float*> inputs;
+    std::vector<float> out;
+    std::vector<float> stack;
+};
+
+// Threads kept across refinement rounds, started on the first round that uses them
+class Pool {
+public:
+    Pool(size_t size) : size{size} {}
+
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+
+    ~Pool() {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    // Runs task(t) for every t below the pool size, t = 0 on the calling thread, and returns
+    // once every call is done
+    void run(const std::function<void(size_t)>& task) {
+        if (threads.empty()) {
+            for (size_t t = 1; t < size; t++) {
+                threads.emplace_back([this, t] { loop(t); });
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            current = &task;
+            pending = size - 1;
+            generation++;
+        }
+        wake.notify_all();
+
+        task(0);
+
+        std::unique_lock<std::mutex> lock{mutex};
+        done.wait(lock, [this] { return pending == 0; });
+    }
+
+private:
+    void loop(size_t t) {
+        size_t seen = 0;
+        while (true) {
+            const std::function<void(size_t)>* task;
+            {
+                std::unique_lock<std::mutex> lock{mutex};
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+                task = current;
+            }
+
+            (*task)(t);
+
+            std::lock_guard<std::mutex> lock{mutex};
+            if (--pending == 0) {
+                done.notify_one();
+            }
+        }
+    }
+
+    size_t size;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(size_t)>* current = nullptr;
+    size_t pending = 0;
+    size_t generation = 0;
+    bool stopping = false;
+};
+
+class Integrator {
+public:
+    Integrator(
+        const Expression& expr,
+        const std::vector<IntegrationBounds>& bounds,
+        const VariableContext& ctx
+    ) : program{expr},
+        dims{bounds.size()} {
+        if (dims == 0 || dims > MAX_DIMENSIONS) {
+            throw std::runtime_error{"[integrate] Only 1 to 3 dimensions are supported"};
+        }
+
+        points = 1;
+        for (size_t d = 0; d < dims; d++) {
+            points *= NODES;
+        }
+
+        // Every program input is either an integration variable or a fixed context value
+        for (const auto& name : program.variables()) {
+            auto it = std::find_if(bounds.begin(), bounds.end(), [&name](const IntegrationBounds& b) {
+                return b.variable == name;
+            });
+            if (it != bounds.end()) {
+                slotDims.push_back(static_cast<int>(it - bounds.begin()));
+                fixed.push_back(0.0f);
+                continue;
+            }
+
+            auto value = ctx.find(name);
+            if (value == ctx.end()) {
+                throw std::runtime_error{"[integrate] Variable name not found in context"};
+            }
+            slotDims.push_back(-1);
+            fixed.push_back(value->second);
+        }
+    }
+
+    size_t pointsPerPanel() const {
+        return points;
+    }
+
+    void prepare(Workspace& ws) const {
+        size_t slots = program.variables().size();
+        ws.columns.resize(slots * points);
+        ws.inputs.resize(slots);
+        ws.out.resize(points);
+        ws.stack.resize(program.stackSize() * Program::LANES);
+
+        for (size_t s = 0; s < slots; s++) {
+            ws.inputs[s] = ws.columns.data() + s * points;
+            if (slotDims[s] < 0) {
+                std::fill(ws.columns.begin() + s * points, ws.columns.begin() + (s + 1) * points, fixed[s]);
+            }
+        }
+    }
+
+    void evaluate(Panel& panel, Workspace& ws) const {
+        double mid[MAX_DIMENSIONS];
+        double half[MAX_DIMENSIONS];
+        double jacobian = 1.0;
+        for (size_t d = 0; d < dims; d++) {
+            mid[d] = 0.5 * (static_cast<double>(panel.lower[d]) + panel.upper[d]);
+            half[d] = 0.5 * (static_cast<double>(panel.upper[d]) - panel.lower[d]);
+            jacobian *= half[d];
+        }
+
+        // Lay out the tensor-product nodes, first dimension varying fastest
+        for (size_t s = 0; s < slotDims.size(); s++) {
+            if (slotDims[s] < 0) {
+                continue;
+            }
+
+            size_t d = slotDims[s];
+            size_t stride = 1;
+            for (size_t e = 0; e < d; e++) {
+                stride *= NODES;
+            }
+
+            float* column = ws.columns.data() + s * points;
+            for (size_t p = 0; p < points; p++) {
+                column[p] = static_cast<float>(mid[d] + half[d] * rule.x[p / stride % NODES]);
+            }
+        }
+
+        program.evalBatch(ws.inputs.data(), ws.out.data(), points, ws.stack.data());
+
+        // Kronrod and Gauss sums, plus one mixed sum per dimension using Gauss weights only
+        // along that dimension; the largest Kronrod/mixed gap picks the dimension to split
+        double kronrod = 0.0;
+        double gauss = 0.0;
+        double mixed[MAX_DIMENSIONS] = {};
+        for (size_t p = 0; p < points; p++) {
+            size_t index[MAX_DIMENSIONS];
+            size_t rest = p;
+            double wk = 1.0;
+            double wg = 1.0;
+            for (size_t d = 0; d < dims; d++) {
+                index[d] = rest % NODES;
+                rest /= NODES;
+                wk *= rule.wk[index[d]];
+                wg *= rule.wg[index[d]];
+            }
+
+            double f = ws.out[p];
+            kronrod += wk * f;
+            gauss += wg * f;
+            for (size_t d = 0; d < dims; d++) {
+                mixed[d] += wk / rule.wk[index[d]] * rule.wg[index[d]] * f;
+            }
+        }
+
+        panel.value = kronrod * jacobian;
+        panel.error = std::abs(kronrod - gauss) * jacobian;
+        panel.splitDim = 0;
+        double worst = -1.0;
+        for (size_t d = 0; d < dims; d++) {
+            double gap = std::abs(kronrod - mixed[d]);
+            if (gap > worst) {
+                worst = gap;
+                panel.splitDim = d;
+            }
+        }
+    }
+
+    size_t dimensions() const {
+        return dims;
+    }
+
+private:
+    Program program;
+    size_t dims;
+    size_t points;
+
+    // Per program input: integration dimension, or -1 with its value in `fixed`
+    std::vector<int> slotDims;
+    std::vector<float> fixed;
+};
+
+} // namespace
+
+IntegrationResult integrate(
+    const Expression& expr,
+    const std::string& varName,
+    float lower,
+    float upper,
+    const IntegrationOptions& options,
+    const VariableContext& ctx
+) {
+    return integrate(expr, {{varName, lower, upper}}, options, ctx);
+}
+
+IntegrationResult integrate(
+    const Expression& expr,
+    const std::vector<IntegrationBounds>& bounds,
+    const IntegrationOptions& options,
+    const VariableContext& ctx
+) {
+    Integrator integrator(expr, bounds, ctx);
+
+    size_t threads = options.threads;
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    std::vector<Workspace> workspaces(threads);
+    for (auto& ws : workspaces) {
+        integrator.prepare(ws);
+    }
+
+    IntegrationResult result;
+
+    Panel root;
+    for (size_t d = 0; d < integrator.dimensions(); d++) {
+        root.lower[d] = bounds[d].lower;
+        root.upper[d] = bounds[d].upper;
+    }
+    integrator.evaluate(root, workspaces[0]);
+    result.panels = 1;
+
+    std::vector<Panel> heap{root};
+    std::vector<Panel> children;
+    double value = root.value;
+    double error = root.error;
+
+    // With several threads a round splits enough panels for every thread to get a share and
+    // for the round to be worth the synchronization, in a whole number of panels per thread
+    size_t round = 1;
+    if (threads > 1) {
+        size_t perSplit = 2 * integrator.pointsPerPanel();
+        round = std::max(threads, (PARALLEL_CUTOFF + perSplit - 1) / perSplit);
+        round = (round + threads - 1) / threads * threads;
+    }
+    Pool pool{threads};
+
+    while (true) {
+        double target = std::max(options.tolerance, options.relativeTolerance * std::abs(value));
+        if (error <= target) {
+            result.converged = true;
+            break;
+        }
+
+        // Split the worst panels of this round in two. The worst one always is; the others only
+        // while they are above an even share of the tolerance, which they would need anyway
+        size_t budget = options.maxPanels > result.panels ? (options.maxPanels - result.panels) / 2 : 0;
+        size_t count = std::min({round, heap.size(), budget});
+        if (count == 0) {
+            break;
+        }
+
+        double share = target / heap.size();
+        children.clear();
+        for (size_t i = 0; i < count; i++) {
+            if (i > 0 && heap.front().error <= share) {
+                break;
+            }
+            std::pop_heap(heap.begin(), heap.end());
+            Panel worst = heap.back();
+            heap.pop_back();
+            value -= worst.value;
+            error -= worst.error;
+
+            size_t d = worst.splitDim;
+            float split = 0.5f * (worst.lower[d] + worst.upper[d]);
+            Panel left = worst;
+            Panel right = worst;
+            left.upper[d] = split;
+            right.lower[d] = split;
+            children.push_back(left);
+            children.push_back(right);
+        }
+
+        if (threads == 1 || children.size() * integrator.pointsPerPanel() < PARALLEL_CUTOFF) {
+            for (auto& child : children) {
+                integrator.evaluate(child, workspaces[0]);
+            }
+        } else {
+            pool.run([&](size_t t) {
+                for (size_t i = t; i < children.size(); i += threads) {
+                    integrator.evaluate(children[i], workspaces[t]);
+                }
+            });
+        }
+
+        for (const auto& child : children) {
+            value += child.value;
+            error += child.error;
+            heap.push_back(child);
+            std::push_heap(heap.begin(), heap.end());
+        }
+        result.panels += children.size();
+    }
+
+    // Sum again from the panels to drop the drift of the running totals
+    result.value = 0.0;
+    result.error = 0.0;
+    for (const auto& panel : heap) {
+        result.value += panel.value;
+        result.error += panel.error;
+    }
+    result.evaluations = result.panels * integrator.pointsPerPanel();
+    return result;
+}
+
+} // namespace mathex
@@ -0,0 +1,240 @@
+#include <stdexcept>
+#include <algorithm>
+
+#include "jacobian.hpp"
+#include "constant.hpp"
+
+namespace mathex {
+
+// Derivative with its constant subtrees folded
+static Expression* derivative(const Expression& expr, const std::string& varName) {
+    auto d = expr.differentiate(varName);
+    auto folded = d->specialize({});
+    delete d;
+    return folded;
+}
+
+// Interned names of the variables, so dependence checks need no lookup
+static std::vector<SymbolId> intern(const std::vector<std::string>& names) {
+    std::vector<SymbolId> ids;
+    ids.reserve(names.size());
+    for (const auto& name : names) {
+        ids.push_back(SymbolTable::global().intern(name));
+    }
+    return ids;
+}
+
+static bool isZero(const Expression* e) {
+    auto c = dynamic_cast<const Constant*>(e);
+    return c != nullptr && c->getValue() == 0.0f;
+}
+
+SparseDerivatives::SparseDerivatives(const std::vector<std::string>& variables)
+  : varNames{variables},
+    offsets{0} {}
+
+SparseDerivatives::SparseDerivatives(const SparseDerivatives& o)
+  : varNames{o.varNames},
+    offsets{o.offsets},
+    colIndices{o.colIndices},
+    slots{o.slots},
+    flat{o.flat} {
+    for (auto entry : o.entries) {
+        entries.push_back(entry->clone());
+    }
+}
+
+SparseDerivatives& SparseDerivatives::operator=(const SparseDerivatives& o) {
+    // Self-assignment
+    if (this == &o) {
+        return *this;
+    }
+
+    // Free existing memory
+    for (auto entry : entries) {
+        delete entry;
+    }
+
+    varNames = o.varNames;
+    offsets = o.offsets;
+    colIndices = o.colIndices;
+    slots = o.slots;
+    flat = o.flat;
+    entries.clear();
+    for (auto entry : o.entries) {
+        entries.push_back(entry->clone());
+    }
+    return *this;
+}
+
+SparseDerivatives::~SparseDerivatives() {
+    for (auto entry : entries) {
+        delete entry;
+    }
+}
+
+void SparseDerivatives::add(uint32_t col, Expression* entry) {
+    if (isZero(entry)) {
+        delete entry;
+        return;
+    }
+
+    entries.push_back(entry);
+    share(col, static_cast<uint32_t>(entries.size() - 1));
+}
+
+void SparseDerivatives::share(uint32_t col, uint32_t slot) {
+    colIndices.push_back(col);
+    slots.push_back(slot);
+}
+
+void SparseDerivatives::endRow() {
+    offsets.push_back(static_cast<uint32_t>(colIndices.size()));
+}
+
+void SparseDerivatives::compile() {
+    std::vector<const Expression*> exprs;
+    exprs.reserve(slots.size());
+    for (auto slot : slots) {
+        exprs.push_back(entries[slot]);
+    }
+    flat = FlatExpression(exprs, varNames);
+}
+
+size_t SparseDerivatives::rows() const {
+    return offsets.size() - 1;
+}
+
+size_t SparseDerivatives::cols() const {
+    return varNames.size();
+}
+
+size_t SparseDerivatives::nonZeros() const {
+    return colIndices.size();
+}
+
+const std::vector<uint32_t>& SparseDerivatives::rowOffsets() const {
+    return offsets;
+}
+
+const std::vector<uint32_t>& SparseDerivatives::columns() const {
+    return colIndices;
+}
+
+const std::vector<std::string>& SparseDerivatives::variables() const {
+    return varNames;
+}
+
+const Expression* SparseDerivatives::at(size_t row, size_t col) const {
+    if (row >= rows() || col >= cols()) {
+        throw std::runtime_error{"[SparseDerivatives::at] Index out of range"};
+    }
+
+    auto begin = colIndices.begin() + offsets[row];
+    auto end = colIndices.begin() + offsets[row + 1];
+    auto it = std::lower_bound(begin, end, static_cast<uint32_t>(col));
+    if (it == end || *it != col) {
+        return nullptr;
+    }
+    return entries[slots[it - colIndices.begin()]];
+}
+
+size_t SparseDerivatives::scratchSize() const {
+    return flat.size();
+}
+
+void SparseDerivatives::eval(const float* values, float* out, float* scratch) const {
+    flat.evalAll(values, out, scratch);
+}
+
+void SparseDerivatives::eval(const VariableContext& ctx, float* out) const {
+    std::vector<float> values;
+    values.reserve(varNames.size());
+    for (const auto& name : varNames) {
+        auto it = ctx.find(name);
+        if (it == ctx.end()) {
+            throw std::runtime_error{"[SparseDerivatives::eval] Variable name not found in context"};
+        }
+        values.push_back(it->second);
+    }
+
+    std::vector<float> scratch(scratchSize());
+    eval(values.data(), out, scratch.data());
+}
+
+// --------------------------
+// --------------------------
+// Jacobian
+
+Jacobian::Jacobian(const std::vector<const Expression*>& outputs, const std::vector<std::string>& variables)
+  : SparseDerivatives{variables} {
+    auto ids = intern(varNames);
+    for (auto f : outputs) {
+        // Columns of variables the output does not depend on are zero without differentiating
+        for (size_t j = 0; j < varNames.size(); j++) {
+            if (f->dependsOn(ids[j])) {
+                add(static_cast<uint32_t>(j), derivative(*f, varNames[j]));
+            }
+        }
+        endRow();
+    }
+
+    compile();
+}
+
+// --------------------------
+// --------------------------
+// Hessian
+
+Hessian::Hessian(const Expression& f, const std::vector<std::string>& variables)
+  : SparseDerivatives{variables} {
+    size_t n = varNames.size();
+    auto ids = intern(varNames);
+
+    // Lower triangle first: row j holds d/dk of the j-th gradient entry for every k <= j it depends on
+    std::vector<std::vector<std::pair<uint32_t, Expression*>>> lower(n);
+    for (size_t j = 0; j < n; j++) {
+        if (!f.dependsOn(ids[j])) {
+            continue;
+        }
+
+        auto gradient = derivative(f, varNames[j]);
+        for (size_t k = 0; k <= j; k++) {
+            if (!gradient->dependsOn(ids[k])) {
+                continue;
+            }
+            auto h = derivative(*gradient, varNames[k]);
+            if (isZero(h)) {
+                delete h;
+                continue;
+            }
+            lower[j].push_back({static_cast<uint32_t>(k), h});
+        }
+        delete gradient;
+    }
+
+    // Number the distinct entries, then mirror them into the upper triangle
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> full(n);
+    for (size_t j = 0; j < n; j++) {
+        for (const auto& [k, h] : lower[j]) {
+            auto slot = static_cast<uint32_t>(entries.size());
+            entries.push_back(h);
+            full[j].push_back({k, slot});
+            if (k != j) {
+                full[k].push_back({static_cast<uint32_t>(j), slot});
+            }
+        }
+    }
+
+    for (auto& row : full) {
+        std::sort(row.begin(), row.end());
+        for (const auto& [col, slot] : row) {
+            share(col, slot);
+        }
+        endRow();
+    }
+
+    compile();
+}
+
+} // namespace mathex
@@ -0,0 +1,491 @@
+#include <stdexcept>
+
+#include "nary_operation.hpp"
+#include "constant.hpp"
+#include "binary_operation.hpp"
+#include "functions.hpp"
+#include "program.hpp"
+
+namespace mathex {
+
+// Width of the partial reductions; independent accumulators let the compiler vectorize across operands
+static constexpr size_t LANES = Program::LANES;
+
+static bool isZero(const Expression* e) {
+    auto c = dynamic_cast<const Constant*>(e);
+    return c != nullptr && c->getValue() == 0.0f;
+}
+
+// Smallest expression for a sum: a constant when there are no terms, the term itself when trivial
+static Expression* makeSum(const std::vector<Expression*>& terms, const std::vector<float>& weights, float offset) {
+    if (terms.empty()) {
+        return new Constant(offset);
+    }
+    if (terms.size() == 1 && weights[0] == 1.0f && offset == 0.0f) {
+        return terms[0];
+    }
+    return new Sum(terms, weights, offset);
+}
+
+// Smallest expression for a product: a constant when there are no factors, the factor itself when trivial
+static Expression* makeProduct(const std::vector<Expression*>& factors, float scale) {
+    if (factors.empty()) {
+        return new Constant(scale);
+    }
+    if (factors.size() == 1 && scale == 1.0f) {
+        return factors[0];
+    }
+    return new Product(factors, scale);
+}
+
+// Emits `w * top of the stack`
+static void emitWeight(Program& program, float w) {
+    if (w == 1.0f) {
+        return;
+    }
+    if (w == -1.0f) {
+        program.emit(OpCode::NEG);
+        return;
+    }
+    program.emitConstant(w);
+    program.emit(OpCode::MUL);
+}
+
+// --------------------------
+// --------------------------
+// NaryOperation
+
+NaryOperation::NaryOperation(const std::vector<Expression*>& operands) : operands{operands} {
+    gatherDependencies();
+}
+
+NaryOperation::NaryOperation(const NaryOperation& o) {
+    for (auto operand : o.operands) {
+        operands.push_back(operand->clone());
+    }
+    gatherDependencies();
+}
+
+NaryOperation& NaryOperation::operator=(const NaryOperation& o) {
+    // Self-assignment
+    if (this == &o) {
+        return *this;
+    }
+
+    // Free existing memory
+    std::vector<Expression*> pending;
+    releaseChildren(pending);
+    destroy(pending);
+
+    for (auto operand : o.operands) {
+        operands.push_back(operand->clone());
+    }
+    gatherDependencies();
+    return *this;
+}
+
+NaryOperation::~NaryOperation() {
+    std::vector<Expression*> pending;
+    releaseChildren(pending);
+    destroy(pending);
+}
+
+size_t NaryOperation::childCount() const {
+    return operands.size();
+}
+
+const Expression* NaryOperation::child(size_t index) const {
+    if (index >= operands.size()) {
+        throw std::runtime_error{"[NaryOperation::child] Index out of range"};
+    }
+    return operands[index];
+}
+
+void NaryOperation::releaseChildren(std::vector<Expression*>& out) {
+    out.insert(out.end(), operands.begin(), operands.end());
+    operands.clear();
+}
+
+// --------------------------
+// --------------------------
+// Sum
+
+Sum::Sum(const std::vector<Expression*>& terms, float offset)
+  : NaryOperation{terms},
+    weights(terms.size(), 1.0f),
+    offset{offset} {}
+
+Sum::Sum(const std::vector<Expression*>& terms, const std::vector<float>& weights, float offset)
+  : NaryOperation{terms},
+    weights{weights},
+    offset{offset} {
+    if (weights.size() != terms.size()) {
+        throw std::runtime_error{"[Sum::Sum] Expected one weight per term"};
+    }
+}
+
+float Sum::apply(const float* args, const VariableContext& ctx) const {
+    (void)ctx;
+
+    size_t n = operands.size();
+    const float* w = weights.data();
+
+    float acc[LANES] = {};
+    size_t i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        for (size_t l = 0; l < LANES; l++) {
+            acc[l] += w[i + l] * args[i + l];
+        }
+    }
+    for (size_t l = 0; i < n; i++, l++) {
+        acc[l] += w[i] * args[i];
+    }
+
+    float r = offset;
+    for (size_t l = 0; l < LANES; l++) {
+        r += acc[l];
+    }
+    return r;
+}
+
+Expression* Sum::withChildren(Expression* const* children) const {
+    return new Sum(std::vector<Expression*>(children, children + operands.size()), weights, offset);
+}
+
+Expression* Sum::derivative(Expression* const* derivatives, SymbolId variable) const {
+    (void)variable;
+
+    // (c + Σ w_i t_i)' = Σ w_i t_i', keeping only the terms that depend on the variable
+    std::vector<Expression*> terms;
+    std::vector<float> w;
+    for (size_t i = 0; i < operands.size(); i++) {
+        if (isZero(derivatives[i])) {
+            delete derivatives[i];
+            continue;
+        }
+        terms.push_back(derivatives[i]);
+        w.push_back(weights[i]);
+    }
+
+    return makeSum(terms, w, 0.0f);
+}
+
+void Sum::emit(Program& program, size_t step) const {
+    // Each term is weighted right after it is compiled, then all of them are reduced at once
+    if (step > 0) {
+        emitWeight(program, weights[step - 1]);
+    }
+    if (step < operands.size()) {
+        return;
+    }
+
+    if (operands.empty()) {
+        program.emitConstant(offset);
+        return;
+    }
+    if (operands.size() > 1) {
+        program.emitSum(operands.size());
+    }
+    if (offset != 0.0f) {
+        program.emitConstant(offset);
+        program.emit(OpCode::ADD);
+    }
+}
+
+Expression* Sum::specializeNode(Expression* const* children, const VariableContext& bound) const {
+    (void)bound;
+
+    // Constant terms are folded into the offset
+    std::vector<Expression*> terms;
+    std::vector<float> w;
+    float c = offset;
+    for (size_t i = 0; i < operands.size(); i++) {
+        auto k = dynamic_cast<Constant*>(children[i]);
+        if (k != nullptr) {
+            c += weights[i] * k->getValue();
+            delete k;
+            continue;
+        }
+        terms.push_back(children[i]);
+        w.push_back(weights[i]);
+    }
+
+    return makeSum(terms, w, c);
+}
+
+float Sum::getOffset() const {
+    return offset;
+}
+
+const std::vector<float>& Sum::getWeights() const {
+    return weights;
+}
+
+// --------------------------
+// --------------------------
+// Product
+
+Product::Product(const std::vector<Expression*>& factors, float scale)
+  : NaryOperation{factors},
+    scale{scale} {}
+
+float Product::apply(const float* args, const VariableContext& ctx) const {
+    (void)ctx;
+
+    size_t n = operands.size();
+
+    float acc[LANES];
+    for (size_t l = 0; l < LANES; l++) {
+        acc[l] = 1.0f;
+    }
+    size_t i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        for (size_t l = 0; l < LANES; l++) {
+            acc[l] *= args[i + l];
+        }
+    }
+    for (size_t l = 0; i < n; i++, l++) {
+        acc[l] *= args[i];
+    }
+
+    float r = scale;
+    for (size_t l = 0; l < LANES; l++) {
+        r *= acc[l];
+    }
+    return r;
+}
+
+Expression* Product::withChildren(Expression* const* children) const {
+    return new Product(std::vector<Expression*>(children, children + operands.size()), scale);
+}
+
+Expression* Product::derivative(Expression* const* derivatives, SymbolId variable) const {
+    (void)variable;
+
+    // (c Π f_j)' = Σ_i c f_1 ... f_i' ... f_n, one product per factor that depends on the variable
+    std::vector<Expression*> terms;
+    for (size_t i = 0; i < operands.size(); i++) {
+        if (isZero(derivatives[i])) {
+            delete derivatives[i];
+            continue;
+        }
+
+        float k = scale;
+        std::vector<Expression*> factors;
+        for (size_t j = 0; j < operands.size(); j++) {
+            if (j != i) {
+                factors.push_back(operands[j]->clone());
+                continue;
+            }
+
+            auto c = dynamic_cast<Constant*>(derivatives[i]);
+            if (c != nullptr) {
+                k *= c->getValue();
+                delete c;
+            } else {
+                factors.push_back(derivatives[i]);
+            }
+        }
+        terms.push_back(makeProduct(factors, k));
+    }
+
+    return makeSum(terms, std::vector<float>(terms.size(), 1.0f), 0.0f);
+}
+
+void Product::emit(Program& program, size_t step) const {
+    if (step < operands.size()) {
+        return;
+    }
+
+    if (operands.empty()) {
+        program.emitConstant(scale);
+        return;
+    }
+    if (operands.size() > 1) {
+        program.emitProduct(operands.size());
+    }
+    if (scale != 1.0f) {
+        program.emitConstant(scale);
+        program.emit(OpCode::MUL);
+    }
+}
+
+Expression* Product::specializeNode(Expression* const* children, const VariableContext& bound) const {
+    (void)bound;
+
+    // Constant factors are folded into the scale
+    std::vector<Expression*> factors;
+    float c = scale;
+    for (size_t i = 0; i < operands.size(); i++) {
+        auto k = dynamic_cast<Constant*>(children[i]);
+        if (k != nullptr) {
+            c *= k->getValue();
+            delete k;
+            continue;
+        }
+        factors.push_back(children[i]);
+    }
+
+    return makeProduct(factors, c);
+}
+
+float Product::getScale() const {
+    return scale;
+}
+
+// --------------------------
+// --------------------------
+// Flattening
+
+Expression* flatten(const Expression& expr) {
+    // Appends `weight * term` to a sum, splicing nested sums and folding constants and negations
+    auto addTerm = [](Sum* sum, Expression* term, float weight) {
+        for (;;) {
+            std::vector<Expression*> inner;
+            auto neg = dynamic_cast<OperationNeg*>(term);
+            auto product = dynamic_cast<Product*>(term);
+            if (neg != nullptr) {
+                weight = -weight;
+            } else if (product != nullptr && product->operands.size() == 1) {
+                weight *= product->scale;
+            } else {
+                break;
+            }
+
+            term->releaseChildren(inner);
+            delete term;
+            term = inner[0];
+        }
+
+        if (auto c = dynamic_cast<Constant*>(term)) {
+            sum->offset += weight * c->getValue();
+            delete c;
+            return;
+        }
+
+        if (auto s = dynamic_cast<Sum*>(term)) {
+            sum->offset += weight * s->offset;
+            sum->dependencies |= s->dependencies;
+            sum->nodes += s->nodes - 1;
+            for (size_t i = 0; i < s->operands.size(); i++) {
+                sum->operands.push_back(s->operands[i]);
+                sum->weights.push_back(weight * s->weights[i]);
+            }
+            s->operands.clear();
+            delete s;
+            return;
+        }
+
+        sum->operands.push_back(term);
+        sum->weights.push_back(weight);
+        sum->dependencies |= term->freeVariables();
+        sum->nodes += term->nodeCount();
+    };
+
+    // Appends a factor to a product, splicing nested products and folding constants
+    auto addFactor = [](Product* product, Expression* factor) {
+        if (auto c = dynamic_cast<Constant*>(factor)) {
+            product->scale *= c->getValue();
+            delete c;
+            return;
+        }
+
+        if (auto p = dynamic_cast<Product*>(factor)) {
+            product->scale *= p->scale;
+            product->dependencies |= p->dependencies;
+            product->nodes += p->nodes - 1;
+            product->operands.insert(product->operands.end(), p->operands.begin(), p->operands.end());
+            p->operands.clear();
+            delete p;
+            return;
+        }
+
+        product->operands.push_back(factor);
+        product->dependencies |= factor->freeVariables();
+        product->nodes += factor->nodeCount();
+    };
+
+    // Sums and products are returned as they are unless a smaller expression is equivalent
+    auto simplifySum = [](Sum* sum) -> Expression* {
+        if (sum->operands.size() > 1 || (sum->operands.size() == 1 && (sum->weights[0] != 1.0f || sum->offset != 0.0f))) {
+            return sum;
+        }
+        std::vector<Expression*> operands;
+        sum->releaseChildren(operands);
+        auto result = makeSum(operands, sum->weights, sum->offset);
+        delete sum;
+        return result;
+    };
+
+    auto simplifyProduct = [](Product* product) -> Expression* {
+        if (product->operands.size() > 1 || (product->operands.size() == 1 && product->scale != 1.0f)) {
+            return product;
+        }
+        std::vector<Expression*> operands;
+        product->releaseChildren(operands);
+        auto result = makeProduct(operands, product->scale);
+        delete product;
+        return result;
+    };
+
+    return reduce<Expression*>(expr, [&](const Expression& node, Expression** children) -> Expression* {
+        if (auto b = dynamic_cast<const BinaryOperation*>(&node)) {
+            switch (b->getOperator()) {
+            case BinaryOperator::ADD:
+            case BinaryOperator::SUB: {
+                // Left-deep chains extend the sum built for their left operand, so they flatten in linear time
+                auto sum = dynamic_cast<Sum*>(children[0]);
+                if (sum == nullptr) {
+                    sum = new Sum({});
+                    addTerm(sum, children[0], 1.0f);
+                }
+                addTerm(sum, children[1], b->getOperator() == BinaryOperator::ADD ? 1.0f : -1.0f);
+                return simplifySum(sum);
+            }
+            case BinaryOperator::MUL: {
+                auto product = dynamic_cast<Product*>(children[0]);
+                if (product == nullptr) {
+                    product = new Product({});
+                    addFactor(product, children[0]);
+                }
+                addFactor(product, children[1]);
+                return simplifyProduct(product);
+            }
+            default:
+                return node.withChildren(children);
+            }
+        }
+
+        if (dynamic_cast<const OperationNeg*>(&node)) {
+            auto sum = dynamic_cast<Sum*>(children[0]);
+            if (sum == nullptr) {
+                return node.withChildren(children);
+            }
+            sum->offset = -sum->offset;
+            for (auto& w : sum->weights) {
+                w = -w;
+            }
+            return sum;
+        }
+
+        if (auto s = dynamic_cast<const Sum*>(&node)) {
+            auto sum = new Sum({}, s->offset);
+            for (size_t i = 0; i < s->operands.size(); i++) {
+                addTerm(sum, children[i], s->weights[i]);
+            }
+            return simplifySum(sum);
+        }
+
+        if (auto p = dynamic_cast<const Product*>(&node)) {
+            auto product = new Product({}, p->scale);
+            for (size_t i = 0; i < p->operands.size(); i++) {
+                addFactor(product, children[i]);
+            }
+            return simplifyProduct(product);
+        }
+
+        return node.withChildren(children);
+    });
+}
+
+} // namespace mathex
@@ -0,0 +1,673 @@
+#include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+
+#include "ode.hpp"
+
+namespace mathex {
+
+namespace {
+
+constexpr size_t LANES = Program::LANES;
+constexpr size_t MAX_STAGES = 7;
+
+// Explicit Runge-Kutta method: c and a give the stages, b the solution and e the error estimate
+struct Tableau {
+    size_t stages;
+    double c[MAX_STAGES];
+    double a[MAX_STAGES][MAX_STAGES];
+    double b[MAX_STAGES];
+    double e[MAX_STAGES];
+
+    // The last stage is evaluated at the new solution, so it is the first stage of the next step
+    bool fsal;
+
+    // Exponent of the step size controller, 1 / (order of the error estimate + 1)
+    double exponent;
+};
+
+const Tableau rk4 = {
+    4,
+    {0.0, 0.5, 0.5, 1.0},
+    {
+        {},
+        {0.5},
+        {0.0, 0.5},
+        {0.0, 0.0, 1.0}
+    },
+    {1.0 / 6.0, 1.0 / 3.0, 1.0 / 3.0, 1.0 / 6.0},
+    {},
+    false,
+    0.0
+};
+
+const Tableau dormandPrince = {
+    7,
+    {0.0, 1.0 / 5.0, 3.0 / 10.0, 4.0 / 5.0, 8.0 / 9.0, 1.0, 1.0},
+    {
+        {},
+        {1.0 / 5.0},
+        {3.0 / 40.0, 9.0 / 40.0},
+        {44.0 / 45.0, -56.0 / 15.0, 32.0 / 9.0},
+        {19372.0 / 6561.0, -25360.0 / 2187.0, 64448.0 / 6561.0, -212.0 / 729.0},
+        {9017.0 / 3168.0, -355.0 / 33.0, 46732.0 / 5247.0, 49.0 / 176.0, -5103.0 / 18656.0},
+        {35.0 / 384.0, 0.0, 500.0 / 1113.0, 125.0 / 192.0, -2187.0 / 6784.0, 11.0 / 84.0}
+    },
+    {35.0 / 384.0, 0.0, 500.0 / 1113.0, 125.0 / 192.0, -2187.0 / 6784.0, 11.0 / 84.0, 0.0},
+    {
+        71.0 / 57600.0, 0.0, -71.0 / 16695.0, 71.0 / 1920.0,
+        -17253.0 / 339200.0, 22.0 / 525.0, -1.0 / 40.0
+    },
+    true,
+    1.0 / 5.0
+};
+
+// Diagonal coefficient of ROS2, 1 + 1/sqrt(2), which makes it L-stable
+constexpr double ROS2_GAMMA = 1.7071067811865475;
+
+// Step size controller bounds
+constexpr double SAFETY = 0.9;
+constexpr double MIN_FACTOR = 0.2;
+constexpr double MAX_FACTOR = 5.0;
+
+// Steps shorter than this fraction of the time are considered stalled
+constexpr double MIN_STEP = 1e-12;
+
+// Derivative with its constant subtrees folded
+Expression* derivative(const Expression& expr, const std::string& varName) {
+    auto d = expr.differentiate(varName);
+    auto folded = d->specialize({});
+    delete d;
+    return folded;
+}
+
+// LU factorization with partial pivoting of a dense n x n matrix, in place; false when singular
+bool factorize(double* m, size_t* pivots, size_t n) {
+    for (size_t k = 0; k < n; k++) {
+        size_t p = k;
+        for (size_t i = k + 1; i < n; i++) {
+            if (std::abs(m[i * n + k]) > std::abs(m[p * n + k])) {
+                p = i;
+            }
+        }
+        pivots[k] = p;
+        if (m[p * n + k] == 0.0 || !std::isfinite(m[p * n + k])) {
+            return false;
+        }
+        if (p != k) {
+            std::swap_ranges(m + k * n, m + (k + 1) * n, m + p * n);
+        }
+
+        for (size_t i = k + 1; i < n; i++) {
+            double f = m[i * n + k] / m[k * n + k];
+            m[i * n + k] = f;
+            for (size_t j = k + 1; j < n; j++) {
+                m[i * n + j] -= f * m[k * n + j];
+            }
+        }
+    }
+    return true;
+}
+
+// Solves in place with a factorization from factorize()
+void solveFactorized(const double* m, const size_t* pivots, double* x, size_t n) {
+    for (size_t k = 0; k < n; k++) {
+        std::swap(x[k], x[pivots[k]]);
+        for (size_t i = k + 1; i < n; i++) {
+            x[i] -= m[i * n + k] * x[k];
+        }
+    }
+    for (size_t k = n; k > 0; k--) {
+        size_t i = k - 1;
+        for (size_t j = i + 1; j < n; j++) {
+            x[i] -= m[i * n + j] * x[j];
+        }
+        x[i] /= m[i * n + i];
+    }
+}
+
+// Buffers and per-lane state of one thread, reused for each block of trajectories
+class Stepper {
+public:
+    Stepper(
+        const FlatExpression& system,
+        const FlatExpression& linearization,
+        size_t dimension,
+        const float* parameters,
+        size_t parameterCount,
+        const OdeOptions& options
+    ) : system{system},
+        linearization{linearization},
+        n{dimension},
+        options{options} {
+        bool implicit = options.method == OdeMethod::ROSENBROCK;
+        size_t outputs = implicit ? n * (n + 2) : 0;
+        size_t rows = 1 + parameterCount + n * (3 + MAX_STAGES) + outputs;
+        buffer.resize(rows * LANES);
+        scratch.resize(std::max(system.size(), implicit ? linearization.size() : 0) * LANES);
+
+        float* next = buffer.data();
+        auto take = [&next](size_t count) {
+            float* first = next;
+            next += count * LANES;
+            return first;
+        };
+
+        time = take(1);
+        inputs.push_back(time);
+        stage = take(n);
+        for (size_t i = 0; i < n; i++) {
+            inputs.push_back(stage + i * LANES);
+        }
+        for (size_t p = 0; p < parameterCount; p++) {
+            float* row = take(1);
+            std::fill(row, row + LANES, parameters[p]);
+            inputs.push_back(row);
+        }
+        y = take(n);
+        candidate = take(n);
+        slopes = take(n * MAX_STAGES);
+        for (size_t s = 0; s < MAX_STAGES; s++) {
+            for (size_t i = 0; i < n; i++) {
+                stageOutputs[s].push_back(slope(s, i));
+            }
+        }
+        if (implicit) {
+            outRows = take(n * (n + 2));
+            matrices.resize(LANES * n * n);
+            pivots.resize(LANES * n);
+            solution.resize(n);
+        }
+    }
+
+    // Integrates the trajectories [first, first + width) of every state array
+    void run(float* const* states, size_t first, size_t width, double t0, double t1, OdeResult& result) {
+        for (size_t i = 0; i < n; i++) {
+            for (size_t l = 0; l < LANES; l++) {
+                y[i * LANES + l] = l < width ? states[i][first + l] : 0.0f;
+            }
+        }
+
+        end = t1;
+        double span = std::abs(t1 - t0);
+        double initial = options.step > 0.0 ? options.step : span / 100.0;
+        double direction = t1 < t0 ? -1.0 : 1.0;
+        for (size_t l = 0; l < LANES; l++) {
+            t[l] = t0;
+            h[l] = direction * initial;
+            active[l] = l < width && span > 0.0;
+            failed[l] = false;
+            steps[l] = 0;
+        }
+
+        switch (options.method) {
+        case OdeMethod::RK4:
+            fixedSteps(rk4, t0, t1, result);
+            break;
+        case OdeMethod::DORMAND_PRINCE:
+            adaptiveSteps(dormandPrince, result);
+            break;
+        case OdeMethod::ROSENBROCK:
+            rosenbrockSteps(result);
+            break;
+        }
+
+        result.failed += static_cast<size_t>(std::count(failed, failed + LANES, true));
+        for (size_t i = 0; i < n; i++) {
+            for (size_t l = 0; l < width; l++) {
+                states[i][first + l] = y[i * LANES + l];
+            }
+        }
+    }
+
+private:
+    float* row(float* rows, size_t i) {
+        return rows + i * LANES;
+    }
+
+    float* slope(size_t s, size_t i) {
+        return slopes + (s * n + i) * LANES;
+    }
+
+    size_t activeLanes() const {
+        return static_cast<size_t>(std::count(active, active + LANES, true));
+    }
+
+    // Evaluates every root of a store at the stage rows and the time row
+    void evaluate(const FlatExpression& flat, float* const* out, OdeResult& result) {
+        flat.evalAllBatch(inputs.data(), out, LANES, scratch.data());
+        result.evaluations += activeLanes();
+    }
+
+    void evaluateStage(size_t s, OdeResult& result) {
+        evaluate(system, stageOutputs[s].data(), result);
+    }
+
+    // Fills the stage rows and the time row for stage s of an explicit method, then evaluates it
+    void explicitStage(const Tableau& tableau, size_t s, OdeResult& result) {
+        for (size_t l = 0; l < LANES; l++) {
+            time[l] = static_cast<float>(t[l] + tableau.c[s] * h[l]);
+        }
+        for (size_t i = 0; i < n; i++) {
+            float* st = row(stage, i);
+            const float* yi = row(y, i);
+            for (size_t l = 0; l < LANES; l++) {
+                double sum = 0.0;
+                for (size_t j = 0; j < s; j++) {
+                    sum += tableau.a[s][j] * slope(j, i)[l];
+                }
+                st[l] = static_cast<float>(yi[l] + h[l] * sum);
+            }
+        }
+        evaluateStage(s, result);
+    }
+
+    // Solution of an explicit step into the `candidate` rows
+    void explicitSolution(const Tableau& tableau) {
+        for (size_t i = 0; i < n; i++) {
+            float* ni = row(candidate, i);
+            const float* yi = row(y, i);
+            for (size_t l = 0; l < LANES; l++) {
+                double sum = 0.0;
+                for (size_t j = 0; j < tableau.stages; j++) {
+                    sum += tableau.b[j] * slope(j, i)[l];
+                }
+                ni[l] = static_cast<float>(yi[l] + h[l] * sum);
+            }
+        }
+    }
+
+    // Same step for every lane, the time computed from the step index so it does not drift
+    void fixedSteps(const Tableau& tableau, double t0, double t1, OdeResult& result) {
+        if (activeLanes() == 0) {
+            return;
+        }
+
+        size_t count = static_cast<size_t>(std::ceil(std::abs(t1 - t0) / std::abs(h[0])));
+        count = std::max<size_t>(count, 1);
+        if (count > options.maxSteps) {
+            std::copy(active, active + LANES, failed);
+            return;
+        }
+
+        double step = (t1 - t0) / static_cast<double>(count);
+        for (size_t k = 0; k < count; k++) {
+            for (size_t l = 0; l < LANES; l++) {
+                t[l] = t0 + static_cast<double>(k) * step;
+                h[l] = step;
+            }
+            for (size_t s = 0; s < tableau.stages; s++) {
+                explicitStage(tableau, s, result);
+            }
+            explicitSolution(tableau);
+            std::copy(candidate, candidate + n * LANES, y);
+        }
+
+        result.steps += count * activeLanes();
+        std::fill(active, active + LANES, false);
+    }
+
+    // Shortens the step of each lane so it stops exactly at the end of the interval
+    void clampSteps() {
+        for (size_t l = 0; l < LANES; l++) {
+            last[l] = false;
+            if (!active[l]) {
+                h[l] = 0.0;
+                continue;
+            }
+            double remaining = end - t[l];
+            if (std::abs(h[l]) >= std::abs(remaining)) {
+                h[l] = remaining;
+                last[l] = true;
+            }
+        }
+    }
+
+    // Scaled RMS norm of the error estimate of one lane
+    double errorNorm(const float* error, size_t l) const {
+        double sum = 0.0;
+        for (size_t i = 0; i < n; i++) {
+            double scale = options.tolerance
+                         + options.relativeTolerance * std::max(std::abs(y[i * LANES + l]), std::abs(candidate[i * LANES + l]));
+            double e = error[i * LANES + l] / scale;
+            sum += e * e;
+        }
+        return std::sqrt(sum / static_cast<double>(n));
+    }
+
+    // Accepts or rejects the step of each active lane and picks its next step size
+    void control(const float* error, double exponent, OdeResult& result) {
+        for (size_t l = 0; l < LANES; l++) {
+            if (!active[l]) {
+                continue;
+            }
+            steps[l]++;
+
+            double norm = errorNorm(error, l);
+            bool accepted = norm <= 1.0;
+            double factor = MIN_FACTOR;
+            if (std::isfinite(norm)) {
+                factor = norm == 0.0 ? MAX_FACTOR : SAFETY * std::pow(norm, -exponent);
+                factor = std::min(std::max(factor, MIN_FACTOR), accepted ? MAX_FACTOR : 1.0);
+            }
+
+            if (accepted) {
+                result.steps++;
+                for (size_t i = 0; i < n; i++) {
+                    y[i * LANES + l] = candidate[i * LANES + l];
+                }
+                t[l] = last[l] ? end : t[l] + h[l];
+                valid[l] = true;
+                if (last[l]) {
+                    active[l] = false;
+                    continue;
+                }
+            } else {
+                result.rejected++;
+                valid[l] = false;
+            }
+
+            h[l] *= factor;
+            if (steps[l] >= options.maxSteps || std::abs(h[l]) < MIN_STEP * std::max(1.0, std::abs(t[l]))) {
+                active[l] = false;
+                failed[l] = true;
+            }
+        }
+    }
+
+    void adaptiveSteps(const Tableau& tableau, OdeResult& result) {
+        size_t lastStage = tableau.stages - 1;
+        std::fill(valid, valid + LANES, false);
+        std::vector<float> error(n * LANES);
+
+        while (activeLanes() > 0) {
+            clampSteps();
+
+            // With FSAL the first stage is known unless the lane rejected its last step
+            bool known = tableau.fsal;
+            for (size_t l = 0; l < LANES; l++) {
+                known = known && (!active[l] || valid[l]);
+            }
+            if (!known) {
+                explicitStage(tableau, 0, result);
+            }
+            for (size_t s = 1; s < tableau.stages; s++) {
+                explicitStage(tableau, s, result);
+            }
+
+            if (tableau.fsal) {
+                std::copy(stage, stage + n * LANES, candidate);
+            } else {
+                explicitSolution(tableau);
+            }
+            for (size_t i = 0; i < n; i++) {
+                for (size_t l = 0; l < LANES; l++) {
+                    double sum = 0.0;
+                    for (size_t j = 0; j < tableau.stages; j++) {
+                        sum += tableau.e[j] * slope(j, i)[l];
+                    }
+                    error[i * LANES + l] = static_cast<float>(h[l] * sum);
+                }
+            }
+
+            control(error.data(), tableau.exponent, result);
+
+            if (tableau.fsal) {
+                for (size_t l = 0; l < LANES; l++) {
+                    if (!valid[l]) {
+                        continue;
+                    }
+                    for (size_t i = 0; i < n; i++) {
+                        slope(0, i)[l] = slope(lastStage, i)[l];
+                    }
+                }
+            }
+        }
+    }
+
+    // ROS2: (I - γhJ) k1 = f(t, y) + γh df/dt
+    //       (I - γhJ) k2 = f(t + h, y + h k1) - 2 k1 - γh df/dt
+    //       y' = y + h (3 k1 + k2) / 2, with y + h k1 as the embedded first-order solution
+    void rosenbrockSteps(OdeResult& result) {
+        std::vector<float> error(n * LANES);
+        std::vector<float*> outputs;
+        for (size_t r = 0; r < n * (n + 2); r++) {
+            outputs.push_back(row(outRows, r));
+        }
+        const float* f = outRows;
+        const float* ft = outRows + n * LANES;
+        const float* jacobian = outRows + 2 * n * LANES;
+        bool singular[LANES];
+
+        while (activeLanes() > 0) {
+            clampSteps();
+
+            // Right-hand side and Jacobian at the current point of every lane
+            for (size_t l = 0; l < LANES; l++) {
+                time[l] = static_cast<float>(t[l]);
+            }
+            std::copy(y, y + n * LANES, stage);
+            evaluate(linearization, outputs.data(), result);
+
+            for (size_t l = 0; l < LANES; l++) {
+                double* m = matrices.data() + l * n * n;
+                for (size_t i = 0; i < n; i++) {
+                    for (size_t j = 0; j < n; j++) {
+                        double identity = i == j ? 1.0 : 0.0;
+                        m[i * n + j] = identity - ROS2_GAMMA * h[l] * jacobian[(i * n + j) * LANES + l];
+                    }
+                }
+                singular[l] = active[l] && !factorize(m, pivots.data() + l * n, n);
+
+                for (size_t i = 0; i < n; i++) {
+                    solution[i] = f[i * LANES + l] + ROS2_GAMMA * h[l] * ft[i * LANES + l];
+                }
+                if (active[l] && !singular[l]) {
+                    solveFactorized(m, pivots.data() + l * n, solution.data(), n);
+                }
+                for (size_t i = 0; i < n; i++) {
+                    slope(0, i)[l] = static_cast<float>(solution[i]);
+                    stage[i * LANES + l] = static_cast<float>(y[i * LANES + l] + h[l] * solution[i]);
+                }
+                time[l] = static_cast<float>(t[l] + h[l]);
+            }
+
+            evaluateStage(1, result);
+
+            for (size_t l = 0; l < LANES; l++) {
+                const double* m = matrices.data() + l * n * n;
+                for (size_t i = 0; i < n; i++) {
+                    solution[i] = slope(1, i)[l] - 2.0 * slope(0, i)[l] - ROS2_GAMMA * h[l] * ft[i * LANES + l];
+                }
+                if (active[l] && !singular[l]) {
+                    solveFactorized(m, pivots.data() + l * n, solution.data(), n);
+                }
+                for (size_t i = 0; i < n; i++) {
+                    double k1 = slope(0, i)[l];
+                    double k2 = solution[i];
+                    candidate[i * LANES + l] = static_cast<float>(y[i * LANES + l] + h[l] * (1.5 * k1 + 0.5 * k2));
+                    error[i * LANES + l] = singular[l] ? INFINITY : static_cast<float>(0.5 * h[l] * (k1 + k2));
+                }
+            }
+
+            control(error.data(), 0.5, result);
+        }
+    }
+
+    const FlatExpression& system;
+    const FlatExpression& linearization;
+    size_t n;
+    const OdeOptions& options;
+
+    std::vector<float> buffer;
+    std::vector<float> scratch;
+    std::vector<const float*> inputs;
+    std::vector<float*> stageOutputs[MAX_STAGES];
+
+    // Rows of LANES floats
+    float* time;
+    float* stage;
+    float* y;
+    float* candidate;
+    float* slopes;
+    float* outRows = nullptr;
+
+    // Factorized iteration matrices of the implicit method, one per lane
+    std::vector<double> matrices;
+    std::vector<size_t> pivots;
+    std::vector<double> solution;
+
+    double end = 0.0;
+    double t[LANES];
+    double h[LANES];
+    bool active[LANES];
+    bool last[LANES];
+    bool valid[LANES];
+    bool failed[LANES];
+    size_t steps[LANES];
+};
+
+} // namespace
+
+OdeSystem::OdeSystem(
+    const std::vector<const Expression*>& rhs,
+    const std::vector<std::string>& states,
+    const std::string& time
+) : stateNames{states} {
+    if (states.empty() || rhs.size() != states.size()) {
+        throw std::runtime_error{"[OdeSystem::OdeSystem] Expected one right-hand side per state"};
+    }
+    if (std::find(states.begin(), states.end(), time) != states.end()) {
+        throw std::runtime_error{"[OdeSystem::OdeSystem] The time cannot be a state"};
+    }
+
+    // Inputs are the time, the states, then every other variable in order of first appearance
+    std::vector<std::string> variables{time};
+    variables.insert(variables.end(), states.begin(), states.end());
+    for (auto f : rhs) {
+        FlatExpression probe{*f};
+        for (const auto& name : probe.variables()) {
+            if (std::find(variables.begin(), variables.end(), name) == variables.end()) {
+                paramNames.push_back(name);
+                variables.push_back(name);
+            }
+        }
+    }
+    system = FlatExpression(rhs, variables);
+
+    std::vector<Expression*> owned;
+    for (auto f : rhs) {
+        owned.push_back(derivative(*f, time));
+    }
+    for (auto f : rhs) {
+        for (const auto& state : states) {
+            owned.push_back(derivative(*f, state));
+        }
+    }
+
+    std::vector<const Expression*> roots{rhs.begin(), rhs.end()};
+    roots.insert(roots.end(), owned.begin(), owned.end());
+    linearization = FlatExpression(roots, variables);
+    for (auto e : owned) {
+        delete e;
+    }
+}
+
+size_t OdeSystem::dimension() const {
+    return stateNames.size();
+}
+
+const std::vector<std::string>& OdeSystem::states() const {
+    return stateNames;
+}
+
+const std::vector<std::string>& OdeSystem::parameters() const {
+    return paramNames;
+}
+
+OdeResult OdeSystem::solve(
+    float* const* y,
+    size_t count,
+    float t0,
+    float t1,
+    const float* parameters,
+    const OdeOptions& options
+) const {
+    size_t blocks = (count + LANES - 1) / LANES;
+
+    size_t threads = options.threads;
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::max<size_t>(1, std::min(threads, blocks));
+
+    // Blocks are taken in order by whichever thread is free, since stiff trajectories take longer
+    std::atomic<size_t> next{0};
+    std::vector<OdeResult> results(threads);
+    auto work = [&](size_t thread) {
+        Stepper stepper{system, linearization, dimension(), parameters, paramNames.size(), options};
+        while (true) {
+            size_t b = next.fetch_add(1);
+            if (b >= blocks) {
+                return;
+            }
+            size_t first = b * LANES;
+            stepper.run(y, first, std::min(LANES, count - first), t0, t1, results[thread]);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < threads; t++) {
+        pool.emplace_back(work, t);
+    }
+    work(0);
+    for (auto& thread : pool) {
+        thread.join();
+    }
+
+    OdeResult result;
+    for (const auto& r : results) {
+        result.steps += r.steps;
+        result.rejected += r.rejected;
+        result.evaluations += r.evaluations;
+        result.failed += r.failed;
+    }
+    result.converged = result.failed == 0;
+    return result;
+}
+
+OdeResult OdeSystem::solve(
+    std::vector<std::vector<float>>& y,
+    float t0,
+    float t1,
+    const VariableContext& ctx,
+    const OdeOptions& options
+) const {
+    if (y.size() != dimension()) {
+        throw std::runtime_error{"[OdeSystem::solve] Expected one vector of initial conditions per state"};
+    }
+
+    size_t count = y[0].size();
+    std::vector<float*> arrays;
+    for (auto& values : y) {
+        if (values.size() != count) {
+            throw std::runtime_error{"[OdeSystem::solve] Initial condition vectors differ in size"};
+        }
+        arrays.push_back(values.data());
+    }
+
+    std::vector<float> values;
+    for (const auto& name : paramNames) {
+        auto it = ctx.find(name);
+        if (it == ctx.end()) {
+            throw std::runtime_error{"[OdeSystem::solve] Variable name not found in context"};
+        }
+        values.push_back(it->second);
+    }
+
+    return solve(arrays.data(), count, t0, t1, values.data(), options);
+}
+
+} // namespace mathex
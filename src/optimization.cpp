@@ -0,0 +1,286 @@
+#include <stdexcept>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+#include "optimization.hpp"
+#include "derivatives.hpp"
+
+namespace mathex {
+
+// Sufficient decrease constant of the Armijo condition
+static constexpr double ARMIJO = 1e-4;
+
+// Maximum number of step reductions in one line search
+static constexpr size_t MAX_BACKTRACKS = 40;
+
+// Bounds of the Barzilai-Borwein step length
+static constexpr double MIN_STEP = 1e-10;
+static constexpr double MAX_STEP = 1e10;
+
+static double seconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static double dot(const double* a, const double* b, size_t n) {
+    double sum = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+Optimizer::Optimizer(
+    const Expression& f,
+    const std::vector<std::string>& variables,
+    const std::vector<std::string>& parameters,
+    const OptimizationOptions& options
+) : options{options},
+    varNames{variables},
+    n{variables.size()} {
+    if (n == 0) {
+        throw std::runtime_error{"[Optimizer::Optimizer] Expected at least one variable"};
+    }
+
+    // f, then its derivative with respect to each variable, over the variables then the parameters
+    std::vector<std::string> inputNames = variables;
+    inputNames.insert(inputNames.end(), parameters.begin(), parameters.end());
+    std::vector<std::vector<std::string>> partials{{}};
+    for (const auto& name : variables) {
+        partials.push_back({name});
+    }
+    objective = derivatives(f, partials, inputNames);
+
+    lower.assign(n, -std::numeric_limits<double>::infinity());
+    upper.assign(n, std::numeric_limits<double>::infinity());
+
+    inputs.resize(inputNames.size());
+    outputs.resize(n + 1);
+    scratch.resize(objective.size());
+    x.resize(n);
+    g.resize(n);
+    trial.resize(n);
+    trialGradient.resize(n);
+    d.resize(n);
+    s.resize(options.history * n);
+    y.resize(options.history * n);
+    rho.resize(options.history);
+    alpha.resize(options.history);
+}
+
+void Optimizer::setBounds(const std::vector<float>& lower, const std::vector<float>& upper) {
+    if (lower.size() != n || upper.size() != n) {
+        throw std::runtime_error{"[Optimizer::setBounds] Expected one bound per variable"};
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!(lower[i] <= upper[i])) {
+            throw std::runtime_error{"[Optimizer::setBounds] Lower bound above upper bound"};
+        }
+        this->lower[i] = lower[i];
+        this->upper[i] = upper[i];
+    }
+}
+
+float Optimizer::evaluate(const float* point, float* gradient, const float* parameters) {
+    std::copy(point, point + n, inputs.begin());
+    if (inputs.size() > n) {
+        std::copy(parameters, parameters + (inputs.size() - n), inputs.begin() + n);
+    }
+
+    objective.evalAll(inputs.data(), outputs.data(), scratch.data());
+    std::copy(outputs.begin() + 1, outputs.end(), gradient);
+    return outputs[0];
+}
+
+double Optimizer::evaluate(const double* point, double* gradient) {
+    for (size_t i = 0; i < n; i++) {
+        inputs[i] = static_cast<float>(point[i]);
+    }
+
+    objective.evalAll(inputs.data(), outputs.data(), scratch.data());
+    evaluations++;
+    for (size_t i = 0; i < n; i++) {
+        gradient[i] = outputs[i + 1];
+    }
+    return outputs[0];
+}
+
+double Optimizer::projectedGradientNorm(const double* point, const double* gradient) const {
+    double norm = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        double projected = std::min(std::max(point[i] - gradient[i], lower[i]), upper[i]);
+        norm = std::max(norm, std::abs(projected - point[i]));
+    }
+    return norm;
+}
+
+bool Optimizer::direction(size_t pairs) {
+    // Variables held at a bound by the gradient stay fixed for this iteration
+    auto fixed = [this](size_t i) {
+        return (x[i] <= lower[i] && g[i] > 0.0) || (x[i] >= upper[i] && g[i] < 0.0);
+    };
+
+    for (size_t i = 0; i < n; i++) {
+        d[i] = fixed(i) ? 0.0 : g[i];
+    }
+
+    // Two-loop recursion, newest pair first, over the free variables
+    size_t m = options.history;
+    for (size_t k = 0; k < pairs; k++) {
+        size_t p = (newest + m - k) % m;
+        alpha[p] = rho[p] * dot(&s[p * n], d.data(), n);
+        for (size_t i = 0; i < n; i++) {
+            d[i] -= alpha[p] * y[p * n + i];
+        }
+    }
+    if (pairs > 0) {
+        const double* sn = &s[newest * n];
+        const double* yn = &y[newest * n];
+        double scale = dot(sn, yn, n) / dot(yn, yn, n);
+        for (size_t i = 0; i < n; i++) {
+            d[i] *= scale;
+        }
+    }
+    for (size_t k = pairs; k > 0; k--) {
+        size_t p = (newest + m - (k - 1)) % m;
+        double beta = rho[p] * dot(&y[p * n], d.data(), n);
+        for (size_t i = 0; i < n; i++) {
+            d[i] += s[p * n + i] * (alpha[p] - beta);
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        d[i] = fixed(i) ? 0.0 : -d[i];
+    }
+    return dot(d.data(), g.data(), n) < 0.0;
+}
+
+OptimizationResult Optimizer::minimize(float* point, const float* parameters) {
+    auto start = std::chrono::steady_clock::now();
+    if (inputs.size() > n) {
+        std::copy(parameters, parameters + (inputs.size() - n), inputs.begin() + n);
+    }
+
+    OptimizationResult result;
+    evaluations = 0;
+    for (size_t i = 0; i < n; i++) {
+        x[i] = std::min(std::max(static_cast<double>(point[i]), lower[i]), upper[i]);
+    }
+    double fx = evaluate(x.data(), g.data());
+    double gradientNorm = projectedGradientNorm(x.data(), g.data());
+    result.converged = gradientNorm <= options.gradientTolerance;
+
+    bool lbfgs = options.method == OptimizationMethod::LBFGS && options.history > 0;
+    size_t pairs = 0;
+    double spectral = 1.0 / std::max(gradientNorm, 1.0);
+
+    while (!result.converged && result.iterations < options.maxIterations && evaluations < options.maxEvaluations) {
+        auto iterationStart = std::chrono::steady_clock::now();
+        size_t evaluationsBefore = evaluations;
+
+        // Without curvature information the first step moves by about one unit
+        double t = 1.0;
+        bool descent = lbfgs && direction(pairs);
+        if (!descent) {
+            pairs = 0;
+            direction(0);
+        }
+        if (pairs == 0) {
+            t = lbfgs ? std::min(1.0, 1.0 / std::sqrt(dot(d.data(), d.data(), n))) : spectral;
+        }
+
+        // Backtracking along the projection of the ray x + t d onto the box
+        bool accepted = false;
+        double ft = 0.0;
+        for (size_t k = 0; k < MAX_BACKTRACKS && evaluations < options.maxEvaluations; k++) {
+            bool moved = false;
+            for (size_t i = 0; i < n; i++) {
+                trial[i] = std::min(std::max(x[i] + t * d[i], lower[i]), upper[i]);
+                moved = moved || trial[i] != x[i];
+            }
+            if (!moved) {
+                break;
+            }
+
+            ft = evaluate(trial.data(), trialGradient.data());
+            double decrease = 0.0;
+            for (size_t i = 0; i < n; i++) {
+                decrease += g[i] * (trial[i] - x[i]);
+            }
+            if (std::isfinite(ft) && ft <= fx + ARMIJO * decrease) {
+                accepted = true;
+                break;
+            }
+
+            // Minimum of the quadratic through f(x), its slope and f(trial), kept in [0.1 t, 0.5 t]
+            double curvature = 2.0 * (ft - fx - decrease);
+            double next = std::isfinite(ft) && curvature > 0.0 ? -decrease * t / curvature : 0.5 * t;
+            t = std::min(std::max(next, 0.1 * t), 0.5 * t);
+        }
+
+        if (!accepted) {
+            // A stale quasi-Newton model can give a poor direction; retry once from the gradient
+            if (pairs > 0) {
+                pairs = 0;
+                continue;
+            }
+            break;
+        }
+
+        // Curvature pair of the step, kept only when it preserves positive definiteness
+        double sy = 0.0;
+        double ss = 0.0;
+        double yy = 0.0;
+        for (size_t i = 0; i < n; i++) {
+            double si = trial[i] - x[i];
+            double yi = trialGradient[i] - g[i];
+            sy += si * yi;
+            ss += si * si;
+            yy += yi * yi;
+        }
+        if (lbfgs && sy > 1e-10 * yy) {
+            newest = pairs == 0 ? 0 : (newest + 1) % options.history;
+            for (size_t i = 0; i < n; i++) {
+                s[newest * n + i] = trial[i] - x[i];
+                y[newest * n + i] = trialGradient[i] - g[i];
+            }
+            rho[newest] = 1.0 / sy;
+            pairs = std::min(pairs + 1, options.history);
+        }
+        spectral = sy > 0.0 ? std::min(std::max(ss / sy, MIN_STEP), MAX_STEP) : MAX_STEP;
+
+        double previous = fx;
+        std::swap(x, trial);
+        std::swap(g, trialGradient);
+        fx = ft;
+        gradientNorm = projectedGradientNorm(x.data(), g.data());
+        result.iterations++;
+
+        OptimizationIteration iteration;
+        iteration.value = fx;
+        iteration.gradientNorm = gradientNorm;
+        iteration.step = t;
+        iteration.evaluations = evaluations - evaluationsBefore;
+        iteration.seconds = seconds(iterationStart);
+        result.trace.push_back(iteration);
+
+        result.converged = gradientNorm <= options.gradientTolerance
+                        || previous - fx <= options.valueTolerance * std::max(std::abs(previous), std::abs(fx));
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        point[i] = static_cast<float>(x[i]);
+    }
+    result.value = fx;
+    result.gradientNorm = gradientNorm;
+    result.evaluations = evaluations;
+    result.seconds = seconds(start);
+    return result;
+}
+
+const std::vector<std::string>& Optimizer::variables() const {
+    return varNames;
+}
+
+} // namespace mathex
@@ -0,0 +1,319 @@
+#include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include "parallel_differentiation.hpp"
+#include "constant.hpp"
+
+namespace mathex {
+
+namespace {
+
+// Failed attempts to find a task before an idle thread starts sleeping between attempts
+constexpr size_t SPINS = 64;
+
+// Same traversal as Expression::differentiate(), skipping the subtrees that do not depend on the variable
+Expression* sequential(const Expression& root, SymbolId variable) {
+    return reduce<Expression*>(
+        root,
+        [variable](const Expression& node, Expression*& derivative) {
+            if (node.dependsOn(variable)) {
+                return false;
+            }
+            derivative = new Constant(0.0f);
+            return true;
+        },
+        [variable](const Expression& node, Expression** derivatives) {
+            return node.derivative(derivatives, variable);
+        }
+    );
+}
+
+// Node combined from the derivatives of its children by the thread that delivers the last of them
+struct Join {
+    const Expression* node;
+
+    // One derivative per child, owned until the node is combined
+    std::vector<Expression*> derivatives;
+
+    // Tasks still to deliver into `derivatives`
+    std::atomic<size_t> pending;
+
+    // Ancestors with a single large child, from the closest one up, and the index of that child.
+    // They are combined right after the node, differentiating their small children in place
+    std::vector<std::pair<const Expression*, size_t>> spine;
+
+    // Join receiving the derivative of the top of the spine, nullptr at the root
+    Join* parent;
+    size_t slot;
+};
+
+// Differentiates `count` consecutive children of the parent's node sequentially from `first`,
+// or splits child `first` further when count is 0
+struct Task {
+    Join* parent;
+    size_t first;
+    size_t count;
+};
+
+class Engine {
+public:
+    Engine(SymbolId variable, size_t cutoff, unsigned threads)
+      : variable{variable},
+        cutoff{std::max<size_t>(cutoff, 1)},
+        queues(threads) {}
+
+    ~Engine() {
+        // Only a failed run leaves derivatives behind
+        for (auto join : joins) {
+            for (auto derivative : join->derivatives) {
+                delete derivative;
+            }
+            delete join;
+        }
+    }
+
+    Expression* run(const Expression& root) {
+        if (weight(root) <= cutoff || queues.size() == 1) {
+            return sequential(root, variable);
+        }
+
+        std::vector<std::thread> pool;
+        for (size_t t = 1; t < queues.size(); t++) {
+            pool.emplace_back([this, t] { work(t); });
+        }
+        guard([&] { split(0, &root, nullptr, 0); });
+        work(0);
+        for (auto& thread : pool) {
+            thread.join();
+        }
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return result;
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    // Nodes differentiated by a subtree; one that does not depend on the variable is replaced by 0 at once
+    size_t weight(const Expression& node) const {
+        return node.dependsOn(variable) ? node.nodeCount() : 1;
+    }
+
+    // Runs a step, stopping every thread on the first exception
+    template <typename F>
+    void guard(F f) {
+        try {
+            f();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock{errorMutex};
+            if (!error) {
+                error = std::current_exception();
+            }
+            done.store(true, std::memory_order_release);
+        }
+    }
+
+    void work(size_t self) {
+        Task task;
+        size_t idle = 0;
+        while (!done.load(std::memory_order_acquire)) {
+            if (pop(self, task) || steal(self, task)) {
+                guard([&] { execute(self, task); });
+                idle = 0;
+            } else if (++idle < SPINS) {
+                std::this_thread::yield();
+            } else {
+                // Long waits give the core back to the threads that still have work
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        }
+    }
+
+    void push(size_t self, const Task& task) {
+        std::lock_guard<std::mutex> lock{queues[self].mutex};
+        queues[self].tasks.push_back(task);
+    }
+
+    // Newest task of a thread's own queue, whose subtree is most likely still in its cache
+    bool pop(size_t self, Task& task) {
+        std::lock_guard<std::mutex> lock{queues[self].mutex};
+        if (queues[self].tasks.empty()) {
+            return false;
+        }
+        task = queues[self].tasks.back();
+        queues[self].tasks.pop_back();
+        return true;
+    }
+
+    // Oldest task of another queue, which is the largest piece of work that queue holds
+    bool steal(size_t self, Task& task) {
+        for (size_t k = 1; k < queues.size(); k++) {
+            Queue& victim = queues[(self + k) % queues.size()];
+            std::lock_guard<std::mutex> lock{victim.mutex};
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void execute(size_t self, const Task& task) {
+        const Expression* node = task.parent->node;
+        if (task.count == 0) {
+            split(self, node->child(task.first), task.parent, task.first);
+            return;
+        }
+
+        for (size_t k = task.first; k < task.first + task.count; k++) {
+            task.parent->derivatives[k] = sequential(*node->child(k), variable);
+        }
+        finish(task.parent);
+    }
+
+    // Spawns one task per large child of a large subtree and one per run of small siblings worth
+    // a sequential task, then keeps splitting its first large child itself
+    void split(size_t self, const Expression* node, Join* parent, size_t slot) {
+        for (;;) {
+            // Nodes with a single large child and little else have nothing to run in parallel
+            std::vector<std::pair<const Expression*, size_t>> spine;
+            for (;;) {
+                size_t n = node->childCount();
+                size_t large = n;
+                size_t small = 0;
+                for (size_t k = 0; k < n; k++) {
+                    size_t w = weight(*node->child(k));
+                    if (w <= cutoff) {
+                        small += w;
+                    } else if (large == n) {
+                        large = k;
+                    } else {
+                        large = n + 1;
+                    }
+                }
+                if (large >= n || small > cutoff) {
+                    break;
+                }
+                spine.emplace_back(node, large);
+                node = node->child(large);
+            }
+            std::reverse(spine.begin(), spine.end());
+
+            size_t n = node->childCount();
+            std::vector<Task> tasks;
+            size_t batched = 0;
+            for (size_t k = 0; k < n; k++) {
+                size_t w = weight(*node->child(k));
+                if (w > cutoff) {
+                    tasks.push_back({nullptr, k, 0});
+                } else if (!tasks.empty() && tasks.back().count > 0 && batched + w <= cutoff) {
+                    tasks.back().count++;
+                    batched += w;
+                } else {
+                    tasks.push_back({nullptr, k, 1});
+                    batched = w;
+                }
+            }
+
+            auto join = new Join{node, std::vector<Expression*>(n, nullptr), {tasks.size()}, std::move(spine), parent, slot};
+            {
+                std::lock_guard<std::mutex> lock{joinsMutex};
+                joins.push_back(join);
+            }
+
+            // The first large child, or else the last run, stays with this thread
+            auto kept = std::find_if(tasks.begin(), tasks.end(), [](const Task& t) { return t.count == 0; });
+            if (kept == tasks.end()) {
+                kept = tasks.end() - 1;
+            }
+            for (auto& task : tasks) {
+                task.parent = join;
+                if (&task != &*kept) {
+                    push(self, task);
+                }
+            }
+
+            if (kept->count > 0) {
+                execute(self, *kept);
+                return;
+            }
+            parent = join;
+            slot = kept->first;
+            node = node->child(slot);
+        }
+    }
+
+    // Counts a delivered task; the last one combines the node and its spine, and so on up the tree
+    void finish(Join* join) {
+        while (join->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            // derivative() takes ownership of the children's derivatives
+            std::vector<Expression*> derivatives;
+            derivatives.swap(join->derivatives);
+            Expression* derivative = join->node->derivative(derivatives.data(), variable);
+
+            for (const auto& [node, large] : join->spine) {
+                derivatives.resize(node->childCount());
+                for (size_t k = 0; k < derivatives.size(); k++) {
+                    derivatives[k] = k == large ? derivative : sequential(*node->child(k), variable);
+                }
+                derivative = node->derivative(derivatives.data(), variable);
+            }
+
+            if (join->parent == nullptr) {
+                result = derivative;
+                done.store(true, std::memory_order_release);
+                return;
+            }
+            join->parent->derivatives[join->slot] = derivative;
+            join = join->parent;
+        }
+    }
+
+    SymbolId variable;
+    size_t cutoff;
+
+    std::vector<Queue> queues;
+    std::mutex joinsMutex;
+    std::vector<Join*> joins;
+
+    std::atomic<bool> done{false};
+    Expression* result = nullptr;
+    std::mutex errorMutex;
+    std::exception_ptr error;
+};
+
+} // namespace
+
+Expression* parallelDifferentiate(
+    const Expression& expr,
+    const std::string& varName,
+    const ParallelDifferentiationOptions& options
+) {
+    // A name that was never interned cannot appear in the tree
+    SymbolId variable;
+    if (!SymbolTable::global().find(varName, variable)) {
+        return new Constant(0.0f);
+    }
+
+    unsigned threads = options.threads;
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    Engine engine{variable, options.cutoff, threads};
+    return engine.run(expr);
+}
+
+} // namespace mathex
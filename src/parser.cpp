@@ -0,0 +1,439 @@
+#include <stdexcept>
+#include <cctype>
+#include <charconv>
+
+#include "parser.hpp"
+#include "constant.hpp"
+#include "variable.hpp"
+#include "binary_operation.hpp"
+#include "functions.hpp"
+#include "conditional.hpp"
+
+namespace mathex {
+
+namespace {
+
+enum class Function {
+    SIN,
+    COS,
+    TAN,
+    CSC,
+    SEC,
+    COT,
+    LN,
+    LOG10,
+    EXP,
+    SQRT,
+    ABS,
+    MIN,
+    MAX,
+    CLAMP,
+    SELECT
+};
+
+bool findFunction(const std::string& name, Function& f) {
+    static const std::unordered_map<std::string, Function> functions{
+        {"sin", Function::SIN},
+        {"cos", Function::COS},
+        {"tan", Function::TAN},
+        {"csc", Function::CSC},
+        {"sec", Function::SEC},
+        {"cot", Function::COT},
+        {"ln", Function::LN},
+        {"log10", Function::LOG10},
+        {"exp", Function::EXP},
+        {"sqrt", Function::SQRT},
+        {"abs", Function::ABS},
+        {"min", Function::MIN},
+        {"max", Function::MAX},
+        {"clamp", Function::CLAMP},
+        {"select", Function::SELECT},
+    };
+
+    auto it = functions.find(name);
+    if (it == functions.end()) {
+        return false;
+    }
+    f = it->second;
+    return true;
+}
+
+// Number of arguments a function takes
+size_t arity(Function f) {
+    switch (f) {
+    case Function::MIN:
+    case Function::MAX:
+        return 2;
+    case Function::CLAMP:
+    case Function::SELECT:
+        return 3;
+    default:
+        return 1;
+    }
+}
+
+// Takes ownership of the arguments
+Expression* applyFunction(Function f, Expression* const* args) {
+    Expression* u = args[0];
+    switch (f) {
+    case Function::SIN:
+        return new OperationSin(u);
+    case Function::COS:
+        return new OperationCos(u);
+    case Function::TAN:
+        return new OperationTan(u);
+    case Function::CSC:
+        return new OperationCsc(u);
+    case Function::SEC:
+        return new OperationSec(u);
+    case Function::COT:
+        return new OperationCot(u);
+    case Function::LN:
+        return new OperationLn(u);
+    case Function::LOG10:
+        return new OperationLog10(u);
+    case Function::EXP:
+        return new OperationExp(u);
+    case Function::SQRT:
+        return new OperationSqrt(u);
+    case Function::ABS:
+        return new OperationAbs(u);
+    case Function::MIN:
+        return new Minimum(args[0], args[1]);
+    case Function::MAX:
+        return new Maximum(args[0], args[1]);
+    case Function::CLAMP:
+        return clamp(args[0], args[1], args[2]);
+    case Function::SELECT:
+        return new Select(args[0], args[1], args[2]);
+    }
+
+    return u;
+}
+
+// Pending entry of the operator stack
+struct Operator {
+    enum class Kind {
+        BINARY,
+        COMPARISON,
+        NEG,
+        FUNCTION,
+        PAREN
+    } kind;
+
+    BinaryOperator op;
+    Function function;
+    ComparisonOperator comparison;
+
+    // Arguments read so far by the parenthesis of a function call
+    size_t arguments;
+};
+
+Operator binaryOperator(BinaryOperator op) {
+    return {Operator::Kind::BINARY, op, Function::SIN, ComparisonOperator::LESS, 0};
+}
+
+Operator comparisonOperator(ComparisonOperator comparison) {
+    return {Operator::Kind::COMPARISON, BinaryOperator::ADD, Function::SIN, comparison, 0};
+}
+
+Operator functionOperator(Function f) {
+    return {Operator::Kind::FUNCTION, BinaryOperator::ADD, f, ComparisonOperator::LESS, 0};
+}
+
+Operator otherOperator(Operator::Kind kind) {
+    return {kind, BinaryOperator::ADD, Function::SIN, ComparisonOperator::LESS, 1};
+}
+
+int precedence(const Operator& o) {
+    if (o.kind == Operator::Kind::COMPARISON) {
+        return 1;
+    }
+    if (o.kind == Operator::Kind::NEG) {
+        return 4;
+    }
+
+    switch (o.op) {
+    case BinaryOperator::ADD:
+    case BinaryOperator::SUB:
+        return 2;
+    case BinaryOperator::MUL:
+    case BinaryOperator::DIV:
+        return 3;
+    case BinaryOperator::POW:
+        return 5;
+    }
+    return 0;
+}
+
+// Shunting-yard state; owns every operand built so far until parsing succeeds
+class Parser {
+public:
+    Parser(const std::string& formula) : text{formula} {}
+
+    ~Parser() {
+        destroy(operands);
+    }
+
+    Expression* run() {
+        bool expectOperand = true;
+        while (skipSpaces()) {
+            char c = text[pos];
+            if (expectOperand) {
+                if (std::isdigit(static_cast<unsigned char>(c)) || c == '.') {
+                    operands.push_back(new Constant(number()));
+                    expectOperand = false;
+                } else if (std::isalpha(static_cast<unsigned char>(c)) || c == '_') {
+                    expectOperand = identifier();
+                } else if (c == '(') {
+                    operators.push_back(otherOperator(Operator::Kind::PAREN));
+                    pos++;
+                } else if (c == '-') {
+                    operators.push_back(otherOperator(Operator::Kind::NEG));
+                    pos++;
+                } else if (c == '+') {
+                    pos++;
+                } else {
+                    fail("Expected a number, a variable or '('");
+                }
+                continue;
+            }
+
+            if (c == ')') {
+                while (!operators.empty() && operators.back().kind != Operator::Kind::PAREN) {
+                    reduce();
+                }
+                if (operators.empty()) {
+                    fail("Unbalanced ')'");
+                }
+                size_t arguments = operators.back().arguments;
+                operators.pop_back();
+                if (!operators.empty() && operators.back().kind == Operator::Kind::FUNCTION) {
+                    size_t expected = arity(operators.back().function);
+                    if (arguments != expected) {
+                        fail("Expected " + std::to_string(expected) + (expected == 1 ? " argument" : " arguments"));
+                    }
+                    reduce();
+                }
+                pos++;
+                continue;
+            }
+
+            if (c == ',') {
+                while (!operators.empty() && operators.back().kind != Operator::Kind::PAREN) {
+                    reduce();
+                }
+                if (operators.size() < 2 || operators[operators.size() - 2].kind != Operator::Kind::FUNCTION) {
+                    fail("Unexpected ',' outside of a function call");
+                }
+                operators.back().arguments++;
+                expectOperand = true;
+                pos++;
+                continue;
+            }
+
+            // Comparisons bind loosest, so "x + 1 < y" compares the sums
+            Operator o;
+            bool rightAssociative = false;
+            if (!comparison(o)) {
+                BinaryOperator op;
+                switch (c) {
+                case '+':
+                    op = BinaryOperator::ADD;
+                    break;
+                case '-':
+                    op = BinaryOperator::SUB;
+                    break;
+                case '*':
+                    op = BinaryOperator::MUL;
+                    break;
+                case '/':
+                    op = BinaryOperator::DIV;
+                    break;
+                case '^':
+                    op = BinaryOperator::POW;
+                    break;
+                default:
+                    fail("Expected an operator or ')'");
+                }
+                o = binaryOperator(op);
+                rightAssociative = op == BinaryOperator::POW;
+                pos++;
+            }
+
+            int p = precedence(o);
+            while (!operators.empty()) {
+                const Operator& top = operators.back();
+                if (top.kind == Operator::Kind::PAREN || top.kind == Operator::Kind::FUNCTION) {
+                    break;
+                }
+                int q = precedence(top);
+                if (q < p || (q == p && rightAssociative)) {
+                    break;
+                }
+                reduce();
+            }
+            operators.push_back(o);
+            expectOperand = true;
+        }
+
+        if (expectOperand) {
+            fail("Unexpected end of formula");
+        }
+        while (!operators.empty()) {
+            Operator::Kind kind = operators.back().kind;
+            if (kind == Operator::Kind::PAREN || kind == Operator::Kind::FUNCTION) {
+                fail("Unbalanced '('");
+            }
+            reduce();
+        }
+
+        Expression* result = operands.back();
+        operands.pop_back();
+        return result;
+    }
+
+private:
+    [[noreturn]] void fail(const std::string& message) const {
+        throw std::runtime_error{"[parse] " + message + " at position " + std::to_string(pos)};
+    }
+
+    // Skips whitespace; returns whether characters remain
+    bool skipSpaces() {
+        while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) {
+            pos++;
+        }
+        return pos < text.size();
+    }
+
+    float number() {
+        float value;
+        auto [end, ec] = std::from_chars(text.data() + pos, text.data() + text.size(), value);
+        if (ec != std::errc{}) {
+            fail("Invalid number");
+        }
+        pos = end - text.data();
+        return value;
+    }
+
+    // Reads a variable or the name of a function; returns whether an operand is still expected
+    bool identifier() {
+        size_t start = pos;
+        while (pos < text.size() && (std::isalnum(static_cast<unsigned char>(text[pos])) || text[pos] == '_')) {
+            pos++;
+        }
+        std::string name = text.substr(start, pos - start);
+
+        Function f;
+        if (findFunction(name, f) && skipSpaces() && text[pos] == '(') {
+            operators.push_back(functionOperator(f));
+            operators.push_back(otherOperator(Operator::Kind::PAREN));
+            pos++;
+            return true;
+        }
+
+        operands.push_back(new Variable(name));
+        return false;
+    }
+
+    // Reads a comparison operator into `o`; returns false, reading nothing, on any other character
+    bool comparison(Operator& o) {
+        char c = text[pos];
+        bool equals = pos + 1 < text.size() && text[pos + 1] == '=';
+        ComparisonOperator op;
+        switch (c) {
+        case '<':
+            op = equals ? ComparisonOperator::LESS_EQUAL : ComparisonOperator::LESS;
+            break;
+        case '>':
+            op = equals ? ComparisonOperator::GREATER_EQUAL : ComparisonOperator::GREATER;
+            break;
+        case '=':
+        case '!':
+            if (!equals) {
+                fail("Expected '=' after '" + std::string(1, c) + "'");
+            }
+            op = c == '=' ? ComparisonOperator::EQUAL : ComparisonOperator::NOT_EQUAL;
+            break;
+        default:
+            return false;
+        }
+
+        o = comparisonOperator(op);
+        pos += equals ? 2 : 1;
+        return true;
+    }
+
+    // Applies the operator on top of the stack to its operands
+    void reduce() {
+        Operator o = operators.back();
+        operators.pop_back();
+
+        if (o.kind == Operator::Kind::BINARY) {
+            Expression* right = operands.back();
+            operands.pop_back();
+            Expression* left = operands.back();
+            operands.back() = nullptr;
+
+            auto exponent = dynamic_cast<Constant*>(right);
+            if (o.op == BinaryOperator::POW && exponent != nullptr) {
+                operands.back() = new OperationPow(left, exponent->getValue());
+                delete right;
+            } else {
+                operands.back() = new BinaryOperation(o.op, left, right);
+            }
+            return;
+        }
+
+        if (o.kind == Operator::Kind::COMPARISON) {
+            Expression* right = operands.back();
+            operands.pop_back();
+            Expression* left = operands.back();
+            operands.back() = nullptr;
+            operands.back() = new Comparison(o.comparison, left, right);
+            return;
+        }
+
+        if (o.kind == Operator::Kind::FUNCTION) {
+            // Arguments are the last operands, in order
+            size_t n = arity(o.function);
+            std::vector<Expression*> args(operands.end() - n, operands.end());
+            operands.resize(operands.size() - n + 1);
+            operands.back() = nullptr;
+            operands.back() = applyFunction(o.function, args.data());
+            return;
+        }
+
+        Expression* u = operands.back();
+        operands.back() = nullptr;
+        if (o.kind == Operator::Kind::NEG) {
+            auto c = dynamic_cast<Constant*>(u);
+            if (c != nullptr) {
+                operands.back() = new Constant(-c->getValue());
+                delete u;
+            } else {
+                operands.back() = new OperationNeg(u);
+            }
+        }
+    }
+
+    static void destroy(std::vector<Expression*>& pending) {
+        for (auto e : pending) {
+            delete e;
+        }
+        pending.clear();
+    }
+
+    const std::string& text;
+    size_t pos = 0;
+    std::vector<Expression*> operands;
+    std::vector<Operator> operators;
+};
+
+} // namespace
+
+Expression* parse(const std::string& formula) {
+    return Parser(formula).run();
+}
+
+} // namespace mathex
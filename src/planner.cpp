@@ -0,0 +1,685 @@
+#include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <typeindex>
+#include <unordered_map>
+
+#include "planner.hpp"
+#include "constant.hpp"
+#include "variable.hpp"
+#include "binary_operation.hpp"
+#include "functions.hpp"
+#include "polynomial.hpp"
+#include "nary_operation.hpp"
+#include "range_operation.hpp"
+#include "conditional.hpp"
+#include "vector_expression.hpp"
+
+namespace mathex {
+
+std::string to_string(Strategy strategy) {
+    switch (strategy) {
+    case Strategy::TREE_WALK:
+        return "TREE_WALK";
+    case Strategy::BYTECODE:
+        return "BYTECODE";
+    case Strategy::BATCH:
+        return "BATCH";
+    case Strategy::THREADED:
+        return "THREADED";
+    }
+
+    return "UNKNOWN";
+}
+
+namespace {
+
+constexpr size_t STRATEGIES = 4;
+
+size_t slot(OpCode op) {
+    return static_cast<size_t>(op);
+}
+
+// Opcode of the nodes whose class alone decides it
+const std::unordered_map<std::type_index, OpCode>& classOpcodes() {
+    static const std::unordered_map<std::type_index, OpCode> opcodes{
+        {typeid(OperationNeg), OpCode::NEG},
+        {typeid(OperationSin), OpCode::SIN},
+        {typeid(OperationCos), OpCode::COS},
+        {typeid(OperationTan), OpCode::TAN},
+        {typeid(OperationCsc), OpCode::CSC},
+        {typeid(OperationSec), OpCode::SEC},
+        {typeid(OperationCot), OpCode::COT},
+        {typeid(OperationLn), OpCode::LN},
+        {typeid(OperationLog10), OpCode::LOG10},
+        {typeid(OperationExp), OpCode::EXP},
+        {typeid(OperationSqrt), OpCode::SQRT},
+        {typeid(OperationAbs), OpCode::ABS},
+        {typeid(Minimum), OpCode::MIN},
+        {typeid(Maximum), OpCode::MAX},
+        {typeid(Select), OpCode::SELECT},
+        {typeid(Constant), OpCode::CONSTANT},
+    };
+    return opcodes;
+}
+
+OpCode binaryOpcode(BinaryOperator op) {
+    switch (op) {
+    case BinaryOperator::ADD:
+        return OpCode::ADD;
+    case BinaryOperator::SUB:
+        return OpCode::SUB;
+    case BinaryOperator::MUL:
+        return OpCode::MUL;
+    case BinaryOperator::DIV:
+        return OpCode::DIV;
+    case BinaryOperator::POW:
+        return OpCode::POW;
+    }
+    return OpCode::ADD;
+}
+
+OpCode comparisonOpcode(ComparisonOperator op) {
+    switch (op) {
+    case ComparisonOperator::LESS:
+        return OpCode::LESS;
+    case ComparisonOperator::LESS_EQUAL:
+        return OpCode::LESS_EQUAL;
+    case ComparisonOperator::GREATER:
+        return OpCode::GREATER;
+    case ComparisonOperator::GREATER_EQUAL:
+        return OpCode::GREATER_EQUAL;
+    case ComparisonOperator::EQUAL:
+        return OpCode::EQUAL;
+    case ComparisonOperator::NOT_EQUAL:
+        return OpCode::NOT_EQUAL;
+    }
+    return OpCode::LESS;
+}
+
+OpCode powOpcode(OperationPow::Kind kind) {
+    switch (kind) {
+    case OperationPow::Kind::INTEGER:
+        return OpCode::POWI;
+    case OperationPow::Kind::RECIPROCAL:
+        return OpCode::RECIPROCAL;
+    case OperationPow::Kind::SQRT:
+        return OpCode::SQRT;
+    case OperationPow::Kind::RSQRT:
+        return OpCode::RSQRT;
+    case OperationPow::Kind::GENERAL:
+        return OpCode::POW;
+    }
+    return OpCode::POW;
+}
+
+using Clock = std::chrono::steady_clock;
+
+// Best of several runs of `run`, in nanoseconds per point
+template <typename F>
+double timePerPoint(F run, size_t points) {
+    double best = std::numeric_limits<double>::max();
+    for (int repeat = 0; repeat < 5; repeat++) {
+        auto start = Clock::now();
+        run();
+        double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        best = std::min(best, ns / static_cast<double>(points));
+    }
+    return best;
+}
+
+// Keeps benchmark results alive so the work is not optimized away
+volatile float sink;
+
+// Times one program over the calibration points, one point at a time and in batches
+struct Bench {
+    static constexpr size_t POINTS = 512;
+
+    std::vector<float> interleaved;
+    std::vector<float> columns;
+    std::vector<float> out;
+
+    Bench() : interleaved(2 * POINTS), columns(2 * POINTS), out(POINTS) {
+        // Inputs x and y stay in [0.5, 1.5], inside the domain of every operation
+        for (size_t i = 0; i < POINTS; i++) {
+            for (size_t k = 0; k < 2; k++) {
+                float v = 0.5f + static_cast<float>((i * 37 + k * 11) % 97) / 97.0f;
+                interleaved[2 * i + k] = v;
+                columns[k * POINTS + i] = v;
+            }
+        }
+    }
+
+    double scalar(const Program& program) {
+        std::vector<float> stack(std::max<size_t>(1, program.stackSize()) * Program::LANES);
+        return timePerPoint(
+            [&]() {
+                float total = 0.0f;
+                for (size_t i = 0; i < POINTS; i++) {
+                    total += program.eval(interleaved.data() + 2 * i, stack.data());
+                }
+                sink = total;
+            },
+            POINTS
+        );
+    }
+
+    double lane(const Program& program) {
+        std::vector<float> stack(std::max<size_t>(1, program.stackSize()) * Program::LANES);
+        const float* inputs[2] = {columns.data(), columns.data() + POINTS};
+        return timePerPoint(
+            [&]() {
+                program.evalBatch(inputs, out.data(), POINTS, stack.data());
+                sink = out[POINTS / 2];
+            },
+            POINTS
+        );
+    }
+};
+
+// Program loading x, which the calibration programs start from
+Program loadX() {
+    Program program;
+    program.emitVariable("x");
+    return program;
+}
+
+// Sum of `n` leaves built by `leaf`
+template <typename Leaf>
+Expression* chain(size_t n, Leaf leaf) {
+    Expression* sum = leaf();
+    for (size_t i = 1; i < n; i++) {
+        sum = new BinaryOperation(BinaryOperator::ADD, sum, leaf());
+    }
+    return sum;
+}
+
+} // namespace
+
+// --------------------------
+// --------------------------
+// ExpressionProfile
+
+ExpressionProfile ExpressionProfile::of(const Expression& expr) {
+    ExpressionProfile profile;
+    const auto& opcodes = classOpcodes();
+
+    postorder(expr, [&profile, &opcodes](const Expression& node) {
+        profile.nodes++;
+
+        auto it = opcodes.find(typeid(node));
+        if (it != opcodes.end()) {
+            profile.counts[slot(it->second)]++;
+            return;
+        }
+
+        if (typeid(node) == typeid(Variable)) {
+            profile.counts[slot(OpCode::VARIABLE)]++;
+            profile.variables++;
+        } else if (auto b = dynamic_cast<const BinaryOperation*>(&node)) {
+            profile.counts[slot(binaryOpcode(b->getOperator()))]++;
+        } else if (auto cmp = dynamic_cast<const Comparison*>(&node)) {
+            profile.counts[slot(comparisonOpcode(cmp->getOperator()))]++;
+        } else if (auto p = dynamic_cast<const OperationPow*>(&node)) {
+            profile.counts[slot(powOpcode(p->getKind()))]++;
+        } else if (auto poly = dynamic_cast<const Polynomial*>(&node)) {
+            // Horner: one load of the variable, one coefficient and one FMA per degree
+            size_t degree = poly->degree();
+            profile.counts[slot(OpCode::VARIABLE)] += degree;
+            profile.counts[slot(OpCode::CONSTANT)] += degree + 1;
+            profile.counts[slot(OpCode::FMA)] += degree;
+            profile.variables += degree;
+        } else if (dynamic_cast<const Sum*>(&node)) {
+            profile.counts[slot(OpCode::ADD)] += node.childCount();
+            profile.counts[slot(OpCode::MUL)] += node.childCount();
+        } else if (dynamic_cast<const Product*>(&node)) {
+            profile.counts[slot(OpCode::MUL)] += node.childCount();
+        } else if (auto range = dynamic_cast<const RangeOperation*>(&node)) {
+            // One callback per point, whose loop runs the body in batches once per index and
+            // combines each term with one addition or multiplication
+            auto body = ExpressionProfile::of(*range->getBody());
+            size_t n = range->count();
+            profile.counts[slot(OpCode::CALL)]++;
+            for (size_t op = 0; op <= slot(OpCode::CALL); op++) {
+                profile.inner[op] += (body.counts[op] + body.inner[op]) * n;
+            }
+            profile.inner[slot(dynamic_cast<const RangeSum*>(range) ? OpCode::ADD : OpCode::MUL)] += n;
+            profile.variables += body.variables;
+
+            // Derivatives of products also run every partial of the body, and multiply series:
+            // about one product and one sum for half the pairs of their m terms
+            if (auto derivative = dynamic_cast<const RangeProductDerivative*>(range)) {
+                const auto& partials = derivative->getPartials();
+                for (size_t t = 1; t < partials.size(); t++) {
+                    auto partial = ExpressionProfile::of(*partials[t]);
+                    for (size_t op = 0; op <= slot(OpCode::CALL); op++) {
+                        profile.inner[op] += (partial.counts[op] + partial.inner[op]) * n;
+                    }
+                }
+                size_t m = partials.size();
+                profile.inner[slot(OpCode::MUL)] += m * (m + 1) / 2 * n;
+                profile.inner[slot(OpCode::ADD)] += m * (m + 1) / 2 * n;
+            }
+        } else if (auto reduction = dynamic_cast<const Reduction*>(&node)) {
+            // One callback per point, whose loop combines the operands and accumulates every element
+            const auto& operands = reduction->getOperands();
+            size_t n = operands[0]->size();
+            profile.counts[slot(OpCode::CALL)]++;
+            profile.inner[slot(OpCode::MUL)] += n * (operands.size() - 1);
+            profile.inner[slot(OpCode::ADD)] += n;
+        } else {
+            profile.counts[slot(OpCode::ADD)]++;
+        }
+    });
+
+    return profile;
+}
+
+// --------------------------
+// --------------------------
+// CostModel
+
+CostModel::CostModel()
+  : pointOverhead{5.0},
+    nodeVisit{8.0},
+    variableLookup{15.0},
+    compileNode{40.0},
+    threadStart{30000.0} {
+    for (size_t op = 0; op < OPS; op++) {
+        scalarCosts[op] = 1.5;
+        laneCosts[op] = 0.3;
+    }
+
+    // Calls into the math library cost about ten arithmetic operations
+    for (OpCode op : {OpCode::POW, OpCode::SIN, OpCode::COS, OpCode::TAN, OpCode::CSC, OpCode::SEC,
+                      OpCode::COT, OpCode::LN, OpCode::LOG10, OpCode::EXP}) {
+        scalarCosts[slot(op)] = 15.0;
+        laneCosts[slot(op)] = 10.0;
+    }
+
+    // Callbacks fill a variable context and evaluate their node one point at a time, in batches too
+    scalarCosts[slot(OpCode::CALL)] = 100.0;
+    laneCosts[slot(OpCode::CALL)] = 100.0;
+}
+
+const CostModel& CostModel::calibrated() {
+    static const CostModel model = calibrate();
+    return model;
+}
+
+CostModel CostModel::calibrate() {
+    CostModel model;
+    Bench bench;
+
+    // Each operation is repeated REPEAT times after loading x, always on a fresh load of y, so
+    // its inputs stay in range and the fixed cost of a call is spread over many operations
+    constexpr size_t REPEAT = 16;
+    auto repeated = [](std::initializer_list<OpCode> ops, int powi = 0) {
+        auto program = loadX();
+        for (size_t r = 0; r < REPEAT; r++) {
+            program.emitVariable("y");
+            for (OpCode op : ops) {
+                if (op == OpCode::VARIABLE) {
+                    program.emitVariable("y");
+                } else if (op == OpCode::CONSTANT) {
+                    program.emitConstant(2.0f);
+                } else if (op == OpCode::POWI) {
+                    program.emitPowi(powi);
+                } else {
+                    program.emit(op);
+                }
+            }
+        }
+        return program;
+    };
+
+    auto base = loadX();
+    double baseScalar = bench.scalar(base);
+    double baseLane = bench.lane(base);
+
+    // Cost of one repetition, less the costs already known
+    auto measure = [&](OpCode op, const Program& program, double knownScalar, double knownLane) {
+        double n = static_cast<double>(REPEAT);
+        model.scalarCosts[slot(op)] = std::max(0.05, (bench.scalar(program) - baseScalar) / n - knownScalar);
+        model.laneCosts[slot(op)] = std::max(0.01, (bench.lane(program) - baseLane) / n - knownLane);
+    };
+
+    measure(OpCode::VARIABLE, repeated({}), 0.0, 0.0);
+    double loadScalar = model.scalarCosts[slot(OpCode::VARIABLE)];
+    double loadLane = model.laneCosts[slot(OpCode::VARIABLE)];
+    model.pointOverhead = std::max(0.0, baseScalar - loadScalar);
+
+    for (OpCode op : {OpCode::ADD, OpCode::SUB, OpCode::MUL, OpCode::DIV, OpCode::POW, OpCode::MIN, OpCode::MAX,
+                      OpCode::LESS, OpCode::LESS_EQUAL, OpCode::GREATER, OpCode::GREATER_EQUAL, OpCode::EQUAL,
+                      OpCode::NOT_EQUAL}) {
+        measure(op, repeated({op}), loadScalar, loadLane);
+    }
+
+    // Unary operations are added to the running sum, so the cost of that addition is known too
+    double addScalar = loadScalar + model.scalarCosts[slot(OpCode::ADD)];
+    double addLane = loadLane + model.laneCosts[slot(OpCode::ADD)];
+    for (OpCode op : {OpCode::NEG, OpCode::SIN, OpCode::COS, OpCode::TAN, OpCode::CSC, OpCode::SEC, OpCode::COT,
+                      OpCode::LN, OpCode::LOG10, OpCode::EXP, OpCode::SQRT, OpCode::RSQRT, OpCode::RECIPROCAL,
+                      OpCode::ABS}) {
+        measure(op, repeated({op, OpCode::ADD}), addScalar, addLane);
+    }
+    measure(OpCode::POWI, repeated({OpCode::POWI, OpCode::ADD}, 5), addScalar, addLane);
+    measure(OpCode::FMA, repeated({OpCode::VARIABLE, OpCode::VARIABLE, OpCode::FMA}), 3 * loadScalar, 3 * loadLane);
+    // Selects blend the running value with two loads of y, so both branches are always computed
+    measure(OpCode::SELECT, repeated({OpCode::VARIABLE, OpCode::SELECT}), 2 * loadScalar, 2 * loadLane);
+
+    // Constants are compared with the loads of y they replace
+    auto constants = loadX();
+    for (size_t r = 0; r < REPEAT; r++) {
+        constants.emitConstant(2.0f);
+        constants.emit(OpCode::ADD);
+    }
+    measure(OpCode::CONSTANT, constants, model.scalarCosts[slot(OpCode::ADD)], model.laneCosts[slot(OpCode::ADD)]);
+
+    // Callbacks into the smallest vector reduction, over one element read from y
+    VectorSum reduction{new VectorBroadcast(new Variable("y"), 1)};
+    auto calls = loadX();
+    for (size_t r = 0; r < REPEAT; r++) {
+        calls.emitCall(reduction, {"y"});
+        calls.emit(OpCode::ADD);
+    }
+    measure(OpCode::CALL, calls, model.scalarCosts[slot(OpCode::ADD)], model.laneCosts[slot(OpCode::ADD)]);
+
+    // N-ary reductions cost about one binary operation per operand
+    model.scalarCosts[slot(OpCode::SUM)] = model.scalarCosts[slot(OpCode::ADD)];
+    model.laneCosts[slot(OpCode::SUM)] = model.laneCosts[slot(OpCode::ADD)];
+    model.scalarCosts[slot(OpCode::PRODUCT)] = model.scalarCosts[slot(OpCode::MUL)];
+    model.laneCosts[slot(OpCode::PRODUCT)] = model.laneCosts[slot(OpCode::MUL)];
+
+    // Tree walks: a sum of constants gives the cost of visiting a node, and the same sum
+    // of variables adds the lookups
+    constexpr size_t LEAVES = 64;
+    constexpr size_t WALKS = 256;
+    Expression* sum = chain(LEAVES, [] { return new Constant(1.0f); });
+    Expression* variables = chain(LEAVES, [] { return new Variable("x"); });
+    VariableContext ctx{{"x", 1.0f}};
+
+    size_t nodes = 2 * LEAVES - 1;
+    double walk = timePerPoint(
+        [&]() {
+            float total = 0.0f;
+            for (size_t i = 0; i < WALKS; i++) {
+                total += sum->eval(ctx);
+            }
+            sink = total;
+        },
+        WALKS
+    );
+    double lookups = timePerPoint(
+        [&]() {
+            float total = 0.0f;
+            for (size_t i = 0; i < WALKS; i++) {
+                total += variables->eval(ctx);
+            }
+            sink = total;
+        },
+        WALKS
+    );
+    double work = (LEAVES - 1) * model.scalarCosts[slot(OpCode::ADD)] + LEAVES * model.scalarCosts[slot(OpCode::CONSTANT)];
+    model.nodeVisit = std::max(0.1, (walk - work) / static_cast<double>(nodes));
+    model.variableLookup = std::max(0.1, (lookups - walk) / static_cast<double>(LEAVES));
+
+    model.compileNode = std::max(
+        0.1,
+        timePerPoint(
+            [&]() {
+                Program program(*variables);
+                sink = static_cast<float>(program.stackSize());
+            },
+            nodes
+        )
+    );
+
+    delete sum;
+    delete variables;
+
+    // Starting and joining a few threads that do nothing
+    constexpr size_t THREADS = 4;
+    model.threadStart = timePerPoint(
+        [&]() {
+            std::vector<std::thread> pool;
+            for (size_t t = 0; t < THREADS; t++) {
+                pool.emplace_back([] {});
+            }
+            for (auto& thread : pool) {
+                thread.join();
+            }
+        },
+        THREADS
+    );
+
+    return model;
+}
+
+double CostModel::scalar(OpCode op) const {
+    return scalarCosts[slot(op)];
+}
+
+double CostModel::lane(OpCode op) const {
+    return laneCosts[slot(op)];
+}
+
+void CostModel::setWeights(OpCode op, double scalar, double lane) {
+    scalarCosts[slot(op)] = scalar;
+    laneCosts[slot(op)] = lane;
+}
+
+double CostModel::pointCost(const ExpressionProfile& profile) const {
+    double cost = innerCost(profile);
+    for (size_t op = 0; op < OPS; op++) {
+        cost += static_cast<double>(profile.counts[op]) * laneCosts[op];
+    }
+    return cost;
+}
+
+double CostModel::innerCost(const ExpressionProfile& profile) const {
+    double cost = 0.0;
+    for (size_t op = 0; op < OPS; op++) {
+        cost += static_cast<double>(profile.inner[op]) * laneCosts[op];
+    }
+    return cost;
+}
+
+double CostModel::estimate(Strategy strategy, const ExpressionProfile& profile, size_t points, unsigned threads) const {
+    double n = static_cast<double>(points);
+    double compile = static_cast<double>(profile.nodes) * compileNode;
+
+    switch (strategy) {
+    case Strategy::TREE_WALK: {
+        // Tree walks evaluate range and reduction nodes directly, without a callback
+        double work = innerCost(profile);
+        for (size_t op = 0; op < OPS; op++) {
+            if (op != slot(OpCode::CALL)) {
+                work += static_cast<double>(profile.counts[op]) * scalarCosts[op];
+            }
+        }
+        double visit = static_cast<double>(profile.nodes) * nodeVisit;
+        double lookups = static_cast<double>(profile.variables) * variableLookup;
+        return n * (work + visit + lookups);
+    }
+    case Strategy::BYTECODE: {
+        double work = pointOverhead + innerCost(profile);
+        for (size_t op = 0; op < OPS; op++) {
+            work += static_cast<double>(profile.counts[op]) * scalarCosts[op];
+        }
+        return compile + n * work;
+    }
+    case Strategy::BATCH: {
+        // Partial rows are padded to a full row of lanes
+        double rows = std::ceil(n / static_cast<double>(Program::LANES));
+        return compile + rows * static_cast<double>(Program::LANES) * pointCost(profile);
+    }
+    case Strategy::THREADED: {
+        double t = static_cast<double>(std::max(1u, threads));
+        double rows = std::ceil(n / static_cast<double>(Program::LANES) / t);
+        return compile + t * threadStart + rows * static_cast<double>(Program::LANES) * pointCost(profile);
+    }
+    }
+
+    return std::numeric_limits<double>::infinity();
+}
+
+// --------------------------
+// --------------------------
+// Plan
+
+std::string Plan::describe() const {
+    char text[256];
+    snprintf(
+        text,
+        sizeof(text),
+        "%s for %zu points (chunk %zu, %u thread%s); estimated tree-walk %.1f us, bytecode %.1f us, batch %.1f us, threaded %.1f us",
+        to_string(strategy).c_str(),
+        points,
+        chunk,
+        threads,
+        threads == 1 ? "" : "s",
+        estimates[0] / 1000.0,
+        estimates[1] / 1000.0,
+        estimates[2] / 1000.0,
+        estimates[3] / 1000.0
+    );
+    return text;
+}
+
+// --------------------------
+// --------------------------
+// Planner
+
+Planner::Planner(const CostModel& model, unsigned threads)
+  : model{model},
+    maxThreads{threads == 0 ? std::max(1u, std::thread::hardware_concurrency()) : threads} {}
+
+const CostModel& Planner::costModel() const {
+    return model;
+}
+
+Plan Planner::plan(const Expression& expr, size_t points) const {
+    return plan(ExpressionProfile::of(expr), points);
+}
+
+Plan Planner::plan(const ExpressionProfile& profile, size_t points) const {
+    Plan plan;
+    plan.points = points;
+
+    // Thread count with the lowest estimate; a single thread is the BATCH strategy
+    unsigned threads = 1;
+    double threaded = std::numeric_limits<double>::infinity();
+    for (unsigned t = 2; t <= maxThreads; t++) {
+        double estimate = model.estimate(Strategy::THREADED, profile, points, t);
+        if (estimate < threaded) {
+            threaded = estimate;
+            threads = t;
+        }
+    }
+
+    plan.estimates[0] = model.estimate(Strategy::TREE_WALK, profile, points, 1);
+    plan.estimates[1] = model.estimate(Strategy::BYTECODE, profile, points, 1);
+    plan.estimates[2] = model.estimate(Strategy::BATCH, profile, points, 1);
+    plan.estimates[3] = threaded;
+
+    size_t best = 0;
+    for (size_t s = 1; s < STRATEGIES; s++) {
+        if (plan.estimates[s] < plan.estimates[best]) {
+            best = s;
+        }
+    }
+    plan.strategy = static_cast<Strategy>(best);
+    plan.chunk = points;
+
+    if (plan.strategy == Strategy::THREADED) {
+        // A few chunks per thread, in whole rows of lanes, so uneven threads even out
+        size_t chunks = 4 * static_cast<size_t>(threads);
+        size_t chunk = (points + chunks - 1) / chunks;
+        plan.chunk = (chunk + Program::LANES - 1) / Program::LANES * Program::LANES;
+        plan.threads = threads;
+    }
+    return plan;
+}
+
+Plan Planner::evaluate(
+    const Expression& expr,
+    const std::vector<std::string>& variables,
+    const float* const* inputs,
+    float* out,
+    size_t count
+) const {
+    Plan decision = plan(expr, count);
+    if (count == 0) {
+        return decision;
+    }
+
+    if (decision.strategy == Strategy::TREE_WALK) {
+        // Every variable is inserted once; each point only overwrites the values
+        VariableContext ctx;
+        std::vector<float*> slots;
+        for (const auto& name : variables) {
+            slots.push_back(&ctx[name]);
+        }
+        for (size_t i = 0; i < count; i++) {
+            for (size_t k = 0; k < slots.size(); k++) {
+                *slots[k] = inputs[k][i];
+            }
+            out[i] = expr.eval(ctx);
+        }
+        return decision;
+    }
+
+    Program program(expr, variables);
+    std::vector<float> stack(program.stackSize() * Program::LANES);
+
+    if (decision.strategy == Strategy::BYTECODE) {
+        std::vector<float> values(variables.size());
+        for (size_t i = 0; i < count; i++) {
+            for (size_t k = 0; k < values.size(); k++) {
+                values[k] = inputs[k][i];
+            }
+            out[i] = program.eval(values.data(), stack.data());
+        }
+        return decision;
+    }
+
+    if (decision.strategy == Strategy::BATCH) {
+        program.evalBatch(inputs, out, count, stack.data());
+        return decision;
+    }
+
+    // Threads take chunks in order until none is left
+    std::atomic<size_t> next{0};
+    auto work = [&]() {
+        std::vector<float> scratch(program.stackSize() * Program::LANES);
+        std::vector<const float*> columns(variables.size());
+        while (true) {
+            size_t first = next.fetch_add(decision.chunk);
+            if (first >= count) {
+                return;
+            }
+            size_t n = std::min(decision.chunk, count - first);
+            for (size_t k = 0; k < columns.size(); k++) {
+                columns[k] = inputs[k] + first;
+            }
+            program.evalBatch(columns.data(), out + first, n, scratch.data());
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < decision.threads; t++) {
+        pool.emplace_back(work);
+    }
+    work();
+    for (auto& thread : pool) {
+        thread.join();
+    }
+    return decision;
+}
+
+} // namespace mathex
@@ -0,0 +1,629 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <map>
+
+#include "polynomial.hpp"
+#include "constant.hpp"
+#include "variable.hpp"
+#include "binary_operation.hpp"
+#include "unary_operation.hpp"
+#include "functions.hpp"
+#include "program.hpp"
+#include "nary_operation.hpp"
+
+namespace mathex {
+
+Polynomial::Polynomial(const std::string& varName, const std::vector<float>& coefficients)
+  : Polynomial(SymbolTable::global().intern(varName), coefficients) {}
+
+Polynomial::Polynomial(const std::string& varName, const std::vector<Expression*>& coefficients)
+  : Polynomial(SymbolTable::global().intern(varName), coefficients) {}
+
+Polynomial::Polynomial(SymbolId variable, const std::vector<float>& coefficients)
+  : id{variable},
+    values{coefficients},
+    terms(coefficients.size(), nullptr) {
+    if (values.empty()) {
+        values.push_back(0.0f);
+        terms.push_back(nullptr);
+    }
+    index();
+}
+
+Polynomial::Polynomial(SymbolId variable, const std::vector<Expression*>& coefficients)
+  : id{variable} {
+    for (auto coefficient : coefficients) {
+        auto c = dynamic_cast<Constant*>(coefficient);
+        if (c != nullptr) {
+            values.push_back(c->getValue());
+            terms.push_back(nullptr);
+            delete c;
+        } else {
+            values.push_back(0.0f);
+            terms.push_back(coefficient);
+        }
+    }
+
+    if (values.empty()) {
+        values.push_back(0.0f);
+        terms.push_back(nullptr);
+    }
+    index();
+}
+
+Polynomial::Polynomial(const Polynomial& o)
+  : id{o.id},
+    values{o.values} {
+    for (auto term : o.terms) {
+        terms.push_back(term ? term->clone() : nullptr);
+    }
+    index();
+}
+
+Polynomial& Polynomial::operator=(const Polynomial& o) {
+    // Self-assignment
+    if (this == &o) {
+        return *this;
+    }
+
+    // Free existing memory
+    std::vector<Expression*> pending;
+    releaseChildren(pending);
+    destroy(pending);
+
+    id = o.id;
+    values = o.values;
+    terms.clear();
+    for (auto term : o.terms) {
+        terms.push_back(term ? term->clone() : nullptr);
+    }
+    index();
+    return *this;
+}
+
+Polynomial::~Polynomial() {
+    std::vector<Expression*> pending;
+    releaseChildren(pending);
+    destroy(pending);
+}
+
+void Polynomial::index() {
+    slots.clear();
+    for (size_t k = terms.size(); k > 0; k--) {
+        if (terms[k - 1]) {
+            slots.push_back(k - 1);
+        }
+    }
+
+    gatherDependencies();
+    dependencies |= variableBit(id);
+}
+
+size_t Polynomial::childCount() const {
+    return slots.size();
+}
+
+const Expression* Polynomial::child(size_t index) const {
+    if (index >= slots.size()) {
+        throw std::runtime_error{"[Polynomial::child] Index out of range"};
+    }
+    return terms[slots[index]];
+}
+
+float Polynomial::apply(const float* args, const VariableContext& ctx) const {
+    auto it = ctx.find(getName());
+    if (it == ctx.end()) {
+        throw std::runtime_error{"[Polynomial::eval] Variable name not found in context"};
+    }
+
+    // Horner: (((c_n x + c_n-1) x + ...) x + c_0); expression coefficients arrive from the highest
+    float x = it->second;
+    size_t k = values.size() - 1;
+    float r = terms[k] ? *args++ : values[k];
+    while (k > 0) {
+        k--;
+        r = std::fma(r, x, terms[k] ? *args++ : values[k]);
+    }
+    return r;
+}
+
+Expression* Polynomial::withChildren(Expression* const* children) const {
+    auto p = new Polynomial(id, values);
+    for (size_t i = 0; i < slots.size(); i++) {
+        p->terms[slots[i]] = children[i];
+    }
+    p->index();
+    return p;
+}
+
+// Multiplies a coefficient expression by a constant, staying polynomial when possible
+static Expression* scale(const Expression* term, float k) {
+    auto p = dynamic_cast<const Polynomial*>(term);
+    if (p != nullptr) {
+        return p->scaled(k);
+    }
+    return new BinaryOperation(BinaryOperator::MUL, new Constant(k), term->clone());
+}
+
+Polynomial* Polynomial::scaled(float k) const {
+    auto p = new Polynomial(*this);
+    for (size_t i = 0; i < p->values.size(); i++) {
+        p->values[i] *= k;
+        if (p->terms[i]) {
+            auto term = scale(p->terms[i], k);
+            delete p->terms[i];
+            p->terms[i] = term;
+        }
+    }
+    return p;
+}
+
+Expression* Polynomial::derivative(Expression* const* derivatives, SymbolId variable) const {
+    std::vector<Expression*> coefficients;
+
+    if (variable == id) {
+        // (Σ c_k x^k)' = Σ k c_k x^(k-1); coefficients do not depend on x
+        for (size_t i = 0; i < slots.size(); i++) {
+            delete derivatives[i];
+        }
+        if (values.size() == 1) {
+            return new Constant(0.0f);
+        }
+        for (size_t k = 1; k < values.size(); k++) {
+            float n = static_cast<float>(k);
+            coefficients.push_back(terms[k] ? scale(terms[k], n) : new Constant(n * values[k]));
+        }
+        return new Polynomial(id, coefficients);
+    }
+
+    // (Σ c_k x^k)' = Σ c_k' x^k
+    coefficients.resize(values.size(), nullptr);
+    for (size_t k = 0; k < values.size(); k++) {
+        if (!terms[k]) {
+            coefficients[k] = new Constant(0.0f);
+        }
+    }
+
+    bool zero = true;
+    for (size_t i = 0; i < slots.size(); i++) {
+        auto c = dynamic_cast<Constant*>(derivatives[i]);
+        zero = zero && c != nullptr && c->getValue() == 0.0f;
+        coefficients[slots[i]] = derivatives[i];
+    }
+
+    if (zero) {
+        for (auto c : coefficients) {
+            delete c;
+        }
+        return new Constant(0.0f);
+    }
+    return new Polynomial(id, coefficients);
+}
+
+void Polynomial::emit(Program& program, size_t step) const {
+    // For k from n down to 0 Horner emits: [x] c_k [FMA], without the brackets for k = n.
+    // Expression coefficients are compiled by the traversal between two steps, so each
+    // step closes the previous child's term and emits everything up to the next child
+    const long n = static_cast<long>(values.size()) - 1;
+
+    long k = n;
+    if (step > 0) {
+        long previous = static_cast<long>(slots[step - 1]);
+        if (previous < n) {
+            program.emit(OpCode::FMA);
+        }
+        k = previous - 1;
+    }
+
+    long stop = step < slots.size() ? static_cast<long>(slots[step]) : -1;
+    for (; k > stop; k--) {
+        if (k < n) {
+            program.emitVariable(getName());
+        }
+        program.emitConstant(values[k]);
+        if (k < n) {
+            program.emit(OpCode::FMA);
+        }
+    }
+
+    if (stop >= 0 && stop < n) {
+        program.emitVariable(getName());
+    }
+}
+
+Expression* Polynomial::specializeNode(Expression* const* children, const VariableContext& bound) const {
+    std::vector<Expression*> coefficients(values.size(), nullptr);
+    for (size_t i = 0; i < slots.size(); i++) {
+        coefficients[slots[i]] = children[i];
+    }
+
+    bool constant = true;
+    for (size_t k = 0; k < values.size(); k++) {
+        if (coefficients[k] == nullptr) {
+            coefficients[k] = new Constant(values[k]);
+        }
+        constant = constant && dynamic_cast<Constant*>(coefficients[k]) != nullptr;
+    }
+
+    auto result = new Polynomial(id, coefficients);
+    auto it = bound.find(getName());
+    if (it == bound.end()) {
+        return result;
+    }
+
+    // The variable itself is bound: fold, or collect the remaining coefficients again
+    Expression* residual = nullptr;
+    if (constant) {
+        residual = new Constant(result->eval(bound));
+    } else {
+        // c_n x^n + ... + c_0 with x known is a sum of the coefficients' polynomials
+        Expression* sum = result->terms.back() ? result->terms.back()->clone() : new Constant(result->values.back());
+        for (size_t k = result->values.size() - 1; k > 0; k--) {
+            auto c = result->terms[k - 1] ? result->terms[k - 1]->clone() : new Constant(result->values[k - 1]);
+            sum = new BinaryOperation(
+                BinaryOperator::ADD,
+                new BinaryOperation(BinaryOperator::MUL, sum, new Constant(it->second)),
+                c
+            );
+        }
+        residual = rewritePolynomials(*sum);
+        delete sum;
+    }
+
+    delete result;
+    return residual;
+}
+
+void Polynomial::releaseChildren(std::vector<Expression*>& out) {
+    for (auto& term : terms) {
+        if (term) {
+            out.push_back(term);
+            term = nullptr;
+        }
+    }
+    slots.clear();
+}
+
+const std::string& Polynomial::getName() const {
+    return SymbolTable::global().name(id);
+}
+
+SymbolId Polynomial::getId() const {
+    return id;
+}
+
+size_t Polynomial::degree() const {
+    return values.size() - 1;
+}
+
+// --------------------------
+// --------------------------
+// Polynomial rewriting
+
+namespace {
+
+// Exponent of every variable of a term, and the coefficient of every term
+using Monomial = std::map<std::string, unsigned>;
+using Terms = std::map<Monomial, double>;
+
+// Expansion limits. Expanding a product of sums trades exact factors for coefficients that
+// cancel each other near the roots, so (x-1)^12 would lose every digit around x = 1; sums
+// are only multiplied out while the result stays of a low degree
+constexpr unsigned MAX_EXPONENT = 16;
+constexpr unsigned MAX_SUM_DEGREE = 2;
+constexpr size_t MAX_TERMS = 256;
+
+void add(Terms& out, const Terms& terms, double sign) {
+    for (const auto& [monomial, c] : terms) {
+        out[monomial] += sign * c;
+    }
+}
+
+// Highest total degree of the terms
+unsigned degree(const Terms& terms) {
+    unsigned d = 0;
+    for (const auto& term : terms) {
+        unsigned e = 0;
+        for (const auto& factor : term.first) {
+            e += factor.second;
+        }
+        d = std::max(d, e);
+    }
+    return d;
+}
+
+bool multiply(const Terms& a, const Terms& b, Terms& out) {
+    out.clear();
+    if (a.size() > 1 && b.size() > 1 && degree(a) + degree(b) > MAX_SUM_DEGREE) {
+        return false;
+    }
+    for (const auto& [ma, ca] : a) {
+        for (const auto& [mb, cb] : b) {
+            Monomial m = ma;
+            for (const auto& [var, e] : mb) {
+                m[var] += e;
+            }
+            out[m] += ca * cb;
+        }
+        if (out.size() > MAX_TERMS) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Raises a sum of monomials to a non-negative integer power by square-and-multiply
+bool power(const Terms& terms, unsigned n, Terms& out) {
+    Terms result{{{}, 1.0}};
+    Terms base = terms;
+    Terms tmp;
+    for (unsigned e = n; e > 0; e >>= 1) {
+        if (e & 1u) {
+            if (!multiply(result, base, tmp)) {
+                return false;
+            }
+            result.swap(tmp);
+        }
+        if (e > 1) {
+            if (!multiply(base, base, tmp)) {
+                return false;
+            }
+            base.swap(tmp);
+        }
+    }
+    out.swap(result);
+    return true;
+}
+
+// Whether `terms` raised to `n` may be expanded: powers of monomials always can, powers of
+// sums only up to MAX_SUM_DEGREE, and are otherwise kept as powers of a Polynomial base
+bool expandable(const Terms& terms, float n) {
+    if (n < 0.0f || n > MAX_EXPONENT || n != std::floor(n)) {
+        return false;
+    }
+    return n <= 1.0f || terms.size() <= 1 || n * degree(terms) <= MAX_SUM_DEGREE;
+}
+
+void prune(Terms& terms) {
+    for (auto it = terms.begin(); it != terms.end();) {
+        it = it->second == 0.0 ? terms.erase(it) : std::next(it);
+    }
+}
+
+// Value of a sum of monomials without variables
+bool constantOf(Terms terms, double& value) {
+    prune(terms);
+    if (terms.empty()) {
+        value = 0.0;
+        return true;
+    }
+    if (terms.size() != 1 || !terms.begin()->first.empty()) {
+        return false;
+    }
+    value = terms.begin()->second;
+    return true;
+}
+
+// Expands one node into a sum of monomials given the expansions of its children (which may be
+// moved from); fails when the node is not a polynomial operation
+bool collect(const Expression& node, Terms* children, Terms& out) {
+    out.clear();
+
+    if (auto c = dynamic_cast<const Constant*>(&node)) {
+        out[{}] = c->getValue();
+        return true;
+    }
+
+    if (auto v = dynamic_cast<const Variable*>(&node)) {
+        out[{{v->getName(), 1}}] = 1.0;
+        return true;
+    }
+
+    if (auto p = dynamic_cast<const OperationPow*>(&node)) {
+        float n = p->getExponent();
+        if (!expandable(children[0], n) || !power(children[0], static_cast<unsigned>(n), out)) {
+            return false;
+        }
+        prune(out);
+        return true;
+    }
+
+    if (dynamic_cast<const OperationNeg*>(&node)) {
+        out.swap(children[0]);
+        for (auto& term : out) {
+            term.second = -term.second;
+        }
+        return true;
+    }
+
+    if (auto sum = dynamic_cast<const Sum*>(&node)) {
+        out[{}] = sum->getOffset();
+        for (size_t i = 0; i < node.childCount(); i++) {
+            add(out, children[i], sum->getWeights()[i]);
+        }
+        prune(out);
+        return true;
+    }
+
+    if (auto product = dynamic_cast<const Product*>(&node)) {
+        out[{}] = product->getScale();
+        Terms tmp;
+        for (size_t i = 0; i < node.childCount(); i++) {
+            if (!multiply(out, children[i], tmp)) {
+                return false;
+            }
+            out.swap(tmp);
+        }
+        prune(out);
+        return true;
+    }
+
+    auto b = dynamic_cast<const BinaryOperation*>(&node);
+    if (b == nullptr) {
+        return false;
+    }
+
+    Terms& left = children[0];
+    Terms& right = children[1];
+    double c;
+
+    switch (b->getOperator()) {
+    case BinaryOperator::ADD:
+        out.swap(left);
+        add(out, right, 1.0);
+        break;
+    case BinaryOperator::SUB:
+        out.swap(left);
+        add(out, right, -1.0);
+        break;
+    case BinaryOperator::MUL:
+        if (!multiply(left, right, out)) {
+            return false;
+        }
+        break;
+    case BinaryOperator::DIV:
+        // Only division by a nonzero constant
+        if (!constantOf(right, c) || c == 0.0) {
+            return false;
+        }
+        add(out, left, 1.0 / c);
+        break;
+    case BinaryOperator::POW:
+        // Only constant non-negative integer exponents, by square-and-multiply
+        if (!constantOf(right, c) || !expandable(left, static_cast<float>(c))) {
+            return false;
+        }
+        if (!power(left, static_cast<unsigned>(c), out)) {
+            return false;
+        }
+        break;
+    default:
+        return false;
+    }
+
+    prune(out);
+    return true;
+}
+
+// Builds nested Horner schemes, one variable per level in `vars` order; the recursion depth
+// is bounded by the number of variables
+Expression* build(const Terms& terms, const std::vector<std::string>& vars, size_t index) {
+    // Skip variables that no term uses
+    while (index < vars.size()) {
+        bool used = std::any_of(terms.begin(), terms.end(), [&](const Terms::value_type& term) {
+            return term.first.count(vars[index]) != 0;
+        });
+        if (used) {
+            break;
+        }
+        index++;
+    }
+
+    if (index == vars.size()) {
+        auto it = terms.find({});
+        return new Constant(it == terms.end() ? 0.0f : static_cast<float>(it->second));
+    }
+
+    // Group the terms by their exponent of this level's variable
+    const auto& var = vars[index];
+    std::vector<Terms> groups;
+    for (const auto& [monomial, c] : terms) {
+        auto it = monomial.find(var);
+        unsigned e = it == monomial.end() ? 0 : it->second;
+        if (groups.size() <= e) {
+            groups.resize(e + 1);
+        }
+
+        Monomial rest = monomial;
+        rest.erase(var);
+        groups[e][rest] += c;
+    }
+
+    std::vector<Expression*> coefficients;
+    for (const auto& group : groups) {
+        coefficients.push_back(build(group, vars, index + 1));
+    }
+    return new Polynomial(var, coefficients);
+}
+
+// Result of rewriting one subtree: its expansion while it is a polynomial, its rewritten tree otherwise
+struct Entry {
+    const Expression* node;
+    bool polynomial;
+    Terms terms;
+    Expression* rewritten;
+};
+
+// Turns a subtree's result into a tree; lone constants and variables are kept as they are
+Expression* materialize(const Entry& entry) {
+    if (!entry.polynomial) {
+        return entry.rewritten;
+    }
+    if (entry.node->childCount() == 0) {
+        return entry.node->clone();
+    }
+
+    std::vector<std::string> vars;
+    for (const auto& term : entry.terms) {
+        for (const auto& factor : term.first) {
+            vars.push_back(factor.first);
+        }
+    }
+    std::sort(vars.begin(), vars.end());
+    vars.erase(std::unique(vars.begin(), vars.end()), vars.end());
+    return build(entry.terms, vars, 0);
+}
+
+} // namespace
+
+Expression* rewritePolynomials(const Expression& expr) {
+    std::vector<Entry> entries;
+    std::vector<Terms> expansions;
+    std::vector<Expression*> rewritten;
+
+    postorder(expr, [&](const Expression& node) {
+        size_t n = node.childCount();
+        Entry* children = entries.data() + (entries.size() - n);
+
+        Entry entry{&node, true, {}, nullptr};
+        for (size_t i = 0; i < n; i++) {
+            entry.polynomial = entry.polynomial && children[i].polynomial;
+        }
+
+        // Expand from copies so that the children stay usable if the expansion fails
+        if (entry.polynomial) {
+            expansions.assign(n, {});
+            for (size_t i = 0; i < n; i++) {
+                expansions[i] = children[i].terms;
+            }
+            entry.polynomial = collect(node, expansions.data(), entry.terms);
+        }
+
+        // Maximal polynomial subtrees below a non-polynomial node become Polynomial nodes
+        if (!entry.polynomial) {
+            rewritten.clear();
+            for (size_t i = 0; i < n; i++) {
+                rewritten.push_back(materialize(children[i]));
+            }
+
+            // A power of a sum that was not expanded keeps its exponent out of std::pow
+            auto b = dynamic_cast<const BinaryOperation*>(&node);
+            auto exponent = n == 2 ? dynamic_cast<Constant*>(rewritten[1]) : nullptr;
+            if (b != nullptr && b->getOperator() == BinaryOperator::POW && exponent != nullptr) {
+                entry.rewritten = new OperationPow(rewritten[0], exponent->getValue());
+                delete exponent;
+            } else {
+                entry.rewritten = node.withChildren(rewritten.data());
+            }
+            entry.terms.clear();
+        }
+
+        entries.resize(entries.size() - n);
+        entries.push_back(std::move(entry));
+    });
+
+    return materialize(entries.back());
+}
+
+} // namespace mathex
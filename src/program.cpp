@@ -0,0 +1,525 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <deque>
+
+#include "program.hpp"
+
+namespace mathex {
+
+std::string to_string(OpCode op) {
+    switch (op) {
+    case OpCode::CONSTANT:
+        return "CONSTANT";
+    case OpCode::VARIABLE:
+        return "VARIABLE";
+    case OpCode::ADD:
+        return "ADD";
+    case OpCode::SUB:
+        return "SUB";
+    case OpCode::MUL:
+        return "MUL";
+    case OpCode::DIV:
+        return "DIV";
+    case OpCode::POW:
+        return "POW";
+    case OpCode::POWI:
+        return "POWI";
+    case OpCode::FMA:
+        return "FMA";
+    case OpCode::NEG:
+        return "NEG";
+    case OpCode::SIN:
+        return "SIN";
+    case OpCode::COS:
+        return "COS";
+    case OpCode::TAN:
+        return "TAN";
+    case OpCode::CSC:
+        return "CSC";
+    case OpCode::SEC:
+        return "SEC";
+    case OpCode::COT:
+        return "COT";
+    case OpCode::LN:
+        return "LN";
+    case OpCode::LOG10:
+        return "LOG10";
+    case OpCode::EXP:
+        return "EXP";
+    case OpCode::SQRT:
+        return "SQRT";
+    case OpCode::RSQRT:
+        return "RSQRT";
+    case OpCode::RECIPROCAL:
+        return "RECIPROCAL";
+    case OpCode::ABS:
+        return "ABS";
+    case OpCode::MIN:
+        return "MIN";
+    case OpCode::MAX:
+        return "MAX";
+    case OpCode::LESS:
+        return "LESS";
+    case OpCode::LESS_EQUAL:
+        return "LESS_EQUAL";
+    case OpCode::GREATER:
+        return "GREATER";
+    case OpCode::GREATER_EQUAL:
+        return "GREATER_EQUAL";
+    case OpCode::EQUAL:
+        return "EQUAL";
+    case OpCode::NOT_EQUAL:
+        return "NOT_EQUAL";
+    case OpCode::SELECT:
+        return "SELECT";
+    case OpCode::SUM:
+        return "SUM";
+    case OpCode::PRODUCT:
+        return "PRODUCT";
+    case OpCode::CALL:
+        return "CALL";
+    }
+
+    return "UNKNOWN";
+}
+
+Program::Program(const Expression& expr) {
+    expr.compile(*this);
+}
+
+Program::Program(const Expression& expr, const std::vector<std::string>& variables)
+  : varNames{variables},
+    fixedInputs{true} {
+    expr.compile(*this);
+}
+
+void Callback::eval(const float* inputs, size_t stride, float* out, size_t count) const {
+    // Point i writes out[i] after reading its inputs, so out may overwrite the first row
+    for (size_t i = 0; i < count; i++) {
+        out[i] = node->call(inputs + i, stride);
+    }
+}
+
+struct ScratchLevel {
+    std::vector<float> floats;
+    std::vector<const float*> pointers;
+    VariableContext context;
+};
+
+// A deque never moves its levels, so outer levels stay valid while inner ones are added
+static thread_local std::deque<ScratchLevel> scratchLevels;
+static thread_local size_t scratchDepth = 0;
+
+ThreadScratch::ThreadScratch() {
+    if (scratchLevels.size() == scratchDepth) {
+        scratchLevels.emplace_back();
+    }
+    level = &scratchLevels[scratchDepth++];
+}
+
+ThreadScratch::~ThreadScratch() {
+    scratchDepth--;
+}
+
+float* ThreadScratch::floats(size_t n) {
+    if (level->floats.size() < n) {
+        level->floats.resize(n);
+    }
+    return level->floats.data();
+}
+
+const float** ThreadScratch::pointers(size_t n) {
+    if (level->pointers.size() < n) {
+        level->pointers.resize(n);
+    }
+    return level->pointers.data();
+}
+
+VariableContext& ThreadScratch::context() {
+    return level->context;
+}
+
+void Program::push(const Instruction& ins, int delta) {
+    code.push_back(ins);
+    depth += delta;
+    maxDepth = std::max(maxDepth, depth);
+}
+
+void Program::emitConstant(float c) {
+    push({OpCode::CONSTANT, 0, c}, 1);
+}
+
+uint32_t Program::slot(const std::string& name) {
+    auto it = std::find(varNames.begin(), varNames.end(), name);
+    if (it == varNames.end()) {
+        if (fixedInputs) {
+            throw std::runtime_error{"[Program::emitVariable] Variable is not an input of the program"};
+        }
+        it = varNames.insert(varNames.end(), name);
+    }
+    return static_cast<uint32_t>(it - varNames.begin());
+}
+
+void Program::emitVariable(const std::string& name) {
+    push({OpCode::VARIABLE, slot(name), 0.0f}, 1);
+}
+
+void Program::emitCall(const Expression& node, const std::vector<std::string>& inputs) {
+    Callback call{std::shared_ptr<const Expression>(node.clone()), inputs, {}};
+    for (const auto& name : inputs) {
+        call.slots.push_back(slot(name));
+    }
+    calls.push_back(std::move(call));
+
+    // The inputs are loaded in the rows from the result up before the call
+    maxDepth = std::max(maxDepth, depth + inputs.size());
+    push({OpCode::CALL, static_cast<uint32_t>(calls.size() - 1), 0.0f}, 1);
+}
+
+void Program::emit(OpCode op) {
+    switch (op) {
+    case OpCode::CONSTANT:
+    case OpCode::VARIABLE:
+    case OpCode::POWI:
+    case OpCode::SUM:
+    case OpCode::PRODUCT:
+    case OpCode::CALL:
+        throw std::runtime_error{"[Program::emit] Operands must be emitted with their own methods"};
+    case OpCode::ADD:
+    case OpCode::SUB:
+    case OpCode::MUL:
+    case OpCode::DIV:
+    case OpCode::POW:
+    case OpCode::MIN:
+    case OpCode::MAX:
+    case OpCode::LESS:
+    case OpCode::LESS_EQUAL:
+    case OpCode::GREATER:
+    case OpCode::GREATER_EQUAL:
+    case OpCode::EQUAL:
+    case OpCode::NOT_EQUAL:
+        push({op, 0, 0.0f}, -1);
+        return;
+    case OpCode::FMA:
+    case OpCode::SELECT:
+        push({op, 0, 0.0f}, -2);
+        return;
+    default:
+        push({op, 0, 0.0f}, 0);
+        return;
+    }
+}
+
+void Program::emitPowi(int n) {
+    push({OpCode::POWI, 0, static_cast<float>(n)}, 0);
+}
+
+void Program::emitSum(size_t count) {
+    if (count == 0) {
+        throw std::runtime_error{"[Program::emitSum] Nothing to reduce"};
+    }
+    push({OpCode::SUM, static_cast<uint32_t>(count), 0.0f}, 1 - static_cast<int>(count));
+}
+
+void Program::emitProduct(size_t count) {
+    if (count == 0) {
+        throw std::runtime_error{"[Program::emitProduct] Nothing to reduce"};
+    }
+    push({OpCode::PRODUCT, static_cast<uint32_t>(count), 0.0f}, 1 - static_cast<int>(count));
+}
+
+// Raises the top row of the stack to an integer power with the same multiplication chain in
+// every lane, in doubles like powi()
+template <size_t Width>
+static inline void powi(float* a, int n) {
+    double base[Width];
+    double r[Width];
+    for (size_t l = 0; l < Width; l++) {
+        base[l] = a[l];
+        r[l] = 1.0;
+    }
+
+    unsigned e = n < 0 ? -static_cast<unsigned>(n) : static_cast<unsigned>(n);
+    while (e != 0) {
+        if (e & 1u) {
+            for (size_t l = 0; l < Width; l++) {
+                r[l] *= base[l];
+            }
+        }
+        e >>= 1;
+        if (e != 0) {
+            for (size_t l = 0; l < Width; l++) {
+                base[l] *= base[l];
+            }
+        }
+    }
+
+    for (size_t l = 0; l < Width; l++) {
+        a[l] = static_cast<float>(n < 0 ? 1.0 / r[l] : r[l]);
+    }
+}
+
+// Computes a * b + c lane-wise into the lowest of the three top rows of the stack
+template <size_t Width>
+static inline void fma(float* a, const float* b, const float* c) {
+    for (size_t l = 0; l < Width; l++) {
+        a[l] = std::fma(a[l], b[l], c[l]);
+    }
+}
+
+// Folds `count` consecutive rows of the stack lane-wise into the first one
+template <size_t Width, typename F>
+static inline void reduce(float* a, size_t count, F f) {
+    for (size_t k = 1; k < count; k++) {
+        const float* b = a + k * Program::LANES;
+        for (size_t l = 0; l < Width; l++) {
+            a[l] = f(a[l], b[l]);
+        }
+    }
+}
+
+// Applies `f` lane-wise on the top row of the stack
+template <size_t Width, typename F>
+static inline void unary(float* a, F f) {
+    for (size_t l = 0; l < Width; l++) {
+        a[l] = f(a[l]);
+    }
+}
+
+// Picks b where a is nonzero and c elsewhere, lane-wise into the lowest of the three top rows of the stack.
+// Both candidates are already computed, so the loop compiles to a blend instead of a branch
+template <size_t Width>
+static inline void select(float* a, const float* b, const float* c) {
+    for (size_t l = 0; l < Width; l++) {
+        a[l] = a[l] != 0.0f ? b[l] : c[l];
+    }
+}
+
+// Combines the two top rows of the stack lane-wise into the lower one
+template <size_t Width, typename F>
+static inline void binary(float* a, const float* b, F f) {
+    for (size_t l = 0; l < Width; l++) {
+        a[l] = f(a[l], b[l]);
+    }
+}
+
+template <size_t Width, typename Load>
+void Program::run(Load load, float* out, float* stack) const {
+    // Each stack entry is a row of LANES floats, one per point; `top` points past the last one
+    float* top = stack;
+
+    for (const auto& ins : code) {
+        switch (ins.op) {
+        case OpCode::CONSTANT:
+            std::fill(top, top + Width, ins.value);
+            top += LANES;
+            break;
+        case OpCode::VARIABLE:
+            load(ins.index, top);
+            top += LANES;
+            break;
+        case OpCode::ADD:
+            top -= LANES;
+            binary<Width>(top - LANES, top, [](float l, float r) { return l + r; });
+            break;
+        case OpCode::SUB:
+            top -= LANES;
+            binary<Width>(top - LANES, top, [](float l, float r) { return l - r; });
+            break;
+        case OpCode::MUL:
+            top -= LANES;
+            binary<Width>(top - LANES, top, [](float l, float r) { return l * r; });
+            break;
+        case OpCode::DIV:
+            top -= LANES;
+            binary<Width>(top - LANES, top, [](float l, float r) { return l / r; });
+            break;
+        case OpCode::POW:
+            top -= LANES;
+            binary<Width>(top - LANES, top, [](float l, float r) { return std::pow(l, r); });
+            break;
+        case OpCode::POWI:
+            powi<Width>(top - LANES, static_cast<int>(ins.value));
+            break;
+        case OpCode::FMA:
+            top -= 2 * LANES;
+            fma<Width>(top - LANES, top, top + LANES);
+            break;
+        case OpCode::NEG:
+            unary<Width>(top - LANES, [](float u) { return -u; });
+            break;
+        case OpCode::SIN:
+            unary<Width>(top - LANES, [](float u) { return std::sin(u); });
+            break;
+        case OpCode::COS:
+            unary<Width>(top - LANES, [](float u) { return std::cos(u); });
+            break;
+        case OpCode::TAN:
+            unary<Width>(top - LANES, [](float u) { return std::tan(u); });
+            break;
+        case OpCode::CSC:
+            unary<Width>(top - LANES, [](float u) { return 1.0f / std::sin(u); });
+            break;
+        case OpCode::SEC:
+            unary<Width>(top - LANES, [](float u) { return 1.0f / std::cos(u); });
+            break;
+        case OpCode::COT:
+            unary<Width>(top - LANES, [](float u) { return 1.0f / std::tan(u); });
+            break;
+        case OpCode::LN:
+            unary<Width>(top - LANES, [](float u) { return std::log(u); });
+            break;
+        case OpCode::LOG10:
+            unary<Width>(top - LANES, [](float u) { return std::log10(u); });
+            break;
+        case OpCode::EXP:
+            unary<Width>(top - LANES, [](float u) { return std::exp(u); });
+            break;
+        case OpCode::SQRT:
+            unary<Width>(top - LANES, [](float u) { return std::sqrt(u); });
+            break;
+        case OpCode::RSQRT:
+            unary<Width>(top - LANES, [](float u) { return 1.0f / std::sqrt(u); });
+            break;
+        case OpCode::RECIPROCAL:
+            unary<Width>(top - LANES, [](float u) { return 1.0f / u; });
+            break;
+        case OpCode::ABS:
+            unary<Width>(top - LANES, [](float u) { return std::abs(u); });
+            break;
+        case OpCode::MIN:
+            top -= LANES;
+            binary<Width>(top - LANES, top, [](float l, float r) { return std::min(l, r); });
+            break;
+        case OpCode::MAX:
+            top -= LANES;
+            binary<Width>(top - LANES, top, [](float l, float r) { return std::max(l, r); });
+            break;
+        case OpCode::LESS:
+            top -= LANES;
+            binary<Width>(top - LANES, top, [](float l, float r) { return l < r ? 1.0f : 0.0f; });
+            break;
+        case OpCode::LESS_EQUAL:
+            top -= LANES;
+            binary<Width>(top - LANES, top, [](float l, float r) { return l <= r ? 1.0f : 0.0f; });
+            break;
+        case OpCode::GREATER:
+            top -= LANES;
+            binary<Width>(top - LANES, top, [](float l, float r) { return l > r ? 1.0f : 0.0f; });
+            break;
+        case OpCode::GREATER_EQUAL:
+            top -= LANES;
+            binary<Width>(top - LANES, top, [](float l, float r) { return l >= r ? 1.0f : 0.0f; });
+            break;
+        case OpCode::EQUAL:
+            top -= LANES;
+            binary<Width>(top - LANES, top, [](float l, float r) { return l == r ? 1.0f : 0.0f; });
+            break;
+        case OpCode::NOT_EQUAL:
+            top -= LANES;
+            binary<Width>(top - LANES, top, [](float l, float r) { return l != r ? 1.0f : 0.0f; });
+            break;
+        case OpCode::SELECT:
+            top -= 2 * LANES;
+            select<Width>(top - LANES, top, top + LANES);
+            break;
+        case OpCode::SUM:
+            top -= (ins.index - 1) * LANES;
+            reduce<Width>(top - LANES, ins.index, [](float l, float r) { return l + r; });
+            break;
+        case OpCode::PRODUCT:
+            top -= (ins.index - 1) * LANES;
+            reduce<Width>(top - LANES, ins.index, [](float l, float r) { return l * r; });
+            break;
+        case OpCode::CALL: {
+            // The result replaces the first input row once every lane is read
+            const auto& call = calls[ins.index];
+            for (size_t k = 0; k < call.slots.size(); k++) {
+                load(call.slots[k], top + k * LANES);
+            }
+            call.eval(top, LANES, top, Width);
+            top += LANES;
+            break;
+        }
+        }
+    }
+
+    std::copy(stack, stack + Width, out);
+}
+
+float Program::eval(const float* values, float* stack) const {
+    float result;
+    run<1>([values](uint32_t index, float* dst) { dst[0] = values[index]; }, &result, stack);
+    return result;
+}
+
+float Program::eval(const float* values) const {
+    std::vector<float> stack(stackSize() * LANES);
+    return eval(values, stack.data());
+}
+
+float Program::eval(const VariableContext& ctx) const {
+    std::vector<float> values;
+    values.reserve(varNames.size());
+    for (const auto& name : varNames) {
+        auto it = ctx.find(name);
+        if (it == ctx.end()) {
+            throw std::runtime_error{"[Program::eval] Variable name not found in context"};
+        }
+        values.push_back(it->second);
+    }
+
+    return eval(values.data());
+}
+
+void Program::evalBatch(const float* const* inputs, float* out, size_t count, float* stack) const {
+    size_t offset = 0;
+    for (; offset + LANES <= count; offset += LANES) {
+        run<LANES>(
+            [inputs, offset](uint32_t index, float* dst) {
+                std::copy(inputs[index] + offset, inputs[index] + offset + LANES, dst);
+            },
+            out + offset,
+            stack
+        );
+    }
+
+    // Remaining points are padded with zeros up to a full row
+    size_t width = count - offset;
+    if (width > 0) {
+        float tail[LANES];
+        run<LANES>(
+            [inputs, offset, width](uint32_t index, float* dst) {
+                std::copy(inputs[index] + offset, inputs[index] + offset + width, dst);
+                std::fill(dst + width, dst + LANES, 0.0f);
+            },
+            tail,
+            stack
+        );
+        std::copy(tail, tail + width, out + offset);
+    }
+}
+
+void Program::evalBatch(const float* const* inputs, float* out, size_t count) const {
+    std::vector<float> stack(stackSize() * LANES);
+    evalBatch(inputs, out, count, stack.data());
+}
+
+size_t Program::stackSize() const {
+    return maxDepth;
+}
+
+const std::vector<std::string>& Program::variables() const {
+    return varNames;
+}
+
+const std::vector<Instruction>& Program::instructions() const {
+    return code;
+}
+
+const std::vector<Callback>& Program::callbacks() const {
+    return calls;
+}
+
+} // namespace mathex
@@ -0,0 +1,645 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+
+#include "range_operation.hpp"
+#include "constant.hpp"
+#include "nary_operation.hpp"
+
+namespace mathex {
+
+static constexpr size_t LANES = Program::LANES;
+
+// Indices evaluated by one batch call; several rows of lanes amortize the call
+static constexpr size_t BLOCK = 8 * LANES;
+
+static constexpr size_t NO_SLOT = SIZE_MAX;
+
+static bool isZero(const Expression* e) {
+    auto c = dynamic_cast<const Constant*>(e);
+    return c != nullptr && c->getValue() == 0.0f;
+}
+
+// --------------------------
+// --------------------------
+// RangeOperation
+
+RangeOperation::RangeOperation(const std::string& index, int lower, int upper, Expression* body)
+  : indexId{SymbolTable::global().intern(index)},
+    lower{lower},
+    upper{upper},
+    body{body} {
+    initialize();
+}
+
+RangeOperation::RangeOperation(const RangeOperation& o)
+  : indexId{o.indexId},
+    lower{o.lower},
+    upper{o.upper},
+    body{o.body->clone()},
+    program{o.program},
+    indexSlot{o.indexSlot} {
+    dependencies = o.dependencies;
+}
+
+RangeOperation& RangeOperation::operator=(const RangeOperation& o) {
+    // Self-assignment
+    if (this == &o) {
+        return *this;
+    }
+
+    // Free existing memory
+    std::vector<Expression*> pending;
+    releaseChildren(pending);
+    destroy(pending);
+
+    indexId = o.indexId;
+    lower = o.lower;
+    upper = o.upper;
+    body = o.body->clone();
+    program = o.program;
+    indexSlot = o.indexSlot;
+    dependencies = o.dependencies;
+    return *this;
+}
+
+RangeOperation::~RangeOperation() {
+    std::vector<Expression*> pending;
+    releaseChildren(pending);
+    destroy(pending);
+}
+
+void RangeOperation::initialize() {
+    // The index is bound here, so the node does not depend on it unless its bit is shared
+    dependencies = body->freeVariables();
+    if (indexId < MAX_BIT) {
+        dependencies &= ~variableBit(indexId);
+    }
+
+    program = Program(*body);
+    const auto& names = program.variables();
+    auto it = std::find(names.begin(), names.end(), getIndex());
+    indexSlot = it == names.end() ? NO_SLOT : static_cast<size_t>(it - names.begin());
+}
+
+template <typename Lookup>
+float RangeOperation::evaluate(Lookup value) const {
+    // One row of BLOCK values per input, the results, the program stack and the accumulators,
+    // in this thread's scratch: a body calls back into nested ranges while its block is
+    // evaluated, and those take the next level
+    const auto& names = program.variables();
+    size_t vars = names.size();
+    size_t rows = outputs();
+    size_t depth = 0;
+    for (size_t k = 0; k < rows; k++) {
+        depth = std::max(depth, output(k).stackSize());
+    }
+    ThreadScratch scratch;
+    float* buffer = scratch.floats((vars + rows) * BLOCK + depth * LANES + stateSize());
+    const float** inputs = scratch.pointers(vars);
+
+    // Every input but the index has the same value at each index
+    for (size_t v = 0; v < vars; v++) {
+        float* row = buffer + v * BLOCK;
+        inputs[v] = row;
+        if (v != indexSlot) {
+            std::fill(row, row + BLOCK, value(v));
+        }
+    }
+
+    float* out = buffer + vars * BLOCK;
+    float* stack = out + rows * BLOCK;
+    float* acc = stack + depth * LANES;
+    start(acc);
+    for (int64_t i = lower; i <= upper; i += BLOCK) {
+        size_t n = static_cast<size_t>(std::min<int64_t>(BLOCK, int64_t{upper} - i + 1));
+        if (indexSlot != NO_SLOT) {
+            float* row = buffer + indexSlot * BLOCK;
+            for (size_t l = 0; l < n; l++) {
+                row[l] = static_cast<float>(i + static_cast<int64_t>(l));
+            }
+        }
+        for (size_t k = 0; k < rows; k++) {
+            output(k).evalBatch(inputs, out + k * BLOCK, n, stack);
+        }
+        accumulate(acc, out, n);
+    }
+    return finish(acc);
+}
+
+float RangeOperation::apply(const float* args, const VariableContext& ctx) const {
+    (void)args;
+
+    const auto& names = program.variables();
+    return evaluate([&ctx, &names](size_t v) {
+        auto it = ctx.find(names[v]);
+        if (it == ctx.end()) {
+            throw std::runtime_error{"[RangeOperation::eval] Variable name not found in context"};
+        }
+        return it->second;
+    });
+}
+
+float RangeOperation::call(const float* inputs, size_t stride) const {
+    // The callback inputs are the body's inputs without the index
+    size_t skip = indexSlot;
+    return evaluate([inputs, stride, skip](size_t v) {
+        return inputs[(v > skip ? v - 1 : v) * stride];
+    });
+}
+
+void RangeOperation::emit(Program& out, size_t step) const {
+    (void)step;
+
+    if (count() == 0) {
+        out.emitConstant(identity());
+        return;
+    }
+
+    // Programs have no loops: the node runs as one callback over the inputs of its body but
+    // the index, which keeps the compiled body and its blocks of indices
+    std::vector<std::string> inputs;
+    for (const auto& name : program.variables()) {
+        if (name != getIndex()) {
+            inputs.push_back(name);
+        }
+    }
+    out.emitCall(*this, inputs);
+}
+
+Expression* RangeOperation::expand() const {
+    if (count() == 0) {
+        return new Constant(identity());
+    }
+
+    std::vector<Expression*> terms;
+    const std::string& name = getIndex();
+    for (int64_t i = lower; i <= upper; i++) {
+        terms.push_back(body->specialize({{name, static_cast<float>(i)}}));
+    }
+    if (combiner() == OpCode::ADD) {
+        return new Sum(terms);
+    }
+    return new Product(terms);
+}
+
+Expression* RangeOperation::specializeNode(Expression* const* children, const VariableContext& bound) const {
+    (void)children;
+
+    // The index shadows any bound variable of the same name
+    VariableContext inner = bound;
+    inner.erase(getIndex());
+
+    auto result = withBody(body->specialize(inner));
+    if (result->dependencies == 0) {
+        float value = result->eval({});
+        delete result;
+        return new Constant(value);
+    }
+    return result;
+}
+
+void RangeOperation::releaseChildren(std::vector<Expression*>& out) {
+    if (body != nullptr) {
+        out.push_back(body);
+        body = nullptr;
+    }
+}
+
+const std::string& RangeOperation::getIndex() const {
+    return SymbolTable::global().name(indexId);
+}
+
+int RangeOperation::getLower() const {
+    return lower;
+}
+
+int RangeOperation::getUpper() const {
+    return upper;
+}
+
+const Expression* RangeOperation::getBody() const {
+    return body;
+}
+
+size_t RangeOperation::count() const {
+    return upper < lower ? 0 : static_cast<size_t>(int64_t{upper} - lower + 1);
+}
+
+size_t RangeOperation::outputs() const {
+    return 1;
+}
+
+const Program& RangeOperation::output(size_t k) const {
+    (void)k;
+    return program;
+}
+
+size_t RangeOperation::stateSize() const {
+    return LANES;
+}
+
+// --------------------------
+// --------------------------
+// RangeSum
+
+void RangeSum::start(float* acc) const {
+    std::fill(acc, acc + LANES, 0.0f);
+}
+
+void RangeSum::accumulate(float* acc, const float* values, size_t n) const {
+    size_t i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        for (size_t l = 0; l < LANES; l++) {
+            acc[l] += values[i + l];
+        }
+    }
+    for (size_t l = 0; i < n; i++, l++) {
+        acc[l] += values[i];
+    }
+}
+
+float RangeSum::finish(const float* acc) const {
+    float r = 0.0f;
+    for (size_t l = 0; l < LANES; l++) {
+        r += acc[l];
+    }
+    return r;
+}
+
+Expression* RangeSum::withChildren(Expression* const* children) const {
+    (void)children;
+    return withBody(body->clone());
+}
+
+Expression* RangeSum::derivative(Expression* const* derivatives, SymbolId variable) const {
+    (void)derivatives;
+
+    // (Σ f)' = Σ f'; the bound index is not a variable of the sum
+    if (variable == indexId) {
+        return new Constant(0.0f);
+    }
+
+    auto d = body->differentiate(SymbolTable::global().name(variable));
+    if (isZero(d)) {
+        return d;
+    }
+    return withBody(d);
+}
+
+RangeOperation* RangeSum::withBody(Expression* newBody) const {
+    return new RangeSum(getIndex(), lower, upper, newBody);
+}
+
+OpCode RangeSum::combiner() const {
+    return OpCode::ADD;
+}
+
+float RangeSum::identity() const {
+    return 0.0f;
+}
+
+// --------------------------
+// --------------------------
+// RangeProduct
+
+void RangeProduct::start(float* acc) const {
+    std::fill(acc, acc + LANES, 1.0f);
+}
+
+void RangeProduct::accumulate(float* acc, const float* values, size_t n) const {
+    size_t i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        for (size_t l = 0; l < LANES; l++) {
+            acc[l] *= values[i + l];
+        }
+    }
+    for (size_t l = 0; i < n; i++, l++) {
+        acc[l] *= values[i];
+    }
+}
+
+float RangeProduct::finish(const float* acc) const {
+    float r = 1.0f;
+    for (size_t l = 0; l < LANES; l++) {
+        r *= acc[l];
+    }
+    return r;
+}
+
+Expression* RangeProduct::withChildren(Expression* const* children) const {
+    (void)children;
+    return withBody(body->clone());
+}
+
+Expression* RangeProduct::derivative(Expression* const* derivatives, SymbolId variable) const {
+    (void)derivatives;
+
+    if (variable == indexId || !body->dependsOn(variable)) {
+        return new Constant(0.0f);
+    }
+    return new RangeProductDerivative(getIndex(), lower, upper, body->clone(), {SymbolTable::global().name(variable)});
+}
+
+RangeOperation* RangeProduct::withBody(Expression* newBody) const {
+    return new RangeProduct(getIndex(), lower, upper, newBody);
+}
+
+OpCode RangeProduct::combiner() const {
+    return OpCode::MUL;
+}
+
+float RangeProduct::identity() const {
+    return 1.0f;
+}
+
+// --------------------------
+// --------------------------
+// RangeProductDerivative
+
+// Flat position of a multi-index, with radix orders[i] + 1 for variable i
+static size_t position(const std::vector<unsigned>& multi, const std::vector<unsigned>& orders) {
+    size_t at = 0;
+    for (size_t i = orders.size(); i-- > 0;) {
+        at = at * (orders[i] + 1) + multi[i];
+    }
+    return at;
+}
+
+static std::vector<unsigned> multiIndex(size_t at, const std::vector<unsigned>& orders) {
+    std::vector<unsigned> multi(orders.size());
+    for (size_t i = 0; i < orders.size(); i++) {
+        multi[i] = static_cast<unsigned>(at % (orders[i] + 1));
+        at /= orders[i] + 1;
+    }
+    return multi;
+}
+
+static size_t termCount(const std::vector<unsigned>& orders) {
+    size_t m = 1;
+    for (auto o : orders) {
+        m *= o + 1;
+    }
+    return m;
+}
+
+// Adds one differentiation in `variable` to the partials of a series, taking ownership of them;
+// the new partials are the derivatives of those of the highest order in that variable
+static void extend(std::vector<Expression*>& partials, std::vector<SymbolId>& variables, std::vector<unsigned>& orders, SymbolId variable) {
+    auto newVariables = variables;
+    auto newOrders = orders;
+    size_t p = std::find(variables.begin(), variables.end(), variable) - variables.begin();
+    if (p == variables.size()) {
+        newVariables.push_back(variable);
+        newOrders.push_back(0);
+    }
+    newOrders[p]++;
+    if (termCount(newOrders) > RangeProductDerivative::MAX_TERMS) {
+        throw std::runtime_error{"[RangeProductDerivative::derivative] Too many partial derivatives of the body"};
+    }
+
+    const std::string& name = SymbolTable::global().name(variable);
+    std::vector<Expression*> result(termCount(newOrders));
+    for (size_t at = 0; at < result.size(); at++) {
+        auto multi = multiIndex(at, newOrders);
+        bool added = multi[p] == newOrders[p];
+        if (added) {
+            multi[p]--;
+        }
+        multi.resize(orders.size());
+
+        Expression* old = partials[position(multi, orders)];
+        result[at] = added ? old->differentiate(name) : old;
+    }
+
+    partials = std::move(result);
+    variables = std::move(newVariables);
+    orders = std::move(newOrders);
+}
+
+RangeProductDerivative::RangeProductDerivative(const std::string& index, int lower, int upper, Expression* body, const std::vector<std::string>& names)
+  : RangeOperation{index, lower, upper, body},
+    partials{body} {
+    try {
+        for (const auto& name : names) {
+            SymbolId variable = SymbolTable::global().intern(name);
+            if (variable == indexId) {
+                throw std::runtime_error{"[RangeProductDerivative::RangeProductDerivative] The index is not a variable of the product"};
+            }
+            extend(partials, variables, orders, variable);
+        }
+        prepare();
+    } catch (...) {
+        // The base still owns the body
+        std::vector<Expression*> pending(partials.begin() + 1, partials.end());
+        destroy(pending);
+        throw;
+    }
+}
+
+RangeProductDerivative::RangeProductDerivative(const std::string& index, int lower, int upper, const std::vector<Expression*>& partials, const std::vector<SymbolId>& variables, const std::vector<unsigned>& orders)
+  : RangeOperation{index, lower, upper, partials[0]},
+    variables{variables},
+    orders{orders},
+    partials{partials} {
+    try {
+        prepare();
+    } catch (...) {
+        std::vector<Expression*> pending(this->partials.begin() + 1, this->partials.end());
+        destroy(pending);
+        throw;
+    }
+}
+
+RangeProductDerivative::RangeProductDerivative(const RangeProductDerivative& o)
+  : RangeOperation{o},
+    variables{o.variables},
+    orders{o.orders},
+    partials{body},
+    programs{o.programs},
+    scales{o.scales},
+    first{o.first},
+    terms{o.terms},
+    others{o.others} {
+    for (size_t t = 1; t < o.partials.size(); t++) {
+        partials.push_back(o.partials[t]->clone());
+    }
+}
+
+RangeProductDerivative::~RangeProductDerivative() {
+    std::vector<Expression*> pending;
+    releaseChildren(pending);
+    destroy(pending);
+}
+
+void RangeProductDerivative::prepare() {
+    // Every partial reads the inputs of the body; none has inputs the body lacks
+    const auto& names = program.variables();
+    programs.clear();
+    for (size_t t = 1; t < partials.size(); t++) {
+        programs.emplace_back(*partials[t], names);
+    }
+
+    // (a b)[t] = Σ a[s] b[t - s] over the multi-indices s <= t
+    size_t m = partials.size();
+    scales.assign(m, 1.0f);
+    first.assign(1, 0);
+    terms.clear();
+    others.clear();
+    for (size_t t = 0; t < m; t++) {
+        auto multi = multiIndex(t, orders);
+        for (auto a : multi) {
+            for (unsigned k = 2; k <= a; k++) {
+                scales[t] /= static_cast<float>(k);
+            }
+        }
+
+        for (size_t s = 0; s <= t; s++) {
+            auto lowerMulti = multiIndex(s, orders);
+            std::vector<unsigned> rest(orders.size());
+            bool below = true;
+            for (size_t i = 0; i < orders.size() && below; i++) {
+                below = lowerMulti[i] <= multi[i];
+                rest[i] = multi[i] - lowerMulti[i];
+            }
+            if (below) {
+                terms.push_back(static_cast<uint32_t>(s));
+                others.push_back(static_cast<uint32_t>(position(rest, orders)));
+            }
+        }
+        first.push_back(static_cast<uint32_t>(terms.size()));
+    }
+}
+
+Expression* RangeProductDerivative::withChildren(Expression* const* children) const {
+    (void)children;
+    return new RangeProductDerivative(*this);
+}
+
+Expression* RangeProductDerivative::derivative(Expression* const* derivatives, SymbolId variable) const {
+    (void)derivatives;
+
+    if (variable == indexId || !body->dependsOn(variable)) {
+        return new Constant(0.0f);
+    }
+
+    std::vector<Expression*> series;
+    for (auto partial : partials) {
+        series.push_back(partial->clone());
+    }
+    auto newVariables = variables;
+    auto newOrders = orders;
+    try {
+        extend(series, newVariables, newOrders, variable);
+    } catch (...) {
+        destroy(series);
+        throw;
+    }
+    return new RangeProductDerivative(getIndex(), lower, upper, series, newVariables, newOrders);
+}
+
+Expression* RangeProductDerivative::specializeNode(Expression* const* children, const VariableContext& bound) const {
+    (void)children;
+
+    // Differentiation and substitution do not commute, so every partial is specialized
+    VariableContext inner = bound;
+    inner.erase(getIndex());
+
+    std::vector<Expression*> series;
+    for (auto partial : partials) {
+        series.push_back(partial->specialize(inner));
+    }
+    auto result = new RangeProductDerivative(getIndex(), lower, upper, series, variables, orders);
+    if (result->dependencies == 0) {
+        float value = result->eval({});
+        delete result;
+        return new Constant(value);
+    }
+    return result;
+}
+
+void RangeProductDerivative::releaseChildren(std::vector<Expression*>& out) {
+    RangeOperation::releaseChildren(out);
+    for (size_t t = 1; t < partials.size(); t++) {
+        out.push_back(partials[t]);
+    }
+    partials.clear();
+}
+
+Expression* RangeProductDerivative::expand() const {
+    RangeProduct product{getIndex(), lower, upper, body->clone()};
+    Expression* result = product.expand();
+    for (size_t i = 0; i < variables.size(); i++) {
+        for (unsigned k = 0; k < orders[i]; k++) {
+            auto d = result->differentiate(SymbolTable::global().name(variables[i]));
+            delete result;
+            result = d;
+        }
+    }
+    return result;
+}
+
+const std::vector<Expression*>& RangeProductDerivative::getPartials() const {
+    return partials;
+}
+
+RangeOperation* RangeProductDerivative::withBody(Expression* newBody) const {
+    std::vector<std::string> names;
+    for (size_t i = 0; i < variables.size(); i++) {
+        names.insert(names.end(), orders[i], SymbolTable::global().name(variables[i]));
+    }
+    return new RangeProductDerivative(getIndex(), lower, upper, newBody, names);
+}
+
+OpCode RangeProductDerivative::combiner() const {
+    return OpCode::MUL;
+}
+
+float RangeProductDerivative::identity() const {
+    // Every derivative of the empty product, 1, vanishes
+    return 0.0f;
+}
+
+size_t RangeProductDerivative::outputs() const {
+    return partials.size();
+}
+
+const Program& RangeProductDerivative::output(size_t k) const {
+    return k == 0 ? program : programs[k - 1];
+}
+
+size_t RangeProductDerivative::stateSize() const {
+    // The series of the product so far, then the series of one factor
+    return 2 * partials.size();
+}
+
+void RangeProductDerivative::start(float* acc) const {
+    std::fill(acc, acc + partials.size(), 0.0f);
+    acc[0] = 1.0f;
+}
+
+void RangeProductDerivative::accumulate(float* acc, const float* values, size_t n) const {
+    size_t m = partials.size();
+    float* factor = acc + m;
+    for (size_t l = 0; l < n; l++) {
+        for (size_t t = 0; t < m; t++) {
+            factor[t] = values[t * BLOCK + l] * scales[t];
+        }
+
+        // Term t only reads terms s <= t of the product, so the update runs in place downwards
+        for (size_t t = m; t-- > 0;) {
+            float sum = 0.0f;
+            for (size_t j = first[t]; j < first[t + 1]; j++) {
+                sum += acc[terms[j]] * factor[others[j]];
+            }
+            acc[t] = sum;
+        }
+    }
+}
+
+float RangeProductDerivative::finish(const float* acc) const {
+    size_t last = partials.size() - 1;
+    return acc[last] / scales[last];
+}
+
+} // namespace mathex
@@ -0,0 +1,190 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+#include "root_finding.hpp"
+
+namespace mathex {
+
+static_assert(Program::LANES <= 32, "Lane masks are stored in 32 bits");
+
+RootSolver::RootSolver(
+    const Expression& f,
+    const std::string& varName,
+    const std::vector<std::string>& parameters,
+    const RootOptions& options
+) : options{options} {
+    // The unknown always takes input slot 0
+    std::vector<std::string> variables{varName};
+    variables.insert(variables.end(), parameters.begin(), parameters.end());
+
+    auto d = f.differentiate(varName);
+    this->f = Program(f, variables);
+    df = Program(*d, variables);
+    if (options.method == RootMethod::HALLEY) {
+        auto dd = d->differentiate(varName);
+        ddf = Program(*dd, variables);
+        delete dd;
+    }
+    delete d;
+
+    inputRows.resize(variables.size() * Program::LANES);
+    for (size_t i = 0; i < variables.size(); i++) {
+        inputs.push_back(inputRows.data() + i * Program::LANES);
+    }
+
+    size_t depth = std::max({this->f.stackSize(), df.stackSize(), ddf.stackSize()});
+    stack.resize(depth * Program::LANES);
+}
+
+void RootSolver::evalLanes(const Program& program, float* out) {
+    program.evalBatch(inputs.data(), out, Program::LANES, stack.data());
+}
+
+RootStatistics RootSolver::solve(
+    const float* targets,
+    float* roots,
+    size_t count,
+    const float* const* parameters
+) {
+    constexpr size_t LANES = Program::LANES;
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    const size_t parameterCount = inputs.size() - 1;
+    const bool halley = options.method == RootMethod::HALLEY;
+
+    RootStatistics stats;
+    float* x = inputRows.data();
+
+    for (size_t offset = 0; offset < count; offset += LANES) {
+        size_t width = std::min(LANES, count - offset);
+
+        float c[LANES];
+        float fx[LANES];
+        float dfx[LANES];
+        float ddfx[LANES];
+        float lo[LANES];
+        float hi[LANES];
+        float flo[LANES];
+        float fhi[LANES];
+        int iterations[LANES] = {};
+        uint32_t active = 0;
+        uint32_t bracket = 0;
+
+        // Load the batch; unused lanes of the last batch are zero and stay inactive
+        for (size_t l = 0; l < LANES; l++) {
+            bool used = l < width;
+            x[l] = used ? roots[offset + l] : 0.0f;
+            c[l] = used && targets ? targets[offset + l] : 0.0f;
+            lo[l] = options.lower;
+            hi[l] = options.upper;
+            for (size_t p = 0; p < parameterCount; p++) {
+                inputRows[(p + 1) * LANES + l] = used ? parameters[p][offset + l] : 0.0f;
+            }
+            if (used) {
+                active |= 1u << l;
+            }
+        }
+
+        // Lanes whose residual changes sign over [lower, upper] get a bisection fallback
+        if (options.bracketed) {
+            float guess[LANES];
+            std::copy(x, x + LANES, guess);
+
+            std::fill(x, x + LANES, options.lower);
+            evalLanes(f, flo);
+            std::fill(x, x + LANES, options.upper);
+            evalLanes(f, fhi);
+
+            for (size_t l = 0; l < LANES; l++) {
+                x[l] = guess[l];
+                flo[l] -= c[l];
+                fhi[l] -= c[l];
+                if ((active >> l & 1u) && flo[l] * fhi[l] <= 0.0f) {
+                    bracket |= 1u << l;
+                    if (!(x[l] >= std::min(lo[l], hi[l]) && x[l] <= std::max(lo[l], hi[l]))) {
+                        x[l] = 0.5f * (lo[l] + hi[l]);
+                    }
+                }
+            }
+        }
+
+        for (int iter = 0; active != 0 && iter < options.maxIterations; iter++) {
+            evalLanes(f, fx);
+            evalLanes(df, dfx);
+            if (halley) {
+                evalLanes(ddf, ddfx);
+            }
+
+            for (size_t l = 0; l < LANES; l++) {
+                uint32_t bit = 1u << l;
+                if (!(active & bit)) {
+                    continue;
+                }
+
+                float r = fx[l] - c[l];
+                if (std::abs(r) <= options.tolerance) {
+                    active &= ~bit;
+                    stats.converged++;
+                    continue;
+                }
+                iterations[l]++;
+
+                // Shrink the bracket around the sign change
+                if (bracket & bit) {
+                    if (fhi[l] != 0.0f && (r < 0.0f) == (fhi[l] < 0.0f)) {
+                        hi[l] = x[l];
+                        fhi[l] = r;
+                    } else {
+                        lo[l] = x[l];
+                        flo[l] = r;
+                    }
+                }
+
+                float step;
+                if (halley) {
+                    // Halley: x - 2rf' / (2f'^2 - rf'')
+                    step = 2.0f * r * dfx[l] / (2.0f * dfx[l] * dfx[l] - r * ddfx[l]);
+                } else {
+                    // Newton: x - r / f'
+                    step = r / dfx[l];
+                }
+                float next = x[l] - step;
+
+                bool inside = next > std::min(lo[l], hi[l]) && next < std::max(lo[l], hi[l]);
+                if (!std::isfinite(next) || ((bracket & bit) && !inside)) {
+                    if (!(bracket & bit)) {
+                        x[l] = nan;
+                        active &= ~bit;
+                        stats.failed++;
+                        continue;
+                    }
+                    next = 0.5f * (lo[l] + hi[l]);
+                    stats.bisections++;
+                }
+
+                bool small = std::abs(next - x[l]) <= options.tolerance * (1.0f + std::abs(next));
+                x[l] = next;
+                if (small) {
+                    active &= ~bit;
+                    stats.converged++;
+                }
+            }
+        }
+
+        // Lanes still active ran out of iterations
+        for (size_t l = 0; l < width; l++) {
+            if (active >> l & 1u) {
+                x[l] = nan;
+                stats.failed++;
+            }
+            roots[offset + l] = x[l];
+            stats.iterations += iterations[l];
+            stats.maxIterations = std::max(stats.maxIterations, iterations[l]);
+        }
+    }
+
+    return stats;
+}
+
+} // namespace mathex
@@ -0,0 +1,79 @@
+#include <stdexcept>
+#include <mutex>
+
+#include "symbol_table.hpp"
+
+namespace mathex {
+
+SymbolTable& SymbolTable::global() {
+    // Never destroyed, so expressions with static storage can outlive it safely
+    static SymbolTable* table = new SymbolTable();
+    return *table;
+}
+
+SymbolTable::SymbolTable() : count{0} {
+    for (auto& chunk : chunks) {
+        chunk.store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+SymbolTable::~SymbolTable() {
+    for (auto& chunk : chunks) {
+        delete[] chunk.load(std::memory_order_relaxed);
+    }
+}
+
+SymbolId SymbolTable::intern(const std::string& name) {
+    SymbolId id;
+    if (find(name, id)) {
+        return id;
+    }
+
+    std::unique_lock<std::shared_mutex> lock{mutex};
+
+    // Another thread may have interned it in the meantime
+    auto it = ids.find(name);
+    if (it != ids.end()) {
+        return it->second;
+    }
+
+    id = count.load(std::memory_order_relaxed);
+    if (id >= CAPACITY) {
+        throw std::runtime_error{"[SymbolTable::intern] Too many variable names"};
+    }
+
+    std::string* chunk = chunks[id >> CHUNK_BITS].load(std::memory_order_relaxed);
+    if (chunk == nullptr) {
+        chunk = new std::string[CHUNK_SIZE];
+        chunks[id >> CHUNK_BITS].store(chunk, std::memory_order_relaxed);
+    }
+    chunk[id & (CHUNK_SIZE - 1)] = name;
+    ids.emplace(name, id);
+
+    // Publishes the name and its chunk to lock-free readers
+    count.store(id + 1, std::memory_order_release);
+    return id;
+}
+
+bool SymbolTable::find(const std::string& name, SymbolId& id) const {
+    std::shared_lock<std::shared_mutex> lock{mutex};
+    auto it = ids.find(name);
+    if (it == ids.end()) {
+        return false;
+    }
+    id = it->second;
+    return true;
+}
+
+const std::string& SymbolTable::name(SymbolId id) const {
+    if (id >= count.load(std::memory_order_acquire)) {
+        throw std::runtime_error{"[SymbolTable::name] Unknown symbol"};
+    }
+    return chunks[id >> CHUNK_BITS].load(std::memory_order_relaxed)[id & (CHUNK_SIZE - 1)];
+}
+
+size_t SymbolTable::size() const {
+    return count.load(std::memory_order_acquire);
+}
+
+} // namespace mathex
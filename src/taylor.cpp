@@ -0,0 +1,423 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+
+#include "taylor.hpp"
+#include "range_operation.hpp"
+
+namespace mathex {
+
+// Every helper works on series of n coefficients; the result never aliases an operand
+
+// r = a * b, by Cauchy product
+static void multiply(const double* a, const double* b, double* r, size_t n) {
+    for (size_t k = 0; k < n; k++) {
+        double s = 0.0;
+        for (size_t j = 0; j <= k; j++) {
+            s += a[j] * b[k - j];
+        }
+        r[k] = s;
+    }
+}
+
+// r = a / b, solving b * r = a one coefficient at a time
+static void divide(const double* a, const double* b, double* r, size_t n) {
+    for (size_t k = 0; k < n; k++) {
+        double s = a[k];
+        for (size_t j = 1; j <= k; j++) {
+            s -= b[j] * r[k - j];
+        }
+        r[k] = s / b[0];
+    }
+}
+
+// r = 1 / a
+static void reciprocal(const double* a, double* r, size_t n) {
+    r[0] = 1.0 / a[0];
+    for (size_t k = 1; k < n; k++) {
+        double s = 0.0;
+        for (size_t j = 1; j <= k; j++) {
+            s += a[j] * r[k - j];
+        }
+        r[k] = -s / a[0];
+    }
+}
+
+// r = exp(a), from r' = a' r
+static void exponential(const double* a, double* r, size_t n) {
+    r[0] = std::exp(a[0]);
+    for (size_t k = 1; k < n; k++) {
+        double s = 0.0;
+        for (size_t j = 1; j <= k; j++) {
+            s += j * a[j] * r[k - j];
+        }
+        r[k] = s / k;
+    }
+}
+
+// r = ln(a), from a r' = a'
+static void logarithm(const double* a, double* r, size_t n) {
+    r[0] = std::log(a[0]);
+    for (size_t k = 1; k < n; k++) {
+        double s = 0.0;
+        for (size_t j = 1; j < k; j++) {
+            s += j * r[j] * a[k - j];
+        }
+        r[k] = (a[k] - s / k) / a[0];
+    }
+}
+
+// s = sin(a) and c = cos(a) together, from s' = a' c and c' = -a' s
+static void sineCosine(const double* a, double* s, double* c, size_t n) {
+    s[0] = std::sin(a[0]);
+    c[0] = std::cos(a[0]);
+    for (size_t k = 1; k < n; k++) {
+        double ss = 0.0;
+        double cs = 0.0;
+        for (size_t j = 1; j <= k; j++) {
+            ss += j * a[j] * c[k - j];
+            cs += j * a[j] * s[k - j];
+        }
+        s[k] = ss / k;
+        c[k] = -cs / k;
+    }
+}
+
+// r = sqrt(a), solving r * r = a one coefficient at a time
+static void squareRoot(const double* a, double* r, size_t n) {
+    r[0] = std::sqrt(a[0]);
+    for (size_t k = 1; k < n; k++) {
+        double s = a[k];
+        for (size_t j = 1; j < k; j++) {
+            s -= r[j] * r[k - j];
+        }
+        r[k] = s / (2.0 * r[0]);
+    }
+}
+
+// r = a^p by binary powering with Cauchy products, for series whose constant term is zero
+static void integerPower(const double* a, int p, double* r, double* base, double* t, size_t n) {
+    std::fill(r, r + n, 0.0);
+    r[0] = 1.0;
+    std::copy(a, a + n, base);
+
+    unsigned e = p < 0 ? -static_cast<unsigned>(p) : static_cast<unsigned>(p);
+    while (e != 0) {
+        if (e & 1u) {
+            multiply(r, base, t, n);
+            std::copy(t, t + n, r);
+        }
+        e >>= 1;
+        if (e != 0) {
+            multiply(base, base, t, n);
+            std::copy(t, t + n, base);
+        }
+    }
+
+    if (p < 0) {
+        std::copy(r, r + n, t);
+        reciprocal(t, r, n);
+    }
+}
+
+// r = a^p for a constant exponent, from the logarithmic derivative a r' = p a' r
+static void power(const double* a, double p, double* r, double* base, double* t, size_t n) {
+    if (a[0] == 0.0) {
+        // The recurrence divides by a[0]; integer powers are still polynomials in a
+        if (p == std::floor(p) && std::abs(p) <= 1 << 30) {
+            integerPower(a, static_cast<int>(p), r, base, t, n);
+        } else {
+            r[0] = std::pow(a[0], p);
+            std::fill(r + 1, r + n, NAN);
+        }
+        return;
+    }
+
+    r[0] = std::pow(a[0], p);
+    for (size_t k = 1; k < n; k++) {
+        double s = 0.0;
+        for (size_t j = 1; j <= k; j++) {
+            s += (p * j - static_cast<double>(k - j)) * a[j] * r[k - j];
+        }
+        r[k] = s / (k * a[0]);
+    }
+}
+
+// 1 when a comparison of two values holds, 0 otherwise
+static double compare(OpCode op, double l, double r) {
+    switch (op) {
+    case OpCode::LESS:
+        return l < r ? 1.0 : 0.0;
+    case OpCode::LESS_EQUAL:
+        return l <= r ? 1.0 : 0.0;
+    case OpCode::GREATER:
+        return l > r ? 1.0 : 0.0;
+    case OpCode::GREATER_EQUAL:
+        return l >= r ? 1.0 : 0.0;
+    case OpCode::EQUAL:
+        return l == r ? 1.0 : 0.0;
+    default:
+        return l != r ? 1.0 : 0.0;
+    }
+}
+
+// Whether a range node of the tree depends on the variable
+static bool hasRange(const Expression& expr, const std::string& variable) {
+    bool found = false;
+    postorder(expr, [&found, &variable](const Expression& node) {
+        found = found || (dynamic_cast<const RangeOperation*>(&node) && node.dependsOn(variable));
+    });
+    return found;
+}
+
+// Copy of a tree where every range node that depends on the variable is expanded into its
+// terms, which the series rules can see through; other ranges stay single callbacks. Each
+// pass expands the outermost ranges and the next one those nested in their terms, so no
+// traversal recurses whatever the nesting depth
+static Expression* expandRanges(const Expression& expr, const std::string& variable) {
+    Expression* current = expr.clone();
+    while (hasRange(*current, variable)) {
+        auto next = reduce<Expression*>(
+            *current,
+            [&variable](const Expression& node, Expression*& result) {
+                auto range = dynamic_cast<const RangeOperation*>(&node);
+                if (range == nullptr || !range->dependsOn(variable)) {
+                    return false;
+                }
+                result = range->expand();
+                return true;
+            },
+            [](const Expression& node, Expression* const* children) {
+                return node.withChildren(children);
+            }
+        );
+        delete current;
+        current = next;
+    }
+    return current;
+}
+
+static FlatExpression flatten(const Expression& expr, const std::string& variable, const std::vector<std::string>& variables) {
+    if (!hasRange(expr, variable)) {
+        return variables.empty() ? FlatExpression(expr) : FlatExpression(expr, variables);
+    }
+
+    auto expanded = expandRanges(expr, variable);
+    auto flat = variables.empty() ? FlatExpression(*expanded) : FlatExpression(*expanded, variables);
+    delete expanded;
+    return flat;
+}
+
+TaylorExpansion::TaylorExpansion(const Expression& expr, const std::string& variable, const std::vector<std::string>& variables)
+  : flat{flatten(expr, variable, variables)},
+    varName{variable},
+    slot{UINT32_MAX} {
+    const auto& names = flat.variables();
+    auto it = std::find(names.begin(), names.end(), variable);
+    if (it != names.end()) {
+        slot = static_cast<uint32_t>(it - names.begin());
+    }
+
+    // Callback nodes are opaque: only their value is known, so they must not vary along the series
+    for (const auto& call : flat.callbacks()) {
+        if (std::find(call.slots.begin(), call.slots.end(), slot) != call.slots.end()) {
+            throw std::runtime_error{"[TaylorExpansion::TaylorExpansion] Vector reductions over the expansion variable have no series rule"};
+        }
+    }
+}
+
+size_t TaylorExpansion::scratchSize(size_t order) const {
+    // One series per node, plus two for intermediate series of composite rules
+    return (flat.size() + 2) * (order + 1);
+}
+
+void TaylorExpansion::coefficients(const float* values, size_t order, double* out, double* scratch) const {
+    const auto& list = flat.nodes();
+    size_t n = order + 1;
+    double* t0 = scratch + list.size() * n;
+    double* t1 = t0 + n;
+
+    for (size_t i = 0; i < list.size(); i++) {
+        const auto& node = list[i];
+        double* r = scratch + i * n;
+        const double* a = scratch + node.operands[0] * n;
+        const double* b = scratch + node.operands[1] * n;
+        const double* c = scratch + node.operands[2] * n;
+
+        switch (node.tag) {
+        case OpCode::CONSTANT:
+            std::fill(r, r + n, 0.0);
+            r[0] = node.value;
+            break;
+        case OpCode::VARIABLE:
+            std::fill(r, r + n, 0.0);
+            r[0] = values[node.operands[0]];
+            if (node.operands[0] == slot && n > 1) {
+                r[1] = 1.0;
+            }
+            break;
+        case OpCode::ADD:
+            for (size_t k = 0; k < n; k++) r[k] = a[k] + b[k];
+            break;
+        case OpCode::SUB:
+            for (size_t k = 0; k < n; k++) r[k] = a[k] - b[k];
+            break;
+        case OpCode::MUL:
+            multiply(a, b, r, n);
+            break;
+        case OpCode::DIV:
+            divide(a, b, r, n);
+            break;
+        case OpCode::POW:
+            if (list[node.operands[1]].tag == OpCode::CONSTANT) {
+                power(a, list[node.operands[1]].value, r, t0, t1, n);
+            } else {
+                // a^b = exp(b ln a)
+                logarithm(a, t0, n);
+                multiply(b, t0, t1, n);
+                exponential(t1, r, n);
+            }
+            break;
+        case OpCode::POWI:
+            power(a, node.value, r, t0, t1, n);
+            break;
+        case OpCode::FMA:
+            multiply(a, b, r, n);
+            for (size_t k = 0; k < n; k++) r[k] += c[k];
+            break;
+        case OpCode::NEG:
+            for (size_t k = 0; k < n; k++) r[k] = -a[k];
+            break;
+        case OpCode::SIN:
+            sineCosine(a, r, t0, n);
+            break;
+        case OpCode::COS:
+            sineCosine(a, t0, r, n);
+            break;
+        case OpCode::TAN:
+            sineCosine(a, t0, t1, n);
+            divide(t0, t1, r, n);
+            break;
+        case OpCode::CSC:
+            sineCosine(a, t0, t1, n);
+            reciprocal(t0, r, n);
+            break;
+        case OpCode::SEC:
+            sineCosine(a, t0, t1, n);
+            reciprocal(t1, r, n);
+            break;
+        case OpCode::COT:
+            sineCosine(a, t0, t1, n);
+            divide(t1, t0, r, n);
+            break;
+        case OpCode::LN:
+            logarithm(a, r, n);
+            break;
+        case OpCode::LOG10:
+            logarithm(a, r, n);
+            for (size_t k = 0; k < n; k++) r[k] /= M_LN10;
+            break;
+        case OpCode::EXP:
+            exponential(a, r, n);
+            break;
+        case OpCode::SQRT:
+            squareRoot(a, r, n);
+            break;
+        case OpCode::RSQRT:
+            power(a, -0.5, r, t0, t1, n);
+            break;
+        case OpCode::RECIPROCAL:
+            reciprocal(a, r, n);
+            break;
+        case OpCode::ABS: {
+            // |a| follows the sign of a around the point; at a zero the right-hand expansion is used
+            double sign = std::signbit(a[0]) ? -1.0 : 1.0;
+            for (size_t k = 0; k < n; k++) r[k] = sign * a[k];
+            break;
+        }
+        case OpCode::MIN: {
+            // The piece chosen at the point, the left one on ties
+            const double* chosen = a[0] <= b[0] ? a : b;
+            std::copy(chosen, chosen + n, r);
+            break;
+        }
+        case OpCode::MAX: {
+            const double* chosen = a[0] >= b[0] ? a : b;
+            std::copy(chosen, chosen + n, r);
+            break;
+        }
+        case OpCode::LESS:
+        case OpCode::LESS_EQUAL:
+        case OpCode::GREATER:
+        case OpCode::GREATER_EQUAL:
+        case OpCode::EQUAL:
+        case OpCode::NOT_EQUAL:
+            // Piecewise constant around the point
+            std::fill(r, r + n, 0.0);
+            r[0] = compare(node.tag, a[0], b[0]);
+            break;
+        case OpCode::SELECT: {
+            const double* chosen = a[0] != 0.0 ? b : c;
+            std::copy(chosen, chosen + n, r);
+            break;
+        }
+        case OpCode::SUM:
+        case OpCode::PRODUCT:
+            throw std::runtime_error{"[TaylorExpansion::coefficients] Reductions must be stored as binary nodes"};
+        case OpCode::CALL: {
+            // Constant along the expansion variable, as checked on construction
+            const auto& call = flat.callbacks()[node.operands[0]];
+            ThreadScratch row;
+            float* inputs = row.floats(call.slots.size());
+            for (size_t k = 0; k < call.slots.size(); k++) {
+                inputs[k] = values[call.slots[k]];
+            }
+            float value;
+            call.eval(inputs, 1, &value, 1);
+            std::fill(r, r + n, 0.0);
+            r[0] = value;
+            break;
+        }
+        }
+    }
+
+    const double* root = scratch + flat.roots()[0] * n;
+    std::copy(root, root + n, out);
+}
+
+std::vector<double> TaylorExpansion::coefficients(const VariableContext& ctx, size_t order) const {
+    std::vector<float> values;
+    values.reserve(flat.variables().size());
+    for (const auto& name : flat.variables()) {
+        auto it = ctx.find(name);
+        if (it == ctx.end()) {
+            throw std::runtime_error{"[TaylorExpansion::coefficients] Variable name not found in context"};
+        }
+        values.push_back(it->second);
+    }
+
+    std::vector<double> scratch(scratchSize(order));
+    std::vector<double> out(order + 1);
+    coefficients(values.data(), order, out.data(), scratch.data());
+    return out;
+}
+
+std::vector<double> TaylorExpansion::derivatives(const VariableContext& ctx, size_t order) const {
+    auto out = coefficients(ctx, order);
+    double factorial = 1.0;
+    for (size_t j = 1; j < out.size(); j++) {
+        factorial *= j;
+        out[j] *= factorial;
+    }
+    return out;
+}
+
+const std::string& TaylorExpansion::variable() const {
+    return varName;
+}
+
+const std::vector<std::string>& TaylorExpansion::variables() const {
+    return flat.variables();
+}
+
+} // namespace mathex
@@ -8,10 +8,14 @@
 
 namespace mathex {
 
-UnaryOperation::UnaryOperation(Expression* operand) : operand{operand} {}
+UnaryOperation::UnaryOperation(Expression* operand) : operand{operand} {
+    gatherDependencies();
+}
 
 UnaryOperation::UnaryOperation(const UnaryOperation& o)
-  : operand{o.operand ? o.operand->clone() : nullptr} {}
+  : operand{o.operand ? o.operand->clone() : nullptr} {
+    gatherDependencies();
+}
 
 UnaryOperation& UnaryOperation::operator=(const UnaryOperation& o) {
     // Self-assignment
@@ -23,11 +27,61 @@ UnaryOperation& UnaryOperation::operator=(const UnaryOperation& o) {
     delete operand;
 
     operand = o.operand ? o.operand->clone() : nullptr;
+    gatherDependencies();
     return *this;
 }
 
 UnaryOperation::~UnaryOperation() {
-    delete operand;
+    // The operand is deleted one node at a time so that deep trees do not overflow the stack
+    std::vector<Expression*> pending;
+    releaseChildren(pending);
+    destroy(pending);
+}
+
+size_t UnaryOperation::childCount() const {
+    return 1;
+}
+
+const Expression* UnaryOperation::child(size_t index) const {
+    (void)index;
+    return operand;
+}
+
+float UnaryOperation::apply(const float* args, const VariableContext& ctx) const {
+    (void)ctx;
+    return compute(args[0]);
+}
+
+Expression* UnaryOperation::withChildren(Expression* const* children) const {
+    return withOperand(children[0]);
+}
+
+Expression* UnaryOperation::derivative(Expression* const* derivatives, SymbolId variable) const {
+    (void)variable;
+
+    // Every chain rule is a multiple of the operand's derivative
+    auto c = dynamic_cast<Constant*>(derivatives[0]);
+    if (c != nullptr && c->getValue() == 0.0f) {
+        return c;
+    }
+    return chainRule(derivatives[0]);
+}
+
+void UnaryOperation::emit(Program& program, size_t step) const {
+    if (step == 1) {
+        emitOperation(program);
+    }
+}
+
+void UnaryOperation::releaseChildren(std::vector<Expression*>& out) {
+    if (operand) {
+        out.push_back(operand);
+        operand = nullptr;
+    }
+}
+
+const Expression* UnaryOperation::getOperand() const {
+    return operand;
 }
 
 // --------------------------
@@ -5,14 +5,19 @@
 #include "unary_operation.hpp"
 #include "binary_operation.hpp"
 #include "functions.hpp"
+#include "program.hpp"
 
 namespace mathex {
 
-Variable::Variable(const std::string& name) : name{name} {}
+Variable::Variable(const std::string& name) : Variable(SymbolTable::global().intern(name)) {}
+
+Variable::Variable(SymbolId id) : id{id} {
+    dependencies = variableBit(id);
+}
 
 float Variable::eval(const VariableContext& ctx) const {
     // TODO: Get from param
-    auto it = ctx.find(name);
+    auto it = ctx.find(getName());
     if (it == ctx.end()) {
         throw std::runtime_error{"[Variable::eval] Variable name not found in context"};
     }
@@ -26,13 +31,53 @@ Expression* Variable::clone() const {
 
 Expression* Variable::differentiate(const std::string& varName) const {
     // If this is the variable being differentiated with respect to, derivative is 1; else 0
-    if (varName == name) {
+    SymbolId variable;
+    if (SymbolTable::global().find(varName, variable) && variable == id) {
         return new Constant(1.0f);
     } else {
         return new Constant(0.0f);
     }
 }
 
+float Variable::apply(const float* args, const VariableContext& ctx) const {
+    (void)args;
+    return eval(ctx);
+}
+
+Expression* Variable::withChildren(Expression* const* children) const {
+    (void)children;
+    return new Variable(*this);
+}
+
+Expression* Variable::derivative(Expression* const* derivatives, SymbolId variable) const {
+    (void)derivatives;
+    return new Constant(variable == id ? 1.0f : 0.0f);
+}
+
+void Variable::emit(Program& program, size_t step) const {
+    (void)step;
+    program.emitVariable(getName());
+}
+
+Expression* Variable::specializeNode(Expression* const* children, const VariableContext& bound) const {
+    (void)children;
+
+    auto it = bound.find(getName());
+    if (it == bound.end()) {
+        return new Variable(*this);
+    }
+
+    return new Constant(it->second);
+}
+
+const std::string& Variable::getName() const {
+    return SymbolTable::global().name(id);
+}
+
+SymbolId Variable::getId() const {
+    return id;
+}
+
 // --------------------------
 // --------------------------
 // Variable and Constant
@@ -0,0 +1,723 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "vector_expression.hpp"
+#include "constant.hpp"
+#include "variable.hpp"
+#include "program.hpp"
+
+namespace mathex {
+
+// Width of the partial reductions; independent accumulators let the compiler vectorize the loops
+static constexpr size_t LANES = Program::LANES;
+
+static uint64_t variableBit(SymbolId variable) {
+    return uint64_t{1} << std::min<SymbolId>(variable, 63);
+}
+
+static VectorExpression* filled(float value, size_t size) {
+    return new VectorBroadcast(new Constant(value), size);
+}
+
+// Element-wise combinations that skip zeros and ones; take ownership of their operands
+
+static VectorExpression* add(VectorExpression* a, VectorExpression* b) {
+    if (a->isConstant(0.0f)) {
+        delete a;
+        return b;
+    }
+    if (b->isConstant(0.0f)) {
+        delete b;
+        return a;
+    }
+    return new VectorBinary(BinaryOperator::ADD, a, b);
+}
+
+static VectorExpression* sub(VectorExpression* a, VectorExpression* b) {
+    if (b->isConstant(0.0f)) {
+        delete b;
+        return a;
+    }
+    return new VectorBinary(BinaryOperator::SUB, a, b);
+}
+
+static VectorExpression* mul(VectorExpression* a, VectorExpression* b) {
+    if (a->isConstant(0.0f) || b->isConstant(0.0f)) {
+        size_t size = a->size();
+        delete a;
+        delete b;
+        return filled(0.0f, size);
+    }
+    if (a->isConstant(1.0f)) {
+        delete a;
+        return b;
+    }
+    if (b->isConstant(1.0f)) {
+        delete b;
+        return a;
+    }
+    return new VectorBinary(BinaryOperator::MUL, a, b);
+}
+
+static VectorExpression* div(VectorExpression* a, VectorExpression* b) {
+    if (a->isConstant(0.0f)) {
+        delete b;
+        return a;
+    }
+    return new VectorBinary(BinaryOperator::DIV, a, b);
+}
+
+static bool isZero(const Expression* e) {
+    auto c = dynamic_cast<const Constant*>(e);
+    return c != nullptr && c->getValue() == 0.0f;
+}
+
+// Elements of a vector expression: its own storage when it has one, else evaluated into
+// `buffer`, which holds size() floats
+static const float* elements(const VectorExpression& v, const VariableContext& ctx, float* buffer) {
+    if (auto data = v.view()) {
+        return data;
+    }
+    v.eval(ctx, buffer);
+    return buffer;
+}
+
+// --------------------------
+// --------------------------
+// VectorExpression
+
+VectorExpression::VectorExpression(size_t size) : length{size} {}
+
+size_t VectorExpression::size() const {
+    return length;
+}
+
+const float* VectorExpression::view() const {
+    return nullptr;
+}
+
+bool VectorExpression::isConstant(float value) const {
+    (void)value;
+    return false;
+}
+
+void VectorExpression::scalarInputs(std::vector<std::string>& out) const {
+    (void)out;
+}
+
+uint64_t VectorExpression::freeVariables() const {
+    return dependencies;
+}
+
+bool VectorExpression::dependsOn(SymbolId variable) const {
+    return (dependencies & variableBit(variable)) != 0;
+}
+
+// --------------------------
+// --------------------------
+// VectorVariable
+
+VectorVariable::VectorVariable(const std::string& name, size_t size, const float* data)
+  : VectorExpression{size},
+    id{SymbolTable::global().intern(name)},
+    data{data} {
+    dependencies = variableBit(id);
+}
+
+void VectorVariable::eval(const VariableContext& ctx, float* out) const {
+    (void)ctx;
+
+    if (data == nullptr) {
+        throw std::runtime_error{"[VectorVariable::eval] Variable is not bound to an array"};
+    }
+    std::copy(data, data + length, out);
+}
+
+const float* VectorVariable::view() const {
+    if (data == nullptr) {
+        throw std::runtime_error{"[VectorVariable::view] Variable is not bound to an array"};
+    }
+    return data;
+}
+
+VectorExpression* VectorVariable::clone() const {
+    return new VectorVariable(*this);
+}
+
+VectorExpression* VectorVariable::derivative(SymbolId variable) const {
+    return filled(variable == id ? 1.0f : 0.0f, length);
+}
+
+bool VectorVariable::containsVector(SymbolId variable) const {
+    return variable == id;
+}
+
+void VectorVariable::bind(const float* data) {
+    this->data = data;
+}
+
+const std::string& VectorVariable::getName() const {
+    return SymbolTable::global().name(id);
+}
+
+SymbolId VectorVariable::getId() const {
+    return id;
+}
+
+// --------------------------
+// --------------------------
+// VectorBroadcast
+
+VectorBroadcast::VectorBroadcast(Expression* scalar, size_t size)
+  : VectorExpression{size},
+    scalar{scalar} {
+    dependencies = scalar->freeVariables();
+}
+
+VectorBroadcast::VectorBroadcast(const VectorBroadcast& o)
+  : VectorExpression{o},
+    scalar{o.scalar->clone()} {}
+
+VectorBroadcast::~VectorBroadcast() {
+    delete scalar;
+}
+
+void VectorBroadcast::eval(const VariableContext& ctx, float* out) const {
+    std::fill(out, out + length, scalar->eval(ctx));
+}
+
+VectorExpression* VectorBroadcast::clone() const {
+    return new VectorBroadcast(*this);
+}
+
+VectorExpression* VectorBroadcast::derivative(SymbolId variable) const {
+    if (!dependsOn(variable)) {
+        return filled(0.0f, length);
+    }
+    return new VectorBroadcast(scalar->differentiate(SymbolTable::global().name(variable)), length);
+}
+
+bool VectorBroadcast::containsVector(SymbolId variable) const {
+    (void)variable;
+    return false;
+}
+
+bool VectorBroadcast::isConstant(float value) const {
+    auto c = dynamic_cast<const Constant*>(scalar);
+    return c != nullptr && c->getValue() == value;
+}
+
+void VectorBroadcast::scalarInputs(std::vector<std::string>& out) const {
+    Program program(*scalar);
+    for (const auto& name : program.variables()) {
+        if (std::find(out.begin(), out.end(), name) == out.end()) {
+            out.push_back(name);
+        }
+    }
+}
+
+const Expression* VectorBroadcast::getScalar() const {
+    return scalar;
+}
+
+// --------------------------
+// --------------------------
+// VectorBinary
+
+VectorBinary::VectorBinary(BinaryOperator op, VectorExpression* left, VectorExpression* right)
+  : VectorExpression{left->size()},
+    op{op},
+    left{left},
+    right{right} {
+    if (left->size() != right->size() || op == BinaryOperator::POW) {
+        delete left;
+        delete right;
+        throw std::runtime_error{op == BinaryOperator::POW
+            ? "[VectorBinary::VectorBinary] Element-wise powers are not supported"
+            : "[VectorBinary::VectorBinary] Operands have different sizes"};
+    }
+    dependencies = left->freeVariables() | right->freeVariables();
+}
+
+VectorBinary::VectorBinary(const VectorBinary& o)
+  : VectorExpression{o},
+    op{o.op},
+    left{o.left->clone()},
+    right{o.right->clone()} {}
+
+VectorBinary::~VectorBinary() {
+    delete left;
+    delete right;
+}
+
+void VectorBinary::eval(const VariableContext& ctx, float* out) const {
+    // The left operand is computed in place; only the right one may need a buffer
+    const float* l = left->view();
+    if (l == nullptr) {
+        left->eval(ctx, out);
+        l = out;
+    }
+    ThreadScratch scratch;
+    const float* r = elements(*right, ctx, scratch.floats(length));
+
+    size_t n = length;
+    switch (op) {
+    case BinaryOperator::ADD:
+        for (size_t i = 0; i < n; i++) out[i] = l[i] + r[i];
+        break;
+    case BinaryOperator::SUB:
+        for (size_t i = 0; i < n; i++) out[i] = l[i] - r[i];
+        break;
+    case BinaryOperator::MUL:
+        for (size_t i = 0; i < n; i++) out[i] = l[i] * r[i];
+        break;
+    case BinaryOperator::DIV:
+        for (size_t i = 0; i < n; i++) out[i] = l[i] / r[i];
+        break;
+    case BinaryOperator::POW:
+        break;
+    }
+}
+
+VectorExpression* VectorBinary::clone() const {
+    return new VectorBinary(*this);
+}
+
+VectorExpression* VectorBinary::derivative(SymbolId variable) const {
+    if (!dependsOn(variable)) {
+        return filled(0.0f, length);
+    }
+
+    auto dl = left->derivative(variable);
+    auto dr = right->derivative(variable);
+    switch (op) {
+    case BinaryOperator::ADD:
+        return add(dl, dr);
+    case BinaryOperator::SUB:
+        return sub(dl, dr);
+    case BinaryOperator::MUL:
+        // (l r)' = l' r + l r'
+        return add(mul(dl, right->clone()), mul(left->clone(), dr));
+    case BinaryOperator::DIV:
+        // (l / r)' = (l' r - l r') / r²
+        return div(
+            sub(mul(dl, right->clone()), mul(left->clone(), dr)),
+            new VectorBinary(BinaryOperator::MUL, right->clone(), right->clone())
+        );
+    case BinaryOperator::POW:
+        break;
+    }
+
+    throw std::runtime_error{"[VectorBinary::derivative] Unknown operator"};
+}
+
+bool VectorBinary::containsVector(SymbolId variable) const {
+    return left->containsVector(variable) || right->containsVector(variable);
+}
+
+void VectorBinary::scalarInputs(std::vector<std::string>& out) const {
+    left->scalarInputs(out);
+    right->scalarInputs(out);
+}
+
+BinaryOperator VectorBinary::getOperator() const {
+    return op;
+}
+
+const VectorExpression* VectorBinary::getLeft() const {
+    return left;
+}
+
+const VectorExpression* VectorBinary::getRight() const {
+    return right;
+}
+
+// --------------------------
+// --------------------------
+// VectorMaxMask
+
+VectorMaxMask::VectorMaxMask(VectorExpression* operand)
+  : VectorExpression{operand->size()},
+    operand{operand} {
+    dependencies = operand->freeVariables();
+}
+
+VectorMaxMask::VectorMaxMask(const VectorMaxMask& o)
+  : VectorExpression{o},
+    operand{o.operand->clone()} {}
+
+VectorMaxMask::~VectorMaxMask() {
+    delete operand;
+}
+
+void VectorMaxMask::eval(const VariableContext& ctx, float* out) const {
+    ThreadScratch scratch;
+    const float* a = elements(*operand, ctx, scratch.floats(length));
+    size_t at = std::max_element(a, a + length) - a;
+    std::fill(out, out + length, 0.0f);
+    if (at < length) {
+        out[at] = 1.0f;
+    }
+}
+
+VectorExpression* VectorMaxMask::clone() const {
+    return new VectorMaxMask(*this);
+}
+
+VectorExpression* VectorMaxMask::derivative(SymbolId variable) const {
+    (void)variable;
+    return filled(0.0f, length);
+}
+
+bool VectorMaxMask::containsVector(SymbolId variable) const {
+    return operand->containsVector(variable);
+}
+
+void VectorMaxMask::scalarInputs(std::vector<std::string>& out) const {
+    operand->scalarInputs(out);
+}
+
+// --------------------------
+// --------------------------
+// Reduction
+
+Reduction::Reduction(const std::vector<VectorExpression*>& operands) : operands{operands} {
+    for (auto operand : operands) {
+        if (operand->size() != operands[0]->size()) {
+            for (auto o : operands) {
+                delete o;
+            }
+            throw std::runtime_error{"[Reduction::Reduction] Operands have different sizes"};
+        }
+        dependencies |= operand->freeVariables();
+    }
+    for (auto operand : operands) {
+        operand->scalarInputs(names);
+    }
+}
+
+Reduction::Reduction(const Reduction& o) : Expression{o}, names{o.names} {
+    for (auto operand : o.operands) {
+        operands.push_back(operand->clone());
+    }
+}
+
+Reduction::~Reduction() {
+    for (auto operand : operands) {
+        delete operand;
+    }
+}
+
+float Reduction::apply(const float* args, const VariableContext& ctx) const {
+    (void)args;
+
+    // Variables are read in place; other operands are computed in the thread's scratch
+    size_t n = operands[0]->size();
+    ThreadScratch scratch;
+    float* buffer = scratch.floats(operands.size() * n);
+    const float* data[2];
+    for (size_t i = 0; i < operands.size(); i++) {
+        data[i] = elements(*operands[i], ctx, buffer + i * n);
+    }
+    return reduce(data, n);
+}
+
+float Reduction::call(const float* inputs, size_t stride) const {
+    // Broadcasts read their scalars by name; the context of the scratch level keeps the
+    // names between calls, so only the values are written
+    if (names.empty()) {
+        static const VariableContext none;
+        return apply(nullptr, none);
+    }
+
+    ThreadScratch scratch;
+    auto& ctx = scratch.context();
+    for (size_t k = 0; k < names.size(); k++) {
+        ctx[names[k]] = inputs[k * stride];
+    }
+    return apply(nullptr, ctx);
+}
+
+void Reduction::emit(Program& program, size_t step) const {
+    (void)step;
+
+    // The loop runs in a callback; the program only loads the scalars the broadcasts read
+    program.emitCall(*this, names);
+}
+
+const std::vector<VectorExpression*>& Reduction::getOperands() const {
+    return operands;
+}
+
+void Reduction::checkScalar(SymbolId variable) const {
+    for (auto operand : operands) {
+        if (operand->containsVector(variable)) {
+            throw std::runtime_error{"[Reduction::derivative] Use gradient() to differentiate with respect to a vector variable"};
+        }
+    }
+}
+
+// --------------------------
+// --------------------------
+// Dot
+
+Dot::Dot(VectorExpression* a, VectorExpression* b) : Reduction{{a, b}} {}
+
+Expression* Dot::withChildren(Expression* const* children) const {
+    (void)children;
+    return new Dot(*this);
+}
+
+Expression* Dot::derivative(Expression* const* derivatives, SymbolId variable) const {
+    (void)derivatives;
+    checkScalar(variable);
+
+    // (a · b)' = a' · b + a · b'
+    auto a = operands[0];
+    auto b = operands[1];
+    std::vector<Expression*> terms;
+    if (a->dependsOn(variable)) {
+        terms.push_back(new Dot(a->derivative(variable), b->clone()));
+    }
+    if (b->dependsOn(variable)) {
+        terms.push_back(new Dot(a->clone(), b->derivative(variable)));
+    }
+
+    if (terms.empty()) {
+        return new Constant(0.0f);
+    }
+    if (terms.size() == 1) {
+        return terms[0];
+    }
+    return new BinaryOperation(BinaryOperator::ADD, terms[0], terms[1]);
+}
+
+VectorExpression* Dot::gradient(SymbolId variable) const {
+    auto a = operands[0];
+    auto b = operands[1];
+    return add(mul(a->derivative(variable), b->clone()), mul(a->clone(), b->derivative(variable)));
+}
+
+float Dot::reduce(const float* const* elements, size_t n) const {
+    const float* a = elements[0];
+    const float* b = elements[1];
+
+    float acc[LANES] = {};
+    size_t i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        for (size_t l = 0; l < LANES; l++) {
+            acc[l] += a[i + l] * b[i + l];
+        }
+    }
+    for (size_t l = 0; i < n; i++, l++) {
+        acc[l] += a[i] * b[i];
+    }
+
+    float r = 0.0f;
+    for (size_t l = 0; l < LANES; l++) {
+        r += acc[l];
+    }
+    return r;
+}
+
+// --------------------------
+// --------------------------
+// Norm2
+
+Norm2::Norm2(VectorExpression* a) : Reduction{{a}} {}
+
+Expression* Norm2::withChildren(Expression* const* children) const {
+    (void)children;
+    return new Norm2(*this);
+}
+
+Expression* Norm2::derivative(Expression* const* derivatives, SymbolId variable) const {
+    (void)derivatives;
+    checkScalar(variable);
+
+    // |a|' = (a · a') / |a|
+    auto a = operands[0];
+    auto dot = new Dot(a->clone(), a->derivative(variable));
+    return new BinaryOperation(BinaryOperator::DIV, dot, new Norm2(*this));
+}
+
+VectorExpression* Norm2::gradient(SymbolId variable) const {
+    auto a = operands[0];
+    return div(mul(a->clone(), a->derivative(variable)), new VectorBroadcast(new Norm2(*this), a->size()));
+}
+
+float Norm2::reduce(const float* const* elements, size_t n) const {
+    const float* a = elements[0];
+
+    float acc[LANES] = {};
+    size_t i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        for (size_t l = 0; l < LANES; l++) {
+            acc[l] += a[i + l] * a[i + l];
+        }
+    }
+    for (size_t l = 0; i < n; i++, l++) {
+        acc[l] += a[i] * a[i];
+    }
+
+    float r = 0.0f;
+    for (size_t l = 0; l < LANES; l++) {
+        r += acc[l];
+    }
+    return std::sqrt(r);
+}
+
+// --------------------------
+// --------------------------
+// VectorSum
+
+VectorSum::VectorSum(VectorExpression* a) : Reduction{{a}} {}
+
+Expression* VectorSum::withChildren(Expression* const* children) const {
+    (void)children;
+    return new VectorSum(*this);
+}
+
+Expression* VectorSum::derivative(Expression* const* derivatives, SymbolId variable) const {
+    (void)derivatives;
+    checkScalar(variable);
+
+    auto d = operands[0]->derivative(variable);
+    if (d->isConstant(0.0f)) {
+        delete d;
+        return new Constant(0.0f);
+    }
+    return new VectorSum(d);
+}
+
+VectorExpression* VectorSum::gradient(SymbolId variable) const {
+    return operands[0]->derivative(variable);
+}
+
+float VectorSum::reduce(const float* const* elements, size_t n) const {
+    const float* a = elements[0];
+
+    float acc[LANES] = {};
+    size_t i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        for (size_t l = 0; l < LANES; l++) {
+            acc[l] += a[i + l];
+        }
+    }
+    for (size_t l = 0; i < n; i++, l++) {
+        acc[l] += a[i];
+    }
+
+    float r = 0.0f;
+    for (size_t l = 0; l < LANES; l++) {
+        r += acc[l];
+    }
+    return r;
+}
+
+// --------------------------
+// --------------------------
+// VectorMax
+
+VectorMax::VectorMax(VectorExpression* a) : Reduction{{a}} {}
+
+Expression* VectorMax::withChildren(Expression* const* children) const {
+    (void)children;
+    return new VectorMax(*this);
+}
+
+Expression* VectorMax::derivative(Expression* const* derivatives, SymbolId variable) const {
+    (void)derivatives;
+    checkScalar(variable);
+
+    // max(a)' is a' at the position of the maximum
+    auto a = operands[0];
+    return new Dot(new VectorMaxMask(a->clone()), a->derivative(variable));
+}
+
+VectorExpression* VectorMax::gradient(SymbolId variable) const {
+    auto a = operands[0];
+    return mul(new VectorMaxMask(a->clone()), a->derivative(variable));
+}
+
+float VectorMax::reduce(const float* const* elements, size_t n) const {
+    const float* a = elements[0];
+
+    float acc[LANES];
+    std::fill(acc, acc + LANES, -std::numeric_limits<float>::infinity());
+    size_t i = 0;
+    for (; i + LANES <= n; i += LANES) {
+        for (size_t l = 0; l < LANES; l++) {
+            acc[l] = a[i + l] > acc[l] ? a[i + l] : acc[l];
+        }
+    }
+    for (size_t l = 0; i < n; i++, l++) {
+        acc[l] = a[i] > acc[l] ? a[i] : acc[l];
+    }
+
+    float r = acc[0];
+    for (size_t l = 1; l < LANES; l++) {
+        r = acc[l] > r ? acc[l] : r;
+    }
+    return r;
+}
+
+// --------------------------
+// --------------------------
+// gradient
+
+// Copy of a tree where `replacement(node)` substitutes whole subtrees when it returns non-null
+template <typename Replacement>
+static Expression* substitute(const Expression& expr, Replacement replacement) {
+    return reduce<Expression*>(
+        expr,
+        [&replacement](const Expression& node, Expression*& result) {
+            result = replacement(node);
+            return result != nullptr;
+        },
+        [](const Expression& node, Expression** children) { return node.withChildren(children); }
+    );
+}
+
+VectorExpression* gradient(const Expression& f, const std::string& variable, size_t size) {
+    SymbolId v = SymbolTable::global().intern(variable);
+    if (auto r = dynamic_cast<const Reduction*>(&f)) {
+        return r->gradient(v);
+    }
+
+    std::vector<const Reduction*> reductions;
+    postorder(f, [&reductions, v](const Expression& node) {
+        auto r = dynamic_cast<const Reduction*>(&node);
+        if (r != nullptr && r->dependsOn(v)) {
+            reductions.push_back(r);
+        }
+    });
+
+    // ∂f/∂r is the derivative of f with r replaced by a placeholder scalar variable
+    SymbolId placeholder = SymbolTable::global().intern("$reduction");
+    VectorExpression* result = filled(0.0f, size);
+    for (auto r : reductions) {
+        auto replaced = substitute(f, [r, placeholder](const Expression& node) -> Expression* {
+            return &node == r ? new Variable(placeholder) : nullptr;
+        });
+        auto partial = replaced->differentiate(SymbolTable::global().name(placeholder));
+        delete replaced;
+        if (isZero(partial)) {
+            delete partial;
+            continue;
+        }
+
+        auto restored = substitute(*partial, [r, placeholder](const Expression& node) -> Expression* {
+            auto var = dynamic_cast<const Variable*>(&node);
+            return var != nullptr && var->getId() == placeholder ? r->clone() : nullptr;
+        });
+        delete partial;
+
+        result = add(result, mul(new VectorBroadcast(restored, size), r->gradient(v)));
+    }
+    return result;
+}
+
+} // namespace mathex
@@ -0,0 +1,783 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "constant.hpp"
+#include "variable.hpp"
+#include "binary_operation.hpp"
+#include "functions.hpp"
+#include "program.hpp"
+#include "parser.hpp"
+#include "root_finding.hpp"
+#include "integration.hpp"
+#include "polynomial.hpp"
+#include "flat_expression.hpp"
+#include "nary_operation.hpp"
+#include "jacobian.hpp"
+#include "symbol_table.hpp"
+#include "eval_cache.hpp"
+#include "planner.hpp"
+#include "derivatives.hpp"
+#include "taylor.hpp"
+#include "approximant.hpp"
+#include "range_operation.hpp"
+#include "vector_expression.hpp"
+#include "grid.hpp"
+#include "ode.hpp"
+#include "optimization.hpp"
+#include "conditional.hpp"
+#include "parallel_differentiation.hpp"
+#include "../tools/protocol.hpp"
+
+// Behavior checks of every feature against independent references: finite differences,
+// closed forms, known series and the plain tree evaluation. Run with `make check`; prints
+// each failed check and exits with 1 when any failed
+
+using Ptr = std::unique_ptr<mathex::Expression>;
+
+static size_t checks = 0;
+static size_t failures = 0;
+
+static void check(bool ok, const std::string& what) {
+    checks++;
+    if (!ok) {
+        failures++;
+        fprintf(stderr, "FAILED: %s\n", what.c_str());
+    }
+}
+
+// |a - b| within `tolerance`, relative to |b| past 1
+static bool near(double a, double b, double tolerance) {
+    return std::fabs(a - b) <= tolerance * std::max(1.0, std::fabs(b));
+}
+
+static void checkNear(double a, double b, double tolerance, const std::string& what) {
+    check(near(a, b, tolerance), what + ": got " + std::to_string(a) + ", expected " + std::to_string(b));
+}
+
+static Ptr parse(const std::string& formula) {
+    return Ptr{mathex::parse(formula)};
+}
+
+// Fourth-order central difference of expr along one variable of ctx
+static double finiteDifference(const mathex::Expression& expr, mathex::VariableContext ctx, const std::string& variable) {
+    double h = 1e-2;
+    float x = ctx[variable];
+    double sum = 0.0;
+    const int offsets[] = {-2, -1, 1, 2};
+    const double weights[] = {1.0, -8.0, 8.0, -1.0};
+    for (int k = 0; k < 4; k++) {
+        ctx[variable] = x + static_cast<float>(offsets[k] * h);
+        sum += weights[k] * expr.eval(ctx);
+    }
+    return sum / (12.0 * h);
+}
+
+// Left-deep chain ((x + sin(x)) + 1) + x + ... of roughly `nodes` nodes
+static Ptr chain(size_t nodes) {
+    mathex::Expression* e = new mathex::Variable("x");
+    for (size_t i = 0; 4 * i < nodes; i++) {
+        mathex::Expression* term = nullptr;
+        switch (i % 3) {
+        case 0: term = new mathex::Variable("x"); break;
+        case 1: term = new mathex::OperationSin(new mathex::Variable("x")); break;
+        default: term = new mathex::Constant(1.0f); break;
+        }
+        e = new mathex::BinaryOperation(i % 4 == 3 ? mathex::BinaryOperator::SUB : mathex::BinaryOperator::ADD, e, term);
+    }
+    return Ptr{e};
+}
+
+// --------------------------
+
+static void checkDerivatives() {
+    const char* formulas[] = {
+        "ln((x^2 + 25*sin(x) + 25) / (abs(x^3) + 10))",
+        "tan(x) * sec(x) - cot(x) / csc(x)",
+        "exp(-x*y) * sqrt(x^2 + y^2) + log10(x + 3)",
+        "x^y + 2^x",
+        "(x - 1)^12 / (1 + x^-0.5)",
+    };
+    const float points[] = {0.3f, 0.9f, 1.7f};
+    for (const char* formula : formulas) {
+        Ptr f = parse(formula);
+        Ptr df{f->differentiate("x")};
+        for (float x : points) {
+            mathex::VariableContext ctx{{"x", x}, {"y", 1.3f}};
+            checkNear(df->eval(ctx), finiteDifference(*f, ctx, "x"), 2e-3, std::string{"d/dx "} + formula + " at " + std::to_string(x));
+        }
+    }
+}
+
+static void checkRootFinding() {
+    Ptr f = parse("x^2 - a");
+    for (auto method : {mathex::RootMethod::NEWTON, mathex::RootMethod::HALLEY}) {
+        mathex::RootOptions options;
+        options.method = method;
+        mathex::RootSolver solver(*f, "x", {"a"}, options);
+
+        std::vector<float> a(20), roots(20, 1.0f);
+        for (size_t i = 0; i < a.size(); i++) {
+            a[i] = 0.5f + i;
+        }
+        const float* parameters[] = {a.data()};
+        auto stats = solver.solve(nullptr, roots.data(), roots.size(), parameters);
+        check(stats.converged == roots.size() && stats.failed == 0, "root solver converges on every lane");
+        for (size_t i = 0; i < a.size(); i++) {
+            checkNear(roots[i], std::sqrt(a[i]), 1e-5, "root of x^2 - " + std::to_string(a[i]));
+        }
+    }
+
+    // Bisection keeps a lane inside its bracket where Newton would leave it
+    mathex::RootOptions options;
+    options.bracketed = true;
+    options.lower = 0.0f;
+    options.upper = 3.0f;
+    Ptr g = parse("x^3 - 2*x - 5");
+    mathex::RootSolver solver(*g, "x", {}, options);
+    float root = 0.0f;
+    solver.solve(nullptr, &root, 1);
+    checkNear(root, 2.0945515, 1e-5, "bracketed root of x^3 - 2x - 5");
+}
+
+static void checkIntegration() {
+    Ptr f = parse("sin(x)");
+    auto result = mathex::integrate(*f, "x", 0.0f, static_cast<float>(M_PI));
+    check(result.converged, "integral of sin converges");
+    checkNear(result.value, 2.0, 1e-5, "integral of sin over [0, pi]");
+
+    Ptr g = parse("1 / sqrt(x)");
+    result = mathex::integrate(*g, "x", 0.0f, 1.0f, {1e-5, 1e-5, 4000, 2});
+    checkNear(result.value, 2.0, 1e-3, "integral of 1/sqrt(x) over [0, 1]");
+
+    Ptr h = parse("x * y^2 + z");
+    result = mathex::integrate(*h, {{"x", 0.0f, 1.0f}, {"y", 0.0f, 2.0f}, {"z", -1.0f, 1.0f}});
+    checkNear(result.value, 8.0 / 3.0, 1e-5, "integral of x y^2 + z over a box");
+}
+
+static void checkPolynomials() {
+    mathex::Polynomial p("x", {1.0f, 2.0f, 3.0f});
+    checkNear(p.eval({{"x", 2.0f}}), 17.0, 0.0, "polynomial 1 + 2x + 3x^2 at 2");
+
+    Ptr f = parse("3*x^3 - 2*x*y + y^2 + 1 + (x - 1)^12");
+    Ptr rewritten{mathex::rewritePolynomials(*f)};
+    for (float x : {-1.5f, 0.25f, 1.0f, 2.0f}) {
+        mathex::VariableContext ctx{{"x", x}, {"y", 0.75f}};
+        checkNear(rewritten->eval(ctx), f->eval(ctx), 1e-5, "Horner form at " + std::to_string(x));
+    }
+}
+
+static void checkPowers() {
+    const float bases[] = {0.3f, 0.999f, 1.001f, 1.7f, -2.1f, 9.5f};
+    for (int n = -mathex::MAX_POWI_EXPONENT; n <= mathex::MAX_POWI_EXPONENT; n++) {
+        for (float x : bases) {
+            double expected = std::pow(static_cast<double>(x), n);
+            checkNear(mathex::powi(x, n), expected, 2e-7 * std::max(1.0, 1.0 / std::fabs(expected)), "powi(" + std::to_string(x) + ", " + std::to_string(n) + ")");
+        }
+    }
+
+    mathex::Variable x("x");
+    for (float exponent : {7.0f, -3.0f, 0.5f, -0.5f, -1.0f, 2.5f}) {
+        auto p = mathex::pow(x, exponent);
+        mathex::Program program(p);
+        for (float v : {0.5f, 1.25f, 3.0f}) {
+            double expected = std::pow(static_cast<double>(v), exponent);
+            checkNear(p.eval({{"x", v}}), expected, 1e-6, "x^" + std::to_string(exponent));
+            checkNear(program.eval(&v), expected, 1e-6, "compiled x^" + std::to_string(exponent));
+        }
+    }
+}
+
+static void checkSpecialization() {
+    Ptr f = parse("sin(x) * y + exp(y) * x^2 + y");
+    Ptr g{f->specialize({{"y", 2.0f}})};
+    check(!g->dependsOn("y") && g->nodeCount() < f->nodeCount(), "specialization folds the bound variable");
+    for (float x : {-1.0f, 0.5f, 2.0f}) {
+        checkNear(g->eval({{"x", x}}), f->eval({{"x", x}, {"y", 2.0f}}), 1e-6, "specialized value at " + std::to_string(x));
+    }
+}
+
+static void checkFlatExpressions() {
+    Ptr f = parse("sin(x) * sin(x) + cos(x * y) / (1 + x^2) + min(x, y)");
+    mathex::FlatExpression flat(*f, {"x", "y"});
+    mathex::Program program(*f, {"x", "y"});
+
+    const size_t count = 37;
+    std::vector<float> xs(count), ys(count), flatOut(count), programOut(count);
+    for (size_t i = 0; i < count; i++) {
+        xs[i] = -2.0f + 0.1f * i;
+        ys[i] = 1.0f - 0.05f * i;
+    }
+    const float* inputs[] = {xs.data(), ys.data()};
+    std::vector<float> scratch(flat.size() * mathex::Program::LANES);
+    flat.evalBatch(inputs, flatOut.data(), count, scratch.data());
+    program.evalBatch(inputs, programOut.data(), count);
+
+    bool same = true;
+    for (size_t i = 0; i < count; i++) {
+        float expected = f->eval({{"x", xs[i]}, {"y", ys[i]}});
+        float values[] = {xs[i], ys[i]};
+        same = same && near(flatOut[i], expected, 1e-6) && near(programOut[i], expected, 1e-6);
+        same = same && near(flat.eval(values, scratch.data()), expected, 1e-6);
+    }
+    check(same, "flat, compiled and tree evaluations agree");
+
+    Ptr rebuilt{flat.toExpression()};
+    checkNear(rebuilt->eval({{"x", 0.7f}, {"y", 0.2f}}), f->eval({{"x", 0.7f}, {"y", 0.2f}}), 1e-6, "flat expression rebuilt as a tree");
+}
+
+static void checkDeepTrees() {
+    const size_t nodes = 200000;
+    Ptr f = chain(nodes);
+    Ptr copy{f->clone()};
+    Ptr df{f->differentiate("x")};
+    mathex::Program program(*f);
+
+    float x = 0.5f;
+    double expected = 0.0, slope = 1.0;
+    for (size_t i = 0; 4 * i < nodes; i++) {
+        double sign = i % 4 == 3 ? -1.0 : 1.0;
+        switch (i % 3) {
+        case 0: expected += sign * x; slope += sign; break;
+        case 1: expected += sign * std::sin(x); slope += sign * std::cos(x); break;
+        default: expected += sign; break;
+        }
+    }
+    expected += x;
+    checkNear(f->eval({{"x", x}}), expected, 1e-4, "deep tree walk");
+    checkNear(copy->eval({{"x", x}}), expected, 1e-4, "deep tree clone");
+    checkNear(program.eval(&x), expected, 1e-4, "deep tree program");
+    checkNear(df->eval({{"x", x}}), slope, 1e-4, "deep tree derivative");
+}
+
+static void checkNaryOperations() {
+    Ptr f = parse("x + y - 2*x + 3 + x*y*2*x - (y - 1)");
+    Ptr flat{mathex::flatten(*f)};
+    check(dynamic_cast<mathex::Sum*>(flat.get()) != nullptr, "chains of additions become a Sum");
+    mathex::Program program(*flat, {"x", "y"});
+    for (float x : {-1.0f, 0.5f, 3.0f}) {
+        mathex::VariableContext ctx{{"x", x}, {"y", 1.5f}};
+        float values[] = {x, 1.5f};
+        checkNear(flat->eval(ctx), f->eval(ctx), 1e-6, "flattened sum");
+        checkNear(program.eval(values), f->eval(ctx), 1e-6, "compiled flattened sum");
+    }
+
+    Ptr dflat{flat->differentiate("x")};
+    Ptr df{f->differentiate("x")};
+    checkNear(dflat->eval({{"x", 0.5f}, {"y", 1.5f}}), df->eval({{"x", 0.5f}, {"y", 1.5f}}), 1e-6, "derivative of a flattened sum");
+}
+
+static void checkJacobians() {
+    Ptr a = parse("x * y");
+    Ptr b = parse("sin(y)");
+    mathex::Jacobian jacobian({a.get(), b.get()}, {"x", "y", "z"});
+    check(jacobian.nonZeros() == 3 && jacobian.at(1, 0) == nullptr && jacobian.at(0, 2) == nullptr, "Jacobian keeps only structural nonzeros");
+
+    mathex::VariableContext ctx{{"x", 0.8f}, {"y", -0.4f}, {"z", 2.0f}};
+    std::vector<float> values(jacobian.nonZeros());
+    jacobian.eval(ctx, values.data());
+    const mathex::Expression* outputs[] = {a.get(), b.get()};
+    for (size_t i = 0; i < jacobian.rows(); i++) {
+        for (uint32_t k = jacobian.rowOffsets()[i]; k < jacobian.rowOffsets()[i + 1]; k++) {
+            const std::string& variable = jacobian.variables()[jacobian.columns()[k]];
+            checkNear(values[k], finiteDifference(*outputs[i], ctx, variable), 1e-3, "Jacobian entry d" + std::to_string(i) + "/d" + variable);
+        }
+    }
+
+    Ptr f = parse("x^2 * y + sin(z)");
+    mathex::Hessian hessian(*f, {"x", "y", "z"});
+    check(hessian.nonZeros() == 4, "Hessian of x^2 y + sin(z) has 4 nonzeros");
+    std::vector<float> h(hessian.nonZeros());
+    hessian.eval(ctx, h.data());
+    // Row-major entries: xx, xy, yx, zz
+    checkNear(h[0], 2.0 * ctx["y"], 1e-6, "Hessian xx");
+    checkNear(h[1], 2.0 * ctx["x"], 1e-6, "Hessian xy");
+    checkNear(h[2], 2.0 * ctx["x"], 1e-6, "Hessian yx");
+    checkNear(h[3], -std::sin(ctx["z"]), 1e-6, "Hessian zz");
+}
+
+static void checkFreeVariables() {
+    Ptr f = parse("sin(y) * exp(y) + x");
+    check(f->dependsOn("x") && f->dependsOn("y") && !f->dependsOn("z"), "free variables of sin(y) exp(y) + x");
+    Ptr dz{f->differentiate("z")};
+    check(dz->nodeCount() == 1 && dz->eval({{"x", 1.0f}, {"y", 1.0f}}) == 0.0f, "derivative along an absent variable is a constant 0");
+}
+
+static void checkSymbols() {
+    mathex::SymbolTable table;
+    mathex::SymbolId a = table.intern("alpha");
+    mathex::SymbolId id;
+    check(table.intern("alpha") == a && table.name(a) == "alpha", "interned names round-trip");
+    check(!table.find("beta", id) && table.size() == 1, "lookups do not intern");
+}
+
+// Runs a tool with its output discarded and returns its exit status
+static int run(const std::string& command) {
+    int status = std::system((command + " > /dev/null 2>&1").c_str());
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static std::string temporaryFile(const std::string& contents) {
+    char path[] = "/tmp/mathex-checks-XXXXXX";
+    int fd = mkstemp(path);
+    ssize_t written = write(fd, contents.data(), contents.size());
+    close(fd);
+    check(written == static_cast<ssize_t>(contents.size()), "temporary file written");
+    return path;
+}
+
+static void checkCsvEvaluator() {
+    std::string output = temporaryFile("");
+    const char* accepted[] = {"x,y\n1,2\n3,4\n", "x,y\r\n1.5 , 2e1\r\n"};
+    const char* rejected[] = {"x,y\n1,2x\n", "x,y\n1,2,3\n", "x,y\n1,\n", "x,y\n1 2,3\n"};
+    for (const char* csv : accepted) {
+        std::string input = temporaryFile(csv);
+        check(run("./bin/mathex-eval x+y " + input + " " + output) == 0, std::string{"mathex-eval accepts "} + csv);
+        unlink(input.c_str());
+    }
+    for (const char* csv : rejected) {
+        std::string input = temporaryFile(csv);
+        check(run("./bin/mathex-eval x+y " + input + " " + output) != 0, std::string{"mathex-eval rejects "} + csv);
+        unlink(input.c_str());
+    }
+    unlink(output.c_str());
+}
+
+static void appendFrame(std::string& requests, protocol::Request kind, const std::string& payload) {
+    char header[protocol::HEADER_SIZE];
+    protocol::encodeHeader(header, static_cast<uint8_t>(kind), payload.size());
+    requests.append(header, sizeof(header));
+    requests += payload;
+}
+
+static std::string evalPayload(uint32_t handle, uint32_t count, size_t floats) {
+    std::string payload(8 + floats * sizeof(float), '\0');
+    memcpy(&payload[0], &handle, 4);
+    memcpy(&payload[4], &count, 4);
+    return payload;
+}
+
+static void checkServer() {
+    std::string requests;
+    appendFrame(requests, protocol::Request::COMPILE, "x*x + y");
+    appendFrame(requests, protocol::Request::COMPILE, std::string(protocol::MAX_FORMULA + 1, 'x'));
+    appendFrame(requests, protocol::Request::COMPILE, "x +* 2");
+    appendFrame(requests, static_cast<protocol::Request>(9), std::string(100000, 'q'));
+    appendFrame(requests, protocol::Request::EVAL, evalPayload(77, 1, 2));
+    appendFrame(requests, protocol::Request::EVAL, evalPayload(0, protocol::MAX_POINTS + 1, 0));
+    appendFrame(requests, protocol::Request::EVAL, evalPayload(0, 3, 5));
+    std::string eval = evalPayload(0, 2, 4);
+    const float points[] = {3.0f, 1.0f, 10.0f, 20.0f};
+    memcpy(&eval[8], points, sizeof(points));
+    appendFrame(requests, protocol::Request::EVAL, eval);
+    appendFrame(requests, protocol::Request::COMPILE, "a + 1");
+    appendFrame(requests, protocol::Request::COMPILE, "b + 1");
+    appendFrame(requests, protocol::Request::EVAL, evalPayload(0, 0, 0));
+    appendFrame(requests, protocol::Request::SHUTDOWN, "ignored");
+
+    int toServer[2], fromServer[2];
+    if (pipe(toServer) != 0 || pipe(fromServer) != 0) {
+        check(false, "pipes to the server");
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(toServer[0], STDIN_FILENO);
+        dup2(fromServer[1], STDOUT_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDERR_FILENO);
+        close(toServer[1]);
+        close(fromServer[0]);
+        execl("./bin/mathex-server", "mathex-server", "--formulas", "2", static_cast<char*>(nullptr));
+        _exit(127);
+    }
+    close(toServer[0]);
+    close(fromServer[1]);
+    bool sent = write(toServer[1], requests.data(), requests.size()) == static_cast<ssize_t>(requests.size());
+    close(toServer[1]);
+    check(sent, "requests sent to the server");
+
+    // Status of each reply, and the payload of the successful evaluation
+    std::vector<uint8_t> statuses;
+    std::vector<std::string> payloads;
+    uint8_t status;
+    size_t size;
+    while (protocol::readHeader(fromServer[0], status, size)) {
+        std::string payload(size, '\0');
+        if (!protocol::readFull(fromServer[0], &payload[0], size)) {
+            break;
+        }
+        statuses.push_back(status);
+        payloads.push_back(payload);
+    }
+    close(fromServer[0]);
+    int exitStatus;
+    waitpid(pid, &exitStatus, 0);
+
+    const uint8_t OK = static_cast<uint8_t>(protocol::Status::OK);
+    const uint8_t ERROR = static_cast<uint8_t>(protocol::Status::ERROR);
+    const std::vector<uint8_t> expected = {OK, ERROR, ERROR, ERROR, ERROR, ERROR, ERROR, OK, OK, OK, ERROR, OK};
+    check(statuses == expected, "server accepts and rejects the expected requests");
+    if (statuses == expected) {
+        check(payloads[1] == "Formula too long", "oversized formula rejected before buffering");
+        check(payloads[3] == "Unknown request", "unknown request rejected");
+        check(payloads[4] == "Unknown handle", "unknown handle rejected");
+        check(payloads[5] == "Too many points in one request", "oversized evaluation rejected");
+        check(payloads[6] == "Payload does not match the point count", "short evaluation payload rejected");
+        float results[2];
+        memcpy(results, payloads[7].data(), sizeof(results));
+        check(payloads[7].size() == sizeof(results) && results[0] == 3.0f * 3.0f + 10.0f && results[1] == 1.0f + 20.0f, "server evaluates x*x + y");
+        check(payloads[10] == "Unknown handle", "evicted formula handle is unknown");
+    }
+    check(WIFEXITED(exitStatus) && WEXITSTATUS(exitStatus) == 0, "server exits cleanly after SHUTDOWN");
+}
+
+static void checkEvalCache() {
+    Ptr f = parse("sin(x) * y");
+    mathex::EvalCache cache(*f, {"x", "y"}, 64, 2);
+    float a[] = {0.5f, 2.0f};
+    float b[] = {1.5f, 2.0f};
+    checkNear(cache.eval(a), f->eval({{"x", 0.5f}, {"y", 2.0f}}), 0.0, "cached value");
+    cache.eval(a);
+    cache.eval(b);
+    auto stats = cache.statistics();
+    check(stats.hits == 1 && stats.misses == 2, "cache counts one hit and two misses");
+    cache.setBypass(true);
+    cache.eval(a);
+    check(cache.statistics().bypassed == 1 && cache.statistics().hits == 1, "bypassed lookups skip the cache");
+
+    for (float x = 0.0f; x < 1000.0f; x += 1.0f) {
+        float values[] = {x, 1.0f};
+        cache.setBypass(false);
+        cache.eval(values);
+    }
+    check(cache.size() <= cache.capacity() && cache.statistics().evictions > 0, "cache stays within its capacity");
+}
+
+static void checkPlanner() {
+    Ptr f = parse("exp(-x*x) * cos(3*y) + x^3 / (1 + y*y)");
+    mathex::Planner planner;
+    mathex::Program program(*f, {"x", "y"});
+    for (size_t count : {1, 7, 300, 100000}) {
+        std::vector<float> xs(count), ys(count), out(count), expected(count);
+        for (size_t i = 0; i < count; i++) {
+            xs[i] = std::sin(0.37f * i);
+            ys[i] = std::cos(0.11f * i);
+        }
+        const float* inputs[] = {xs.data(), ys.data()};
+        auto plan = planner.evaluate(*f, {"x", "y"}, inputs, out.data(), count);
+        program.evalBatch(inputs, expected.data(), count);
+        bool same = true;
+        for (size_t i = 0; i < count; i++) {
+            same = same && near(out[i], expected[i], 1e-5);
+        }
+        check(same && plan.points == count, "planner result for " + std::to_string(count) + " points (" + mathex::to_string(plan.strategy) + ")");
+    }
+    check(planner.plan(*f, 1).strategy != mathex::Strategy::THREADED, "a single point is never threaded");
+}
+
+static void checkHigherOrderDerivatives() {
+    Ptr f = parse("sin(x) * exp(x)");
+    Ptr d4{f->differentiate("x", 4)};
+    float x = 0.7f;
+    checkNear(d4->eval({{"x", x}}), -4.0 * std::exp(x) * std::sin(x), 1e-5, "fourth derivative of sin(x) exp(x)");
+
+    Ptr g = parse("x^2 * y^3 + sin(x * y)");
+    Ptr dxy{g->differentiate(std::vector<std::string>{"x", "y"})};
+    float y = -0.6f;
+    double mixed = 6.0 * x * y * y + std::cos(x * y) - x * y * std::sin(x * y);
+    checkNear(dxy->eval({{"x", x}, {"y", y}}), mixed, 1e-5, "mixed partial d2/dx dy");
+
+    auto flat = mathex::derivatives(*g, {{}, {"x"}, {"x", "y"}, {"y", "x"}}, {"x", "y"});
+    std::vector<float> out(4), scratch(flat.size());
+    float values[] = {x, y};
+    flat.evalAll(values, out.data(), scratch.data());
+    checkNear(out[0], g->eval({{"x", x}, {"y", y}}), 1e-6, "derivative store root f");
+    checkNear(out[2], mixed, 1e-5, "derivative store d2/dx dy");
+    checkNear(out[3], mixed, 1e-5, "derivative store d2/dy dx");
+
+    Ptr h = parse("x / (1 + x^2)");
+    auto high = mathex::derivatives(*h, {std::vector<std::string>(12, "x")});
+    check(high.size() < 2000, "twelfth derivative store stays small");
+}
+
+static void checkTaylorSeries() {
+    Ptr e = parse("exp(x)");
+    auto c = mathex::TaylorExpansion(*e, "x").coefficients({{"x", 0.0f}}, 12);
+    double factorial = 1.0;
+    for (size_t j = 0; j <= 12; j++) {
+        factorial *= j > 0 ? j : 1;
+        checkNear(c[j], 1.0 / factorial, 1e-7, "exp coefficient " + std::to_string(j));
+    }
+
+    Ptr l = parse("ln(1 + x)");
+    c = mathex::TaylorExpansion(*l, "x").coefficients({{"x", 0.0f}}, 10);
+    for (size_t j = 1; j <= 10; j++) {
+        checkNear(c[j], (j % 2 ? 1.0 : -1.0) / j, 1e-7, "ln(1 + x) coefficient " + std::to_string(j));
+    }
+
+    Ptr g = parse("1 / (1 - x) + sqrt(1 + x)");
+    c = mathex::TaylorExpansion(*g, "x").coefficients({{"x", 0.0f}}, 6);
+    const double binomial[] = {1.0, 0.5, -0.125, 0.0625, -0.0390625, 0.02734375, -0.0205078125};
+    for (size_t j = 0; j <= 6; j++) {
+        checkNear(c[j], 1.0 + binomial[j], 1e-7, "1/(1 - x) + sqrt(1 + x) coefficient " + std::to_string(j));
+    }
+
+    Ptr s = parse("sin(x) * y");
+    auto d = mathex::TaylorExpansion(*s, "x").derivatives({{"x", 0.5f}, {"y", 2.0f}}, 4);
+    const double expected[] = {std::sin(0.5), std::cos(0.5), -std::sin(0.5), -std::cos(0.5), std::sin(0.5)};
+    for (size_t j = 0; j <= 4; j++) {
+        checkNear(d[j], 2.0 * expected[j], 1e-6, "derivative " + std::to_string(j) + " of y sin(x)");
+    }
+}
+
+static void checkApproximants() {
+    Ptr f = parse("exp(sin(x)) + x^2");
+    float tolerance = 1e-4f;
+    mathex::ChebyshevApproximant approximant(*f, {{"x", -2.0f, 2.0f}}, tolerance);
+    double worst = 0.0;
+    for (int i = 0; i <= 1000; i++) {
+        float x = -2.0f + 4.0f * i / 1000;
+        worst = std::max(worst, std::fabs(approximant.eval(x) - static_cast<double>(f->eval({{"x", x}}))));
+    }
+    check(worst <= 2.0 * tolerance, "Chebyshev approximant within tolerance, error " + std::to_string(worst));
+
+    Ptr g = parse("sin(x) * cos(y)");
+    mathex::ChebyshevApproximant approximant2(*g, {{"x", 0.0f, 3.0f}, {"y", -1.0f, 1.0f}}, tolerance);
+    std::vector<float> xs(50), ys(50), out(50);
+    for (size_t i = 0; i < xs.size(); i++) {
+        xs[i] = 3.0f * i / 49;
+        ys[i] = std::sin(0.3f * i);
+    }
+    const float* inputs[] = {xs.data(), ys.data()};
+    approximant2.evalBatch(inputs, out.data(), xs.size());
+    worst = 0.0;
+    for (size_t i = 0; i < xs.size(); i++) {
+        worst = std::max(worst, std::fabs(out[i] - std::sin(static_cast<double>(xs[i])) * std::cos(ys[i])));
+    }
+    check(worst <= 2.0 * tolerance, "2D Chebyshev approximant within tolerance, error " + std::to_string(worst));
+}
+
+static void checkRanges() {
+    mathex::RangeSum sum("i", 1, 100, mathex::parse("i * x + 1 / i"));
+    double harmonic = 0.0;
+    for (int i = 1; i <= 100; i++) {
+        harmonic += 1.0 / i;
+    }
+    checkNear(sum.eval({{"x", 2.0f}}), 10100.0 + harmonic, 1e-6, "range sum");
+    mathex::Program program(sum);
+    float x = 2.0f;
+    checkNear(program.eval(&x), 10100.0 + harmonic, 1e-6, "compiled range sum");
+    Ptr dsum{sum.differentiate("x")};
+    checkNear(dsum->eval({{"x", 2.0f}}), 5050.0, 1e-6, "derivative of a range sum");
+
+    // Π (x - i) for i = 0..3: derivatives at the zero x = 1 are finite
+    mathex::RangeProduct product("i", 0, 3, mathex::parse("x - i"));
+    Ptr d1{product.differentiate("x")};
+    Ptr d2{d1->differentiate("x")};
+    checkNear(d1->eval({{"x", 1.0f}}), 2.0, 1e-6, "derivative of a range product at a zero");
+    checkNear(d2->eval({{"x", 1.0f}}), -2.0, 1e-6, "second derivative of a range product at a zero");
+    checkNear(d1->eval({{"x", 1.7f}}), finiteDifference(product, {{"x", 1.7f}}, "x"), 1e-3, "derivative of a range product");
+
+    auto c = mathex::TaylorExpansion(product, "x").derivatives({{"x", 1.0f}}, 4);
+    checkNear(c[1], 2.0, 1e-6, "Taylor f' of a range product");
+    checkNear(c[2], -2.0, 1e-6, "Taylor f'' of a range product");
+    checkNear(c[4], 24.0, 1e-6, "Taylor f'''' of a range product");
+
+    mathex::RangeSum outer("j", 1, 3, new mathex::RangeSum("i", 1, 4, mathex::parse("i * j * x")));
+    checkNear(outer.eval({{"x", 1.0f}}), 60.0, 1e-6, "nested range sums");
+    checkNear(mathex::TaylorExpansion(outer, "x").derivatives({{"x", 1.0f}}, 1)[1], 60.0, 1e-6, "Taylor series of nested ranges");
+}
+
+static void checkVectors() {
+    const size_t n = 37;
+    std::vector<float> a(n), b(n);
+    double dot = 0.0, norm = 0.0, sum = 0.0, max = -INFINITY;
+    for (size_t i = 0; i < n; i++) {
+        a[i] = std::sin(0.5f * i);
+        b[i] = 1.0f + 0.25f * i;
+        dot += static_cast<double>(a[i]) * b[i];
+        norm += static_cast<double>(a[i]) * a[i];
+        sum += a[i];
+        max = std::max(max, static_cast<double>(a[i]));
+    }
+
+    auto va = [&] { return new mathex::VectorVariable("a", n, a.data()); };
+    auto vb = [&] { return new mathex::VectorVariable("b", n, b.data()); };
+    mathex::Dot d(va(), vb());
+    checkNear(d.eval({}), dot, 1e-5, "dot product");
+    checkNear(mathex::Norm2(va()).eval({}), std::sqrt(norm), 1e-6, "Euclidean norm");
+    checkNear(mathex::VectorSum(va()).eval({}), sum, 1e-5, "vector sum");
+    checkNear(mathex::VectorMax(va()).eval({}), max, 0.0, "vector maximum");
+
+    mathex::Program program(d);
+    checkNear(program.eval(static_cast<const float*>(nullptr)), dot, 1e-5, "compiled dot product");
+
+    std::unique_ptr<mathex::VectorExpression> gradient{mathex::gradient(d, "a", n)};
+    std::vector<float> g(n);
+    gradient->eval({}, g.data());
+    check(g == b, "gradient of a . b along a is b");
+
+    mathex::Dot scaled(va(), new mathex::VectorBroadcast(mathex::parse("s^2"), n));
+    Ptr ds{scaled.differentiate("s")};
+    checkNear(ds->eval({{"s", 3.0f}}), 6.0 * sum, 1e-5, "derivative of a broadcast scalar");
+}
+
+static void checkGrids() {
+    Ptr f = parse("sin(x) * cos(y) + x * y * p + exp(z) * x");
+    mathex::GridEvaluator grid(*f, {"x", "y", "z"});
+    std::vector<std::vector<float>> samples = {std::vector<float>(13), std::vector<float>(7), std::vector<float>(5)};
+    for (size_t a = 0; a < 3; a++) {
+        for (size_t i = 0; i < samples[a].size(); i++) {
+            samples[a][i] = -1.0f + 0.3f * i + a;
+        }
+    }
+    std::vector<float> out(13 * 7 * 5);
+    grid.eval(samples, {{"p", 0.5f}}, out.data(), 2);
+    check(grid.axisNodes() > 0 && grid.mixedNodes() > 0, "grid hoists per-axis nodes");
+
+    bool same = true;
+    for (size_t k = 0; k < 5; k++) {
+        for (size_t j = 0; j < 7; j++) {
+            for (size_t i = 0; i < 13; i++) {
+                float expected = f->eval({{"x", samples[0][i]}, {"y", samples[1][j]}, {"z", samples[2][k]}, {"p", 0.5f}});
+                same = same && near(out[i + 13 * (j + 7 * k)], expected, 1e-5);
+            }
+        }
+    }
+    check(same, "grid evaluation matches pointwise evaluation");
+}
+
+static void checkOdes() {
+    Ptr decay = parse("-k * y");
+    mathex::OdeSystem system({decay.get()}, {"y"});
+    for (auto method : {mathex::OdeMethod::RK4, mathex::OdeMethod::DORMAND_PRINCE, mathex::OdeMethod::ROSENBROCK}) {
+        mathex::OdeOptions options;
+        options.method = method;
+        options.tolerance = options.relativeTolerance = 1e-7;
+        options.threads = 2;
+        std::vector<std::vector<float>> y = {std::vector<float>(11)};
+        for (size_t i = 0; i < y[0].size(); i++) {
+            y[0][i] = 1.0f + i;
+        }
+        auto result = system.solve(y, 0.0f, 1.0f, {{"k", 2.0f}}, options);
+        check(result.converged, "decay integration converges");
+        for (size_t i = 0; i < y[0].size(); i++) {
+            checkNear(y[0][i], (1.0 + i) * std::exp(-2.0), 1e-4, "y' = -2y at t = 1, method " + std::to_string(static_cast<int>(method)));
+        }
+    }
+
+    Ptr dx = parse("v");
+    Ptr dv = parse("-x");
+    mathex::OdeSystem oscillator({dx.get(), dv.get()}, {"x", "v"});
+    std::vector<std::vector<float>> y = {{1.0f, 0.0f}, {0.0f, 1.0f}};
+    oscillator.solve(y, 0.0f, static_cast<float>(M_PI), {});
+    checkNear(y[0][0], -1.0, 1e-3, "oscillator position at pi");
+    checkNear(y[1][0], 0.0, 1e-3, "oscillator velocity at pi");
+    checkNear(y[0][1], 0.0, 1e-3, "second oscillator position at pi");
+    checkNear(y[1][1], -1.0, 1e-3, "second oscillator velocity at pi");
+}
+
+static void checkOptimization() {
+    Ptr rosenbrock = parse("(1 - x)^2 + 100 * (y - x^2)^2");
+    for (auto method : {mathex::OptimizationMethod::LBFGS, mathex::OptimizationMethod::PROJECTED_GRADIENT}) {
+        mathex::OptimizationOptions options;
+        options.method = method;
+        options.maxIterations = 20000;
+        options.maxEvaluations = 100000;
+        options.gradientTolerance = 1e-5;
+        options.valueTolerance = 0.0;
+        mathex::Optimizer optimizer(*rosenbrock, {"x", "y"}, {}, options);
+        float point[] = {-1.2f, 1.0f};
+        optimizer.minimize(point);
+        checkNear(point[0], 1.0, 1e-2, "Rosenbrock minimum x, method " + std::to_string(static_cast<int>(method)));
+        checkNear(point[1], 1.0, 2e-2, "Rosenbrock minimum y, method " + std::to_string(static_cast<int>(method)));
+    }
+
+    Ptr f = parse("(x - a)^2 + (y + 1)^2");
+    mathex::Optimizer optimizer(*f, {"x", "y"}, {"a"});
+    optimizer.setBounds({0.0f, 0.0f}, {2.0f, INFINITY});
+    float point[] = {1.0f, 1.0f};
+    float a = 3.0f;
+    float gradient[2];
+    checkNear(optimizer.evaluate(point, gradient, &a), 8.0, 1e-6, "objective value");
+    checkNear(gradient[0], -4.0, 1e-6, "objective gradient");
+    optimizer.minimize(point, &a);
+    checkNear(point[0], 2.0, 1e-5, "bounded minimum x");
+    checkNear(point[1], 0.0, 1e-5, "bounded minimum y");
+}
+
+static void checkConditionals() {
+    Ptr f = parse("select(x < 1, x^2, 2*x - 1) + max(x, y) - min(x, y) + clamp(x, -1, 1) + (x >= y)");
+    mathex::Program program(*f, {"x", "y"});
+    Ptr df{f->differentiate("x")};
+    const size_t count = 29;
+    std::vector<float> xs(count), ys(count, 0.3f), out(count);
+    // Samples stay away from the kinks at -1, 0.3 and 1, where derivatives are one-sided
+    for (size_t i = 0; i < count; i++) {
+        xs[i] = -2.03f + 0.15f * i;
+    }
+    const float* inputs[] = {xs.data(), ys.data()};
+    program.evalBatch(inputs, out.data(), count);
+    for (size_t i = 0; i < count; i++) {
+        float x = xs[i], y = ys[i];
+        double expected = (x < 1 ? x * x : 2 * x - 1) + std::fabs(x - y) + std::min(std::max(x, -1.0f), 1.0f) + (x >= y);
+        checkNear(out[i], expected, 1e-6, "branchless evaluation at " + std::to_string(x));
+        checkNear(df->eval({{"x", x}, {"y", y}}), finiteDifference(*f, {{"x", x}, {"y", y}}, "x"), 1e-3, "piecewise derivative at " + std::to_string(x));
+    }
+}
+
+static void checkParallelDifferentiation() {
+    Ptr f = chain(100000);
+    Ptr sequential{f->differentiate("x")};
+    for (unsigned threads : {1u, 4u}) {
+        Ptr parallel{mathex::parallelDifferentiate(*f, "x", {threads, 64})};
+        check(parallel->nodeCount() == sequential->nodeCount(), "parallel derivative has the same nodes");
+        for (float x : {-0.5f, 0.25f, 2.0f}) {
+            check(parallel->eval({{"x", x}}) == sequential->eval({{"x", x}}), "parallel derivative is identical at " + std::to_string(x));
+        }
+    }
+}
+
+// --------------------------
+
+int main() {
+    checkDerivatives();
+    checkRootFinding();
+    checkIntegration();
+    checkPolynomials();
+    checkPowers();
+    checkSpecialization();
+    checkFlatExpressions();
+    checkDeepTrees();
+    checkNaryOperations();
+    checkJacobians();
+    checkFreeVariables();
+    checkSymbols();
+    checkCsvEvaluator();
+    checkServer();
+    checkEvalCache();
+    checkPlanner();
+    checkHigherOrderDerivatives();
+    checkTaylorSeries();
+    checkApproximants();
+    checkRanges();
+    checkVectors();
+    checkGrids();
+    checkOdes();
+    checkOptimization();
+    checkConditionals();
+    checkParallelDifferentiation();
+
+    printf("%zu checks, %zu failed\n", checks, failures);
+    return failures > 0 ? 1 : 0;
+}
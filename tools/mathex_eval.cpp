@@ -0,0 +1,492 @@
+// mathex-eval: applies one formula to every row of a large data file.
+//
+// The input is memory-mapped and evaluated in fixed-size chunks with the batch evaluator of
+// a compiled Program, so memory use does not grow with the file. Two formats are understood:
+//   csv  Comma-separated rows, with a header naming the columns unless --columns is given
+//   f32  Raw little-endian float32 columns stored one after the other (column-major);
+//        --columns names them and the row count follows from the file size
+// The output is written in the same format unless --output-format says otherwise: one
+// column with the formula, and a second one with its derivative when --derivative is given.
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "parser.hpp"
+#include "program.hpp"
+
+namespace {
+
+enum class Format {
+    CSV,
+    F32
+};
+
+struct Options {
+    std::string formula;
+    std::string input;
+    std::string output;
+    bool hasInputFormat = false;
+    Format inputFormat = Format::CSV;
+    bool hasOutputFormat = false;
+    Format outputFormat = Format::CSV;
+    std::vector<std::string> columns;
+    std::unordered_map<std::string, std::string> mapping;
+    std::string derivative;
+    size_t chunk = 1 << 16;
+};
+
+void usage() {
+    fprintf(
+        stderr,
+        "usage: mathex-eval [options] <formula> <input> <output>\n"
+        "  --format csv|f32          input format (default: f32 for .f32 files, csv otherwise)\n"
+        "  --output-format csv|f32   output format (default: the input format)\n"
+        "  --columns a,b,...         column names; required for f32, replaces the csv header\n"
+        "  --map var=column          reads a variable from a differently named column\n"
+        "  --derivative var          adds a column with the derivative with respect to var\n"
+        "  --chunk rows              rows evaluated per chunk (default 65536)\n"
+    );
+}
+
+std::vector<std::string> split(const std::string& s, char separator) {
+    std::vector<std::string> parts;
+    size_t start = 0;
+    while (true) {
+        size_t end = s.find(separator, start);
+        parts.push_back(s.substr(start, end - start));
+        if (end == std::string::npos) {
+            return parts;
+        }
+        start = end + 1;
+    }
+}
+
+Format parseFormat(const std::string& s) {
+    if (s == "csv") {
+        return Format::CSV;
+    }
+    if (s == "f32") {
+        return Format::F32;
+    }
+    throw std::runtime_error{"[mathex-eval] Unknown format: " + s};
+}
+
+Options parseOptions(int argc, char** argv) {
+    Options options;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            positional.push_back(arg);
+            continue;
+        }
+        if (i + 1 >= argc) {
+            throw std::runtime_error{"[mathex-eval] Missing value for " + arg};
+        }
+        std::string value = argv[++i];
+        if (arg == "--format") {
+            options.inputFormat = parseFormat(value);
+            options.hasInputFormat = true;
+        } else if (arg == "--output-format") {
+            options.outputFormat = parseFormat(value);
+            options.hasOutputFormat = true;
+        } else if (arg == "--columns") {
+            options.columns = split(value, ',');
+        } else if (arg == "--map") {
+            size_t eq = value.find('=');
+            if (eq == std::string::npos) {
+                throw std::runtime_error{"[mathex-eval] Expected var=column, got " + value};
+            }
+            options.mapping[value.substr(0, eq)] = value.substr(eq + 1);
+        } else if (arg == "--derivative") {
+            options.derivative = value;
+        } else if (arg == "--chunk") {
+            options.chunk = std::max<size_t>(1, std::stoul(value));
+        } else {
+            throw std::runtime_error{"[mathex-eval] Unknown option " + arg};
+        }
+    }
+
+    if (positional.size() != 3) {
+        usage();
+        throw std::runtime_error{"[mathex-eval] Expected a formula, an input and an output"};
+    }
+    options.formula = positional[0];
+    options.input = positional[1];
+    options.output = positional[2];
+
+    if (!options.hasInputFormat) {
+        size_t dot = options.input.rfind('.');
+        bool f32 = dot != std::string::npos && options.input.substr(dot) == ".f32";
+        options.inputFormat = f32 ? Format::F32 : Format::CSV;
+    }
+    if (!options.hasOutputFormat) {
+        options.outputFormat = options.inputFormat;
+    }
+    return options;
+}
+
+// Read-only mapping of a whole file
+class MappedFile {
+public:
+    MappedFile(const std::string& path) {
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error{"[mathex-eval] Cannot open " + path};
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error{"[mathex-eval] Cannot stat " + path};
+        }
+
+        length = static_cast<size_t>(st.st_size);
+        if (length > 0) {
+            void* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error{"[mathex-eval] Cannot map " + path};
+            }
+            bytes = static_cast<const char*>(p);
+            madvise(p, length, MADV_SEQUENTIAL);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (bytes != nullptr) {
+            munmap(const_cast<char*>(bytes), length);
+        }
+        close(fd);
+    }
+
+    const char* data() const {
+        return bytes;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+private:
+    int fd = -1;
+    const char* bytes = nullptr;
+    size_t length = 0;
+};
+
+// Writes result columns either as CSV lines or as raw float32 columns
+class Writer {
+public:
+    Writer(const std::string& path, Format format, size_t columns, size_t rows)
+      : format{format},
+        columns{columns},
+        rows{rows} {
+        file = fopen(path.c_str(), "wb");
+        if (file == nullptr) {
+            throw std::runtime_error{"[mathex-eval] Cannot create " + path};
+        }
+        if (format == Format::F32 && ftruncate(fileno(file), static_cast<off_t>(rows * columns * sizeof(float))) != 0) {
+            fclose(file);
+            throw std::runtime_error{"[mathex-eval] Cannot resize " + path};
+        }
+    }
+
+    Writer(const Writer&) = delete;
+    Writer& operator=(const Writer&) = delete;
+
+    ~Writer() {
+        fclose(file);
+    }
+
+    void header(const std::vector<std::string>& names) {
+        if (format != Format::CSV) {
+            return;
+        }
+        for (size_t j = 0; j < names.size(); j++) {
+            line += names[j];
+            line += j + 1 < names.size() ? ',' : '\n';
+        }
+        flush();
+    }
+
+    // Writes rows [first, first + count) of every column
+    void write(const float* const* values, size_t first, size_t count) {
+        if (format == Format::F32) {
+            for (size_t j = 0; j < columns; j++) {
+                off_t offset = static_cast<off_t>((j * rows + first) * sizeof(float));
+                size_t bytes = count * sizeof(float);
+                if (pwrite(fileno(file), values[j], bytes, offset) != static_cast<ssize_t>(bytes)) {
+                    throw std::runtime_error{"[mathex-eval] Write failed"};
+                }
+            }
+            return;
+        }
+
+        char number[32];
+        for (size_t i = 0; i < count; i++) {
+            for (size_t j = 0; j < columns; j++) {
+                auto result = std::to_chars(number, number + sizeof(number), values[j][i]);
+                line.append(number, result.ptr);
+                line += j + 1 < columns ? ',' : '\n';
+            }
+        }
+        flush();
+    }
+
+private:
+    void flush() {
+        if (fwrite(line.data(), 1, line.size(), file) != line.size()) {
+            throw std::runtime_error{"[mathex-eval] Write failed"};
+        }
+        line.clear();
+    }
+
+    FILE* file = nullptr;
+    Format format;
+    size_t columns;
+    size_t rows;
+    std::string line;
+};
+
+// Index of the column each program input is read from
+std::vector<size_t> mapInputs(const Options& options, const std::vector<std::string>& inputs, const std::vector<std::string>& columns) {
+    std::vector<size_t> indices;
+    for (const auto& input : inputs) {
+        auto mapped = options.mapping.find(input);
+        const std::string& name = mapped == options.mapping.end() ? input : mapped->second;
+        auto it = std::find(columns.begin(), columns.end(), name);
+        if (it == columns.end()) {
+            throw std::runtime_error{"[mathex-eval] No column for variable " + input};
+        }
+        indices.push_back(static_cast<size_t>(it - columns.begin()));
+    }
+    return indices;
+}
+
+// Compiled formula and optional derivative, evaluated a chunk at a time
+struct Evaluator {
+    std::unique_ptr<mathex::Program> value;
+    std::unique_ptr<mathex::Program> derivative;
+    std::vector<float> stack;
+    std::vector<std::vector<float>> results;
+
+    Evaluator(const Options& options, size_t chunk) {
+        std::unique_ptr<mathex::Expression> f{mathex::parse(options.formula)};
+        value = std::make_unique<mathex::Program>(*f);
+
+        size_t depth = value->stackSize();
+        if (!options.derivative.empty()) {
+            std::unique_ptr<mathex::Expression> d{f->differentiate(options.derivative)};
+            std::unique_ptr<mathex::Expression> folded{d->specialize({})};
+            derivative = std::make_unique<mathex::Program>(*folded, value->variables());
+            depth = std::max(depth, derivative->stackSize());
+        }
+
+        stack.resize(depth * mathex::Program::LANES);
+        results.assign(derivative ? 2 : 1, std::vector<float>(chunk));
+    }
+
+    std::vector<std::string> names(const Options& options) const {
+        std::vector<std::string> names{"value"};
+        if (derivative) {
+            names.push_back("d/d" + options.derivative);
+        }
+        return names;
+    }
+
+    void run(const float* const* inputs, size_t count) {
+        value->evalBatch(inputs, results[0].data(), count, stack.data());
+        if (derivative) {
+            derivative->evalBatch(inputs, results[1].data(), count, stack.data());
+        }
+    }
+
+    void write(Writer& writer, size_t first, size_t count) const {
+        const float* columns[2] = {results[0].data(), derivative ? results[1].data() : nullptr};
+        writer.write(columns, first, count);
+    }
+};
+
+// Evaluates a raw float32 file: every chunk is read in place from the mapping
+size_t runF32(const Options& options, const MappedFile& in) {
+    if (options.columns.empty()) {
+        throw std::runtime_error{"[mathex-eval] f32 input needs --columns"};
+    }
+    size_t stride = options.columns.size() * sizeof(float);
+    if (in.size() % stride != 0) {
+        throw std::runtime_error{"[mathex-eval] File size is not a multiple of the row size"};
+    }
+    size_t rows = in.size() / stride;
+
+    Evaluator evaluator(options, options.chunk);
+    auto indices = mapInputs(options, evaluator.value->variables(), options.columns);
+    Writer writer(options.output, options.outputFormat, evaluator.results.size(), rows);
+    writer.header(evaluator.names(options));
+
+    auto base = reinterpret_cast<const float*>(in.data());
+    std::vector<const float*> inputs(indices.size());
+    for (size_t first = 0; first < rows; first += options.chunk) {
+        size_t count = std::min(options.chunk, rows - first);
+        for (size_t k = 0; k < indices.size(); k++) {
+            inputs[k] = base + indices[k] * rows + first;
+        }
+        evaluator.run(inputs.data(), count);
+        evaluator.write(writer, first, count);
+    }
+    return rows;
+}
+
+// Next line of a CSV mapping, without its line terminator; returns false at the end
+bool nextLine(const char*& p, const char* end, const char*& lineBegin, const char*& lineEnd) {
+    while (p < end) {
+        lineBegin = p;
+        auto newline = static_cast<const char*>(memchr(p, '\n', static_cast<size_t>(end - p)));
+        lineEnd = newline ? newline : end;
+        p = newline ? newline + 1 : end;
+        if (lineEnd > lineBegin && lineEnd[-1] == '\r') {
+            lineEnd--;
+        }
+        if (lineEnd > lineBegin) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Evaluates a CSV file, parsing one chunk of rows into column buffers at a time
+size_t runCsv(const Options& options, const MappedFile& in) {
+    const char* begin = in.data();
+    const char* end = begin + in.size();
+    const char* p = begin;
+    const char* lineBegin;
+    const char* lineEnd;
+
+    std::vector<std::string> columns = options.columns;
+    if (columns.empty()) {
+        if (!nextLine(p, end, lineBegin, lineEnd)) {
+            throw std::runtime_error{"[mathex-eval] Missing CSV header"};
+        }
+        columns = split(std::string(lineBegin, lineEnd), ',');
+        for (auto& column : columns) {
+            column.erase(0, column.find_first_not_of(' '));
+            column.erase(column.find_last_not_of(' ') + 1);
+        }
+    }
+
+    // Raw output needs the row count up front to lay its columns out
+    size_t rows = 0;
+    if (options.outputFormat == Format::F32) {
+        for (const char* q = p; nextLine(q, end, lineBegin, lineEnd);) {
+            rows++;
+        }
+    }
+
+    Evaluator evaluator(options, options.chunk);
+    auto indices = mapInputs(options, evaluator.value->variables(), columns);
+    Writer writer(options.output, options.outputFormat, evaluator.results.size(), rows);
+    writer.header(evaluator.names(options));
+
+    // Slot of each column in the chunk buffers, or -1 when no variable reads it
+    std::vector<long> slotOf(columns.size(), -1);
+    for (size_t k = 0; k < indices.size(); k++) {
+        slotOf[indices[k]] = static_cast<long>(k);
+    }
+
+    std::vector<std::vector<float>> buffers(indices.size(), std::vector<float>(options.chunk));
+    std::vector<const float*> inputs;
+    for (const auto& buffer : buffers) {
+        inputs.push_back(buffer.data());
+    }
+
+    size_t total = 0;
+    size_t count = 0;
+    auto evaluate = [&]() {
+        evaluator.run(inputs.data(), count);
+        evaluator.write(writer, total, count);
+        total += count;
+        count = 0;
+    };
+
+    while (nextLine(p, end, lineBegin, lineEnd)) {
+        const char* field = lineBegin;
+        for (size_t column = 0; column < columns.size(); column++) {
+            if (field > lineEnd) {
+                throw std::runtime_error{"[mathex-eval] Missing field on row " + std::to_string(total + count + 1)};
+            }
+            auto comma = static_cast<const char*>(memchr(field, ',', static_cast<size_t>(lineEnd - field)));
+            const char* fieldEnd = comma ? comma : lineEnd;
+            if (slotOf[column] >= 0) {
+                // The whole field must be one number: "1.5abc" is not read as 1.5
+                const char* last = fieldEnd;
+                while (field < last && *field == ' ') {
+                    field++;
+                }
+                while (last > field && (last[-1] == ' ' || last[-1] == '\r')) {
+                    last--;
+                }
+                float value;
+                auto result = std::from_chars(field, last, value);
+                if (result.ec != std::errc{} || result.ptr != last) {
+                    throw std::runtime_error{"[mathex-eval] Invalid number on row " + std::to_string(total + count + 1)};
+                }
+                buffers[slotOf[column]][count] = value;
+            }
+            field = fieldEnd + 1;
+        }
+        if (field <= lineEnd) {
+            // More fields than columns, such as a decimal comma splitting a number in two
+            throw std::runtime_error{"[mathex-eval] Extra field on row " + std::to_string(total + count + 1)};
+        }
+
+        if (++count == options.chunk) {
+            evaluate();
+        }
+    }
+    if (count > 0) {
+        evaluate();
+    }
+    return total;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    try {
+        Options options = parseOptions(argc, argv);
+        MappedFile in(options.input);
+
+        auto start = std::chrono::steady_clock::now();
+        size_t rows = options.inputFormat == Format::F32 ? runF32(options, in) : runCsv(options, in);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        double seconds = elapsed.count();
+        fprintf(
+            stderr,
+            "%zu rows in %.3f s (%.0f rows/s)\n",
+            rows,
+            seconds,
+            seconds > 0.0 ? static_cast<double>(rows) / seconds : 0.0
+        );
+    } catch (const std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
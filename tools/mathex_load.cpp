@@ -0,0 +1,201 @@
+// mathex-load: load generator for mathex-server.
+//
+// Opens --clients connections to the server's Unix socket, compiles one formula on each and
+// sends --requests evaluation requests of --points random points per connection, one at a
+// time. Reports the latency percentiles and throughput seen by the clients, followed by the
+// server's own statistics.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "protocol.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string socket;
+    std::string formula = "sin(x) * exp(-y*y) + x^3 / (1 + y*y)";
+    size_t clients = 8;
+    size_t requests = 10000;
+    size_t points = 16;
+    bool shutdown = false;
+};
+
+Options parseOptions(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--shutdown") {
+            options.shutdown = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            throw std::runtime_error{"[mathex-load] Missing value for " + arg};
+        }
+        std::string value = argv[++i];
+        if (arg == "--socket") {
+            options.socket = value;
+        } else if (arg == "--formula") {
+            options.formula = value;
+        } else if (arg == "--clients") {
+            options.clients = std::max<size_t>(1, std::stoul(value));
+        } else if (arg == "--requests") {
+            options.requests = std::stoul(value);
+        } else if (arg == "--points") {
+            options.points = std::min<size_t>(std::max<size_t>(1, std::stoul(value)), protocol::MAX_POINTS);
+        } else {
+            throw std::runtime_error{"[mathex-load] Unknown option " + arg};
+        }
+    }
+
+    if (options.socket.empty()) {
+        throw std::runtime_error{"[mathex-load] --socket is required"};
+    }
+    return options;
+}
+
+int connectTo(const std::string& path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (fd < 0 || path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error{"[mathex-load] Cannot create socket"};
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        close(fd);
+        throw std::runtime_error{"[mathex-load] Cannot connect to " + path};
+    }
+    return fd;
+}
+
+// Sends a request and reads its response payload; throws on ERROR responses
+std::string call(int fd, protocol::Request request, const void* a, size_t aSize, const void* b = nullptr, size_t bSize = 0) {
+    if (!protocol::writeFrame(fd, static_cast<uint8_t>(request), a, aSize, b, bSize)) {
+        throw std::runtime_error{"[mathex-load] Connection lost"};
+    }
+
+    uint8_t status;
+    size_t size;
+    std::string payload;
+    if (!protocol::readHeader(fd, status, size)) {
+        throw std::runtime_error{"[mathex-load] Connection lost"};
+    }
+    payload.resize(size);
+    if (!protocol::readFull(fd, payload.data(), size)) {
+        throw std::runtime_error{"[mathex-load] Connection lost"};
+    }
+    if (static_cast<protocol::Status>(status) != protocol::Status::OK) {
+        throw std::runtime_error{"[mathex-load] Server error: " + payload};
+    }
+    return payload;
+}
+
+// Runs one client and appends its request latencies, in nanoseconds
+void client(const Options& options, size_t seed, std::vector<long long>& latencies) {
+    int fd = connectTo(options.socket);
+
+    auto compiled = call(fd, protocol::Request::COMPILE, options.formula.data(), options.formula.size());
+    uint32_t header[2];
+    memcpy(header, compiled.data(), sizeof(header));
+
+    uint32_t prefix[2] = {header[0], static_cast<uint32_t>(options.points)};
+    std::vector<float> inputs(header[1] * options.points);
+    std::mt19937 random(static_cast<unsigned>(seed));
+    std::uniform_real_distribution<float> value(-2.0f, 2.0f);
+
+    latencies.reserve(options.requests);
+    for (size_t r = 0; r < options.requests; r++) {
+        for (auto& x : inputs) {
+            x = value(random);
+        }
+
+        auto start = Clock::now();
+        auto results = call(fd, protocol::Request::EVAL, prefix, sizeof(prefix), inputs.data(), inputs.size() * sizeof(float));
+        latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+
+        if (results.size() != options.points * sizeof(float)) {
+            throw std::runtime_error{"[mathex-load] Unexpected result size"};
+        }
+    }
+
+    close(fd);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    try {
+        Options options = parseOptions(argc, argv);
+
+        std::vector<std::vector<long long>> latencies(options.clients);
+        std::vector<std::string> errors(options.clients);
+        std::vector<std::thread> threads;
+
+        auto start = Clock::now();
+        for (size_t c = 0; c < options.clients; c++) {
+            threads.emplace_back([&options, &latencies, &errors, c] {
+                try {
+                    client(options, c + 1, latencies[c]);
+                } catch (const std::exception& e) {
+                    errors[c] = e.what();
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        for (const auto& error : errors) {
+            if (!error.empty()) {
+                throw std::runtime_error{error};
+            }
+        }
+
+        std::vector<long long> all;
+        for (const auto& l : latencies) {
+            all.insert(all.end(), l.begin(), l.end());
+        }
+        std::sort(all.begin(), all.end());
+        auto percentile = [&all](double p) {
+            size_t index = std::min(all.size() - 1, static_cast<size_t>(p * static_cast<double>(all.size())));
+            return static_cast<double>(all[index]) / 1000.0;
+        };
+
+        if (!all.empty()) {
+            printf(
+                "client: %zu requests in %.3f s, %.0f requests/s, %.0f points/s, p50 %.1f us, p99 %.1f us\n",
+                all.size(),
+                seconds,
+                static_cast<double>(all.size()) / seconds,
+                static_cast<double>(all.size() * options.points) / seconds,
+                percentile(0.50),
+                percentile(0.99)
+            );
+        }
+
+        int fd = connectTo(options.socket);
+        printf("server:\n%s", call(fd, protocol::Request::STATS, nullptr, 0).c_str());
+        if (options.shutdown) {
+            call(fd, protocol::Request::SHUTDOWN, nullptr, 0);
+        }
+        close(fd);
+    } catch (const std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,636 @@
+// mathex-server: keeps compiled formulas resident and evaluates them for other processes.
+//
+// Requests arrive as length-prefixed binary frames (see protocol.hpp) on stdin, or on a Unix
+// domain socket with --socket, one thread per connection. Small evaluation requests from
+// concurrent connections are queued and coalesced by worker threads into a single call to
+// the batch evaluator per formula; requests of at least --batch points skip the queue and are
+// evaluated in place from the receive buffer. Results are written straight from the
+// evaluation buffer. Latency percentiles and throughput are reported on STATS requests and
+// when the server stops.
+//
+// Memory is bounded whatever the clients send: connections past --connections wait to be
+// accepted, the buffers of EVAL requests are reserved from a budget of --memory bytes shared
+// by every connection, and at most --formulas compiled formulas are kept, the oldest evicted.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "parser.hpp"
+#include "program.hpp"
+#include "protocol.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string socket;
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    size_t batch = 4096;
+    size_t connections = 64;
+    size_t formulas = 1024;
+    size_t memory = size_t{1} << 30;
+};
+
+// Compiled formulas, deduplicated by text. At most `capacity` are kept; the oldest one is
+// evicted for a new one, and requests being evaluated keep their program alive
+class Registry {
+public:
+    explicit Registry(size_t capacity) : capacity{capacity} {}
+
+    // Reply to a COMPILE request for the formula
+    std::string compile(const std::string& formula) {
+        {
+            std::shared_lock<std::shared_mutex> lock{mutex};
+            auto it = handles.find(formula);
+            if (it != handles.end()) {
+                return entries.at(it->second).reply;
+            }
+        }
+
+        // Parsed outside the lock; a concurrent compilation of the same text is discarded
+        std::unique_ptr<mathex::Expression> expr{mathex::parse(formula)};
+        Entry entry;
+        entry.formula = formula;
+        entry.program = std::make_shared<const mathex::Program>(*expr);
+
+        std::unique_lock<std::shared_mutex> lock{mutex};
+        auto it = handles.find(formula);
+        if (it != handles.end()) {
+            return entries.at(it->second).reply;
+        }
+
+        while (order.size() >= capacity) {
+            auto evicted = entries.find(order.front());
+            handles.erase(evicted->second.formula);
+            entries.erase(evicted);
+            order.pop_front();
+        }
+
+        // Handles are never reused, so an evicted handle stays unknown
+        uint32_t handle = next++;
+        const auto& inputs = entry.program->variables();
+        auto count = static_cast<uint32_t>(inputs.size());
+        append(entry.reply, handle);
+        append(entry.reply, count);
+        for (const auto& name : inputs) {
+            append(entry.reply, static_cast<uint32_t>(name.size()));
+            entry.reply += name;
+        }
+
+        handles.emplace(formula, handle);
+        order.push_back(handle);
+        return entries.emplace(handle, std::move(entry)).first->second.reply;
+    }
+
+    std::shared_ptr<const mathex::Program> find(uint32_t handle) const {
+        std::shared_lock<std::shared_mutex> lock{mutex};
+        auto it = entries.find(handle);
+        return it != entries.end() ? it->second.program : nullptr;
+    }
+
+private:
+    struct Entry {
+        std::string formula;
+        std::shared_ptr<const mathex::Program> program;
+        std::string reply;
+    };
+
+    static void append(std::string& s, uint32_t v) {
+        s.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+
+    size_t capacity;
+    mutable std::shared_mutex mutex;
+    std::unordered_map<uint32_t, Entry> entries;
+    std::unordered_map<std::string, uint32_t> handles;
+    std::deque<uint32_t> order;
+    uint32_t next = 0;
+};
+
+// Bytes of request buffers every connection together may hold; a request waits until the
+// bytes it needs are free
+class Budget {
+public:
+    explicit Budget(size_t limit) : limit{limit} {}
+
+    size_t capacity() const {
+        return limit;
+    }
+
+    void acquire(size_t bytes) {
+        std::unique_lock<std::mutex> lock{mutex};
+        freed.wait(lock, [this, bytes] { return used + bytes <= limit; });
+        used += bytes;
+    }
+
+    void release(size_t bytes) {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            used -= bytes;
+        }
+        freed.notify_all();
+    }
+
+private:
+    size_t limit;
+    size_t used = 0;
+    std::mutex mutex;
+    std::condition_variable freed;
+};
+
+// Latency samples of the most recent requests, and totals since startup
+class Stats {
+public:
+    void record(Clock::duration latency, size_t points) {
+        requests.fetch_add(1, std::memory_order_relaxed);
+        evaluated.fetch_add(points, std::memory_order_relaxed);
+
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count();
+        std::lock_guard<std::mutex> lock{mutex};
+        if (samples.size() < CAPACITY) {
+            samples.push_back(ns);
+        } else {
+            samples[next] = ns;
+            next = (next + 1) % CAPACITY;
+        }
+    }
+
+    // Counts a call to the batch evaluator made for `jobs` queued requests
+    void recordBatch(size_t jobs) {
+        batches.fetch_add(1, std::memory_order_relaxed);
+        batched.fetch_add(jobs, std::memory_order_relaxed);
+    }
+
+    std::string report() const {
+        std::vector<long long> sorted;
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            sorted = samples;
+        }
+        std::sort(sorted.begin(), sorted.end());
+        auto percentile = [&sorted](double p) {
+            if (sorted.empty()) {
+                return 0.0;
+            }
+            size_t index = std::min(sorted.size() - 1, static_cast<size_t>(p * static_cast<double>(sorted.size())));
+            return static_cast<double>(sorted[index]) / 1000.0;
+        };
+
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        size_t n = requests.load();
+        size_t points = evaluated.load();
+
+        char text[512];
+        snprintf(
+            text,
+            sizeof(text),
+            "requests %zu\npoints %zu\nbatches %zu (%.1f requests each)\nseconds %.3f\nrequests/s %.0f\npoints/s %.0f\np50 %.1f us\np99 %.1f us\n",
+            n,
+            points,
+            batches.load(),
+            batches.load() > 0 ? static_cast<double>(batched.load()) / static_cast<double>(batches.load()) : 0.0,
+            seconds,
+            static_cast<double>(n) / seconds,
+            static_cast<double>(points) / seconds,
+            percentile(0.50),
+            percentile(0.99)
+        );
+        return text;
+    }
+
+private:
+    static constexpr size_t CAPACITY = size_t{1} << 20;
+
+    Clock::time_point start = Clock::now();
+    std::atomic<size_t> requests{0};
+    std::atomic<size_t> evaluated{0};
+    std::atomic<size_t> batches{0};
+    std::atomic<size_t> batched{0};
+
+    mutable std::mutex mutex;
+    std::vector<long long> samples;
+    size_t next = 0;
+};
+
+// Evaluation request waiting for a worker; inputs are stored input after input
+struct Job {
+    Job(const mathex::Program* program, const float* inputs, size_t count, float* out)
+      : program{program},
+        inputs{inputs},
+        count{count},
+        out{out} {}
+
+    const mathex::Program* program;
+    const float* inputs;
+    size_t count;
+    float* out;
+    bool done = false;
+    std::condition_variable finished;
+};
+
+// Worker threads that merge queued jobs on the same program into one batch evaluation
+class Batcher {
+public:
+    Batcher(size_t workers, size_t maxPoints, Stats& stats)
+      : maxPoints{maxPoints},
+        stats{stats} {
+        for (size_t i = 0; i < workers; i++) {
+            threads.emplace_back([this] { work(); });
+        }
+    }
+
+    ~Batcher() {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    // Blocks until a worker evaluated the job
+    void submit(Job& job) {
+        std::unique_lock<std::mutex> lock{mutex};
+        queue.push_back(&job);
+        ready.notify_one();
+        job.finished.wait(lock, [&job] { return job.done; });
+    }
+
+    static void evaluate(const mathex::Program& program, const float* inputs, size_t count, float* out) {
+        thread_local std::vector<const float*> columns;
+        thread_local std::vector<float> stack;
+
+        size_t n = program.variables().size();
+        columns.resize(n);
+        for (size_t k = 0; k < n; k++) {
+            columns[k] = inputs + k * count;
+        }
+        stack.resize(program.stackSize() * mathex::Program::LANES);
+        program.evalBatch(columns.data(), out, count, stack.data());
+    }
+
+private:
+    void work() {
+        std::vector<Job*> batch;
+        std::vector<float> packed;
+        std::vector<float> results;
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock{mutex};
+                ready.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+
+                // The oldest job, with every later one on the same program while the batch has room
+                batch.assign(1, queue.front());
+                queue.pop_front();
+                size_t points = batch[0]->count;
+                for (auto it = queue.begin(); it != queue.end() && points < maxPoints;) {
+                    if ((*it)->program == batch[0]->program && points + (*it)->count <= maxPoints) {
+                        points += (*it)->count;
+                        batch.push_back(*it);
+                        it = queue.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+
+            run(batch, packed, results);
+            stats.recordBatch(batch.size());
+
+            std::lock_guard<std::mutex> lock{mutex};
+            for (auto job : batch) {
+                job->done = true;
+                job->finished.notify_one();
+            }
+        }
+    }
+
+    static void run(const std::vector<Job*>& batch, std::vector<float>& packed, std::vector<float>& results) {
+        const mathex::Program& program = *batch[0]->program;
+        if (batch.size() == 1) {
+            evaluate(program, batch[0]->inputs, batch[0]->count, batch[0]->out);
+            return;
+        }
+
+        // Packs the jobs' columns next to each other, so each input is one contiguous column
+        size_t n = program.variables().size();
+        size_t total = 0;
+        for (auto job : batch) {
+            total += job->count;
+        }
+        packed.resize(n * total);
+        results.resize(total);
+
+        size_t offset = 0;
+        for (auto job : batch) {
+            for (size_t k = 0; k < n; k++) {
+                const float* column = job->inputs + k * job->count;
+                std::copy(column, column + job->count, packed.begin() + k * total + offset);
+            }
+            offset += job->count;
+        }
+
+        evaluate(program, packed.data(), total, results.data());
+
+        offset = 0;
+        for (auto job : batch) {
+            std::copy(results.begin() + offset, results.begin() + offset + job->count, job->out);
+            offset += job->count;
+        }
+    }
+
+    size_t maxPoints;
+    Stats& stats;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<Job*> queue;
+    bool stopping = false;
+    std::vector<std::thread> threads;
+};
+
+struct Server {
+    Options options;
+    Registry registry;
+    Budget budget;
+    Stats stats;
+    Batcher batcher;
+    std::atomic<bool> stopping{false};
+
+    // Buffers a connection keeps between requests; larger ones are freed after each request
+    static constexpr size_t RETAINED_BYTES = size_t{1} << 20;
+
+    Server(const Options& options)
+      : options{options},
+        registry{options.formulas},
+        budget{options.memory},
+        batcher{options.workers, options.batch, stats} {}
+
+    // Serves one stream of requests until it closes; returns false when a SHUTDOWN was received
+    bool serve(int in, int out) {
+        std::string text;
+        std::vector<float> inputs;
+        std::vector<float> results;
+
+        uint8_t kind;
+        size_t size;
+        while (protocol::readHeader(in, kind, size)) {
+            auto start = Clock::now();
+
+            if (static_cast<protocol::Request>(kind) == protocol::Request::EVAL) {
+                uint32_t prefix[2];
+                if (size < sizeof(prefix) || !protocol::readFull(in, prefix, sizeof(prefix))) {
+                    return true;
+                }
+                size -= sizeof(prefix);
+
+                // Requests are checked before anything is allocated for them
+                auto program = registry.find(prefix[0]);
+                size_t count = prefix[1];
+                size_t bytes = size + count * sizeof(float);
+                const char* problem = nullptr;
+                if (program == nullptr) {
+                    problem = "Unknown handle";
+                } else if (count > protocol::MAX_POINTS) {
+                    problem = "Too many points in one request";
+                } else if (size != count * program->variables().size() * sizeof(float)) {
+                    problem = "Payload does not match the point count";
+                } else if (bytes > budget.capacity()) {
+                    problem = "Request exceeds the server's memory budget";
+                }
+                if (problem != nullptr) {
+                    if (!protocol::skip(in, size)) {
+                        return true;
+                    }
+                    error(out, problem);
+                    continue;
+                }
+
+                // The buffers are reserved for the request, then freed unless small
+                budget.acquire(bytes);
+                struct Reservation {
+                    Server& server;
+                    size_t bytes;
+                    std::vector<float>& inputs;
+                    std::vector<float>& results;
+                    ~Reservation() {
+                        if ((inputs.capacity() + results.capacity()) * sizeof(float) > RETAINED_BYTES) {
+                            std::vector<float>().swap(inputs);
+                            std::vector<float>().swap(results);
+                        }
+                        server.budget.release(bytes);
+                    }
+                } reservation{*this, bytes, inputs, results};
+
+                // The payload is read straight into float storage and evaluated from there
+                inputs.resize(size / sizeof(float) + 1);
+                if (!protocol::readFull(in, inputs.data(), size)) {
+                    return true;
+                }
+
+                results.resize(count);
+                if (count >= options.batch) {
+                    Batcher::evaluate(*program, inputs.data(), count, results.data());
+                } else if (count > 0) {
+                    Job job(program.get(), inputs.data(), count, results.data());
+                    batcher.submit(job);
+                }
+
+                if (!protocol::writeFrame(out, static_cast<uint8_t>(protocol::Status::OK), results.data(), count * sizeof(float))) {
+                    return true;
+                }
+                stats.record(Clock::now() - start, count);
+                continue;
+            }
+
+            // Only formulas are buffered, up to their own bound; other payloads are skipped
+            if (static_cast<protocol::Request>(kind) != protocol::Request::COMPILE || size > protocol::MAX_FORMULA) {
+                if (!protocol::skip(in, size)) {
+                    return true;
+                }
+            }
+
+            switch (static_cast<protocol::Request>(kind)) {
+            case protocol::Request::COMPILE:
+                if (size > protocol::MAX_FORMULA) {
+                    error(out, "Formula too long");
+                    break;
+                }
+                text.resize(size);
+                if (!protocol::readFull(in, text.data(), size)) {
+                    return true;
+                }
+                try {
+                    reply(out, registry.compile(text));
+                } catch (const std::exception& e) {
+                    error(out, e.what());
+                }
+                break;
+            case protocol::Request::STATS:
+                reply(out, stats.report());
+                break;
+            case protocol::Request::SHUTDOWN:
+                reply(out, "");
+                return false;
+            default:
+                error(out, "Unknown request");
+                break;
+            }
+        }
+        return true;
+    }
+
+    static void reply(int out, const std::string& payload) {
+        protocol::writeFrame(out, static_cast<uint8_t>(protocol::Status::OK), payload.data(), payload.size());
+    }
+
+    static void error(int out, const std::string& message) {
+        protocol::writeFrame(out, static_cast<uint8_t>(protocol::Status::ERROR), message.data(), message.size());
+    }
+};
+
+Options parseOptions(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            throw std::runtime_error{"[mathex-server] Missing value for " + arg};
+        }
+        std::string value = argv[++i];
+        if (arg == "--socket") {
+            options.socket = value;
+        } else if (arg == "--workers") {
+            options.workers = std::max<size_t>(1, std::stoul(value));
+        } else if (arg == "--batch") {
+            options.batch = std::max<size_t>(1, std::stoul(value));
+        } else if (arg == "--connections") {
+            options.connections = std::max<size_t>(1, std::stoul(value));
+        } else if (arg == "--formulas") {
+            options.formulas = std::max<size_t>(1, std::stoul(value));
+        } else if (arg == "--memory") {
+            options.memory = std::max<size_t>(1, std::stoul(value));
+        } else {
+            throw std::runtime_error{"[mathex-server] Unknown option " + arg};
+        }
+    }
+    return options;
+}
+
+void listenOn(Server& server, const std::string& path) {
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        throw std::runtime_error{"[mathex-server] Cannot create socket"};
+    }
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        close(listener);
+        throw std::runtime_error{"[mathex-server] Socket path too long"};
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    unlink(path.c_str());
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 128) != 0) {
+        close(listener);
+        throw std::runtime_error{"[mathex-server] Cannot listen on " + path};
+    }
+
+    // Open connections; each one is served by a detached thread that removes itself
+    std::mutex mutex;
+    std::condition_variable closed;
+    std::unordered_set<int> connections;
+
+    while (!server.stopping) {
+        // Past the connection limit, clients wait in the listen backlog until one closes
+        {
+            std::unique_lock<std::mutex> lock{mutex};
+            closed.wait(lock, [&server, &connections] {
+                return server.stopping || connections.size() < server.options.connections;
+            });
+        }
+        if (server.stopping) {
+            break;
+        }
+
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        std::lock_guard<std::mutex> lock{mutex};
+        connections.insert(fd);
+        std::thread([&server, &mutex, &closed, &connections, listener, fd] {
+            bool keepRunning = server.serve(fd, fd);
+
+            std::lock_guard<std::mutex> lock{mutex};
+            if (!keepRunning) {
+                // Unblocks accept() and every other connection
+                server.stopping = true;
+                shutdown(listener, SHUT_RDWR);
+                for (int other : connections) {
+                    shutdown(other, SHUT_RDWR);
+                }
+            }
+            connections.erase(fd);
+            close(fd);
+            closed.notify_all();
+        }).detach();
+    }
+
+    std::unique_lock<std::mutex> lock{mutex};
+    for (int fd : connections) {
+        shutdown(fd, SHUT_RDWR);
+    }
+    closed.wait(lock, [&connections] { return connections.empty(); });
+    close(listener);
+    unlink(path.c_str());
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    try {
+        signal(SIGPIPE, SIG_IGN);
+        Options options = parseOptions(argc, argv);
+        Server server(options);
+
+        if (options.socket.empty()) {
+            server.serve(STDIN_FILENO, STDOUT_FILENO);
+        } else {
+            listenOn(server, options.socket);
+        }
+
+        fprintf(stderr, "%s", server.stats.report().c_str());
+    } catch (const std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,140 @@
+// Wire protocol shared by mathex-server and mathex-load.
+//
+// Every message is a frame: a little-endian uint32 with the number of bytes that follow,
+// then one byte (the request type, or the response status), then the payload.
+//
+// Requests:
+//   COMPILE   formula text of at most MAX_FORMULA bytes
+//             -> uint32 handle, uint32 input count, then per input: uint32 length, name bytes
+//             The server keeps a bounded number of formulas; once it evicts a formula its
+//             handle is unknown and the formula must be compiled again
+//   EVAL      uint32 handle, uint32 point count n <= MAX_POINTS, then n floats per input,
+//             input after input -> n floats
+//   STATS     (empty; any payload is ignored) -> text report
+//   SHUTDOWN  (empty; any payload is ignored) -> (empty); the server stops accepting connections
+// A response with status ERROR carries a text message instead.
+
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace protocol {
+
+enum class Request : uint8_t {
+    COMPILE = 1,
+    EVAL = 2,
+    STATS = 3,
+    SHUTDOWN = 4
+};
+
+enum class Status : uint8_t {
+    OK = 0,
+    ERROR = 1
+};
+
+// Size of the length and type/status prefix of every frame
+constexpr size_t HEADER_SIZE = 5;
+
+// Upper bound of a frame, to reject corrupt lengths before allocating
+constexpr uint32_t MAX_FRAME = 1u << 28;
+
+// Upper bound of the point count of one EVAL request, which sizes its result buffer
+constexpr uint32_t MAX_POINTS = 1u << 22;
+
+// Upper bound of the formula text of one COMPILE request
+constexpr uint32_t MAX_FORMULA = 1u << 16;
+
+inline bool readFull(int fd, void* data, size_t size) {
+    auto p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Reads and discards the rest of a rejected payload, keeping the stream at a frame boundary
+inline bool skip(int fd, size_t size) {
+    char buffer[4096];
+    while (size > 0) {
+        size_t n = size < sizeof(buffer) ? size : sizeof(buffer);
+        if (!readFull(fd, buffer, n)) {
+            return false;
+        }
+        size -= n;
+    }
+    return true;
+}
+
+// Writes every buffer, resuming after partial writes
+inline bool writeAll(int fd, iovec* parts, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, parts, count);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return false;
+        }
+        auto written = static_cast<size_t>(n);
+        while (count > 0 && written >= parts->iov_len) {
+            written -= parts->iov_len;
+            parts++;
+            count--;
+        }
+        if (count > 0) {
+            parts->iov_base = static_cast<char*>(parts->iov_base) + written;
+            parts->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+inline void encodeHeader(char* header, uint8_t kind, size_t payload) {
+    uint32_t size = static_cast<uint32_t>(payload + 1);
+    memcpy(header, &size, sizeof(size));
+    header[4] = static_cast<char>(kind);
+}
+
+// Writes one frame whose payload is split in two buffers, without joining them
+inline bool writeFrame(int fd, uint8_t kind, const void* a, size_t aSize, const void* b = nullptr, size_t bSize = 0) {
+    char header[HEADER_SIZE];
+    encodeHeader(header, kind, aSize + bSize);
+    iovec parts[3] = {
+        {header, HEADER_SIZE},
+        {const_cast<void*>(a), aSize},
+        {const_cast<void*>(b), bSize},
+    };
+    return writeAll(fd, parts, bSize > 0 ? 3 : 2);
+}
+
+// Reads a frame header; `payload` receives the number of bytes that follow the kind byte
+inline bool readHeader(int fd, uint8_t& kind, size_t& payload) {
+    char header[HEADER_SIZE];
+    if (!readFull(fd, header, HEADER_SIZE)) {
+        return false;
+    }
+    uint32_t size;
+    memcpy(&size, header, sizeof(size));
+    if (size == 0 || size > MAX_FRAME) {
+        return false;
+    }
+    kind = static_cast<uint8_t>(header[4]);
+    payload = size - 1;
+    return true;
+}
+
+} // namespace protocol